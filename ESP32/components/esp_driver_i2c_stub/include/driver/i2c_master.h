@@ -49,6 +49,17 @@ i2c_master_bus_add_device(i2c_master_bus_handle_t bus_handle,
   return ESP_OK;
 }
 
+static inline esp_err_t
+i2c_master_bus_rm_device(i2c_master_dev_handle_t handle) {
+  ESP_LOGI("[esp_driver_i2c_stub]", "i2c_master_bus_rm_device called");
+  return ESP_OK;
+}
+
+static inline esp_err_t i2c_master_bus_reset(i2c_master_bus_handle_t handle) {
+  ESP_LOGI("[esp_driver_i2c_stub]", "i2c_master_bus_reset called");
+  return ESP_OK;
+}
+
 static inline esp_err_t i2c_master_transmit(i2c_master_dev_handle_t i2c_dev,
                                             const uint8_t *write_buffer,
                                             size_t write_size,
@@ -47,6 +47,12 @@ static inline int uart_read_bytes(uart_port_t uart_num, void *buf,
   return 1;
 }
 
+static inline int uart_write_bytes(uart_port_t uart_num, const void *src,
+                                   size_t size) {
+  ESP_LOGI("[esp_driver_uart_stub]", "uart_write_bytes called");
+  return size;
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -23,6 +23,7 @@ typedef enum {
 typedef enum {
   UART_NUM_0,
   UART_NUM_1,
+  UART_NUM_2,
 } uart_port_t;
 
 #ifdef __cplusplus
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "esp_event_base.h"
 #include "esp_netif_ip_addr.h"
 
 #ifdef __cplusplus
@@ -15,6 +16,13 @@ typedef struct {
 struct esp_netif_obj;
 typedef struct esp_netif_obj esp_netif_t;
 
+typedef enum {
+  IP_EVENT_STA_GOT_IP,
+  IP_EVENT_STA_LOST_IP,
+} ip_event_t;
+
+ESP_EVENT_DECLARE_BASE(IP_EVENT);
+
 #ifdef __cplusplus
 }
 #endif
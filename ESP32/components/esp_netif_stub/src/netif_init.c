@@ -0,0 +1,3 @@
+#include <esp_netif_types.h>
+
+ESP_EVENT_DEFINE_BASE(IP_EVENT);
@@ -1,17 +1,16 @@
 #pragma once
 
 #include <stdint.h>
-#include <sys/time.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-static inline int64_t esp_timer_get_time(void) {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return (int64_t)tv.tv_sec * 1000000LL + tv.tv_usec;
-}
+int64_t esp_timer_get_time(void);
+
+// moves the stub clock forwards without waiting, so that host-side runs can
+// simulate long periods of operation quickly
+void esp_timer_stub_advance(int64_t us);
 
 #ifdef __cplusplus
 }
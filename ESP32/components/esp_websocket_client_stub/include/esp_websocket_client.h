@@ -29,6 +29,7 @@ typedef struct {
   const char *uri;
   const char *cert_pem;
   bool skip_cert_common_name_check;
+  bool disable_auto_reconnect;
   int reconnect_timeout_ms;
   int network_timeout_ms;
 } esp_websocket_client_config_t;
@@ -67,6 +68,40 @@ esp_websocket_client_send_text(esp_websocket_client_handle_t client,
   return 1;
 }
 
+static inline int
+esp_websocket_client_send_text_partial(esp_websocket_client_handle_t client,
+                                       const char *data, int len,
+                                       TickType_t timeout) {
+  ESP_LOGI("[esp_websocket_client_stub]",
+           "esp_websocket_client_send_text_partial called");
+  return len;
+}
+
+static inline int
+esp_websocket_client_send_cont_msg(esp_websocket_client_handle_t client,
+                                   const char *data, int len,
+                                   TickType_t timeout) {
+  ESP_LOGI("[esp_websocket_client_stub]",
+           "esp_websocket_client_send_cont_msg called");
+  return len;
+}
+
+static inline esp_err_t
+esp_websocket_client_send_fin(esp_websocket_client_handle_t client,
+                              TickType_t timeout) {
+  ESP_LOGI("[esp_websocket_client_stub]",
+           "esp_websocket_client_send_fin called");
+  return ESP_OK;
+}
+
+static inline int
+esp_websocket_client_send_bin(esp_websocket_client_handle_t client,
+                              const char *data, int len, TickType_t timeout) {
+  ESP_LOGI("[esp_websocket_client_stub]",
+           "esp_websocket_client_send_bin called");
+  return 1;
+}
+
 static inline bool
 esp_websocket_client_is_connected(esp_websocket_client_handle_t client) {
   ESP_LOGI("[esp_websocket_client_stub]",
@@ -8,6 +8,9 @@
 extern "C" {
 #endif
 
+#define ESP_ERR_WIFI_BASE 0x3000
+#define ESP_ERR_WIFI_STATE (ESP_ERR_WIFI_BASE + 7)
+
 typedef struct {
 } wifi_init_config_t;
 #define WIFI_INIT_CONFIG_DEFAULT()                                             \
@@ -59,6 +62,43 @@ esp_wifi_scan_get_ap_records(uint16_t *number, wifi_ap_record_t *ap_records) {
   return ESP_OK;
 }
 
+static inline esp_err_t esp_wifi_clear_ap_list(void) {
+  ESP_LOGI("[esp_wifi_stub]", "esp_wifi_clear_ap_list called");
+  return ESP_OK;
+}
+
+static inline esp_err_t esp_wifi_get_channel(uint8_t *primary,
+                                             wifi_second_chan_t *second) {
+  ESP_LOGI("[esp_wifi_stub]", "esp_wifi_get_channel called");
+  *primary = 1;
+  *second = WIFI_SECOND_CHAN_NONE;
+  return ESP_OK;
+}
+
+static inline esp_err_t esp_wifi_ap_get_sta_list(wifi_sta_list_t *sta) {
+  ESP_LOGI("[esp_wifi_stub]", "esp_wifi_ap_get_sta_list called");
+  sta->num = 0;
+  return ESP_OK;
+}
+
+typedef void (*esp_vendor_ie_cb_t)(void *ctx, wifi_vendor_ie_type_t type,
+                                   const uint8_t sa[6],
+                                   const vendor_ie_data_t *vnd_ie, int rssi);
+
+static inline esp_err_t esp_wifi_set_vendor_ie(bool enable,
+                                               wifi_vendor_ie_type_t type,
+                                               wifi_vendor_ie_id_t idx,
+                                               const void *vnd_ie) {
+  ESP_LOGI("[esp_wifi_stub]", "esp_wifi_set_vendor_ie called");
+  return ESP_OK;
+}
+
+static inline esp_err_t esp_wifi_set_vendor_ie_cb(esp_vendor_ie_cb_t cb,
+                                                  void *ctx) {
+  ESP_LOGI("[esp_wifi_stub]", "esp_wifi_set_vendor_ie_cb called");
+  return ESP_OK;
+}
+
 static inline esp_err_t esp_wifi_sta_get_ap_info(wifi_ap_record_t *ap_info) {
   ESP_LOGI("[esp_wifi_stub]", "esp_wifi_sta_get_ap_info called");
   return ESP_OK;
@@ -29,20 +29,46 @@ typedef enum {
   WIFI_SCAN_TYPE_ACTIVE = 0,
   WIFI_SCAN_TYPE_PASSIVE,
 } wifi_scan_type_t;
+typedef struct {
+  uint32_t min;
+  uint32_t max;
+} wifi_active_scan_time_t;
+typedef struct {
+  wifi_active_scan_time_t active;
+  uint32_t passive;
+} wifi_scan_time_t;
 typedef struct {
   uint8_t *ssid;
   uint8_t *bssid;
   uint8_t channel;
   bool show_hidden;
   wifi_scan_type_t scan_type;
+  wifi_scan_time_t scan_time;
 } wifi_scan_config_t;
 
+typedef enum {
+  WIFI_SECOND_CHAN_NONE = 0,
+  WIFI_SECOND_CHAN_ABOVE,
+  WIFI_SECOND_CHAN_BELOW,
+} wifi_second_chan_t;
+
 typedef struct {
   uint8_t bssid[6];
   uint8_t ssid[33];
+  uint8_t primary;
   int8_t rssi;
 } wifi_ap_record_t;
 
+typedef struct {
+  uint8_t mac[6];
+  int8_t rssi;
+} wifi_sta_info_t;
+#define ESP_WIFI_MAX_CONN_NUM 15
+typedef struct {
+  wifi_sta_info_t sta[ESP_WIFI_MAX_CONN_NUM];
+  int num;
+} wifi_sta_list_t;
+
 typedef struct {
   uint8_t ssid[32];
   uint8_t ssid_len;
@@ -53,14 +79,40 @@ typedef struct {
 typedef struct {
   uint8_t ssid[32];
   uint8_t password[64];
+  bool bssid_set;
+  uint8_t bssid[6];
 } wifi_sta_config_t;
 typedef union {
   wifi_ap_config_t ap;
   wifi_sta_config_t sta;
 } wifi_config_t;
 
+typedef enum {
+  WIFI_VND_IE_TYPE_BEACON,
+  WIFI_VND_IE_TYPE_PROBE_REQ,
+  WIFI_VND_IE_TYPE_PROBE_RESP,
+  WIFI_VND_IE_TYPE_ASSOC_REQ,
+  WIFI_VND_IE_TYPE_ASSOC_RESP,
+} wifi_vendor_ie_type_t;
+
+typedef enum {
+  WIFI_VND_IE_ID_0,
+  WIFI_VND_IE_ID_1,
+} wifi_vendor_ie_id_t;
+
+#define WIFI_VENDOR_IE_ELEMENT_ID 0xDD
+typedef struct {
+  uint8_t element_id;
+  uint8_t length;
+  uint8_t vendor_oui[3];
+  uint8_t vendor_oui_type;
+  uint8_t payload[0];
+} vendor_ie_data_t;
+
 typedef enum {
   WIFI_EVENT_STA_START,
+  WIFI_EVENT_STA_CONNECTED,
+  WIFI_EVENT_STA_DISCONNECTED,
   WIFI_EVENT_AP_STACONNECTED,
   WIFI_EVENT_AP_STADISCONNECTED,
 } wifi_event_t;
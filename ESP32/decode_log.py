@@ -0,0 +1,58 @@
+#!/usr/bin/env python3
+"""Prints the deferred log lines of an ESP32, as exported by /api/log.
+
+Usage: ./decode_log.py <file or URL>
+
+e.g. ./decode_log.py "http://192.168.4.1/api/log?auth_token=..."
+"""
+
+import json
+import re
+import sys
+import urllib.request
+
+LEVELS = {1: "E", 2: "W", 3: "I", 4: "D", 5: "V"}
+
+# the lengths C needs and Python doesn't, e.g. PRIu32
+LENGTH = re.compile(r"%([-+ #0-9.]*)[hlLqjzt]+([a-zA-Z])")
+
+
+def decode(fmt, args):
+    fmt = LENGTH.sub(r"%\1\2", fmt)
+    # negative numbers are 32-bit unsigned ones, where the format says so
+    conversions = [
+        c for c in re.findall(r"%[-+ #0-9.]*([a-zA-Z%])", fmt) if c != "%"
+    ]
+    args = [
+        a + (1 << 32) if isinstance(a, int) and a < 0 and c in "uxXo" else a
+        for a, c in zip(args, conversions)
+    ]
+    try:
+        return fmt % tuple(args)
+    except (TypeError, ValueError):
+        return f"{fmt} {args}"
+
+
+def main():
+    if len(sys.argv) != 2:
+        print(__doc__.strip())
+        sys.exit(1)
+
+    source = sys.argv[1]
+    if source.startswith("http"):
+        with urllib.request.urlopen(source) as response:
+            log = json.load(response)
+    else:
+        with open(source) as file:
+            log = json.load(file)
+
+    if log["overwritten"] > 0:
+        print(f"({log['overwritten']} earlier lines overwritten)")
+    for time, level, index, args in log["records"]:
+        tag, fmt = log["formats"][index]
+        level = LEVELS.get(level, "?")
+        print(f"{level} ({time}) {tag}: {decode(fmt, args)}")
+
+
+if __name__ == "__main__":
+    main()
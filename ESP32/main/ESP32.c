@@ -1,15 +1,29 @@
 #include "AP.h"
+#include "BENCH.h"
 #include "BMS.h"
+#include "CMD.h"
+#include "DLOG.h"
 #include "DNS.h"
+#include "ELECT.h"
+#include "FLASH.h"
 #include "GPS.h"
 #include "I2C.h"
 #include "INV.h"
 #include "LoRa.h"
+#include "MEM.h"
 #include "MESH.h"
+#include "PARAM.h"
+#include "PROF.h"
+#include "SCHED.h"
 #include "SLAVE.h"
+#include "SOAK.h"
+#include "STATE.h"
 #include "TASK.h"
+#include "TRACE.h"
+#include "UPLINK.h"
 #include "WS.h"
 #include "config.h"
+#include "global.h"
 #include "utils.h"
 
 #include <inttypes.h>
@@ -24,32 +38,47 @@
 #include "freertos/FreeRTOS.h"
 
 esp_netif_t *ap_netif;
-bool is_root = false;
 int num_connected_clients = 0;
 uint8_t ESP_ID = 0;
-telemetry_data_t telemetry_data = {0};
-inverter_data_t inverter_data = {0};
-GPRMC_t gps_data = {0};
 httpd_handle_t server = NULL;
-bool connected_to_WiFi = false;
-bool connected_to_root = false;
 client_socket client_sockets[WS_CONFIG_MAX_CLIENTS];
 char current_auth_token[UTILS_AUTH_TOKEN_LENGTH] = "";
-bool LoRa_configured = false;
 LoRa_message all_messages[MESH_SIZE] = {0};
 char forwarded_message[LORA_MAX_PACKET_LEN - 2] = "";
 
 QueueHandle_t job_queue;
 
 void app_main(void) {
+  // must come before anything touches cJSON
+  mem_init();
+
   job_queue = xQueueCreate(10, sizeof(job_t));
   assert(job_queue != NULL);
+  state_init();
+  sched_init();
+  flash_init();
+  start_dlog_task();
+
+#if BENCH_TEST
+  // host-side checks and timings of the optimised code paths, then exit
+  bench_run();
+#endif
+
+#if SOAK_TEST
+  // host-side leak check: run the periodic jobs against the stubs and exit
+  ESP_ERROR_CHECK(i2c_master_init());
+  inv_init();
+  soak_run();
+#endif
 
   if (JOBS_ENABLED)
     xTaskCreate(job_worker_freertos_task, "job_worker_freertos_task", 3700,
                 NULL, 5, NULL);
+  cmd_init();
 
   initialise_nvs();
+  param_init();
+  trace_init();
 
   if (!LORA_IS_RECEIVER) {
     initialise_spiffs();
@@ -64,17 +93,20 @@ void app_main(void) {
     inv_init();
 
     // grab BMS DeviceName from the BMS DataFlash
-    uint8_t address[2] = {0};
-    convert_uint_to_n_bytes(I2C_DEVICE_NAME_ADDR, address, sizeof(address),
-                            true);
-    uint8_t data_flash[UTILS_ID_LENGTH + 1] = {0}; // S21 data type
-    read_data_flash(address, sizeof(address), data_flash, sizeof(data_flash));
+    uint8_t data_flash[UTILS_ID_LENGTH + 2] = {0}; // S21 data type
+    flash_get(BMS_PRIMARY_PACK, FLASH_DEVICE_NAME, data_flash);
     // store the ID in ESP32 memory
     if (strcmp((char *)data_flash, "") != 0)
       change_esp_id((char *)&data_flash[1]);
 
-    if (READ_BMS_ENABLED || READ_GPS_ENABLED || READ_INV_ENABLED)
-      start_read_data_timed_task();
+    // each sensor is polled by its own task so that a slow or unresponsive
+    // device does not hold up the others
+    if (READ_BMS_ENABLED)
+      start_read_bms_task();
+    if (READ_GPS_ENABLED)
+      start_read_gps_task();
+    if (READ_INV_ENABLED)
+      start_read_inv_task();
 
     // TODO: this should only be started if a task which uses `server` is
     // enabled
@@ -84,8 +116,10 @@ void app_main(void) {
       ESP_LOGE("main", "Failed to start web server!");
   }
 
-  if (WEBSOCKET_MESSAGES_ENABLED)
+  if (WEBSOCKET_MESSAGES_ENABLED) {
+    start_uplink_task();
     start_websocket_timed_task();
+  }
 
   if (!LORA_IS_RECEIVER) {
     if (HTTP_SERVER_ENABLED)
@@ -95,36 +129,30 @@ void app_main(void) {
     if (SLAVE_ESP32_ENABLED)
       start_slave_esp32_timed_task();
 
-    // MESH stuff
-    if (!is_root) {
-      if (MESH_NODE_CONNECT_ENABLED)
-        start_connect_to_root_timed_task();
+    // MESH stuff, for either role since the ROOT can change without a
+    // restart
+    if (MESH_NODE_CONNECT_ENABLED)
+      start_connect_to_root_timed_task();
 
-      if (MESH_NODE_WEBSOCKET_MESSAGES_ENABLED)
-        start_mesh_websocket_timed_task();
-    } else {
-      if (MESH_ROOT_MERGE_ENABLED)
-        start_merge_root_timed_task();
-    }
+    if (MESH_NODE_WEBSOCKET_MESSAGES_ENABLED)
+      start_mesh_websocket_timed_task();
+
+    elect_init();
+    start_elect_timed_task();
   }
 
   // radio stuff
-  if (LORA_IS_RECEIVER || is_root) {
-    lora_init();
-
-    if (LoRa_configured) {
-      if (LORA_RECEIVE_ENABLED)
-        start_receive_interrupt_task();
-
-      if (LORA_TRANSMIT_ENABLED)
-        start_transmit_timed_task();
-    }
-  }
+  if (LORA_IS_RECEIVER || state_is(STATE_ROOT))
+    lora_start();
 
   while (true) {
-    if (VERBOSE)
-      ESP_LOGI("main", "%" PRId32 " bytes available in heap",
-               esp_get_free_heap_size());
+    prof_sample();
+    if (VERBOSE) {
+      mem_log_stats();
+      prof_log_stats();
+      if (!LORA_IS_RECEIVER)
+        i2c_log_stats();
+    }
     if (esp_get_minimum_free_heap_size() < 2000)
       esp_restart();
     vTaskDelay(pdMS_TO_TICKS(10000));
@@ -0,0 +1,51 @@
+#ifndef ALARM_H
+#define ALARM_H
+
+#include "CHANGE.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cJSON.h"
+
+typedef enum {
+  ALARM_CELL_IMBALANCE,   // spread of the cell voltages
+  ALARM_OVER_TEMPERATURE, // hottest cell at or heading for the OTC threshold
+  ALARM_OVER_CURRENT,     // pack current over its limit
+  N_ALARMS                // keep last
+} alarm_t;
+
+// one device's alarm message: which alarms are raised, and a summary of the
+// reading which raised or cleared them
+typedef struct {
+  uint8_t esp_id;
+  uint8_t active;      // one bit per alarm_t which is raised
+  uint8_t raised;      // bits which have just been raised
+  uint16_t spread;     // cell imbalance, mV
+  int16_t rate;        // heating rate of the hottest cell, 0.1 °C per minute
+  int16_t temperature; // hottest cell, 0.1 °C
+  int16_t current;     // 0.1 A
+} alarm_report_t;
+
+#define ALARM_MESSAGE_MAX_LEN 192
+
+void alarm_check();
+
+void alarm_forward(const cJSON *message);
+
+void alarm_send();
+
+bool alarm_radio_pending();
+
+size_t alarm_pack_pending(uint8_t *binary_message);
+
+size_t alarm_write_json(const alarm_report_t *report, char *out, size_t size);
+
+void alarm_add_to_json(const alarm_report_t *report, cJSON *content);
+
+size_t alarm_unpack(const uint8_t *packet, alarm_report_t *report);
+
+int64_t alarm_latency(destination_t destination);
+
+#endif // ALARM_H
@@ -11,11 +11,11 @@ struct rendered_page {
   char content[WS_MAX_HTML_SIZE];
 };
 
-wifi_ap_record_t *wifi_scan(void);
-
 void ap_n_clients_handler(void *arg, esp_event_base_t event_base,
                           int32_t event_id, void *event_data);
 
+esp_err_t ap_configure(bool root);
+
 void wifi_init(void);
 
 esp_err_t redirect_handler(httpd_req_t *req);
@@ -24,9 +24,11 @@ esp_err_t file_serve_handler(httpd_req_t *req);
 
 esp_err_t login_handler(httpd_req_t *req);
 
-esp_err_t num_clients_handler(httpd_req_t *req);
+esp_err_t prof_handler(httpd_req_t *req);
+
+esp_err_t trace_handler(httpd_req_t *req);
 
-esp_err_t restart_handler(httpd_req_t *req);
+esp_err_t log_handler(httpd_req_t *req);
 
 httpd_handle_t start_webserver(void);
 
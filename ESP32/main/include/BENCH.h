@@ -0,0 +1,13 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdbool.h>
+
+typedef struct {
+  const char *name;
+  bool (*run)(); // false if any of its checks failed
+} bench_t;
+
+void bench_run();
+
+#endif // BENCH_H
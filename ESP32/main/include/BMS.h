@@ -1,43 +1,34 @@
 #ifndef BMS_H
 #define BMS_H
 
+#include "SCHEMA.h"
+
+#include <stdbool.h>
 #include <stdint.h>
 
+#include "esp_err.h"
+
+// BMS readings, in the units the BMS reports them in
 typedef struct {
-  uint8_t Q;
-  uint8_t H;
-  uint16_t aT;
-  uint16_t cT;
-  uint16_t T1;
-  uint16_t T2;
-  uint16_t T3;
-  uint16_t T4;
-  uint16_t V;
-  uint16_t V1;
-  uint16_t V2;
-  uint16_t V3;
-  uint16_t V4;
-  int16_t I;
-  int16_t I1;
-  int16_t I2;
-  int16_t I3;
-  int16_t I4;
-  int16_t OTC;
-  uint16_t CC;
+#define X(key, source, member, type, ...) SCHEMA_MEMBER_##source(type, member)
+  SCHEMA_FIELDS(X)
+#undef X
 } telemetry_data_t;
 
-void reset();
+esp_err_t reset(uint8_t pack);
+
+esp_err_t seal(uint8_t pack);
 
-void seal();
+esp_err_t unseal(uint8_t pack);
 
-void unseal();
+esp_err_t full_access(uint8_t pack);
 
-void full_access();
+int8_t get_sealed_status(uint8_t pack);
 
-int8_t get_sealed_status();
+esp_err_t update_telemetry_data(uint8_t pack);
 
-void update_telemetry_data();
+void read_bms_freertos_task(void *arg);
 
-void start_read_data_timed_task();
+void start_read_bms_task();
 
 #endif // BMS_H
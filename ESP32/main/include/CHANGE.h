@@ -0,0 +1,28 @@
+#ifndef CHANGE_H
+#define CHANGE_H
+
+#include "CODEC.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// everywhere this device's data messages go
+typedef enum {
+  DESTINATION_BROWSER, // browsers connected to this device
+  DESTINATION_SERVER,  // the web server, over the internet
+  DESTINATION_MESH,    // the root, from a mesh node
+  DESTINATION_RADIO,   // the LoRa receiver, from the root
+  N_DESTINATIONS       // keep last
+} destination_t;
+
+bool change_is_due(destination_t destination, uint8_t pack,
+                   const report_t *report);
+
+void change_mark_sent(destination_t destination, uint8_t pack,
+                      const report_t *report);
+
+void change_reset(destination_t destination);
+
+void change_check();
+
+#endif // CHANGE_H
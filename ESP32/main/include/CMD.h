@@ -0,0 +1,70 @@
+#ifndef CMD_H
+#define CMD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cJSON.h"
+#include "esp_err.h"
+
+// the commands which can be requested of a device
+typedef enum {
+  CMD_QUERY,           // "are you still there?"
+  CMD_CHANGE_SETTINGS, // new esp_id and / or OTC threshold
+  CMD_CONNECT_WIFI,
+  CMD_RESET_BMS,
+  CMD_UNSEAL_BMS,
+  CMD_FLIP_INVERTER,
+  CMD_SET_PARAMS, // runtime settings, see PARAM.h
+  N_CMD_KINDS     // keep last
+} cmd_kind_t;
+
+typedef enum {
+  CMD_STATUS_SUCCESS,
+  CMD_STATUS_ERROR,
+  CMD_STATUS_BUSY, // too many commands were already waiting
+  N_CMD_STATUSES   // keep last
+} cmd_status_t;
+
+// where a command came from, and so where its response goes
+typedef enum {
+  CMD_ORIGIN_NONE,     // this device, e.g. reconnecting to Wi-Fi
+  CMD_ORIGIN_BROWSER,  // a browser connected to this device
+  CMD_ORIGIN_UPSTREAM, // the web server, or the ROOT for a mesh node
+  CMD_ORIGIN_RADIO,    // the LoRa receiver, for the ROOT
+} cmd_origin_t;
+
+// one device's response message
+typedef struct {
+  uint8_t esp_id;
+  cmd_kind_t kind;
+  cmd_status_t status;
+  uint8_t failed; // settings which weren't changed, one bit per
+                  // flash_setting_t
+} cmd_response_t;
+
+#define CMD_RESPONSE_MAX_LEN 160
+
+void cmd_init();
+
+esp_err_t cmd_submit(const cJSON *message, cmd_origin_t origin, int fd);
+
+bool cmd_pending(cmd_kind_t kind);
+
+void cmd_step();
+
+void cmd_forward_response(const cJSON *message);
+
+bool cmd_radio_pending();
+
+size_t cmd_pack_pending(uint8_t *binary_message);
+
+size_t cmd_write_response(const cmd_response_t *response, char *out,
+                          size_t size);
+
+void cmd_add_to_json(const cmd_response_t *response, cJSON *content);
+
+size_t cmd_unpack(const uint8_t *packet, cmd_response_t *response);
+
+#endif // CMD_H
@@ -0,0 +1,102 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include "DATA.h"
+#include "SCHEMA.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cJSON.h"
+
+typedef enum {
+#define X(key, ...) FIELD_##key,
+  SCHEMA_FIELDS(X)
+#undef X
+  N_FIELDS // keep last
+} field_t;
+
+typedef enum {
+  FORMAT_NUMBER,
+  FORMAT_BOOL,
+} field_format_t;
+
+typedef struct {
+  const char *key;
+  uint8_t ndp;
+  bool scaled;
+  field_format_t format;
+  uint8_t wire_offset; // within radio_data_packet
+  uint8_t wire_size;
+  bool wire_signed;
+  int32_t deadband;           // in 10^-ndp units
+  uint16_t relative_deadband; // in 1/1000ths
+} field_info_t;
+
+extern const field_info_t field_info[N_FIELDS];
+
+// a set of fields, one bit per field_t (there are fewer than 64)
+#define CODEC_FIELD_BIT(field) ((uint64_t)1 << (field))
+#define CODEC_ALL_FIELDS UINT64_MAX
+
+// one device's data message: every field as a whole number of 10^-ndp units
+typedef struct {
+  uint8_t esp_id;
+  int32_t values[N_FIELDS];
+} report_t;
+
+const field_info_t *codec_find_field(const char *key);
+
+void codec_from_snapshot(const data_snapshot_t *snapshot, uint8_t esp_id,
+                         report_t *report);
+
+void codec_read_latest(report_t *report);
+
+bool codec_read_pack(uint8_t pack, report_t *report);
+
+bool codec_from_json(const cJSON *message, report_t *report);
+
+size_t codec_write_json(const report_t *report, char *out, size_t size,
+                        bool for_frontend);
+
+size_t codec_write_fields(const report_t *report, uint64_t fields, char *out,
+                          size_t size, bool for_frontend);
+
+size_t codec_write_keys(char *out, size_t size);
+
+size_t codec_write_row(const report_t *report, char *out, size_t size);
+
+void codec_add_to_json(const report_t *report, cJSON *content);
+
+// whole numbers in radio packets, which are little endian whatever the host is
+void codec_put_le(uint8_t *out, uint32_t value, uint8_t size);
+
+int32_t codec_get_le(const uint8_t *in, uint8_t size, bool is_signed);
+
+// whether a whole number type is signed, without comparing an unsigned -1
+// against 0; the standard signed types cover every intN_t, whatever each is
+#define CODEC_IS_SIGNED(type)                                                  \
+  _Generic((type)0,                                                            \
+      signed char: true,                                                       \
+      short: true,                                                             \
+      int: true,                                                               \
+      long: true,                                                              \
+      long long: true,                                                         \
+      default: false)
+
+// a member of a packet laid out as one of the packed structs in LoRa.h, so
+// that what goes over the radio doesn't depend on the compiler
+#define CODEC_PUT_MEMBER(packet, type, member, value)                          \
+  codec_put_le(&(packet)[offsetof(type, member)], (uint32_t)(value),           \
+               sizeof(((type *)0)->member))
+#define CODEC_GET_MEMBER(packet, type, member)                                 \
+  codec_get_le(&(packet)[offsetof(type, member)],                              \
+               sizeof(((type *)0)->member),                                    \
+               CODEC_IS_SIGNED(__typeof__(((type *)0)->member)))
+
+size_t codec_pack(const report_t *report, uint8_t *packet);
+
+size_t codec_unpack(const uint8_t *packet, report_t *report);
+
+#endif // CODEC_H
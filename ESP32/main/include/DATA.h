@@ -0,0 +1,36 @@
+#ifndef DATA_H
+#define DATA_H
+
+#include "BMS.h"
+#include "GPS.h"
+#include "INV.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct {
+  uint32_t seq;      // incremented every time any part of the sample changes
+  int64_t timestamp; // time of the most recent publish, in us since boot
+  telemetry_data_t telemetry;
+  GPRMC_t gps;
+  inverter_data_t inverter;
+} data_snapshot_t;
+
+void data_publish_telemetry(const telemetry_data_t *telemetry);
+
+void data_publish_pack(uint8_t pack, uint8_t esp_id,
+                       const telemetry_data_t *telemetry);
+
+void data_set_pack_offline(uint8_t pack);
+
+void data_publish_gps(const GPRMC_t *gps);
+
+void data_publish_inverter(const inverter_data_t *inverter);
+
+void data_set_inverter_enabled(bool enabled);
+
+void data_read_snapshot(data_snapshot_t *snapshot);
+
+bool data_read_pack(uint8_t pack, data_snapshot_t *snapshot, uint8_t *esp_id);
+
+#endif // DATA_H
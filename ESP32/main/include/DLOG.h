@@ -0,0 +1,77 @@
+#ifndef DLOG_H
+#define DLOG_H
+
+#include "config.h"
+#include "utils.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "esp_log.h"
+
+// like the ESP_LOGx macros, but only the format and up to `DLOG_MAX_ARGS`
+// integer arguments are recorded, for a low priority task to print later.
+// the format is kept rather than copied, and so is a string passed with
+// `DLOG_STR`, which has to last as long as the firmware runs (e.g. a literal).
+// the arguments are checked against the format as printf's would be, and
+// anything which doesn't fit in an `intptr_t` as it is (a double, or a 64-bit
+// integer) is refused when compiling rather than printed as garbage
+#define DLOG_STR(str) ((const char *)(str))
+
+#define DLOG_N_ARGS(...) DLOG_NTH(0, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define DLOG_NTH(_0, _1, _2, _3, _4, _5, _6, _7, _8, n, ...) n
+#define DLOG_CAT(a, b) DLOG_CAT_(a, b)
+#define DLOG_CAT_(a, b) a##b
+
+// `m` applied to each argument
+#define DLOG_EACH(m, ...)                                                      \
+  DLOG_CAT(DLOG_EACH_, DLOG_N_ARGS(__VA_ARGS__))(m, ##__VA_ARGS__)
+#define DLOG_EACH_0(m)
+#define DLOG_EACH_1(m, a) m(a)
+#define DLOG_EACH_2(m, a, ...) m(a) DLOG_EACH_1(m, __VA_ARGS__)
+#define DLOG_EACH_3(m, a, ...) m(a) DLOG_EACH_2(m, __VA_ARGS__)
+#define DLOG_EACH_4(m, a, ...) m(a) DLOG_EACH_3(m, __VA_ARGS__)
+
+#define DLOG_CHECK_ARG(arg)                                                    \
+  _Static_assert(sizeof(arg) <= sizeof(intptr_t) &&                            \
+                     !_Generic((arg),                                          \
+                         float: 1,                                             \
+                         double: 1,                                            \
+                         long double: 1,                                       \
+                         long long: 1,                                         \
+                         unsigned long long: 1,                                \
+                         default: 0),                                          \
+                 "only integers up to 32 bits, and strings with `DLOG_STR`, "  \
+                 "can be logged");
+#define DLOG_ARG(arg) , (intptr_t)(arg)
+
+#define DLOG_LEVEL(level, tag, format, ...)                                    \
+  do {                                                                         \
+    _Static_assert(DLOG_N_ARGS(__VA_ARGS__) <= DLOG_MAX_ARGS,                  \
+                   "too many arguments to log");                               \
+    DLOG_EACH(DLOG_CHECK_ARG, ##__VA_ARGS__)                                   \
+    if (0)                                                                     \
+      printf(format, ##__VA_ARGS__);                                           \
+    const intptr_t dlog_args[] = {0 DLOG_EACH(DLOG_ARG, ##__VA_ARGS__)};       \
+    dlog_write(level, tag, format, dlog_args + 1,                              \
+               sizeof(dlog_args) / sizeof(intptr_t) - 1);                      \
+  } while (0)
+
+#define DLOGE(tag, format, ...)                                                \
+  DLOG_LEVEL(ESP_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define DLOGW(tag, format, ...)                                                \
+  DLOG_LEVEL(ESP_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define DLOGI(tag, format, ...)                                                \
+  DLOG_LEVEL(ESP_LOG_INFO, tag, format, ##__VA_ARGS__)
+
+void dlog_write(esp_log_level_t level, const char *tag, const char *format,
+                const intptr_t *args, uint8_t n_args);
+
+void dlog_freertos_task(void *arg);
+
+void start_dlog_task();
+
+bool dlog_export(chunk_emit_t emit, void *ctx);
+
+#endif // DLOG_H
@@ -0,0 +1,53 @@
+#ifndef ELECT_H
+#define ELECT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ELECT_FLAG_ROOT (1 << 0)
+#define ELECT_FLAG_UPLINK (1 << 1) // connected to Wi-Fi, so the web server
+#define ELECT_FLAG_ORPHAN (1 << 2) // a node without a route to a ROOT
+
+#define ELECT_HOP_NONE 0xff // no route to a ROOT
+
+// what each device advertises about itself in its beacons and probe responses
+typedef struct {
+  uint8_t mac[6];
+  uint8_t priority;
+  uint8_t flags; // ELECT_FLAG_*
+  uint8_t n_clients;
+  uint16_t uptime; // minutes
+  uint8_t esp_id;
+  uint8_t hop; // 0 for a ROOT, its parent's plus 1 for a node
+} elect_candidate_t;
+
+typedef struct {
+  elect_candidate_t candidate;
+  int8_t rssi;
+  int64_t heard_at; // us
+} elect_neighbour_t;
+
+typedef enum {
+  ELECT_STAY,
+  ELECT_PROMOTE, // become the ROOT
+  ELECT_DEMOTE,  // become a node of a better ROOT
+} elect_action_t;
+
+int elect_compare(const elect_candidate_t *a, const elect_candidate_t *b);
+
+elect_action_t elect_decide(const elect_candidate_t *self,
+                            const elect_candidate_t *heard, size_t n_heard);
+
+size_t elect_neighbours(elect_neighbour_t *out, size_t max,
+                        uint32_t max_age_ms);
+
+void elect_advertise();
+
+void elect_init();
+
+void elect_round();
+
+void start_elect_timed_task();
+
+#endif // ELECT_H
@@ -0,0 +1,39 @@
+#ifndef FLASH_H
+#define FLASH_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+// the BMS DataFlash settings which this device reads and changes
+typedef enum {
+  FLASH_DEVICE_NAME,   // S21: length byte, then the characters
+  FLASH_OTC_THRESHOLD, // I2, 0.1 °C
+  N_FLASH_SETTINGS     // keep last
+} flash_setting_t;
+
+#define FLASH_BLOCK_SIZE 32 // the most one ManufacturerBlockAccess moves
+#define FLASH_MAX_SETTING_SIZE (UTILS_ID_LENGTH + 1)
+
+void flash_init();
+
+size_t flash_setting_size(flash_setting_t setting);
+
+esp_err_t flash_get(uint8_t pack, flash_setting_t setting, uint8_t *value);
+
+esp_err_t flash_set(uint8_t pack, flash_setting_t setting,
+                    const uint8_t *value);
+
+bool flash_staged(uint8_t pack);
+
+esp_err_t flash_write(uint8_t pack);
+
+void flash_verify(uint8_t pack, esp_err_t results[N_FLASH_SETTINGS]);
+
+void flash_invalidate(uint8_t pack);
+
+#endif // FLASH_H
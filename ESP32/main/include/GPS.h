@@ -24,8 +24,12 @@ bool validate_nmea_checksum(const char *sentence);
 
 double nmea_to_decimal(double coord, char hemi);
 
-void parse_gprmc(char *gprmc);
+bool parse_gprmc(char *gprmc, GPRMC_t *out);
 
 void update_gps();
 
+void read_gps_freertos_task(void *arg);
+
+void start_read_gps_task();
+
 #endif
@@ -1,23 +1,53 @@
 #ifndef I2C_H
 #define I2C_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include "esp_err.h"
 
+#define I2C_DATA_FLASH_WRITE_MS 100 // for the gauge to commit a DataFlash write
+
+typedef enum {
+  I2C_BUS_BMS, // each pack's BMS, and the multiplexer if there is one
+  I2C_BUS_EXT, // the slave ESP32
+  N_I2C_BUSES  // keep last
+} i2c_bus_t;
+
+typedef struct {
+  uint32_t transactions;
+  uint32_t nacks;      // failures other than timeouts, e.g. a missing device
+  uint32_t timeouts;
+  uint32_t skipped;    // failed straight away, as the device was backed off
+  uint32_t recoveries; // bus resets after a timeout
+  uint32_t freq_hz;
+  uint32_t min_latency_us;
+  uint32_t max_latency_us;
+  uint64_t total_latency_us;
+} i2c_bus_stats_t;
+
 esp_err_t i2c_master_init(void);
 
-esp_err_t check_device();
+esp_err_t check_device(uint8_t pack);
 
 void device_scan(void);
 
-esp_err_t read_SBS_data(uint8_t reg, uint8_t *data, size_t data_size);
+esp_err_t read_SBS_data(uint8_t pack, uint8_t reg, uint8_t *data,
+                        size_t data_size);
+
+esp_err_t write_word(uint8_t pack, uint8_t command, uint8_t *word,
+                     size_t word_size);
+
+esp_err_t read_data_flash(uint8_t pack, uint8_t *address, size_t address_size,
+                          uint8_t *data, size_t data_size);
 
-void write_word(uint8_t command, uint8_t *word, size_t word_size);
+esp_err_t write_data_flash(uint8_t pack, uint8_t *address,
+                           size_t address_size, uint8_t *data,
+                           size_t data_size);
 
-void read_data_flash(uint8_t *address, size_t address_size, uint8_t *data,
-                     size_t data_size);
+void i2c_get_bus_stats(i2c_bus_t bus, i2c_bus_stats_t *stats);
 
-void write_data_flash(uint8_t *address, size_t address_size, uint8_t *data,
-                      size_t data_size);
+void i2c_log_stats();
 
 void write_to_slave_esp32();
 
@@ -17,4 +17,8 @@ void inv_init();
 
 void update_inv();
 
+void read_inv_freertos_task(void *arg);
+
+void start_read_inv_task();
+
 #endif
@@ -1,6 +1,8 @@
 #ifndef LORA_H
 #define LORA_H
 
+#include "SCHEMA.h"
+
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -12,39 +14,16 @@ enum packet_type {
   QUERY,
   REQUEST,
   RESPONSE,
+  ALARM,
 };
 
 // `type` must always be first byte in each type of radio packet
 typedef struct __attribute__((packed)) {
-  double t;
-  uint32_t d;
-  double lat;
-  double lon;
   uint8_t type;
   uint8_t esp_id;
-  uint8_t Q;
-  uint8_t H;
-  uint8_t V;
-  uint16_t V1;
-  uint16_t V2;
-  uint16_t V3;
-  uint16_t V4;
-  int8_t I;
-  int16_t I1;
-  int16_t I2;
-  int16_t I3;
-  int16_t I4;
-  int16_t aT;
-  int16_t cT;
-  int16_t T1;
-  int16_t T2;
-  int16_t T3;
-  int16_t T4;
-  int16_t OTC;
-  uint16_t CC;
-  uint16_t P;
-  bool inv;
-  bool wifi;
+#define X(key, source, member, type, wire_type, ...) wire_type key;
+  SCHEMA_FIELDS(X)
+#undef X
 } radio_data_packet;
 
 typedef struct __attribute__((packed)) {
@@ -53,25 +32,56 @@ typedef struct __attribute__((packed)) {
   int8_t query; // 1 for "are you still there?"
 } radio_query_packet;
 
+typedef struct __attribute__((packed)) {
+  uint8_t type;
+  uint8_t esp_id;
+  uint8_t active;      // one bit per alarm_t which is raised
+  uint8_t raised;      // bits which have just been raised
+  uint16_t spread;     // cell imbalance, mV
+  int16_t rate;        // heating rate of the hottest cell, 0.1 °C per minute
+  int16_t temperature; // hottest cell, 0.1 °C
+  int16_t current;     // 0.1 A
+} radio_alarm_packet;
+
 enum request_type {
   NO_REQUEST,
   CHANGE_SETTINGS,
   CONNECT_WIFI,
   RESET_BMS,
   UNSEAL_BMS,
+  SET_PARAMS,
 };
+#define RADIO_MAX_PARAMS 6 // settings in one radio set-params request
 typedef struct __attribute__((packed)) {
   uint8_t type;
   uint8_t esp_id;
   int8_t request;
   uint8_t new_esp_id;
   int16_t OTC;
-  uint8_t ssid[16];
-  uint8_t password[16];
-  bool auto_connect;
+  // the Wi-Fi details and the settings share the same bytes
+  union __attribute__((packed)) {
+    struct __attribute__((packed)) {
+      uint8_t ssid[16];
+      uint8_t password[16];
+      bool auto_connect;
+    };
+    struct __attribute__((packed)) {
+      uint8_t n_params;
+      uint8_t param_ids[RADIO_MAX_PARAMS]; // param_id_t
+      int32_t param_values[RADIO_MAX_PARAMS];
+    };
+  };
   bool success;
 } radio_request_packet;
 
+typedef struct __attribute__((packed)) {
+  uint8_t type;
+  uint8_t esp_id;
+  uint8_t command; // cmd_kind_t
+  uint8_t status;  // cmd_status_t
+  uint8_t failed;  // settings which weren't changed
+} radio_response_packet;
+
 #define FRAME_END 0x7E // marks beginning and end of message
 #define FRAME_ESC 0x7D // escape character
 #define ESC_END 0x5E   // escaped 0x7E → 0x7D 0x5E
@@ -79,14 +89,20 @@ typedef struct __attribute__((packed)) {
 
 void lora_init();
 
+void lora_start();
+
 size_t json_to_binary(uint8_t *binary_message, cJSON *json_array);
 
+// `output` needs room for `2 * input_len + 2` bytes, if every byte is escaped
 size_t encode_frame(const uint8_t *input, size_t input_len, uint8_t *output);
 
 size_t decode_frame(const uint8_t *input, size_t input_len, uint8_t *output);
 
 void binary_to_json(uint8_t *binary_message, cJSON *json_array);
 
+// handles a whole frame, still encoded, as read off the radio by `receive`
+void receive_frame(const uint8_t *encoded, size_t length, int rssi_dbm);
+
 void receive();
 
 void start_receive_interrupt_task();
@@ -95,6 +111,8 @@ void execute_transmission(uint8_t *message, size_t n_bytes);
 
 void transmit();
 
+int64_t transmit_ready_at();
+
 void start_transmit_timed_task();
 
 #endif // LORA_H
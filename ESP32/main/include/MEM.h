@@ -0,0 +1,40 @@
+#ifndef MEM_H
+#define MEM_H
+
+#include "TASK.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+  char name[32];
+  uint32_t runs;
+  size_t arena_high_water;   // most arena bytes used by a single run
+  uint32_t arena_overflows;  // JSON allocations which fell back to the heap
+  int32_t largest_heap_drop; // worst free heap lost across a single run
+  uint32_t min_free_heap;    // lowest free heap seen at the end of a run
+} mem_job_stats_t;
+
+typedef struct {
+  size_t in_use;
+  size_t high_water;
+  uint32_t heap_fallbacks;
+} mem_pool_stats_t;
+
+void mem_init();
+
+void mem_job_begin(job_type_t type);
+
+void mem_job_end(job_type_t type, const char *name);
+
+void *mem_block_alloc(size_t size);
+
+void mem_block_free(void *ptr);
+
+void mem_get_job_stats(job_type_t type, mem_job_stats_t *stats);
+
+void mem_get_pool_stats(mem_pool_stats_t *stats);
+
+void mem_log_stats();
+
+#endif // MEM_H
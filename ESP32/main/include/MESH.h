@@ -1,8 +1,39 @@
 #ifndef MESH_H
 #define MESH_H
 
+#include "CODEC.h"
+#include "config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #include "esp_err.h"
-#include "esp_http_client.h"
+
+uint8_t mesh_hop();
+
+void mesh_learn_route(uint8_t esp_id, int fd, bool direct);
+
+void mesh_forget_routes(int fd);
+
+int mesh_route(uint8_t esp_id);
+
+bool mesh_send_down(uint8_t esp_id, const char *message);
+
+void mesh_announce_route();
+
+void mesh_set_parent_hop(uint8_t hop);
+
+void mesh_set_parent_binary(bool binary);
+
+bool mesh_keep_report(const report_t *report);
+
+bool mesh_reports_waiting();
+
+size_t mesh_peek_reports(report_t reports[MESH_SIZE], bool waiting[MESH_SIZE]);
+
+void mesh_commit_reports(const report_t reports[MESH_SIZE],
+                         const bool sent[MESH_SIZE]);
 
 void connect_to_root();
 
@@ -10,12 +41,10 @@ void start_connect_to_root_timed_task();
 
 void send_mesh_websocket_data();
 
-void start_mesh_websocket_timed_task();
-
-esp_err_t ap_n_client_comparison_handler(esp_http_client_event_t *evt);
+void mesh_reset();
 
-void merge_root();
+bool send_mesh_message(const char *message);
 
-void start_merge_root_timed_task();
+void start_mesh_websocket_timed_task();
 
 #endif // MESH_H
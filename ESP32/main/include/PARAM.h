@@ -0,0 +1,72 @@
+#ifndef PARAM_H
+#define PARAM_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+
+// every setting which can be changed while running, without reflashing. each
+// starts at its Kconfig value, is overridden by NVS at boot and kept in RAM
+// from then on:
+//
+//   X(id, key, default, min, max)
+//
+// key         name in set-params requests and in NVS (at most 15 characters)
+// default     value until it is first changed
+// min, max    range of values accepted
+#define PARAM_LIST(X)                                                          \
+  X(WS_PERIOD, ws_period, WS_DELAY, 100, 3600000)                              \
+  X(SLAVE_PERIOD, slave_period, SLAVE_DELAY, 100, 3600000)                     \
+  X(MESH_CONNECT_PERIOD, mesh_period, 5000, 1000, 3600000)                     \
+  X(MESH_WS_PERIOD, mesh_ws_period, 5000, 100, 3600000)                        \
+  X(ELECT_PERIOD, elect_period, ELECT_PERIOD_MS, 1000, 600000)                 \
+  X(RADIO_PERIOD, lora_period, 5000, 1000, 3600000)                            \
+  X(BMS_PERIOD, bms_period, BMS_READ_PERIOD, 100, 3600000)                     \
+  X(PACK_PERIOD, pack_period, BMS_PACK_READ_PERIOD, 100, 3600000)              \
+  X(GPS_PERIOD, gps_period, GPS_READ_PERIOD, 100, 3600000)                     \
+  X(INV_PERIOD, inv_period, INV_READ_PERIOD, 100, 3600000)                     \
+  X(HEARTBEAT, heartbeat, REPORT_HEARTBEAT_PERIOD, 0, 86400000)                \
+  X(RADIO_FREQ, lora_freq, LORA_FREQ, 137, 1020)                               \
+  X(RADIO_SF, lora_sf, LORA_SF, 6, 12)                                         \
+  X(RADIO_BW, lora_bw, LORA_BW, 0, 9)                                          \
+  X(RADIO_CR, lora_cr, LORA_CR, 1, 4)                                          \
+  X(RADIO_POWER, lora_power, LORA_OUTPUT_POWER, 0, 15)                         \
+  X(TRACE, trace, 0, 0, 1)
+
+typedef enum {
+#define X(id, ...) PARAM_##id,
+  PARAM_LIST(X)
+#undef X
+  N_PARAMS // keep last
+} param_id_t;
+
+#define PARAM_BIT(id) (1u << (id))
+#define PARAM_RADIO                                                            \
+  (PARAM_BIT(PARAM_RADIO_FREQ) | PARAM_BIT(PARAM_RADIO_SF) |                   \
+   PARAM_BIT(PARAM_RADIO_BW) | PARAM_BIT(PARAM_RADIO_CR) |                     \
+   PARAM_BIT(PARAM_RADIO_POWER))
+
+// called with the setting which changed, by whoever changed it (the job
+// worker for requests)
+typedef void (*param_watcher_t)(param_id_t id, int32_t value);
+
+void param_init();
+
+int32_t param_get(param_id_t id);
+
+int param_find(const char *key);
+
+const char *param_key(param_id_t id);
+
+bool param_valid(param_id_t id, int32_t value);
+
+esp_err_t param_set(param_id_t id, int32_t value);
+
+bool param_watch(uint32_t ids, param_watcher_t watcher);
+
+void param_save();
+
+#endif // PARAM_H
@@ -0,0 +1,19 @@
+#ifndef PROF_H
+#define PROF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROF_FOREVER UINT32_MAX // waiting on something which may never come
+
+void prof_checkin(uint32_t next_ms);
+
+void prof_sample();
+
+size_t prof_write_json(char *out, size_t size);
+
+void prof_send();
+
+void prof_log_stats();
+
+#endif // PROF_H
@@ -0,0 +1,15 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "esp_wifi_types_generic.h"
+
+esp_err_t scan_find_root(uint32_t max_age_ms, bool all_channels,
+                         wifi_ap_record_t *root);
+
+esp_err_t scan_lookup(const uint8_t bssid[6], wifi_ap_record_t *record);
+
+#endif // SCAN_H
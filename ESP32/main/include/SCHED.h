@@ -0,0 +1,22 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include "PARAM.h"
+#include "TASK.h"
+
+#include <stdint.h>
+
+// what a recurring job is chained after: a job type, or one of these
+#define SCHED_AFTER_NONE -1
+#define SCHED_AFTER_SAMPLE N_JOB_TYPES // a new reading of this ESP32's pack
+
+void sched_init();
+
+void sched_add(job_type_t type, param_id_t period, uint32_t jitter_ms,
+               int after);
+
+void sched_ran(int stage);
+
+void sched_queue(job_type_t type);
+
+#endif // SCHED_H
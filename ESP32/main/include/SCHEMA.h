@@ -0,0 +1,85 @@
+#ifndef SCHEMA_H
+#define SCHEMA_H
+
+#include <stdint.h>
+
+// every field of a device's data message, in the order it is sent. the
+// telemetry struct, the radio data packet and the JSON and radio codecs (see
+// CODEC.c) are all generated from this one list, so a new field only needs a
+// line here (and somewhere to read it from):
+//
+//   X(key, source, member, type, wire type, conversion, ndp, scaled, format,
+//     deadband, relative deadband)
+//
+// key         name in JSON messages and in the radio packet
+// source      BMS readings are members of telemetry_data_t, GPS and INV name
+//             a member of the GPS or inverter data, WIFI is the connection
+// member      name of the reading in its source
+// type        type of the reading in its source
+// wire type   type it is sent as by radio
+// conversion  from the reading to a whole number of 10^-ndp units
+// ndp         decimal places of the reported value
+// scaled      whether the web server is sent the whole number of units
+//             rather than the decimal, which browsers always get
+// format      NUMBER or BOOL in JSON
+// deadband    smallest change, in 10^-ndp units, which is reported straight
+//             away rather than with the next heartbeat (see CHANGE.c), or
+//             SCHEMA_NEVER for fields which only go out with other changes
+// relative deadband
+//             the same as a fraction of the last value sent, in 1/1000ths,
+//             where it is larger
+#define SCHEMA_FIELDS(X)                                                       \
+  X(Q, BMS, Q, uint8_t, uint8_t, as_is, 0, true, NUMBER, 1, 0)                 \
+  X(H, BMS, H, uint8_t, uint8_t, as_is, 0, true, NUMBER, 1, 0)                 \
+  X(aT, BMS, aT, uint16_t, int16_t, deci_kelvin_to_tenths,                     \
+    1, true, NUMBER, 5, 0)                                                     \
+  X(V, BMS, V, uint16_t, uint16_t, milli_to_tenths, 1, true, NUMBER, 1, 0)     \
+  X(I, BMS, I, int16_t, int16_t, milli_to_tenths, 1, true, NUMBER, 2, 50)      \
+  X(V1, BMS, V1, uint16_t, uint16_t, milli_to_hundredths,                      \
+    2, true, NUMBER, 2, 0)                                                     \
+  X(V2, BMS, V2, uint16_t, uint16_t, milli_to_hundredths,                      \
+    2, true, NUMBER, 2, 0)                                                     \
+  X(V3, BMS, V3, uint16_t, uint16_t, milli_to_hundredths,                      \
+    2, true, NUMBER, 2, 0)                                                     \
+  X(V4, BMS, V4, uint16_t, uint16_t, milli_to_hundredths,                      \
+    2, true, NUMBER, 2, 0)                                                     \
+  X(I1, BMS, I1, int16_t, int16_t, milli_to_hundredths,                        \
+    2, true, NUMBER, 5, 50)                                                    \
+  X(I2, BMS, I2, int16_t, int16_t, milli_to_hundredths,                        \
+    2, true, NUMBER, 5, 50)                                                    \
+  X(I3, BMS, I3, int16_t, int16_t, milli_to_hundredths,                        \
+    2, true, NUMBER, 5, 50)                                                    \
+  X(I4, BMS, I4, int16_t, int16_t, milli_to_hundredths,                        \
+    2, true, NUMBER, 5, 50)                                                    \
+  X(T1, BMS, T1, uint16_t, int16_t, deci_kelvin_to_hundredths,                 \
+    2, true, NUMBER, 50, 0)                                                    \
+  X(T2, BMS, T2, uint16_t, int16_t, deci_kelvin_to_hundredths,                 \
+    2, true, NUMBER, 50, 0)                                                    \
+  X(T3, BMS, T3, uint16_t, int16_t, deci_kelvin_to_hundredths,                 \
+    2, true, NUMBER, 50, 0)                                                    \
+  X(T4, BMS, T4, uint16_t, int16_t, deci_kelvin_to_hundredths,                 \
+    2, true, NUMBER, 50, 0)                                                    \
+  X(cT, BMS, cT, uint16_t, int16_t, deci_kelvin_to_tenths,                     \
+    1, true, NUMBER, 5, 0)                                                     \
+  X(OTC, BMS, OTC, int16_t, int16_t, as_is, 0, true, NUMBER, 1, 0)             \
+  X(CC, BMS, CC, uint16_t, uint16_t, as_is, 0, true, NUMBER, 1, 0)             \
+  X(wifi, WIFI, connected, bool, uint8_t, as_is, 0, true, BOOL, 1, 0)          \
+  X(t, GPS, time, float, uint32_t, to_hundredths,                              \
+    2, false, NUMBER, SCHEMA_NEVER, 0)                                         \
+  X(d, GPS, date, int, uint32_t, as_is, 0, false, NUMBER, SCHEMA_NEVER, 0)     \
+  X(lat, GPS, latitude, float, int32_t, to_millionths,                         \
+    6, false, NUMBER, 100, 0)                                                  \
+  X(lon, GPS, longitude, float, int32_t, to_millionths,                        \
+    6, false, NUMBER, 100, 0)                                                  \
+  X(P, INV, output_power, uint16_t, uint16_t, as_is, 0, true, NUMBER, 10, 50)  \
+  X(inv, INV, enabled, bool, uint8_t, as_is, 0, true, NUMBER, 1, 0)
+
+#define SCHEMA_NEVER INT32_MAX
+
+// members of the struct generated from the list, for fields from `source`
+#define SCHEMA_MEMBER_BMS(type, member) type member;
+#define SCHEMA_MEMBER_GPS(type, member)
+#define SCHEMA_MEMBER_INV(type, member)
+#define SCHEMA_MEMBER_WIFI(type, member)
+
+#endif // SCHEMA_H
@@ -0,0 +1,22 @@
+#ifndef SOAK_H
+#define SOAK_H
+
+#include "TASK.h"
+
+#include <stdint.h>
+
+typedef struct {
+  const char *name;
+  job_type_t type; // N_JOB_TYPES for work which doesn't run through the queue
+  uint32_t period_ms;
+  void (*run)();
+  int64_t next_due_ms;
+  uint64_t runs;
+  int64_t growth;     // net bytes left allocated by all runs after warm-up
+  int64_t worst_run;  // most bytes left allocated by a single run
+  int64_t total_time; // wall time spent in the job (us)
+} soak_job_t;
+
+void soak_run();
+
+#endif // SOAK_H
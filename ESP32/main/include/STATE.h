@@ -0,0 +1,40 @@
+#ifndef STATE_H
+#define STATE_H
+
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+
+// what this device is connected to, and as what
+#define STATE_ROOT (1 << 0)         // this device is the ROOT
+#define STATE_WIFI (1 << 1)         // connected to a router, with an address
+#define STATE_PARENT (1 << 2)       // connected, as a node, to a parent's AP
+#define STATE_LORA (1 << 3)         // the radio has been set up
+#define STATE_STA_LINK (1 << 4)     // the STA is associated with an AP
+#define STATE_UPLINK (1 << 5)       // connected to the web server
+#define STATE_AUTO_CONNECT (1 << 6) // reconnect to the router when it's lost
+
+// called with the watched bits which changed, from whichever task changed
+// them, so should only queue work and return
+typedef void (*state_watcher_t)(EventBits_t changed);
+
+void state_init();
+
+void state_start();
+
+EventBits_t state_get();
+
+bool state_is(EventBits_t bits);
+
+void state_set(EventBits_t bits);
+
+void state_clear(EventBits_t bits);
+
+void state_assign(EventBits_t bits, bool value);
+
+EventBits_t state_wait(EventBits_t bits, TickType_t timeout);
+
+bool state_watch(EventBits_t bits, state_watcher_t watcher);
+
+#endif // STATE_H
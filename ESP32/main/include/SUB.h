@@ -0,0 +1,33 @@
+#ifndef SUB_H
+#define SUB_H
+
+#include "CODEC.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cJSON.h"
+
+// what a browser can subscribe to
+typedef enum {
+  SUB_TELEMETRY, // this device's own data message
+  SUB_MESH,      // those of the devices relayed through it
+  SUB_ALARMS,    // alarm messages, as they are raised or cleared
+  SUB_JOBS,      // the job worker's statistics
+  N_SUB_TOPICS   // keep last
+} sub_topic_t;
+
+void sub_add_client(int fd);
+
+void sub_remove_client(int fd);
+
+int sub_update(int fd, const cJSON *content);
+
+void sub_note_report(const report_t *report);
+
+bool sub_publish(const report_t *own, bool changed);
+
+bool sub_publish_alarm(const char *message);
+
+#endif // SUB_H
@@ -5,15 +5,18 @@
 
 typedef enum {
   JOB_DNS_REQUEST,
-  JOB_UPDATE_DATA,
   JOB_WS_SEND,
   JOB_WS_RECEIVE,
   JOB_SLAVE_ESP32_TRANSMIT,
   JOB_MESH_CONNECT,
   JOB_MESH_WS_SEND,
-  JOB_MESH_MERGE,
+  JOB_MESH_ELECT,
   JOB_LORA_RECEIVE,
-  JOB_LORA_TRANSMIT
+  JOB_LORA_TRANSMIT,
+  JOB_ALARM_SEND,
+  JOB_CMD_STEP,
+  JOB_PARAM_SAVE,
+  N_JOB_TYPES // keep last
 } job_type_t;
 
 typedef struct {
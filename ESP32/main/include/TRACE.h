@@ -0,0 +1,26 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "utils.h"
+
+#include <stdbool.h>
+
+void trace_init();
+
+void trace_set_enabled(bool enabled);
+
+bool trace_enabled();
+
+// `name` is kept rather than copied, so must be a string literal or last as
+// long
+void trace_begin(const char *name);
+
+void trace_end(const char *name);
+
+void trace_instant(const char *name);
+
+void trace_isr(const char *name);
+
+bool trace_export(chunk_emit_t emit, void *ctx);
+
+#endif // TRACE_H
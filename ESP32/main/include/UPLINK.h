@@ -0,0 +1,19 @@
+#ifndef UPLINK_H
+#define UPLINK_H
+
+#include "CODEC.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+bool uplink_connected();
+
+bool uplink_send(const char *message);
+
+bool uplink_batch(const report_t *reports, size_t n_reports);
+
+void uplink_freertos_task(void *arg);
+
+void start_uplink_task();
+
+#endif // UPLINK_H
@@ -24,6 +24,20 @@
 #endif
 #define FLASK_IP CONFIG_FLASK_IP
 #define WS_DELAY CONFIG_WS_DELAY
+#ifdef CONFIG_SOAK_TEST
+#define SOAK_TEST true
+#define SOAK_DURATION CONFIG_SOAK_DURATION
+#define SOAK_TOLERANCE CONFIG_SOAK_TOLERANCE
+#else
+#define SOAK_TEST false
+#endif
+#ifdef CONFIG_BENCH_TEST
+#define BENCH_TEST true
+#define BENCH_ITERATIONS CONFIG_BENCH_ITERATIONS
+#define BENCH_TRACE_FILE "bench_trace.json"
+#else
+#define BENCH_TEST false
+#endif
 
 // components
 #ifdef CONFIG_JOBS_ENABLED
@@ -86,6 +100,12 @@
 #define MESH_ROOT_MERGE_ENABLED false
 #endif
 
+#ifdef CONFIG_MESH_BINARY_ENABLED
+#define MESH_BINARY_ENABLED true
+#else
+#define MESH_BINARY_ENABLED false
+#endif
+
 #ifdef CONFIG_LORA_RECEIVE_ENABLED
 #define LORA_RECEIVE_ENABLED true
 #else
@@ -104,7 +124,9 @@
 #else
 #define SCAN_I2C false
 #endif
-#define I2C_MASTER_TIMEOUT_MS 5000 // time delay to allow for BMS response
+#define I2C_MASTER_TIMEOUT_MS 5000 // time to wait for the BMS bus to be free
+#define I2C_TRANSFER_TIMEOUT_MS                                                \
+  CONFIG_I2C_TRANSFER_TIMEOUT // time delay to allow for BMS response
 #define I2C_SLAVE_TIMEOUT_MS                                                   \
   1000                           // time delay to allow for Ben's ESP32 response
 #define I2C_MASTER_NUM I2C_NUM_0 // I2C port number for master dev
@@ -115,6 +137,20 @@
   CONFIG_MASTER_SCL_PIN                   // GPIO number for I2C master clock
 #define I2C_MASTER_FREQ_HZ CONFIG_FREQ_HZ // I2C master clock frequency
 #define I2C_DELAY CONFIG_DELAY            // I2C read / write delay
+#ifdef CONFIG_I2C_ADAPTIVE_CLOCK
+#define I2C_ADAPTIVE_CLOCK true
+#else
+#define I2C_ADAPTIVE_CLOCK false
+#endif
+#define I2C_MIN_FREQ_HZ CONFIG_I2C_MIN_FREQ_HZ
+#define I2C_MAX_FREQ_HZ CONFIG_I2C_MAX_FREQ_HZ
+#define I2C_BACKOFF_MAX CONFIG_I2C_BACKOFF_MAX
+#define BMS_READ_PERIOD CONFIG_BMS_READ_PERIOD
+#define BMS_N_PACKS CONFIG_BMS_N_PACKS
+#define BMS_PRIMARY_PACK 0 // names the ESP32, and takes the commands
+#define BMS_MUX_ADDR CONFIG_BMS_MUX_ADDR // 0 if there's no multiplexer
+#define BMS_PACK_READ_PERIOD CONFIG_BMS_PACK_READ_PERIOD
+#define BMS_PACK_MAX_FAILURES CONFIG_BMS_PACK_MAX_FAILURES
 #define I2C_MANUFACTURER_ACCESS CONFIG_MANUFACTURER_ACCESS
 #define I2C_MANUFACTURER_BLOCK_ACCESS CONFIG_MANUFACTURER_BLOCK_ACCESS
 #define I2C_RELATIVE_STATE_OF_CHARGE_ADDR CONFIG_RELATIVE_STATE_OF_CHARGE_ADDR
@@ -147,11 +183,13 @@
 #define GPS_BUFF_SIZE (1024)
 #define GPS_RX_GPIO CONFIG_GPS_UART_RX_PIN
 #define GPS_TX_GPIO CONFIG_GPS_UART_TX_PIN
+#define GPS_READ_PERIOD CONFIG_GPS_READ_PERIOD
 #define INV_UART_NUM UART_NUM_2
 #define INV_BUFF_SIZE (256)
 #define INV_RX_GPIO CONFIG_INV_UART_RX_PIN
 #define INV_TX_GPIO CONFIG_INV_UART_TX_PIN
 #define INV_EN_GPIO CONFIG_INV_ENABLE_PIN
+#define INV_READ_PERIOD CONFIG_INV_READ_PERIOD
 
 // WiFi:
 #define DNS_PORT 53
@@ -170,10 +208,57 @@
 #define WS_USERNAME CONFIG_USERNAME
 #define WS_PASSWORD CONFIG_PASSWORD
 #define WS_MESSAGE_MAX_LEN 1024
+#define WS_DATA_MAX_LEN 512
 #define WS_QUEUE_SIZE 10
+#define UPLINK_QUEUE_LEN 8 // messages waiting for the web server
+#define UPLINK_CONNECT_TIMEOUT_MS 10000
+#define UPLINK_SEND_TIMEOUT_MS 5000
+#define UPLINK_BACKOFF_MIN_MS 1000
+#define UPLINK_BACKOFF_MAX_MS 60000
+#define UPLINK_PIECE_LEN 1024 // bytes of a batch sent at once
+// data messages in a batch
+#define UPLINK_BATCH_MAX_REPORTS                                               \
+  (UPLINK_BATCH_SAMPLES * (BMS_N_PACKS + MESH_SIZE))
 #define UTILS_AUTH_TOKEN_LENGTH CONFIG_AUTH_TOKEN_LENGTH
 #define MESH_SIZE 5
-#define MESH_MAX_HTTP_RECV_BUFFER 128
+#define MESH_MAX_HOPS 3             // from the ROOT to the furthest node
+#define MESH_MIN_RSSI -80           // dBm, weaker parents are a last resort
+#define MESH_ROUTE_TIMEOUT_MS 30000 // for a device relayed through a child
+#define ELECT_PRIORITY CONFIG_MESH_ROOT_PRIORITY
+#define ELECT_PERIOD_MS 5000 // between election rounds
+#define ELECT_MAX_HEARD 8    // neighbours remembered from scans
+#define CMD_MAX_PENDING 4 // commands waiting or in progress at once
+#define CMD_RETRY_MS 100  // before queueing a step again, if the queue is full
+#define SUB_MAX_PER_CLIENT 4 // subscriptions each browser can have
+#define SUB_MAX_VIEWS 8      // distinct messages written once per tick
+#define SUB_JOBS_MAX_LEN 2048
+#define STATE_MAX_WATCHERS 4 // callbacks told of connectivity changes
+#define PARAM_MAX_WATCHERS 4      // callbacks told of changed settings
+#define PARAM_MAX_PER_REQUEST 8   // settings in one set-params request
+#define PARAM_SAVE_DELAY_MS 10000 // from the last change to writing NVS
+#define SCHED_TICK_MS 50     // resolution of the recurring jobs
+#define SCHED_WHEEL_SLOTS 64 // ticks in one turn of the wheel
+#define SCHED_MAX_ENTRIES 8  // recurring jobs
+#define SCHED_JITTER_MS 250  // most a recurring job is moved either way
+#define PROF_MAX_TASKS 24        // tasks profiled, FreeRTOS's own included
+#define PROF_IDLE_MS 5000        // job worker's longest wait between check ins
+#define PROF_STALL_MS 10000      // how late a check in can be before a stall
+#define PROF_STACK_LOW 512       // bytes of stack spare before it's logged
+#define PROF_REPORT_MIN_MS 60000 // between task profiles to the web server
+#define PROF_MESSAGE_MAX_LEN WS_MESSAGE_MAX_LEN
+#define TRACE_RING_LEN 256   // events kept per core, a power of two
+#define TRACE_MAX_TASKS 16   // tasks told apart in a trace
+#define TRACE_CHUNK_LEN 1024 // bytes of an exported trace sent at once
+#define DLOG_RING_LEN 128     // deferred log lines kept, a power of two
+#define DLOG_MAX_ARGS 4       // arguments to a deferred log line
+#define DLOG_DRAIN_MS 200     // between printing deferred log lines
+#define DLOG_LINE_MAX_LEN 256 // characters of a deferred log line printed
+#define DLOG_CHUNK_LEN 1024   // bytes of an exported log sent at once
+#define SCAN_MAX_APS 8             // MESH APs remembered from scans
+#define SCAN_MAX_AGE_MS 15000      // how long a ROOT heard is relied upon
+#define SCAN_FULL_PERIOD_MS 300000 // longest between all-channel scans
+#define SCAN_ACTIVE_DWELL_MIN_MS 20
+#define SCAN_ACTIVE_DWELL_MAX_MS 60
 
 typedef struct {
   int descriptor;
@@ -181,8 +266,45 @@ typedef struct {
   bool is_browser_not_mesh;
   uint8_t esp_id; // just the number following "bms_", only relevent for mesh ws
                   // clients
+  bool binary;    // asked for data as binary frames, with "proto=bin"
 } client_socket;
 
+// Memory:
+#define MEM_JSON_ARENA_SIZE CONFIG_MEM_JSON_ARENA_SIZE
+#define MEM_BLOCK_COUNT CONFIG_MEM_BLOCK_COUNT
+#define MEM_BLOCK_SIZE WS_MESSAGE_MAX_LEN
+
+// Reporting:
+#ifdef CONFIG_REPORT_ON_CHANGE
+#define REPORT_ON_CHANGE true
+#define REPORT_HEARTBEAT_PERIOD CONFIG_REPORT_HEARTBEAT_PERIOD
+#else
+#define REPORT_ON_CHANGE false
+#define REPORT_HEARTBEAT_PERIOD 0
+#endif
+#define UPLINK_BATCH_SAMPLES CONFIG_UPLINK_BATCH_SAMPLES
+#define UPLINK_BATCH_MAX_DELAY CONFIG_UPLINK_BATCH_MAX_DELAY
+#ifdef CONFIG_UPLINK_BATCH_COLUMNAR
+#define UPLINK_BATCH_COLUMNAR true
+#else
+#define UPLINK_BATCH_COLUMNAR false
+#endif
+
+// Alarms:
+#ifdef CONFIG_ALARMS_ENABLED
+#define ALARMS_ENABLED true
+#define ALARM_IMBALANCE CONFIG_ALARM_IMBALANCE
+#define ALARM_TEMPERATURE_RATE CONFIG_ALARM_TEMPERATURE_RATE
+#define ALARM_TEMPERATURE_HORIZON CONFIG_ALARM_TEMPERATURE_HORIZON
+#define ALARM_CURRENT_LIMIT CONFIG_ALARM_CURRENT_LIMIT
+#else
+#define ALARMS_ENABLED false
+#define ALARM_IMBALANCE 0
+#define ALARM_TEMPERATURE_RATE 0
+#define ALARM_TEMPERATURE_HORIZON 0
+#define ALARM_CURRENT_LIMIT 0
+#endif
+
 // LoRa:
 #ifdef CONFIG_IS_RECEIVER
 #define LORA_IS_RECEIVER true
@@ -250,11 +372,6 @@ typedef struct {
 #define MODE_STDBY 0b00000001
 #define MODE_LORA 0b10000000
 
-typedef struct {
-  uint8_t esp_id;
-  char message[WS_MESSAGE_MAX_LEN];
-} LoRa_message;
-
 typedef struct {
   int stack_size;
   const char *task_name;
@@ -2,6 +2,7 @@
 #define GLOBAL_H
 
 #include "BMS.h"
+#include "CODEC.h"
 #include "GPS.h"
 #include "INV.h"
 #include "config.h"
@@ -13,19 +14,20 @@
 #include "esp_netif_types.h"
 #include "freertos/FreeRTOS.h"
 
+// the latest data from a device relayed through this one, until it is passed
+// on. an `esp_id` of 0 marks an empty slot
+typedef struct {
+  uint8_t esp_id;
+  report_t report;
+} LoRa_message;
+
 extern esp_netif_t *ap_netif;
-extern bool is_root;
 extern int num_connected_clients;
 extern uint8_t ESP_ID;
-extern telemetry_data_t telemetry_data;
-extern inverter_data_t inverter_data;
-extern GPRMC_t gps_data;
 extern httpd_handle_t server;
-extern bool connected_to_WiFi;
-extern bool connected_to_root;
 extern client_socket client_sockets[WS_CONFIG_MAX_CLIENTS];
 extern char current_auth_token[UTILS_AUTH_TOKEN_LENGTH];
-extern bool LoRa_configured;
+// only touched through `mesh_keep_report` and the others in MESH.h
 extern LoRa_message all_messages[MESH_SIZE];
 extern char forwarded_message[LORA_MAX_PACKET_LEN - 2];
 
@@ -11,6 +11,8 @@
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
+int parse_esp_id(char *name);
+
 void change_esp_id(char *name);
 
 void initialise_nvs();
@@ -19,7 +21,8 @@ void initialise_spiffs();
 
 void send_fake_request();
 
-char *send_fake_login_post_request();
+bool send_fake_login_post_request(const char *host, char *auth_token,
+                                  size_t auth_token_size);
 
 esp_err_t get_POST_data(httpd_req_t *req, char *content, size_t content_size);
 
@@ -32,7 +35,37 @@ void url_encode(char *dest, const char *src, size_t dest_size);
 
 void random_token(char *key);
 
-int round_to_dp(float var, int ndp);
+int32_t divide_and_round(int32_t numerator, int32_t denominator);
+
+// writes `value` * 10^-`ndp` to `out` as the shortest decimal, without going
+// through floating point. this is how %g prints it for magnitudes of 10^-4 and
+// above. `out` must have room for 13 characters and `ndp` must be less than 10
+size_t format_fixed(char *out, int32_t value, uint8_t ndp);
+
+// given each piece of a long response in turn, false to stop early
+typedef bool (*chunk_emit_t)(const char *chunk, size_t length, void *ctx);
+
+// collects what is written into chunks of up to `size` before emitting them,
+// so that a response needn't be held whole. once emitting fails, or a piece
+// doesn't fit in a chunk, the rest is dropped
+typedef struct {
+  char *chunk;
+  size_t size;
+  size_t length;
+  chunk_emit_t emit;
+  void *ctx;
+  bool ok;
+} chunk_writer_t;
+
+bool chunk_begin(chunk_writer_t *writer, size_t size, chunk_emit_t emit,
+                 void *ctx);
+
+void chunk_printf(chunk_writer_t *writer, const char *format, ...);
+
+// `str` quoted and escaped, as a JSON string
+void chunk_put_string(chunk_writer_t *writer, const char *str);
+
+bool chunk_end(chunk_writer_t *writer);
 
 char *read_file(const char *path);
 
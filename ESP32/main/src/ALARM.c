@@ -0,0 +1,450 @@
+#include "ALARM.h"
+
+#include "CODEC.h"
+#include "DATA.h"
+#include "LoRa.h"
+#include "MESH.h"
+#include "STATE.h"
+#include "SUB.h"
+#include "TASK.h"
+#include "UPLINK.h"
+#include "config.h"
+#include "global.h"
+#include "utils.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+static const char *TAG = "ALARM";
+
+// the heating rate is taken across up to a minute of readings, since the
+// temperatures are only read to 0.1 K
+#define RATE_SAMPLES 12
+#define RATE_SAMPLE_SPACING 5000000 // us
+#define RATE_MIN_SPAN 30000000      // us
+
+typedef struct {
+  int64_t time;
+  int16_t temperature;
+} temperature_sample_t;
+
+// only touched by the BMS task
+static temperature_sample_t history[RATE_SAMPLES];
+static uint8_t history_length = 0;
+static uint8_t history_newest = 0;
+
+// this device's alarm state, and which destinations haven't been told about
+// its latest change yet. the job worker sends it, and on the ROOT passes on
+// those forwarded by mesh nodes
+static alarm_report_t own = {0};
+static uint8_t own_unsent = 0; // one bit per destination_t
+static int64_t own_changed_at = 0;
+static alarm_report_t forwarded[MESH_SIZE];
+static bool forwarded_unsent[MESH_SIZE] = {false};
+static portMUX_TYPE alarm_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// time from the reading which changed the alarm state to the message leaving
+// by each route, most recently
+static int64_t latency[N_DESTINATIONS] = {[0 ... N_DESTINATIONS - 1] = -1};
+
+static const char *alarm_names[N_ALARMS] = {
+    [ALARM_CELL_IMBALANCE] = "cell imbalance",
+    [ALARM_OVER_TEMPERATURE] = "over-temperature",
+    [ALARM_OVER_CURRENT] = "over-current",
+};
+
+static const char *destination_names[N_DESTINATIONS] = {
+    [DESTINATION_BROWSER] = "browsers",
+    [DESTINATION_SERVER] = "web server",
+    [DESTINATION_MESH] = "mesh ROOT",
+    [DESTINATION_RADIO] = "radio",
+};
+
+static int16_t deci_kelvin_to_tenths(uint16_t deci_kelvin) {
+  return divide_and_round(deci_kelvin * 10 - 27315, 10);
+}
+
+static int16_t heating_rate(int64_t now, int16_t temperature) {
+  // keep a reading every few seconds...
+  if (history_length == 0 ||
+      now - history[history_newest].time >= RATE_SAMPLE_SPACING) {
+    if (history_length > 0)
+      history_newest = (history_newest + 1) % RATE_SAMPLES;
+    history[history_newest] = (temperature_sample_t){now, temperature};
+    if (history_length < RATE_SAMPLES)
+      history_length++;
+  }
+
+  // ...and compare against the oldest of them
+  const temperature_sample_t *oldest =
+      &history[(history_newest + RATE_SAMPLES - history_length + 1) %
+               RATE_SAMPLES];
+  int64_t span = now - oldest->time;
+  if (span < RATE_MIN_SPAN)
+    return 0;
+
+  return (temperature - oldest->temperature) * 60000000LL / span;
+}
+
+static bool over_limit(bool active, int32_t value, int32_t raise_at,
+                       int32_t clear_below) {
+  // each alarm is raised at its limit but only cleared a little under it, so
+  // that a reading sitting on the limit doesn't flap
+  return value >= raise_at || (active && value >= clear_below);
+}
+
+static uint8_t evaluate(const telemetry_data_t *telemetry, int64_t time,
+                        uint8_t active, alarm_report_t *report) {
+  uint16_t cells[] = {telemetry->V1, telemetry->V2, telemetry->V3,
+                      telemetry->V4};
+  uint16_t highest = 0;
+  uint16_t lowest = UINT16_MAX;
+  for (int i = 0; i < sizeof(cells) / sizeof(cells[0]); i++) {
+    if (cells[i] == 0)
+      continue; // not fitted
+    highest = MAX(highest, cells[i]);
+    lowest = MIN(lowest, cells[i]);
+  }
+  report->spread = highest > lowest ? highest - lowest : 0;
+
+  uint16_t hottest = MAX(MAX(telemetry->T1, telemetry->T2),
+                         MAX(telemetry->T3, telemetry->T4));
+  report->temperature = deci_kelvin_to_tenths(hottest);
+  report->rate = heating_rate(time, report->temperature);
+  report->current = divide_and_round(telemetry->I, 100);
+
+  uint8_t now_active = 0;
+
+  if (over_limit(active & (1 << ALARM_CELL_IMBALANCE), report->spread,
+                 ALARM_IMBALANCE, ALARM_IMBALANCE - ALARM_IMBALANCE / 10))
+    now_active |= 1 << ALARM_CELL_IMBALANCE;
+
+  // where the hottest cell will be at the end of the warning time, if it
+  // carries on heating up at the same rate
+  int32_t projected = report->temperature;
+  if (report->rate >= ALARM_TEMPERATURE_RATE)
+    projected += (int32_t)report->rate * ALARM_TEMPERATURE_HORIZON / 60;
+  if (telemetry->OTC > 0 &&
+      over_limit(active & (1 << ALARM_OVER_TEMPERATURE), projected,
+                 telemetry->OTC, telemetry->OTC - 20))
+    now_active |= 1 << ALARM_OVER_TEMPERATURE;
+
+  if (over_limit(active & (1 << ALARM_OVER_CURRENT), abs(telemetry->I),
+                 ALARM_CURRENT_LIMIT,
+                 ALARM_CURRENT_LIMIT - ALARM_CURRENT_LIMIT / 10))
+    now_active |= 1 << ALARM_OVER_CURRENT;
+
+  return now_active;
+}
+
+static void queue_send() {
+  // ahead of everything else waiting for the job worker
+  job_t job = {.type = JOB_ALARM_SEND};
+  if (xQueueSendToFront(job_queue, &job, 0) != pdPASS)
+    ESP_LOGW(TAG, "Queue full, alarm will be sent after the next reading");
+}
+
+void alarm_check() {
+  if (!ALARMS_ENABLED)
+    return;
+
+  data_snapshot_t snapshot;
+  data_read_snapshot(&snapshot);
+
+  alarm_report_t report = {.esp_id = ESP_ID};
+  uint8_t active =
+      evaluate(&snapshot.telemetry, snapshot.timestamp, own.active, &report);
+
+  taskENTER_CRITICAL(&alarm_lock);
+  uint8_t previous = own.active;
+  bool changed = active != previous;
+  if (changed) {
+    report.active = active;
+    report.raised = active & ~previous;
+    own = report;
+    own_unsent = (1 << N_DESTINATIONS) - 1;
+    own_changed_at = snapshot.timestamp;
+  }
+  // the radio is handled by `transmit`
+  bool unsent = own_unsent & ~(1 << DESTINATION_RADIO);
+  taskEXIT_CRITICAL(&alarm_lock);
+
+  if (changed) {
+    for (int i = 0; i < N_ALARMS; i++) {
+      if (report.raised & (1 << i))
+        ESP_LOGW(TAG, "%s alarm raised", alarm_names[i]);
+      else if (previous & ~active & (1 << i))
+        ESP_LOGI(TAG, "%s alarm cleared", alarm_names[i]);
+    }
+  }
+
+  if (unsent)
+    queue_send();
+}
+
+static bool alarm_from_json(const cJSON *message, alarm_report_t *report) {
+  cJSON *esp_id = cJSON_GetObjectItem(message, "esp_id");
+  cJSON *content = cJSON_GetObjectItem(message, "content");
+  if (!cJSON_IsNumber(esp_id) || !content) {
+    ESP_LOGE(TAG, "Badly formed alarm message");
+    return false;
+  }
+
+  cJSON *item;
+  report->esp_id = esp_id->valueint;
+  item = cJSON_GetObjectItem(content, "active");
+  report->active = cJSON_IsNumber(item) ? item->valueint : 0;
+  item = cJSON_GetObjectItem(content, "raised");
+  report->raised = cJSON_IsNumber(item) ? item->valueint : 0;
+  item = cJSON_GetObjectItem(content, "dV");
+  report->spread = cJSON_IsNumber(item) ? item->valueint : 0;
+  item = cJSON_GetObjectItem(content, "dTdt");
+  report->rate = cJSON_IsNumber(item) ? item->valueint : 0;
+  item = cJSON_GetObjectItem(content, "T");
+  report->temperature = cJSON_IsNumber(item) ? item->valueint : 0;
+  item = cJSON_GetObjectItem(content, "I");
+  report->current = cJSON_IsNumber(item) ? item->valueint : 0;
+
+  return true;
+}
+
+void alarm_forward(const cJSON *message) {
+  // an alarm message from a mesh node, for the ROOT to pass on
+  alarm_report_t report;
+  if (!alarm_from_json(message, &report))
+    return;
+
+  bool stored = false;
+  taskENTER_CRITICAL(&alarm_lock);
+  for (int i = 0; i < MESH_SIZE && !stored; i++) {
+    if (forwarded_unsent[i] && forwarded[i].esp_id == report.esp_id) {
+      // keep any alarm raised since the last one was passed on
+      report.raised |= forwarded[i].raised & report.active;
+      forwarded[i] = report;
+      stored = true;
+    }
+  }
+  for (int i = 0; i < MESH_SIZE && !stored; i++) {
+    if (!forwarded_unsent[i]) {
+      forwarded[i] = report;
+      forwarded_unsent[i] = true;
+      stored = true;
+    }
+  }
+  taskEXIT_CRITICAL(&alarm_lock);
+
+  if (!stored) {
+    ESP_LOGE(TAG, "No space to forward alarm from bms_%u", report.esp_id);
+    return;
+  }
+
+  queue_send();
+}
+
+static void note_sent(destination_t destination, int64_t changed_at) {
+  latency[destination] = esp_timer_get_time() - changed_at;
+  ESP_LOGI(TAG, "Alarm message sent to %s %" PRId64 " ms after the reading",
+           destination_names[destination], latency[destination] / 1000);
+}
+
+void alarm_send() {
+  // only ever called from the job worker, so this can be reused
+  // the brackets, each alarm and the commas between them
+  static char server_message[1 + (MESH_SIZE + 1) * ALARM_MESSAGE_MAX_LEN +
+                             MESH_SIZE + 1 + 1];
+
+  taskENTER_CRITICAL(&alarm_lock);
+  alarm_report_t report = own;
+  uint8_t unsent = own_unsent;
+  int64_t changed_at = own_changed_at;
+  taskEXIT_CRITICAL(&alarm_lock);
+
+  char message[ALARM_MESSAGE_MAX_LEN];
+  size_t length = alarm_write_json(&report, message, sizeof(message));
+  uint8_t done = 0;
+
+  if (unsent & (1 << DESTINATION_BROWSER)) {
+    if (length > 0 && sub_publish_alarm(message))
+      note_sent(DESTINATION_BROWSER, changed_at);
+    done |= 1 << DESTINATION_BROWSER; // otherwise there's nobody to tell
+  }
+
+  if (unsent & (1 << DESTINATION_MESH)) {
+    if (length > 0 && !state_is(STATE_ROOT) && send_mesh_message(message))
+      note_sent(DESTINATION_MESH, changed_at);
+    done |= 1 << DESTINATION_MESH;
+  }
+
+  if (state_is(STATE_WIFI)) {
+    // own alarm and any forwarded ones together, as the web server expects
+    char *cursor = server_message;
+    const char *end = server_message + sizeof(server_message);
+    *cursor++ = '[';
+    if (unsent & (1 << DESTINATION_SERVER) && length > 0) {
+      memcpy(cursor, message, length);
+      cursor += length;
+    }
+    bool included[MESH_SIZE] = {false};
+    taskENTER_CRITICAL(&alarm_lock);
+    for (int i = 0; i < MESH_SIZE; i++) {
+      if (!forwarded_unsent[i])
+        continue;
+      // the comma only goes in once there's an alarm to follow it
+      bool comma = cursor > server_message + 1;
+      size_t written = alarm_write_json(&forwarded[i], cursor + comma,
+                                        end - cursor - comma - 1);
+      if (written == 0)
+        continue;
+      if (comma)
+        *cursor = ',';
+      cursor += comma + written;
+      included[i] = true;
+    }
+    taskEXIT_CRITICAL(&alarm_lock);
+    *cursor++ = ']';
+    *cursor = '\0';
+
+    // left pending if the connection is down, and retried after the next
+    // reading
+    if (cursor - server_message > 2 && uplink_send(server_message)) {
+      if (unsent & (1 << DESTINATION_SERVER))
+        note_sent(DESTINATION_SERVER, changed_at);
+      done |= 1 << DESTINATION_SERVER;
+      taskENTER_CRITICAL(&alarm_lock);
+      for (int i = 0; i < MESH_SIZE; i++)
+        forwarded_unsent[i] &= !included[i];
+      taskEXIT_CRITICAL(&alarm_lock);
+    }
+    // nothing goes by radio while there's Wi-Fi
+    done |= 1 << DESTINATION_RADIO;
+  } else {
+    done |= 1 << DESTINATION_SERVER;
+    if (state_is(STATE_ROOT | STATE_LORA)) {
+      // `transmit` sends pending alarms before anything else
+      job_t job = {.type = JOB_LORA_TRANSMIT};
+      if (alarm_radio_pending() &&
+          xQueueSendToFront(job_queue, &job, 0) != pdPASS)
+        ESP_LOGW(TAG, "Queue full, alarm will go with the next transmission");
+    } else {
+      done |= 1 << DESTINATION_RADIO;
+    }
+  }
+
+  taskENTER_CRITICAL(&alarm_lock);
+  if (own_changed_at == changed_at)
+    own_unsent &= ~done;
+  taskEXIT_CRITICAL(&alarm_lock);
+}
+
+bool alarm_radio_pending() {
+  taskENTER_CRITICAL(&alarm_lock);
+  bool pending = own_unsent & (1 << DESTINATION_RADIO);
+  for (int i = 0; i < MESH_SIZE; i++)
+    pending |= forwarded_unsent[i];
+  taskEXIT_CRITICAL(&alarm_lock);
+
+  return pending;
+}
+
+static size_t alarm_pack(const alarm_report_t *report, uint8_t *packet) {
+#define PUT(member, value)                                                     \
+  CODEC_PUT_MEMBER(packet, radio_alarm_packet, member, value)
+  PUT(type, ALARM);
+  PUT(esp_id, report->esp_id);
+  PUT(active, report->active);
+  PUT(raised, report->raised);
+  PUT(spread, report->spread);
+  PUT(rate, report->rate);
+  PUT(temperature, report->temperature);
+  PUT(current, report->current);
+#undef PUT
+
+  return sizeof(radio_alarm_packet);
+}
+
+size_t alarm_pack_pending(uint8_t *binary_message) {
+  // every pending alarm in one radio message, laid out as `json_to_binary`
+  // does
+  uint8_t n_alarms = 0;
+  size_t packet_start = 1; // after first byte n_alarms
+  int64_t changed_at = 0;
+
+  taskENTER_CRITICAL(&alarm_lock);
+  if (own_unsent & (1 << DESTINATION_RADIO)) {
+    packet_start += alarm_pack(&own, &binary_message[packet_start]);
+    n_alarms++;
+    own_unsent &= ~(1 << DESTINATION_RADIO);
+    changed_at = own_changed_at;
+  }
+  for (int i = 0; i < MESH_SIZE; i++) {
+    if (forwarded_unsent[i]) {
+      packet_start += alarm_pack(&forwarded[i], &binary_message[packet_start]);
+      n_alarms++;
+      forwarded_unsent[i] = false;
+    }
+  }
+  taskEXIT_CRITICAL(&alarm_lock);
+
+  if (n_alarms == 0)
+    return 0;
+
+  if (changed_at != 0)
+    note_sent(DESTINATION_RADIO, changed_at);
+
+  binary_message[0] = n_alarms;
+  return packet_start;
+}
+
+size_t alarm_write_json(const alarm_report_t *report, char *out, size_t size) {
+  int length =
+      snprintf(out, size,
+               "{\"esp_id\":%u,\"type\":\"alarm\",\"content\":{\"esp_id\":%u,"
+               "\"active\":%u,\"raised\":%u,\"dV\":%u,\"dTdt\":%d,\"T\":%d,"
+               "\"I\":%d}}",
+               report->esp_id, report->esp_id, report->active, report->raised,
+               report->spread, report->rate, report->temperature,
+               report->current);
+  if (length < 0 || length >= size) {
+    if (size > 0)
+      out[0] = '\0';
+    return 0;
+  }
+
+  return length;
+}
+
+void alarm_add_to_json(const alarm_report_t *report, cJSON *content) {
+  cJSON_AddNumberToObject(content, "esp_id", report->esp_id);
+  cJSON_AddNumberToObject(content, "active", report->active);
+  cJSON_AddNumberToObject(content, "raised", report->raised);
+  cJSON_AddNumberToObject(content, "dV", report->spread);
+  cJSON_AddNumberToObject(content, "dTdt", report->rate);
+  cJSON_AddNumberToObject(content, "T", report->temperature);
+  cJSON_AddNumberToObject(content, "I", report->current);
+}
+
+size_t alarm_unpack(const uint8_t *packet, alarm_report_t *report) {
+#define GET(member) CODEC_GET_MEMBER(packet, radio_alarm_packet, member)
+  *report = (alarm_report_t){
+      .esp_id = GET(esp_id),
+      .active = GET(active),
+      .raised = GET(raised),
+      .spread = GET(spread),
+      .rate = GET(rate),
+      .temperature = GET(temperature),
+      .current = GET(current),
+  };
+#undef GET
+
+  return sizeof(radio_alarm_packet);
+}
+
+int64_t alarm_latency(destination_t destination) {
+  return latency[destination];
+}
@@ -1,6 +1,12 @@
 #include "AP.h"
 
+#include "DLOG.h"
 #include "I2C.h"
+#include "MEM.h"
+#include "PROF.h"
+#include "SCAN.h"
+#include "STATE.h"
+#include "TRACE.h"
 #include "WS.h"
 #include "config.h"
 #include "global.h"
@@ -25,40 +31,6 @@ static const char *TAG = "AP";
 static struct rendered_page rendered_html_pages[WS_MAX_N_HTML_PAGES];
 static uint8_t n_rendered_html_pages = 0;
 
-wifi_ap_record_t *wifi_scan(void) {
-  // configure Wi-Fi scan settings
-  wifi_scan_config_t scan_config = {
-      .ssid = NULL,  // all SSIDs
-      .bssid = NULL, // all BSSIDs
-      .channel = 0,  // all channels
-      .show_hidden = false,
-      .scan_type = WIFI_SCAN_TYPE_PASSIVE,
-  };
-
-  ESP_ERROR_CHECK(esp_wifi_scan_start(&scan_config, true)); // blocking scan
-
-  // get the number of APs found
-  uint16_t ap_num = 0;
-  ESP_ERROR_CHECK(esp_wifi_scan_get_ap_num(&ap_num));
-
-  // allocate memory for AP info and retrieve the list
-  wifi_ap_record_t *ap_info = malloc(sizeof(wifi_ap_record_t) * ap_num);
-  if (ap_info == NULL) {
-    ESP_LOGE(TAG, "Failed to allocate memory for AP list");
-    return false;
-  }
-  ESP_ERROR_CHECK(esp_wifi_scan_get_ap_records(&ap_num, ap_info));
-
-  for (int i = 0; i < ap_num; i++) {
-    if (strncmp((const char *)ap_info[i].ssid, "ROOT ", 5) == 0)
-      return &ap_info[i];
-  }
-
-  free(ap_info);
-
-  return NULL;
-}
-
 void ap_n_clients_handler(void *arg, esp_event_base_t event_base,
                           int32_t event_id, void *event_data) {
   if (event_base == WIFI_EVENT) {
@@ -91,33 +63,7 @@ void ap_n_clients_handler(void *arg, esp_event_base_t event_base,
   }
 }
 
-void wifi_init(void) {
-  // initialize the Wi-Fi stack
-  ESP_ERROR_CHECK(esp_netif_init());
-  ESP_ERROR_CHECK(esp_event_loop_create_default());
-
-  esp_netif_create_default_wifi_sta();
-
-  wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-  ESP_ERROR_CHECK(esp_wifi_init(&cfg));
-
-  // use only STA at first to scan for APs
-  ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-  ESP_ERROR_CHECK(esp_wifi_start());
-  vTaskDelay(pdMS_TO_TICKS(100));
-
-  // scan for other WiFi APs
-  wifi_ap_record_t *AP_exists = wifi_scan();
-
-  // stop WiFi before changing mode
-  ESP_ERROR_CHECK(esp_wifi_stop());
-
-  // create the AP network interface
-  ap_netif = esp_netif_create_default_wifi_ap();
-
-  // set Wi-Fi mode to both AP and STA
-  ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_APSTA));
-
+esp_err_t ap_configure(bool root) {
   // configure the Access Point
   wifi_config_t wifi_ap_config = {
       .ap = {.channel = 1,
@@ -132,10 +78,10 @@ void wifi_init(void) {
     snprintf(buffer, sizeof(buffer), "LoRa RECEIVER");
   } else {
     uint8_t data_SBS[2] = {0};
-    read_SBS_data(I2C_RELATIVE_STATE_OF_CHARGE_ADDR, data_SBS,
+    read_SBS_data(BMS_PRIMARY_PACK, I2C_RELATIVE_STATE_OF_CHARGE_ADDR, data_SBS,
                   sizeof(data_SBS));
-    snprintf(buffer, sizeof(buffer), "%sbms_%02u: %d%%",
-             !AP_exists ? "ROOT " : "", ESP_ID, data_SBS[1] << 8 | data_SBS[0]);
+    snprintf(buffer, sizeof(buffer), "%sbms_%02u: %d%%", root ? "ROOT " : "",
+             ESP_ID, data_SBS[1] << 8 | data_SBS[0]);
   }
 
   strncpy((char *)wifi_ap_config.ap.ssid, buffer,
@@ -145,28 +91,67 @@ void wifi_init(void) {
   wifi_ap_config.ap.ssid_len =
       strlen((char *)wifi_ap_config.ap.ssid); // set SSID length
 
-  // specific configurations or ROOT or non-ROOT APs
-  if (!AP_exists) {
-    // keep count of number of connected clients
-    ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
-                                               &ap_n_clients_handler, NULL));
-    is_root = true;
+  // the ROOT is at the default 192.168.4.1, and each node has a subnet of its
+  // own, so that a child of it can send messages to it (at its STA's
+  // gateway) whichever subnet the node itself is in
+  esp_netif_ip_info_t ip_info = {0};
+  if (root) {
+    IP4_ADDR(&ip_info.ip, 192, 168, 4, 1);
+    IP4_ADDR(&ip_info.gw, 192, 168, 4, 1);
   } else {
-    // must change IP address from default so
-    // can send messages to ROOT at 192.168.4.1
-    esp_netif_ip_info_t ip_info = {0};
-    IP4_ADDR(&ip_info.ip, 192, 168, 5, 1);
-    IP4_ADDR(&ip_info.gw, 192, 168, 5, 1);
-    IP4_ADDR(&ip_info.netmask, 255, 255, 255, 0);
-    esp_netif_dhcps_stop(ap_netif);
-    esp_netif_set_ip_info(ap_netif, &ip_info);
-    esp_netif_dhcps_start(ap_netif);
+    IP4_ADDR(&ip_info.ip, 10, 0, ESP_ID, 1);
+    IP4_ADDR(&ip_info.gw, 10, 0, ESP_ID, 1);
   }
+  IP4_ADDR(&ip_info.netmask, 255, 255, 255, 0);
+  esp_netif_dhcps_stop(ap_netif);
+  esp_netif_set_ip_info(ap_netif, &ip_info);
+  esp_netif_dhcps_start(ap_netif);
+
+  ESP_LOGI(TAG, "AP SSID: %s", wifi_ap_config.ap.ssid);
+  return esp_wifi_set_config(WIFI_IF_AP, &wifi_ap_config);
+}
+
+void wifi_init(void) {
+  // initialize the Wi-Fi stack
+  ESP_ERROR_CHECK(esp_netif_init());
+  ESP_ERROR_CHECK(esp_event_loop_create_default());
+  state_start();
+
+  esp_netif_create_default_wifi_sta();
+
+  wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+  ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+
+  // use only STA at first to scan for APs
+  ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+  ESP_ERROR_CHECK(esp_wifi_start());
+  vTaskDelay(pdMS_TO_TICKS(100));
+
+  // scan all channels for another ROOT AP
+  wifi_ap_record_t root;
+  esp_err_t err = scan_find_root(0, true, &root);
+  if (err != ESP_ERR_NOT_FOUND)
+    ESP_ERROR_CHECK(err);
+  bool AP_exists = err == ESP_OK;
+
+  // stop WiFi before changing mode
+  ESP_ERROR_CHECK(esp_wifi_stop());
 
-  ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_AP, &wifi_ap_config));
+  // create the AP network interface
+  ap_netif = esp_netif_create_default_wifi_ap();
+
+  // set Wi-Fi mode to both AP and STA
+  ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_APSTA));
+
+  // keep count of number of connected clients, which is advertised for the
+  // ROOT election
+  ESP_ERROR_CHECK(esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
+                                             &ap_n_clients_handler, NULL));
+  state_assign(STATE_ROOT, !AP_exists);
+  ESP_ERROR_CHECK(ap_configure(!AP_exists));
 
   // restart WiFi
-  ESP_LOGI(TAG, "Starting WiFi AP... SSID: %s", wifi_ap_config.ap.ssid);
+  ESP_LOGI(TAG, "Starting WiFi AP...");
   ESP_ERROR_CHECK(esp_wifi_start());
   vTaskDelay(pdMS_TO_TICKS(100));
 }
@@ -359,25 +344,69 @@ esp_err_t login_handler(httpd_req_t *req) {
   return ESP_OK;
 }
 
-esp_err_t num_clients_handler(httpd_req_t *req) {
-  char response[64];
-  snprintf(response, sizeof(response), "{\"num_connected_clients\": %d}",
-           num_connected_clients);
+static bool authorise(httpd_req_t *req) {
+  // by the "auth_token" of a browser which is logged in, responding if not
+  char query[16 + UTILS_AUTH_TOKEN_LENGTH];
+  char auth_token[UTILS_AUTH_TOKEN_LENGTH] = {0};
+  bool authorised = false;
+  if (httpd_req_get_url_query_str(req, query, sizeof(query)) == ESP_OK &&
+      httpd_query_key_value(query, "auth_token", auth_token,
+                            sizeof(auth_token)) == ESP_OK)
+    for (int i = 0; i < WS_CONFIG_MAX_CLIENTS && !authorised; i++)
+      authorised = auth_token[0] != '\0' &&
+                   strcmp(client_sockets[i].auth_token, auth_token) == 0;
 
   httpd_resp_set_type(req, "application/json");
-  httpd_resp_send(req, response, HTTPD_RESP_USE_STRLEN);
+  if (!authorised) {
+    httpd_resp_set_status(req, "401 Unauthorized");
+    httpd_resp_send(req, "{\"success\": false}", HTTPD_RESP_USE_STRLEN);
+  }
+  return authorised;
+}
 
-  // big delay before resuming to give
-  // other AP time to receive message
-  vTaskDelay(pdMS_TO_TICKS(10000));
+esp_err_t prof_handler(httpd_req_t *req) {
+  // the task profile (see `PROF.c`), for a browser which is logged in
+  if (!authorise(req))
+    return ESP_OK;
 
+  char *profile = mem_block_alloc(PROF_MESSAGE_MAX_LEN);
+  size_t length =
+      profile != NULL ? prof_write_json(profile, PROF_MESSAGE_MAX_LEN) : 0;
+  if (length > 0)
+    httpd_resp_send(req, profile, length);
+  else
+    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR,
+                        "Failed to write task profile");
+  if (profile != NULL)
+    mem_block_free(profile);
   return ESP_OK;
 }
 
-esp_err_t restart_handler(httpd_req_t *req) {
-  ESP_LOGI(TAG, "I am being told to restart");
-  esp_restart();
+static bool send_chunk(const char *chunk, size_t length, void *ctx) {
+  return httpd_resp_send_chunk((httpd_req_t *)ctx, chunk, length) == ESP_OK;
+}
+
+esp_err_t trace_handler(httpd_req_t *req) {
+  // the timeline (see `TRACE.c`) as a file to open in Perfetto, for a browser
+  // which is logged in
+  if (!authorise(req))
+    return ESP_OK;
+
+  httpd_resp_set_hdr(req, "Content-Disposition",
+                     "attachment; filename=\"trace.json\"");
+  if (trace_export(send_chunk, req))
+    httpd_resp_send_chunk(req, NULL, 0);
+  return ESP_OK;
+}
+
+esp_err_t log_handler(httpd_req_t *req) {
+  // the deferred log lines (see `DLOG.c`), undecoded, for a browser which is
+  // logged in
+  if (!authorise(req))
+    return ESP_OK;
 
+  if (dlog_export(send_chunk, req))
+    httpd_resp_send_chunk(req, NULL, 0);
   return ESP_OK;
 }
 
@@ -388,6 +417,7 @@ httpd_handle_t start_webserver(void) {
     client_sockets[i].auth_token[0] = '\0';
     client_sockets[i].is_browser_not_mesh = true;
     client_sockets[i].esp_id = 0;
+    client_sockets[i].binary = false;
   }
 
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
@@ -440,6 +470,24 @@ httpd_handle_t start_webserver(void) {
                                .user_ctx = NULL};
     httpd_register_uri_handler(server, &refresh_uri);
 
+    httpd_uri_t prof_uri = {.uri = "/api/prof",
+                            .method = HTTP_GET,
+                            .handler = prof_handler,
+                            .user_ctx = NULL};
+    httpd_register_uri_handler(server, &prof_uri);
+
+    httpd_uri_t trace_uri = {.uri = "/api/trace",
+                             .method = HTTP_GET,
+                             .handler = trace_handler,
+                             .user_ctx = NULL};
+    httpd_register_uri_handler(server, &trace_uri);
+
+    httpd_uri_t log_uri = {.uri = "/api/log",
+                           .method = HTTP_GET,
+                           .handler = log_handler,
+                           .user_ctx = NULL};
+    httpd_register_uri_handler(server, &log_uri);
+
     httpd_uri_t ws_uri = {.uri = "/api/browser_ws",
                           .method = HTTP_GET,
                           .handler = client_handler,
@@ -449,16 +497,6 @@ httpd_handle_t start_webserver(void) {
     ws_uri.uri = "/mesh_ws";
     httpd_register_uri_handler(server, &ws_uri);
 
-    httpd_uri_t mesh_uri = {.uri = "/api_num_clients",
-                            .method = HTTP_GET,
-                            .handler = num_clients_handler,
-                            .user_ctx = NULL};
-    httpd_register_uri_handler(server, &mesh_uri);
-
-    mesh_uri.uri = "/no_you_restart", mesh_uri.method = HTTP_POST,
-    mesh_uri.handler = restart_handler,
-    httpd_register_uri_handler(server, &mesh_uri);
-
     httpd_uri_t favicon_uri = {.uri = "/favicon.ico",
                                .method = HTTP_GET,
                                .handler = file_serve_handler,
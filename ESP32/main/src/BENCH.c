@@ -0,0 +1,840 @@
+#include "BENCH.h"
+
+#include "ALARM.h"
+#include "CODEC.h"
+#include "DATA.h"
+#include "ELECT.h"
+#include "LoRa.h"
+#include "MEM.h"
+#include "MESH.h"
+#include "STATE.h"
+#include "TASK.h"
+#include "TRACE.h"
+#include "WS.h"
+#include "config.h"
+#include "global.h"
+#include "utils.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cJSON.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static const char *TAG = "BENCH";
+
+// the float based formatting which `write_data` replaced, kept as the
+// reference its output is checked against
+static int legacy_round_to_dp(float var, int ndp) {
+  char str[40];
+  // format to 0 d.p. after multiplying by 10^{ndp}
+  sprintf(str, "%.0f", var * pow(10, ndp));
+  // insert back into var
+  sscanf(str, "%f", &var);
+
+  return (int)var;
+}
+
+static char *legacy_get_data(const data_snapshot_t *snapshot) {
+  cJSON *data = cJSON_CreateObject();
+  const telemetry_data_t *t = &snapshot->telemetry;
+
+  cJSON_AddNumberToObject(data, "esp_id", ESP_ID);
+  cJSON_AddNumberToObject(data, "Q", t->Q);
+  cJSON_AddNumberToObject(data, "H", t->H);
+  cJSON_AddNumberToObject(
+      data, "aT", legacy_round_to_dp(((float)t->aT) / 10.0 - 273.15, 1));
+  cJSON_AddNumberToObject(data, "V",
+                          legacy_round_to_dp(((float)t->V) / 1000.0, 1));
+  cJSON_AddNumberToObject(data, "I",
+                          legacy_round_to_dp(((float)t->I) / 1000.0, 1));
+  cJSON_AddNumberToObject(data, "V1",
+                          legacy_round_to_dp(((float)t->V1) / 1000.0, 2));
+  cJSON_AddNumberToObject(data, "V2",
+                          legacy_round_to_dp(((float)t->V2) / 1000.0, 2));
+  cJSON_AddNumberToObject(data, "V3",
+                          legacy_round_to_dp(((float)t->V3) / 1000.0, 2));
+  cJSON_AddNumberToObject(data, "V4",
+                          legacy_round_to_dp(((float)t->V4) / 1000.0, 2));
+  cJSON_AddNumberToObject(data, "I1",
+                          legacy_round_to_dp(((float)t->I1) / 1000.0, 2));
+  cJSON_AddNumberToObject(data, "I2",
+                          legacy_round_to_dp(((float)t->I2) / 1000.0, 2));
+  cJSON_AddNumberToObject(data, "I3",
+                          legacy_round_to_dp(((float)t->I3) / 1000.0, 2));
+  cJSON_AddNumberToObject(data, "I4",
+                          legacy_round_to_dp(((float)t->I4) / 1000.0, 2));
+  cJSON_AddNumberToObject(
+      data, "T1", legacy_round_to_dp(((float)t->T1) / 10.0 - 273.15, 2));
+  cJSON_AddNumberToObject(
+      data, "T2", legacy_round_to_dp(((float)t->T2) / 10.0 - 273.15, 2));
+  cJSON_AddNumberToObject(
+      data, "T3", legacy_round_to_dp(((float)t->T3) / 10.0 - 273.15, 2));
+  cJSON_AddNumberToObject(
+      data, "T4", legacy_round_to_dp(((float)t->T4) / 10.0 - 273.15, 2));
+  cJSON_AddNumberToObject(
+      data, "cT", legacy_round_to_dp(((float)t->cT) / 10.0 - 273.15, 1));
+  cJSON_AddNumberToObject(data, "OTC",
+                          legacy_round_to_dp(((float)t->OTC) / 10.0, 1));
+  cJSON_AddNumberToObject(data, "CC", t->CC);
+  cJSON_AddBoolToObject(data, "wifi", state_is(STATE_WIFI));
+  cJSON_AddNumberToObject(data, "t", snapshot->gps.time);
+  cJSON_AddNumberToObject(data, "d", snapshot->gps.date);
+  cJSON_AddNumberToObject(data, "lat", snapshot->gps.latitude);
+  cJSON_AddNumberToObject(data, "lon", snapshot->gps.longitude);
+  cJSON_AddNumberToObject(data, "P", snapshot->inverter.output_power);
+  cJSON_AddNumberToObject(data, "inv", snapshot->inverter.enabled);
+
+  cJSON *message = cJSON_CreateObject();
+  cJSON_AddNumberToObject(message, "esp_id", ESP_ID);
+  cJSON_AddStringToObject(message, "type", "data");
+  cJSON_AddItemToObject(message, "content", data);
+
+  char *data_string = cJSON_PrintUnformatted(message);
+  cJSON_Delete(message);
+
+  return data_string;
+}
+
+static char *legacy_convert_for_frontend(const char *data_string) {
+  static const char *tenths[] = {"V", "I", "aT", "cT"};
+  static const char *hundredths[] = {"V1", "V2", "V3", "V4", "I1", "I2",
+                                     "I3", "I4", "T1", "T2", "T3", "T4"};
+
+  cJSON *data_json = cJSON_Parse(data_string);
+  cJSON *content = cJSON_GetObjectItem(data_json, "content");
+  for (size_t i = 0; i < sizeof(tenths) / sizeof(tenths[0]); i++) {
+    cJSON *item = cJSON_GetObjectItem(content, tenths[i]);
+    cJSON_SetNumberValue(item, (float)item->valueint / 10.0);
+  }
+  for (size_t i = 0; i < sizeof(hundredths) / sizeof(hundredths[0]); i++) {
+    cJSON *item = cJSON_GetObjectItem(content, hundredths[i]);
+    cJSON_SetNumberValue(item, (float)item->valueint / 100.0);
+  }
+  char *converted_data_string = cJSON_PrintUnformatted(data_json);
+  cJSON_Delete(data_json);
+
+  return converted_data_string;
+}
+
+// whether the exact value of `key` for a raw reading of `raw` lies half way
+// between two reported values, where the float version rounds either way
+// depending on how the intermediate values happen to be represented
+static bool is_tie(const char *key, int32_t raw) {
+  // currents are signed
+  int32_t magnitude = abs(key[0] == 'I' ? (int16_t)raw : raw);
+  if (strcmp(key, "aT") == 0 || strcmp(key, "cT") == 0)
+    return true; // 0.1 K − 273.15 always ends in 0.05 °C
+  if (strcmp(key, "V") == 0 || strcmp(key, "I") == 0)
+    return magnitude % 100 == 50;
+  if (key[0] == 'V' || key[0] == 'I')
+    return magnitude % 10 == 5;
+  return false;
+}
+
+// size of one count of `key` as it appears in the message
+static double count_size(const char *key, bool for_frontend) {
+  const field_info_t *info = codec_find_field(key);
+  if (info == NULL || (info->scaled && !for_frontend))
+    return 1;
+  return pow(10, -info->ndp);
+}
+
+// compares the two versions of one message field by field. fields may only
+// differ by a single count where the reading is a tie, or by less than half
+// a count where it was a float
+static bool compare_data(const char *expected, const char *actual,
+                         int32_t raw, bool for_frontend,
+                         uint32_t *n_tie_differences, uint32_t *n_rounded) {
+  if (strcmp(expected, actual) == 0)
+    return true;
+
+  cJSON *expected_json = cJSON_Parse(expected);
+  cJSON *actual_json = cJSON_Parse(actual);
+  cJSON *expected_content = cJSON_GetObjectItem(expected_json, "content");
+  cJSON *actual_content = cJSON_GetObjectItem(actual_json, "content");
+  bool same = cJSON_GetArraySize(expected_content) ==
+              cJSON_GetArraySize(actual_content);
+
+  cJSON *item = NULL;
+  cJSON_ArrayForEach(item, expected_content) {
+    cJSON *other = cJSON_GetObjectItem(actual_content, item->string);
+    if (other != NULL && cJSON_Compare(item, other, true))
+      continue;
+
+    double count = count_size(item->string, for_frontend);
+    double difference =
+        other ? fabs(item->valuedouble - other->valuedouble) : INFINITY;
+    if (is_tie(item->string, raw) && fabs(difference - count) < count * 1e-6) {
+      (*n_tie_differences)++;
+      continue;
+    }
+    // GPS readings are floats, which were printed with all of their
+    // representation error and are now rounded to their precision
+    if (count < 1 && difference <= count / 2 * (1 + 1e-6)) {
+      (*n_rounded)++;
+      continue;
+    }
+
+    char *expected_value = cJSON_PrintUnformatted(item);
+    char *actual_value = other ? cJSON_PrintUnformatted(other) : NULL;
+    ESP_LOGE(TAG, "  raw %" PRId32 ": \"%s\" was %s, now %s", raw,
+             item->string, expected_value,
+             actual_value ? actual_value : "missing");
+    cJSON_free(expected_value);
+    cJSON_free(actual_value);
+    same = false;
+  }
+
+  cJSON_Delete(expected_json);
+  cJSON_Delete(actual_json);
+  return same;
+}
+
+static size_t write_data(char *out, size_t size,
+                         const data_snapshot_t *snapshot, bool for_frontend) {
+  report_t report;
+  codec_from_snapshot(snapshot, ESP_ID, &report);
+  return codec_write_json(&report, out, size, for_frontend);
+}
+
+static void fill_snapshot(data_snapshot_t *snapshot, int32_t raw,
+                          uint32_t variant) {
+  static const float times[] = {0, 123519, 94512.5f, 235959.99f};
+  static const float latitudes[] = {0, 51.4545f, -33.8688f, 48.1173f};
+  static const float longitudes[] = {0, -2.5879f, 151.2093f, 11.5167f};
+  static const int dates[] = {0, 230394, 311299, 10125};
+  uint32_t i = variant % 4;
+
+  memset(snapshot, 0, sizeof(*snapshot));
+  telemetry_data_t *t = &snapshot->telemetry;
+  t->Q = t->H = (uint8_t)raw;
+  t->aT = t->cT = t->T1 = t->T2 = t->T3 = t->T4 = (uint16_t)raw;
+  t->V = t->V1 = t->V2 = t->V3 = t->V4 = t->CC = (uint16_t)raw;
+  t->I = t->I1 = t->I2 = t->I3 = t->I4 = t->OTC = (int16_t)raw;
+  snapshot->gps.time = times[i];
+  snapshot->gps.date = dates[i];
+  snapshot->gps.latitude = latitudes[i];
+  snapshot->gps.longitude = longitudes[i];
+  snapshot->inverter.output_power = (uint16_t)(raw * 7);
+  snapshot->inverter.enabled = variant % 2;
+  state_assign(STATE_WIFI, variant % 3 == 0);
+}
+
+static bool bench_data_format() {
+  data_snapshot_t snapshot;
+  char data_string[WS_DATA_MAX_LEN];
+  char frontend_string[WS_DATA_MAX_LEN];
+  uint32_t n_identical = 0;
+  uint32_t n_tie_differences = 0;
+  uint32_t n_rounded = 0;
+  uint32_t n_failures = 0;
+
+  // every raw reading, checking both the web server and browser versions
+  for (int32_t raw = 0; raw <= UINT16_MAX; raw++) {
+    fill_snapshot(&snapshot, raw, raw);
+    char *expected = legacy_get_data(&snapshot);
+    char *expected_frontend = legacy_convert_for_frontend(expected);
+    write_data(data_string, sizeof(data_string), &snapshot, false);
+    write_data(frontend_string, sizeof(frontend_string), &snapshot, true);
+
+    bool identical = strcmp(expected, data_string) == 0 &&
+                     strcmp(expected_frontend, frontend_string) == 0;
+    if (identical) {
+      n_identical++;
+    } else if (!compare_data(expected, data_string, raw, false,
+                             &n_tie_differences, &n_rounded) ||
+               !compare_data(expected_frontend, frontend_string, raw, true,
+                             &n_tie_differences, &n_rounded)) {
+      n_failures++;
+    }
+
+    cJSON_free(expected);
+    cJSON_free(expected_frontend);
+  }
+
+  ESP_LOGI(TAG,
+           "  %" PRIu32 "/%d readings formatted identically, %" PRIu32
+           " fields rounded the other way at exact ties, %" PRIu32
+           " GPS fields rounded to precision, %" PRIu32 " real differences",
+           n_identical, UINT16_MAX + 1, n_tie_differences, n_rounded,
+           n_failures);
+
+  // time a message of typical values both ways
+  fill_snapshot(&snapshot, 3700, 1);
+  snapshot.telemetry.aT = snapshot.telemetry.cT = 2981;
+  snapshot.telemetry.V = 14800;
+  snapshot.telemetry.I = -1234;
+
+  int64_t start_time = esp_timer_get_time();
+  for (int i = 0; i < BENCH_ITERATIONS; i++) {
+    char *expected = legacy_get_data(&snapshot);
+    char *expected_frontend = legacy_convert_for_frontend(expected);
+    cJSON_free(expected);
+    cJSON_free(expected_frontend);
+  }
+  int64_t legacy_time = esp_timer_get_time() - start_time;
+
+  start_time = esp_timer_get_time();
+  for (int i = 0; i < BENCH_ITERATIONS; i++) {
+    write_data(data_string, sizeof(data_string), &snapshot, false);
+    write_data(frontend_string, sizeof(frontend_string), &snapshot, true);
+  }
+  int64_t fixed_time = esp_timer_get_time() - start_time;
+
+  ESP_LOGI(TAG, "  float + cJSON: %.2f us per message pair",
+           (double)legacy_time / BENCH_ITERATIONS);
+  ESP_LOGI(TAG, "  fixed point:   %.2f us per message pair (%.1fx)",
+           (double)fixed_time / BENCH_ITERATIONS,
+           fixed_time > 0 ? (double)legacy_time / fixed_time : 0.0);
+
+  return n_failures == 0;
+}
+
+static bool same_report(const report_t *expected, const report_t *actual,
+                        bool on_wire, const char *what, int32_t raw) {
+  bool same = expected->esp_id == actual->esp_id;
+  for (int i = 0; i < N_FIELDS; i++) {
+    const field_info_t *info = &field_info[i];
+    int32_t value = expected->values[i];
+    // values outside the range of the wire type stick at its limits
+    if (on_wire && info->wire_size < sizeof(int32_t)) {
+      int64_t max = info->wire_signed ? (1LL << (8 * info->wire_size - 1)) - 1
+                                      : (1LL << (8 * info->wire_size)) - 1;
+      int64_t min = info->wire_signed ? -max - 1 : 0;
+      value = value > max ? max : value < min ? min : value;
+    }
+    if (value != actual->values[i]) {
+      ESP_LOGE(TAG,
+               "  raw %" PRId32 ": %s \"%s\" was %" PRId32 ", now %" PRId32,
+               raw, what, info->key, value, actual->values[i]);
+      same = false;
+    }
+  }
+
+  return same;
+}
+
+static bool bench_codec() {
+  data_snapshot_t snapshot;
+  report_t report;
+  report_t decoded;
+  uint8_t packet[sizeof(radio_data_packet)];
+  char data_string[WS_DATA_MAX_LEN];
+  uint32_t n_failures = 0;
+
+  // every raw reading through the radio packet and back, and through the JSON
+  // sent to the web server (and by mesh nodes) and back
+  for (int32_t raw = 0; raw <= UINT16_MAX; raw++) {
+    fill_snapshot(&snapshot, raw, raw);
+    codec_from_snapshot(&snapshot, raw % 256, &report);
+
+    codec_pack(&report, packet);
+    codec_unpack(packet, &decoded);
+    bool passed = packet[0] == DATA &&
+                  same_report(&report, &decoded, true, "radio", raw);
+
+    codec_write_json(&report, data_string, sizeof(data_string), false);
+    cJSON *message = cJSON_Parse(data_string);
+    passed &= codec_from_json(message, &decoded) &&
+              same_report(&report, &decoded, false, "JSON", raw);
+    cJSON_Delete(message);
+
+    if (!passed)
+      n_failures++;
+  }
+
+  ESP_LOGI(TAG, "  %" PRIu32 "/%d readings changed by a round trip",
+           n_failures, UINT16_MAX + 1);
+  ESP_LOGI(TAG, "  %zu byte radio data packets", sizeof(radio_data_packet));
+
+  // time a message of typical values through each codec
+  fill_snapshot(&snapshot, 3700, 1);
+  codec_from_snapshot(&snapshot, ESP_ID, &report);
+
+  int64_t start_time = esp_timer_get_time();
+  for (int i = 0; i < BENCH_ITERATIONS; i++) {
+    codec_pack(&report, packet);
+    codec_unpack(packet, &decoded);
+  }
+  int64_t radio_time = esp_timer_get_time() - start_time;
+
+  start_time = esp_timer_get_time();
+  for (int i = 0; i < BENCH_ITERATIONS; i++) {
+    codec_write_json(&report, data_string, sizeof(data_string), false);
+    cJSON *message = cJSON_Parse(data_string);
+    codec_from_json(message, &decoded);
+    cJSON_Delete(message);
+  }
+  int64_t json_time = esp_timer_get_time() - start_time;
+
+  ESP_LOGI(TAG, "  radio: %.2f us per pack + unpack",
+           (double)radio_time / BENCH_ITERATIONS);
+  ESP_LOGI(TAG, "  JSON:  %.2f us per write + parse",
+           (double)json_time / BENCH_ITERATIONS);
+
+  return n_failures == 0;
+}
+
+#define BENCH_UPDATE_REPORTS (BMS_N_PACKS + MESH_SIZE)
+
+static bool bench_ws_protocol() {
+  // a node's update to its parent, with its own packs and those of a full
+  // MESH relayed through it, as the JSON array and as the binary frame of
+  // radio data packets which a parent that understands "proto=bin" gets
+  static char json_frame[BENCH_UPDATE_REPORTS * WS_DATA_MAX_LEN];
+  static uint8_t binary_frame[BENCH_UPDATE_REPORTS * sizeof(radio_data_packet)];
+  data_snapshot_t snapshot;
+  report_t reports[BENCH_UPDATE_REPORTS];
+  report_t decoded[BENCH_UPDATE_REPORTS];
+
+  size_t json_length = 0;
+  size_t binary_length = 0;
+  json_frame[json_length++] = '[';
+  for (int i = 0; i < BENCH_UPDATE_REPORTS; i++) {
+    fill_snapshot(&snapshot, 3700 + i, i);
+    codec_from_snapshot(&snapshot, ESP_ID + i, &reports[i]);
+    json_length += codec_write_json(&reports[i], &json_frame[json_length],
+                                    sizeof(json_frame) - json_length, false);
+    json_frame[json_length++] = i + 1 < BENCH_UPDATE_REPORTS ? ',' : ']';
+    binary_length += codec_pack(&reports[i], &binary_frame[binary_length]);
+  }
+  json_frame[json_length] = '\0';
+
+  // each way back, as `client_handler` does
+  bool passed = true;
+  int64_t start_time = esp_timer_get_time();
+  for (int n = 0; n < BENCH_ITERATIONS; n++) {
+    cJSON *message = cJSON_Parse(json_frame);
+    int i = 0;
+    cJSON *item = NULL;
+    cJSON_ArrayForEach(item, message) {
+      if (i < BENCH_UPDATE_REPORTS)
+        codec_from_json(item, &decoded[i++]);
+    }
+    cJSON_Delete(message);
+  }
+  int64_t json_time = esp_timer_get_time() - start_time;
+  for (int i = 0; i < BENCH_UPDATE_REPORTS; i++)
+    passed &= same_report(&reports[i], &decoded[i], false, "JSON", i);
+
+  start_time = esp_timer_get_time();
+  for (int n = 0; n < BENCH_ITERATIONS; n++)
+    for (size_t offset = 0; offset < binary_length;
+         offset += sizeof(radio_data_packet))
+      codec_unpack(&binary_frame[offset],
+                   &decoded[offset / sizeof(radio_data_packet)]);
+  int64_t binary_time = esp_timer_get_time() - start_time;
+  for (int i = 0; i < BENCH_UPDATE_REPORTS; i++)
+    passed &= same_report(&reports[i], &decoded[i], true, "binary", i);
+
+  ESP_LOGI(TAG, "  an update of %d reports, parsed by the parent:",
+           BENCH_UPDATE_REPORTS);
+  ESP_LOGI(TAG, "  JSON:   %5zu bytes, %.2f us", json_length,
+           (double)json_time / BENCH_ITERATIONS);
+  ESP_LOGI(TAG, "  binary: %5zu bytes, %.2f us", binary_length,
+           (double)binary_time / BENCH_ITERATIONS);
+
+  return passed;
+}
+
+static void run_queued_jobs() {
+  // as the job worker would, for the jobs which carry alarms. the data sends
+  // queued by `change_check` aren't timed here
+  job_t job;
+  while (xQueueReceive(job_queue, &job, 0) == pdPASS) {
+    if (job.type == JOB_ALARM_SEND)
+      alarm_send();
+    else if (job.type == JOB_LORA_TRANSMIT)
+      transmit();
+    if (job.data)
+      mem_block_free(job.data);
+  }
+}
+
+static int64_t publish_reading(int16_t current) {
+  // as `update_telemetry_data` does, returning the time of the reading
+  telemetry_data_t telemetry = {.Q = 80, .H = 100, .OTC = 550, .CC = 12};
+  telemetry.V = 14800;
+  telemetry.V1 = telemetry.V2 = telemetry.V3 = telemetry.V4 = 3700;
+  telemetry.aT = telemetry.cT = 2982;
+  telemetry.T1 = telemetry.T2 = telemetry.T3 = telemetry.T4 = 2982;
+  telemetry.I = current;
+  telemetry.I1 = telemetry.I2 = telemetry.I3 = telemetry.I4 = current / 4;
+  data_publish_telemetry(&telemetry);
+  alarm_check();
+  change_check();
+
+  data_snapshot_t snapshot;
+  data_read_snapshot(&snapshot);
+  return snapshot.timestamp;
+}
+
+static int64_t raise_alarm(destination_t destination) {
+  // clear any earlier alarm, then raise a new one
+  publish_reading(1000);
+  run_queued_jobs();
+
+  publish_reading(ALARM_CURRENT_LIMIT);
+  run_queued_jobs();
+
+  return alarm_latency(destination);
+}
+
+static bool bench_alarm() {
+  bool passed = true;
+
+  // straight to the web server over Wi-Fi
+  state_clear(STATE_ROOT);
+  state_set(STATE_WIFI);
+  int64_t server_latency = raise_alarm(DESTINATION_SERVER);
+
+  // from a mesh node to its ROOT
+  state_clear(STATE_WIFI);
+  state_set(STATE_PARENT);
+  int64_t mesh_latency = raise_alarm(DESTINATION_MESH);
+
+  ESP_LOGI(TAG, "  web server: %.2f ms, rather than up to %d ms with the data",
+           server_latency / 1000.0, WS_DELAY);
+  ESP_LOGI(TAG, "  mesh ROOT:  %.2f ms, rather than up to %d ms with the data",
+           mesh_latency / 1000.0, 5000);
+  passed &= server_latency >= 0 && mesh_latency >= 0;
+
+  // by radio from a ROOT which has just sent its own and a node's data, so
+  // has to wait out the duty cycle
+  state_set(STATE_ROOT | STATE_LORA);
+  publish_reading(1000);
+  run_queued_jobs();
+  report_t report;
+  codec_read_latest(&report);
+  report.esp_id = ESP_ID + 1;
+  mesh_keep_report(&report);
+  transmit();
+  int64_t data_sent_at = esp_timer_get_time();
+  int64_t ready_at = transmit_ready_at();
+
+  esp_timer_stub_advance(1000000);
+  int64_t fault_at = publish_reading(ALARM_CURRENT_LIMIT);
+  run_queued_jobs();
+  for (int i = 0; i < 10 && alarm_radio_pending(); i++) {
+    // `alarm_transmit_timer` fires as soon as the duty cycle allows
+    int64_t wait = transmit_ready_at() - esp_timer_get_time();
+    if (wait > 0)
+      esp_timer_stub_advance(wait + 1000);
+    job_t job = {.type = JOB_LORA_TRANSMIT};
+    xQueueSendToFront(job_queue, &job, 0);
+    run_queued_jobs();
+  }
+  int64_t radio_latency = alarm_latency(DESTINATION_RADIO);
+
+  // without alarms the fault would have gone with the next data, on the first
+  // tick of the 5 s transmit timer after the duty cycle allowed
+  int64_t next_tick = data_sent_at;
+  while (next_tick <= ready_at)
+    next_tick += 5000000;
+  int64_t data_latency = next_tick - fault_at;
+
+  ESP_LOGI(TAG, "  radio:      %.2f ms, rather than %.2f ms with the data",
+           radio_latency / 1000.0, data_latency / 1000.0);
+  passed &= radio_latency >= 0 && radio_latency < data_latency;
+
+  state_clear(STATE_ROOT | STATE_PARENT | STATE_LORA);
+  all_messages[0].esp_id = 0;
+
+  return passed;
+}
+
+// a few devices in range of each other, which run `elect_decide` on what the
+// others last advertised, on the periods of the real tasks
+#define SIM_DEVICES 6
+#define SIM_TRIALS 1000
+#define SIM_STEP_MS 100
+#define SIM_LIMIT_MS 600000
+#define SIM_CONNECT_PERIOD_MS 5000 // `connect_to_root_timer`
+#define SIM_FULL_SCAN_MS 4700      // 13 channels, passively
+#define SIM_JOIN_MS 1000           // connecting, after `esp_wifi_connect`
+#define SIM_BOOT_MS 3000           // to the set-up scan, after a restart
+
+typedef struct {
+  elect_candidate_t advertised;
+  uint8_t n_browsers;
+  bool alive;
+  bool root;
+  int parent;  // the ROOT a node is connected to, or -1
+  int joining; // the ROOT a node is connecting to, or -1
+  int64_t joined_at;
+  int64_t scanned_at; // the end of a node's all-channel scan, or -1
+  int connect_phase;  // ms into each period that the ticks come
+  int elect_phase;
+} sim_device_t;
+
+static sim_device_t sim[SIM_DEVICES];
+
+static void sim_advertise(int i) {
+  sim_device_t *device = &sim[i];
+  device->advertised.flags = device->root         ? ELECT_FLAG_ROOT
+                             : device->parent < 0 ? ELECT_FLAG_ORPHAN
+                                                  : 0;
+  device->advertised.hop = device->root         ? 0
+                           : device->parent < 0 ? ELECT_HOP_NONE
+                                                : 1;
+  device->advertised.n_clients = device->n_browsers;
+  for (int j = 0; j < SIM_DEVICES; j++)
+    if (sim[j].alive && sim[j].parent == i)
+      device->advertised.n_clients++;
+}
+
+static elect_action_t sim_decide(int i) {
+  sim_advertise(i);
+  elect_candidate_t heard[SIM_DEVICES];
+  size_t n_heard = 0;
+  for (int j = 0; j < SIM_DEVICES; j++)
+    if (j != i && sim[j].alive)
+      heard[n_heard++] = sim[j].advertised;
+  return elect_decide(&sim[i].advertised, heard, n_heard);
+}
+
+static int sim_root_heard(int i) {
+  int root = -1;
+  for (int j = 0; j < SIM_DEVICES; j++)
+    if (j != i && sim[j].alive && sim[j].root &&
+        (root < 0 ||
+         elect_compare(&sim[j].advertised, &sim[root].advertised) > 0))
+      root = j;
+  return root;
+}
+
+static bool sim_converged() {
+  int root = -1;
+  for (int i = 0; i < SIM_DEVICES; i++) {
+    if (!sim[i].alive || !sim[i].root)
+      continue;
+    if (root >= 0)
+      return false;
+    root = i;
+  }
+  if (root < 0)
+    return false;
+
+  for (int i = 0; i < SIM_DEVICES; i++)
+    if (sim[i].alive && i != root && sim[i].parent != root)
+      return false;
+  return true;
+}
+
+static void sim_step_node(int i, int64_t t) {
+  sim_device_t *device = &sim[i];
+  if (device->joining >= 0 && t >= device->joined_at) {
+    if (sim[device->joining].alive && sim[device->joining].root)
+      device->parent = device->joining;
+    device->joining = -1;
+  }
+
+  // `connect_to_root` notices a ROOT which has gone, or has become a node,
+  // and joins whichever ROOT it hears or else scans all channels
+  if (device->joining < 0 && device->scanned_at < 0 &&
+      t % SIM_CONNECT_PERIOD_MS == device->connect_phase) {
+    int parent = device->parent;
+    if (parent >= 0 && !(sim[parent].alive && sim[parent].root))
+      device->parent = -1;
+    if (device->parent < 0) {
+      int root = sim_root_heard(i);
+      if (root >= 0) {
+        device->joining = root;
+        device->joined_at = t + SIM_JOIN_MS;
+      } else {
+        device->scanned_at = t + SIM_FULL_SCAN_MS;
+      }
+    }
+  }
+
+  // after which it, or an election round, might take over
+  bool scanned = device->scanned_at >= 0 && t >= device->scanned_at;
+  if (scanned)
+    device->scanned_at = -1;
+  if (scanned || t % ELECT_PERIOD_MS == device->elect_phase) {
+    if (device->parent < 0 && device->joining < 0 &&
+        sim_decide(i) == ELECT_PROMOTE) {
+      device->root = true;
+      device->scanned_at = -1;
+    }
+  }
+}
+
+static void sim_step_root(int i, int64_t t) {
+  sim_device_t *device = &sim[i];
+  if (t % ELECT_PERIOD_MS != device->elect_phase ||
+      sim_decide(i) != ELECT_DEMOTE)
+    return;
+
+  // and joins the better ROOT straight away
+  device->root = false;
+  device->parent = -1;
+  device->joining = sim_root_heard(i);
+  device->joined_at = t + SIM_JOIN_MS;
+}
+
+static int64_t sim_run(int n_roots, int64_t *legacy) {
+  // `n_roots` MESHs of the devices between them, either the one losing its
+  // ROOT or them all coming into range of each other
+  for (int i = 0; i < SIM_DEVICES; i++) {
+    sim[i] = (sim_device_t){
+        .advertised = {.uptime = rand() % 600},
+        .n_browsers = rand() % 2,
+        .alive = true,
+        .root = i < n_roots,
+        .parent = i < n_roots ? -1 : i % n_roots,
+        .joining = -1,
+        .scanned_at = -1,
+        .connect_phase = rand() % (SIM_CONNECT_PERIOD_MS / SIM_STEP_MS) *
+                         SIM_STEP_MS,
+        .elect_phase = rand() % (ELECT_PERIOD_MS / SIM_STEP_MS) * SIM_STEP_MS,
+    };
+    for (int j = 0; j < sizeof(sim[i].advertised.mac); j++)
+      sim[i].advertised.mac[j] = rand();
+  }
+  for (int i = 0; i < SIM_DEVICES; i++)
+    sim_advertise(i);
+
+  if (n_roots == 1) {
+    sim[0].alive = false;
+
+    // before, the first node to notice, scan, wait out its MAC-derived delay,
+    // scan again and restart would have been the ROOT at best
+    *legacy = INT64_MAX;
+    for (int i = 1; i < SIM_DEVICES; i++) {
+      const uint8_t *mac = sim[i].advertised.mac;
+      uint32_t unique_number = ((uint32_t)mac[2] << 24) |
+                               ((uint32_t)mac[3] << 16) |
+                               ((uint32_t)mac[4] << 8) | ((uint32_t)mac[5]);
+      int64_t restart = sim[i].connect_phase + 2 * SIM_FULL_SCAN_MS +
+                        unique_number % 100000 + 5000 + SIM_BOOT_MS +
+                        SIM_FULL_SCAN_MS;
+      *legacy = MIN(*legacy, restart);
+    }
+  } else {
+    // before, the merge task of one ROOT would next have run, and at best
+    // had it restart
+    *legacy = rand() % 60000 + SIM_JOIN_MS + SIM_BOOT_MS + SIM_FULL_SCAN_MS;
+  }
+
+  for (int64_t t = 0; t <= SIM_LIMIT_MS; t += SIM_STEP_MS) {
+    for (int i = 0; i < SIM_DEVICES; i++) {
+      if (!sim[i].alive)
+        continue;
+      if (sim[i].root)
+        sim_step_root(i, t);
+      else
+        sim_step_node(i, t);
+    }
+    if (sim_converged())
+      return t;
+  }
+
+  return -1;
+}
+
+static bool bench_election() {
+  bool passed = true;
+  srand(1);
+
+  const struct {
+    const char *name;
+    int n_roots;
+  } scenarios[] = {
+      {"ROOT lost", 1},
+      {"MESHs merged", 2},
+  };
+  for (int i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+    int64_t total = 0;
+    int64_t longest = 0;
+    int64_t legacy_total = 0;
+    int n_failures = 0;
+    for (int j = 0; j < SIM_TRIALS; j++) {
+      int64_t legacy = 0;
+      int64_t converged = sim_run(scenarios[i].n_roots, &legacy);
+      if (converged < 0) {
+        n_failures++;
+        continue;
+      }
+      total += converged;
+      longest = MAX(longest, converged);
+      legacy_total += legacy;
+    }
+
+    int n_converged = SIM_TRIALS - n_failures;
+    if (n_failures > 0)
+      ESP_LOGE(TAG, "  %s: %d of %d trials never settled on one ROOT",
+               scenarios[i].name, n_failures, SIM_TRIALS);
+    if (n_converged > 0)
+      ESP_LOGI(TAG,
+               "  %s: %.1f s on average (%.1f s at most), rather than at "
+               "least %.1f s",
+               scenarios[i].name, total / 1000.0 / n_converged,
+               longest / 1000.0, legacy_total / 1000.0 / n_converged);
+    passed &= n_failures == 0;
+  }
+
+  return passed;
+}
+
+static bench_t benches[] = {
+    {.name = "data formatting", .run = bench_data_format},
+    {.name = "data codecs", .run = bench_codec},
+    {.name = "WebSocket protocols", .run = bench_ws_protocol},
+    {.name = "alarm latency", .run = bench_alarm},
+    {.name = "ROOT election", .run = bench_election},
+};
+static const size_t n_benches = sizeof(benches) / sizeof(benches[0]);
+
+static bool write_trace_chunk(const char *chunk, size_t length, void *ctx) {
+  return fwrite(chunk, 1, length, (FILE *)ctx) == length;
+}
+
+static void write_trace() {
+  // for opening in Perfetto alongside the timings
+  FILE *file = fopen(BENCH_TRACE_FILE, "w");
+  if (file == NULL) {
+    ESP_LOGW(TAG, "Couldn't open %s", BENCH_TRACE_FILE);
+    return;
+  }
+  bool written = trace_export(write_trace_chunk, file);
+  if (fclose(file) == 0 && written)
+    ESP_LOGI(TAG, "Trace written to %s", BENCH_TRACE_FILE);
+  else
+    ESP_LOGW(TAG, "Couldn't write %s", BENCH_TRACE_FILE);
+}
+
+void bench_run() {
+  // the stub components are chatty, keep the output to this harness
+  esp_log_level_set("*", ESP_LOG_WARN);
+  esp_log_level_set(TAG, ESP_LOG_INFO);
+
+  // each bench is a span of the trace
+  trace_set_enabled(true);
+
+  bool passed = true;
+  for (size_t i = 0; i < n_benches; i++) {
+    ESP_LOGI(TAG, "%s:", benches[i].name);
+    trace_begin(benches[i].name);
+    bool bench_passed = benches[i].run();
+    trace_end(benches[i].name);
+    if (!bench_passed)
+      ESP_LOGE(TAG, "%s: FAILED", benches[i].name);
+    passed &= bench_passed;
+  }
+  write_trace();
+
+  if (passed) {
+    ESP_LOGI(TAG, "PASSED");
+    exit(EXIT_SUCCESS);
+  }
+
+  ESP_LOGE(TAG, "FAILED");
+  exit(EXIT_FAILURE);
+}
@@ -1,6 +1,13 @@
 #include "BMS.h"
 
+#include "ALARM.h"
+#include "CHANGE.h"
+#include "DATA.h"
+#include "FLASH.h"
 #include "I2C.h"
+#include "PARAM.h"
+#include "PROF.h"
+#include "SCHED.h"
 #include "TASK.h"
 #include "config.h"
 #include "global.h"
@@ -8,77 +15,71 @@
 
 #include "cJSON.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
-static const char *TAG = "BMS";
+#include <string.h>
 
-static TimerHandle_t read_data_timer;
+static const char *TAG = "BMS";
 
-void reset() {
+// the packs share one bus, so they are read one at a time, each when it is
+// next due. a pack which stops answering is backed off by the bus manager in
+// `I2C.c`, so that its reads fail fast rather than hold up the others, and it
+// stops being reported after `BMS_PACK_MAX_FAILURES` failed reads in a row
+typedef struct {
+  int64_t next_read_at; // us since boot
+  uint8_t failures;     // in a row
+  uint8_t esp_id;       // from the pack's DeviceName, 0 until read
+} pack_schedule_t;
+
+static pack_schedule_t schedule[BMS_N_PACKS] = {0};
+
+// these only send the command. the BMS takes `I2C_DELAY` ms to act on it,
+// after which `get_sealed_status` shows whether it did (see `CMD.c`)
+esp_err_t reset(uint8_t pack) {
   uint8_t word[2] = {0};
   convert_uint_to_n_bytes(BMS_RESET_CMD, word, sizeof(word), true);
 
-  write_word(I2C_MANUFACTURER_ACCESS, word, sizeof(word));
-
-  // delay to allow reset to complete
-  vTaskDelay(pdMS_TO_TICKS(I2C_DELAY));
-
-  if (get_sealed_status() == 0 && true)
-    ESP_LOGI(TAG, "Reset command sent successfully.");
+  return write_word(pack, I2C_MANUFACTURER_ACCESS, word, sizeof(word));
 }
 
-void seal() {
+esp_err_t seal(uint8_t pack) {
   uint8_t word[2] = {0};
   convert_uint_to_n_bytes(BMS_SEAL_CMD, word, sizeof(word), true);
-  write_word(I2C_MANUFACTURER_ACCESS, word, sizeof(word));
 
-  // delay to allow seal to complete
-  vTaskDelay(pdMS_TO_TICKS(I2C_DELAY));
-
-  if (get_sealed_status() == 0)
-    ESP_LOGI(TAG, "Seal command sent successfully.");
+  return write_word(pack, I2C_MANUFACTURER_ACCESS, word, sizeof(word));
 }
 
-void unseal() {
+esp_err_t unseal(uint8_t pack) {
   uint8_t word[2];
 
   convert_uint_to_n_bytes(BMS_UNSEAL_CMD_2, word, sizeof(word), true);
-  write_word(I2C_MANUFACTURER_ACCESS, word, sizeof(word));
+  esp_err_t err = write_word(pack, I2C_MANUFACTURER_ACCESS, word, sizeof(word));
+  if (err != ESP_OK)
+    return err;
 
   convert_uint_to_n_bytes(BMS_UNSEAL_CMD_1, word, sizeof(word), true);
-  write_word(I2C_MANUFACTURER_ACCESS, word, sizeof(word));
-
-  // delay to allow unseal to complete
-  vTaskDelay(pdMS_TO_TICKS(I2C_DELAY));
-
-  if (get_sealed_status() == 1)
-    ESP_LOGI(TAG, "Unseal command sent successfully.");
+  return write_word(pack, I2C_MANUFACTURER_ACCESS, word, sizeof(word));
 }
 
-void full_access() {
-  // first do regular unseal
-  unseal();
-
+esp_err_t full_access(uint8_t pack) {
+  // once `unseal` has taken effect
   uint8_t word[2];
 
   convert_uint_to_n_bytes(BMS_FULL_ACCESS_CMD_2, word, sizeof(word), true);
-  write_word(I2C_MANUFACTURER_ACCESS, word, sizeof(word));
+  esp_err_t err = write_word(pack, I2C_MANUFACTURER_ACCESS, word, sizeof(word));
+  if (err != ESP_OK)
+    return err;
 
   convert_uint_to_n_bytes(BMS_FULL_ACCESS_CMD_1, word, sizeof(word), true);
-  write_word(I2C_MANUFACTURER_ACCESS, word, sizeof(word));
-
-  // delay to allow full access to complete
-  vTaskDelay(pdMS_TO_TICKS(I2C_DELAY));
-
-  if (get_sealed_status() == 2)
-    ESP_LOGI(TAG, "Full access command sent successfully.");
+  return write_word(pack, I2C_MANUFACTURER_ACCESS, word, sizeof(word));
 }
 
-int8_t get_sealed_status() {
+int8_t get_sealed_status(uint8_t pack) {
   // read OperationStatus
   uint8_t addr[2] = {0};
   convert_uint_to_n_bytes(I2C_OPERATION_STATUS_ADDR, addr, sizeof(addr), true);
   uint8_t data[4] = {0}; // expect 4 bytes for OperationStatus
-  read_data_flash(addr, sizeof(addr), data, sizeof(data));
+  read_data_flash(pack, addr, sizeof(addr), data, sizeof(data));
   bool SEC0 = 0b00000001 & data[1];
   bool SEC1 = 0b00000010 & data[1];
 
@@ -92,83 +93,151 @@ int8_t get_sealed_status() {
     return -1; // error
 }
 
-void update_telemetry_data() {
+static uint8_t read_pack_esp_id(uint8_t pack) {
+  // as the first pack's names the ESP32
+  uint8_t data_flash[UTILS_ID_LENGTH + 2] = {0}; // S21 data type
+  int id = -1;
+  if (flash_get(pack, FLASH_DEVICE_NAME, data_flash) == ESP_OK &&
+      strcmp((char *)data_flash, "") != 0)
+    id = parse_esp_id((char *)&data_flash[1]);
+
+  if (id <= 0 || id > UINT8_MAX) {
+    id = (ESP_ID + pack) & UINT8_MAX;
+    ESP_LOGW(TAG, "Pack %u has no usable DeviceName, reporting it as bms_%02d",
+             pack, id);
+  }
+
+  return id;
+}
+
+esp_err_t update_telemetry_data(uint8_t pack) {
+  // give up on a pack which isn't there before waiting on every read
+  esp_err_t err = check_device(pack);
+  if (err != ESP_OK)
+    return err;
+
   uint8_t data_SBS[2] = {0};
   uint8_t address[2] = {0};
   uint8_t data_flash[2] = {0};
   uint8_t block_data_flash[32] = {0};
 
+  // read into a local sample first so that readers never see a half-updated
+  // record
+  telemetry_data_t sample = {0};
+
   // read sensor data
-  read_SBS_data(I2C_RELATIVE_STATE_OF_CHARGE_ADDR, data_SBS, 1);
-  telemetry_data.Q = (uint8_t)data_SBS[0];
+  err |= read_SBS_data(pack, I2C_RELATIVE_STATE_OF_CHARGE_ADDR, data_SBS, 1);
+  sample.Q = (uint8_t)data_SBS[0];
 
-  read_SBS_data(I2C_STATE_OF_HEALTH_ADDR, data_SBS, 1);
-  telemetry_data.H = (uint8_t)data_SBS[0];
+  err |= read_SBS_data(pack, I2C_STATE_OF_HEALTH_ADDR, data_SBS, 1);
+  sample.H = (uint8_t)data_SBS[0];
 
-  read_SBS_data(I2C_TEMPERATURE_ADDR, data_SBS, 2);
-  telemetry_data.aT = (uint16_t)(data_SBS[1] << 8 | data_SBS[0]);
+  err |= read_SBS_data(pack, I2C_TEMPERATURE_ADDR, data_SBS, 2);
+  sample.aT = (uint16_t)(data_SBS[1] << 8 | data_SBS[0]);
 
-  read_SBS_data(I2C_VOLTAGE_ADDR, data_SBS, 2);
-  telemetry_data.V = (uint16_t)(data_SBS[1] << 8 | data_SBS[0]);
+  err |= read_SBS_data(pack, I2C_VOLTAGE_ADDR, data_SBS, 2);
+  sample.V = (uint16_t)(data_SBS[1] << 8 | data_SBS[0]);
 
-  read_SBS_data(I2C_CURRENT_ADDR, data_SBS, 2);
-  telemetry_data.I = (int16_t)(data_SBS[1] << 8 | data_SBS[0]);
+  err |= read_SBS_data(pack, I2C_CURRENT_ADDR, data_SBS, 2);
+  sample.I = (int16_t)(data_SBS[1] << 8 | data_SBS[0]);
 
   convert_uint_to_n_bytes(I2C_DA_STATUS_1_ADDR, address, sizeof(address), true);
-  read_data_flash(address, sizeof(address), block_data_flash,
-                  sizeof(block_data_flash));
-  telemetry_data.V1 =
-      (uint16_t)(block_data_flash[1] << 8 | block_data_flash[0]);
-  telemetry_data.V2 =
-      (uint16_t)(block_data_flash[3] << 8 | block_data_flash[2]);
-  telemetry_data.V3 =
-      (uint16_t)(block_data_flash[5] << 8 | block_data_flash[4]);
-  telemetry_data.V4 =
-      (uint16_t)(block_data_flash[7] << 8 | block_data_flash[6]);
-  telemetry_data.I1 =
-      (int16_t)(block_data_flash[13] << 8 | block_data_flash[12]);
-  telemetry_data.I2 =
-      (int16_t)(block_data_flash[15] << 8 | block_data_flash[14]);
-  telemetry_data.I3 =
-      (int16_t)(block_data_flash[17] << 8 | block_data_flash[16]);
-  telemetry_data.I4 =
-      (int16_t)(block_data_flash[19] << 8 | block_data_flash[18]);
+  err |= read_data_flash(pack, address, sizeof(address), block_data_flash,
+                         sizeof(block_data_flash));
+  sample.V1 = (uint16_t)(block_data_flash[1] << 8 | block_data_flash[0]);
+  sample.V2 = (uint16_t)(block_data_flash[3] << 8 | block_data_flash[2]);
+  sample.V3 = (uint16_t)(block_data_flash[5] << 8 | block_data_flash[4]);
+  sample.V4 = (uint16_t)(block_data_flash[7] << 8 | block_data_flash[6]);
+  sample.I1 = (int16_t)(block_data_flash[13] << 8 | block_data_flash[12]);
+  sample.I2 = (int16_t)(block_data_flash[15] << 8 | block_data_flash[14]);
+  sample.I3 = (int16_t)(block_data_flash[17] << 8 | block_data_flash[16]);
+  sample.I4 = (int16_t)(block_data_flash[19] << 8 | block_data_flash[18]);
 
   convert_uint_to_n_bytes(I2C_DA_STATUS_2_ADDR, address, sizeof(address), true);
-  read_data_flash(address, sizeof(address), block_data_flash,
-                  sizeof(block_data_flash));
-  telemetry_data.T1 =
-      (uint16_t)(block_data_flash[3] << 8 | block_data_flash[2]);
-  telemetry_data.T2 =
-      (uint16_t)(block_data_flash[5] << 8 | block_data_flash[4]);
-  telemetry_data.T3 =
-      (uint16_t)(block_data_flash[7] << 8 | block_data_flash[6]);
-  telemetry_data.T4 =
-      (uint16_t)(block_data_flash[9] << 8 | block_data_flash[8]);
-  telemetry_data.cT =
-      (uint16_t)(block_data_flash[11] << 8 | block_data_flash[10]);
-
-  // configurable data too
-  convert_uint_to_n_bytes(I2C_OTC_THRESHOLD_ADDR, address, sizeof(address),
-                          true);
-  read_data_flash(address, sizeof(address), data_flash, sizeof(data_flash));
-  telemetry_data.OTC = (int16_t)(data_flash[1] << 8 | data_flash[0]);
-
-  read_SBS_data(I2C_CYCLE_COUNT_ADDR, data_SBS, 2);
-  telemetry_data.CC = (uint16_t)(data_SBS[1] << 8 | data_SBS[0]);
+  err |= read_data_flash(pack, address, sizeof(address), block_data_flash,
+                         sizeof(block_data_flash));
+  sample.T1 = (uint16_t)(block_data_flash[3] << 8 | block_data_flash[2]);
+  sample.T2 = (uint16_t)(block_data_flash[5] << 8 | block_data_flash[4]);
+  sample.T3 = (uint16_t)(block_data_flash[7] << 8 | block_data_flash[6]);
+  sample.T4 = (uint16_t)(block_data_flash[9] << 8 | block_data_flash[8]);
+  sample.cT = (uint16_t)(block_data_flash[11] << 8 | block_data_flash[10]);
+
+  // configurable data too, which is cached as it only changes when it is
+  // written
+  err |= flash_get(pack, FLASH_OTC_THRESHOLD, data_flash);
+  sample.OTC = (int16_t)(data_flash[1] << 8 | data_flash[0]);
+
+  err |= read_SBS_data(pack, I2C_CYCLE_COUNT_ADDR, data_SBS, 2);
+  sample.CC = (uint16_t)(data_SBS[1] << 8 | data_SBS[0]);
+
+  // keep the last complete sample rather than publish a partial one
+  if (err != ESP_OK)
+    return err;
+
+  // publish the complete sample in one go
+  if (pack == BMS_PRIMARY_PACK) {
+    data_publish_telemetry(&sample);
+    // alarms first, so that they go out ahead of the data
+    alarm_check();
+    sched_ran(SCHED_AFTER_SAMPLE);
+  } else {
+    if (schedule[pack].esp_id == 0)
+      schedule[pack].esp_id = read_pack_esp_id(pack);
+    data_publish_pack(pack, schedule[pack].esp_id, &sample);
+  }
+  change_check();
+
+  return ESP_OK;
 }
 
-void read_data_callback(TimerHandle_t xTimer) {
-  job_t job = {.type = JOB_UPDATE_DATA};
+static void read_pack(uint8_t pack) {
+  pack_schedule_t *entry = &schedule[pack];
+  int64_t period = (int64_t)param_get(pack == BMS_PRIMARY_PACK
+                                          ? PARAM_BMS_PERIOD
+                                          : PARAM_PACK_PERIOD) *
+                   1000;
+
+  if (update_telemetry_data(pack) == ESP_OK) {
+    if (entry->failures >= BMS_PACK_MAX_FAILURES)
+      ESP_LOGI(TAG, "Pack %u is back online", pack);
+    entry->failures = 0;
+  } else {
+    if (entry->failures < UINT8_MAX)
+      entry->failures++;
+    if (entry->failures == BMS_PACK_MAX_FAILURES) {
+      ESP_LOGW(TAG, "Pack %u failed %u reads in a row", pack, entry->failures);
+      // the first pack is still reported, as this ESP32
+      data_set_pack_offline(pack);
+      // it may have been swapped by the time it comes back
+      entry->esp_id = 0;
+      flash_invalidate(pack);
+    }
+  }
+
+  // on a fixed period, unless it has fallen behind
+  entry->next_read_at += period;
+  int64_t now = esp_timer_get_time();
+  if (entry->next_read_at <= now)
+    entry->next_read_at = now + period;
+}
 
-  if (xQueueSend(job_queue, &job, 0) != pdPASS)
-    if (VERBOSE)
-      ESP_LOGW(TAG, "Queue full, dropping job");
+void read_bms_freertos_task(void *arg) {
+  while (true) {
+    int64_t next_read_at = INT64_MAX;
+    for (int i = 0; i < BMS_N_PACKS; i++) {
+      if (esp_timer_get_time() >= schedule[i].next_read_at)
+        read_pack(i);
+      next_read_at = MIN(next_read_at, schedule[i].next_read_at);
+    }
+
+    int64_t wait = next_read_at - esp_timer_get_time();
+    prof_checkin(MAX(wait / 1000, 0));
+    if (wait > 0)
+      vTaskDelay(pdMS_TO_TICKS(wait / 1000) + 1);
+  }
 }
 
-void start_read_data_timed_task() {
-  read_data_timer = xTimerCreate("read_data_timer", pdMS_TO_TICKS(5000), pdTRUE,
-                                 NULL, read_data_callback);
-  assert(read_data_timer);
-  xTimerStart(read_data_timer, 0);
+void start_read_bms_task() {
+  xTaskCreate(read_bms_freertos_task, "read_bms_freertos_task", 2560, NULL, 4,
+              NULL);
 }
@@ -0,0 +1,136 @@
+#include "CHANGE.h"
+
+#include "PARAM.h"
+#include "TASK.h"
+#include "config.h"
+#include "global.h"
+
+#include <stdlib.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+static const char *TAG = "CHANGE";
+
+// what was last sent to each destination for each battery pack, and when. the
+// periodic send jobs still run on their timers, but only send when a field has
+// moved by more than its deadband (see SCHEMA_FIELDS) since then, or when the
+// heartbeat period is up. the acquisition tasks call `change_check` after every
+// reading so that a significant change goes out straight away rather than on
+// the next tick
+typedef struct {
+  bool sent;    // false until something has been sent, or after a reset
+  bool pending; // a send job has been queued by `change_check`
+  int64_t sent_at;
+  report_t last;
+} destination_state_t;
+
+static destination_state_t destinations[N_DESTINATIONS][BMS_N_PACKS] = {0};
+static portMUX_TYPE destinations_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static const job_type_t destination_jobs[N_DESTINATIONS] = {
+    [DESTINATION_BROWSER] = JOB_WS_SEND,
+    [DESTINATION_SERVER] = JOB_WS_SEND,
+    [DESTINATION_MESH] = JOB_MESH_WS_SEND,
+    [DESTINATION_RADIO] = JOB_LORA_TRANSMIT,
+};
+
+static bool is_significant(const report_t *last, const report_t *report) {
+  for (int i = 0; i < N_FIELDS; i++) {
+    const field_info_t *info = &field_info[i];
+    if (info->deadband == SCHEMA_NEVER)
+      continue;
+
+    int64_t change = llabs((int64_t)report->values[i] - last->values[i]);
+    int64_t deadband = llabs((int64_t)last->values[i]) *
+                       info->relative_deadband / 1000;
+    if (deadband < info->deadband)
+      deadband = info->deadband;
+    if (change >= deadband)
+      return true;
+  }
+
+  return false;
+}
+
+// call with `destinations_lock` held
+static bool is_due(const destination_state_t *state, const report_t *report) {
+  if (!REPORT_ON_CHANGE || !state->sent)
+    return true;
+
+  if (esp_timer_get_time() - state->sent_at >=
+      (int64_t)param_get(PARAM_HEARTBEAT) * 1000)
+    return true;
+
+  return is_significant(&state->last, report);
+}
+
+bool change_is_due(destination_t destination, uint8_t pack,
+                   const report_t *report) {
+  taskENTER_CRITICAL(&destinations_lock);
+  destination_state_t *state = &destinations[destination][pack];
+  state->pending = false;
+  bool due = is_due(state, report);
+  taskEXIT_CRITICAL(&destinations_lock);
+
+  return due;
+}
+
+void change_mark_sent(destination_t destination, uint8_t pack,
+                      const report_t *report) {
+  taskENTER_CRITICAL(&destinations_lock);
+  destination_state_t *state = &destinations[destination][pack];
+  state->sent = true;
+  state->sent_at = esp_timer_get_time();
+  state->last = *report;
+  taskEXIT_CRITICAL(&destinations_lock);
+}
+
+void change_reset(destination_t destination) {
+  // e.g. when a destination (dis)connects: its next check is due, and it
+  // isn't woken up by changes until something has been sent to it again
+  taskENTER_CRITICAL(&destinations_lock);
+  for (int i = 0; i < BMS_N_PACKS; i++)
+    destinations[destination][i].sent = false;
+  taskEXIT_CRITICAL(&destinations_lock);
+}
+
+void change_check() {
+  if (!REPORT_ON_CHANGE)
+    return;
+
+  bool queued[N_JOB_TYPES] = {false};
+  for (int pack = 0; pack < BMS_N_PACKS; pack++) {
+    report_t report;
+    if (!codec_read_pack(pack, &report))
+      continue; // offline
+
+    for (int i = 0; i < N_DESTINATIONS; i++) {
+      taskENTER_CRITICAL(&destinations_lock);
+      destination_state_t *state = &destinations[i][pack];
+      // only destinations which are being sent to, i.e. which have been sent
+      // something since they were last reset
+      bool wake = state->sent && !state->pending &&
+                  is_significant(&state->last, &report);
+      if (wake)
+        state->pending = true;
+      taskEXIT_CRITICAL(&destinations_lock);
+
+      job_type_t type = destination_jobs[i];
+      if (!wake || queued[type])
+        continue;
+
+      job_t job = {.type = type};
+      if (xQueueSend(job_queue, &job, 0) == pdPASS) {
+        queued[type] = true;
+      } else {
+        if (VERBOSE)
+          ESP_LOGW(TAG, "Queue full, dropping job");
+        taskENTER_CRITICAL(&destinations_lock);
+        state->pending = false;
+        taskEXIT_CRITICAL(&destinations_lock);
+      }
+    }
+  }
+}
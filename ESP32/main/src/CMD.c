@@ -0,0 +1,795 @@
+#include "CMD.h"
+
+#include "BMS.h"
+#include "CHANGE.h"
+#include "CODEC.h"
+#include "DATA.h"
+#include "FLASH.h"
+#include "I2C.h"
+#include "LoRa.h"
+#include "MESH.h"
+#include "PARAM.h"
+#include "STATE.h"
+#include "TASK.h"
+#include "UPLINK.h"
+#include "WS.h"
+#include "config.h"
+#include "global.h"
+#include "utils.h"
+
+#include <string.h>
+
+#include "driver/gpio.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "nvs_flash.h"
+
+static const char *TAG = "CMD";
+
+// commands run as small state machines on the job worker rather than blocking
+// it: each step does its part and says when the next one is due, and
+// `cmd_timer` queues a `JOB_CMD_STEP` for then, so that telemetry, radio and
+// mesh jobs run in between. commands which use the same resource wait for one
+// another, first come first served, and the response goes back to wherever the
+// command came from once it is done
+typedef enum {
+  CMD_RESOURCE_NONE,
+  CMD_RESOURCE_BMS,
+  CMD_RESOURCE_WIFI,
+  N_CMD_RESOURCES // keep last
+} cmd_resource_t;
+
+static const struct {
+  const char *summary;
+  cmd_resource_t resource;
+} kinds[N_CMD_KINDS] = {
+    [CMD_QUERY] = {"query", CMD_RESOURCE_NONE},
+    [CMD_CHANGE_SETTINGS] = {"change-settings", CMD_RESOURCE_BMS},
+    [CMD_CONNECT_WIFI] = {"connect-wifi", CMD_RESOURCE_WIFI},
+    [CMD_RESET_BMS] = {"reset-bms", CMD_RESOURCE_BMS},
+    [CMD_UNSEAL_BMS] = {"unseal-bms", CMD_RESOURCE_BMS},
+    [CMD_FLIP_INVERTER] = {"flip-inverter", CMD_RESOURCE_NONE},
+    [CMD_SET_PARAMS] = {"set-params", CMD_RESOURCE_NONE},
+};
+
+// as in the change-settings request
+static const char *setting_keys[N_FLASH_SETTINGS] = {
+    [FLASH_DEVICE_NAME] = "new_esp_id",
+    [FLASH_OTC_THRESHOLD] = "OTC",
+};
+
+static const char *status_names[N_CMD_STATUSES] = {
+    [CMD_STATUS_SUCCESS] = "success",
+    [CMD_STATUS_ERROR] = "error",
+    [CMD_STATUS_BUSY] = "busy",
+};
+
+// how many commands may use each resource at once
+static const uint8_t resource_limits[N_CMD_RESOURCES] = {
+    [CMD_RESOURCE_NONE] = CMD_MAX_PENDING,
+    [CMD_RESOURCE_BMS] = 1,
+    [CMD_RESOURCE_WIFI] = 1,
+};
+
+#define CMD_WIFI_SETTLE_MS 5000 // before the first check for a connection
+#define CMD_WIFI_RETRY_MS 1000
+#define CMD_WIFI_MAX_TRIES 10
+
+typedef struct {
+  bool used;
+  bool started;
+  uint32_t order; // of submission
+  cmd_kind_t kind;
+  cmd_origin_t origin;
+  int fd;         // of the browser, for `CMD_ORIGIN_BROWSER`
+  uint8_t esp_id; // when the command was made
+  uint8_t step;
+  uint8_t tries;
+  uint8_t failed;  // as in `cmd_response_t`
+  int64_t wake_at; // us since boot
+  // copied out of the request, as its cJSON doesn't outlive the job
+  union {
+    struct {
+      uint8_t new_esp_id; // 0 to leave it
+      bool change_OTC;
+      uint16_t OTC;
+    } settings;
+    struct {
+      char ssid[33];
+      char password[65];
+      bool auto_connect;
+    } wifi;
+    bool inverter_enabled;
+    struct {
+      uint8_t n;
+      uint8_t ids[PARAM_MAX_PER_REQUEST]; // param_id_t
+      int32_t values[PARAM_MAX_PER_REQUEST];
+    } config;
+  } params;
+} command_t;
+
+static command_t commands[CMD_MAX_PENDING] = {0};
+static uint32_t next_order = 0;
+static portMUX_TYPE cmd_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// responses waiting for the ROOT's next radio transmission, either its own or
+// those of its mesh nodes
+#define CMD_RADIO_QUEUE_LEN (CMD_MAX_PENDING + MESH_SIZE)
+static cmd_response_t radio_responses[CMD_RADIO_QUEUE_LEN];
+static uint8_t n_radio_responses = 0;
+
+static TimerHandle_t cmd_timer = NULL;
+
+static void queue_step() {
+  // with the queue full, the timer tries again shortly rather than leave the
+  // commands in progress stuck until something else queues a step
+  job_t job = {.type = JOB_CMD_STEP};
+  if (xQueueSend(job_queue, &job, 0) == pdPASS)
+    return;
+  if (VERBOSE)
+    ESP_LOGW(TAG, "Queue full, retrying step in %d ms", CMD_RETRY_MS);
+  if (cmd_timer != NULL)
+    xTimerChangePeriod(cmd_timer, pdMS_TO_TICKS(CMD_RETRY_MS), 0);
+}
+
+static void cmd_timer_callback(TimerHandle_t xTimer) { queue_step(); }
+
+void cmd_init() {
+  cmd_timer = xTimerCreate("cmd_timer", pdMS_TO_TICKS(1000), pdFALSE, NULL,
+                           cmd_timer_callback);
+  assert(cmd_timer);
+}
+
+size_t cmd_write_response(const cmd_response_t *response, char *out,
+                          size_t size) {
+  int length;
+  if (response->kind == CMD_QUERY && response->status == CMD_STATUS_SUCCESS) {
+    length = snprintf(out, size,
+                      "{\"type\":\"response\",\"esp_id\":%u,"
+                      "\"content\":{\"response\":\"yes\"}}",
+                      response->esp_id);
+  } else {
+    // the settings which weren't changed, if any
+    char failed[48] = "";
+    size_t failed_length = 0;
+    for (int i = 0; i < N_FLASH_SETTINGS; i++) {
+      if (!(response->failed & (1 << i)))
+        continue;
+      failed_length += snprintf(
+          &failed[failed_length], sizeof(failed) - failed_length, "%s\"%s\"",
+          failed_length == 0 ? ",\"failed\":[" : ",", setting_keys[i]);
+    }
+    if (failed_length > 0)
+      snprintf(&failed[failed_length], sizeof(failed) - failed_length, "]");
+
+    length = snprintf(out, size,
+                      "{\"type\":\"response\",\"esp_id\":%u,"
+                      "\"content\":{\"summary\":\"%s\",\"status\":\"%s\""
+                      "%s}}",
+                      response->esp_id, kinds[response->kind].summary,
+                      status_names[response->status], failed);
+  }
+
+  if (length < 0 || (size_t)length >= size)
+    return 0;
+  return length;
+}
+
+void cmd_add_to_json(const cmd_response_t *response, cJSON *content) {
+  if (response->kind == CMD_QUERY && response->status == CMD_STATUS_SUCCESS) {
+    cJSON_AddStringToObject(content, "response", "yes");
+    return;
+  }
+  cJSON_AddStringToObject(content, "summary", kinds[response->kind].summary);
+  cJSON_AddStringToObject(content, "status", status_names[response->status]);
+  if (response->failed == 0)
+    return;
+  cJSON *failed = cJSON_AddArrayToObject(content, "failed");
+  for (int i = 0; i < N_FLASH_SETTINGS; i++)
+    if (response->failed & (1 << i))
+      cJSON_AddItemToArray(failed, cJSON_CreateString(setting_keys[i]));
+}
+
+static void queue_radio_response(const cmd_response_t *response) {
+  if (!state_is(STATE_ROOT | STATE_LORA)) {
+    ESP_LOGW(TAG, "No radio, dropping %s response for bms_%u",
+             kinds[response->kind].summary, response->esp_id);
+    return;
+  }
+
+  bool stored = false;
+  taskENTER_CRITICAL(&cmd_lock);
+  if (n_radio_responses < CMD_RADIO_QUEUE_LEN) {
+    radio_responses[n_radio_responses++] = *response;
+    stored = true;
+  }
+  taskEXIT_CRITICAL(&cmd_lock);
+
+  if (!stored) {
+    ESP_LOGE(TAG, "No space to send %s response for bms_%u by radio",
+             kinds[response->kind].summary, response->esp_id);
+    return;
+  }
+
+  // `transmit` sends pending responses ahead of the telemetry data
+  job_t job = {.type = JOB_LORA_TRANSMIT};
+  if (xQueueSend(job_queue, &job, 0) != pdPASS)
+    ESP_LOGW(TAG, "Queue full, response will go with the next transmission");
+}
+
+static void reply(const cmd_response_t *response, cmd_origin_t origin,
+                  int fd) {
+  ESP_LOGI(TAG, "%s: %s", kinds[response->kind].summary,
+           status_names[response->status]);
+
+  char message[CMD_RESPONSE_MAX_LEN];
+  if (origin != CMD_ORIGIN_RADIO &&
+      cmd_write_response(response, message, sizeof(message)) == 0)
+    return;
+
+  switch (origin) {
+  case CMD_ORIGIN_BROWSER:
+    send_to_client(fd, message);
+    break;
+
+  case CMD_ORIGIN_UPSTREAM:
+    if (state_is(STATE_ROOT))
+      uplink_send(message);
+    else
+      send_mesh_message(message);
+    break;
+
+  case CMD_ORIGIN_RADIO:
+    queue_radio_response(response);
+    break;
+
+  default:
+    break; // nobody to tell
+  }
+}
+
+static void finish(command_t *command, cmd_status_t status) {
+  cmd_response_t response = {
+      .esp_id = command->esp_id,
+      .kind = command->kind,
+      .status = status,
+      .failed = command->failed,
+  };
+  reply(&response, command->origin, command->fd);
+
+  taskENTER_CRITICAL(&cmd_lock);
+  command->used = false;
+  taskEXIT_CRITICAL(&cmd_lock);
+}
+
+static void wait_for(command_t *command, uint32_t ms) {
+  command->wake_at = esp_timer_get_time() + (int64_t)ms * 1000;
+}
+
+static void new_device_name(const command_t *command, char *name,
+                            size_t size) {
+  snprintf(name, size, "bms_%02u", command->params.settings.new_esp_id);
+}
+
+static void stage_settings(command_t *command) {
+  uint8_t value[FLASH_MAX_SETTING_SIZE] = {0};
+
+  if (command->params.settings.new_esp_id != 0 &&
+      command->params.settings.new_esp_id != ESP_ID) {
+    ESP_LOGI(TAG, "Changing device name...");
+    // construct DeviceName string from ID, padded with zeros
+    char new_id[7];
+    new_device_name(command, new_id, sizeof(new_id));
+    size_t new_id_length = strlen(new_id);
+    value[0] = new_id_length;
+    memcpy(&value[1], new_id, new_id_length);
+    if (flash_set(BMS_PRIMARY_PACK, FLASH_DEVICE_NAME, value) != ESP_OK)
+      command->failed |= 1 << FLASH_DEVICE_NAME;
+  }
+
+  if (command->params.settings.change_OTC) {
+    convert_uint_to_n_bytes(command->params.settings.OTC, value,
+                            flash_setting_size(FLASH_OTC_THRESHOLD), false);
+    if (flash_set(BMS_PRIMARY_PACK, FLASH_OTC_THRESHOLD, value) != ESP_OK)
+      command->failed |= 1 << FLASH_OTC_THRESHOLD;
+  }
+}
+
+static void step_change_settings(command_t *command) {
+  // every change is staged against the cached DataFlash, each changed region
+  // is written in one block, and then all of them are checked with a single
+  // read-back (see `FLASH.c`)
+  switch (command->step) {
+  case 0:
+    stage_settings(command);
+    command->step++;
+    return;
+
+  case 1:
+    if (flash_staged(BMS_PRIMARY_PACK)) {
+      // a failure shows up in the read-back
+      flash_write(BMS_PRIMARY_PACK);
+      // let the gauge commit it before the next DataFlash access
+      wait_for(command, I2C_DATA_FLASH_WRITE_MS);
+    } else {
+      command->step++;
+    }
+    return;
+
+  default:
+    break;
+  }
+
+  esp_err_t results[N_FLASH_SETTINGS];
+  flash_verify(BMS_PRIMARY_PACK, results);
+  for (int i = 0; i < N_FLASH_SETTINGS; i++)
+    if (results[i] != ESP_OK)
+      command->failed |= 1 << i;
+
+  if (command->params.settings.new_esp_id != 0 &&
+      command->params.settings.new_esp_id != ESP_ID &&
+      !(command->failed & (1 << FLASH_DEVICE_NAME))) {
+    // update ESP32 memory
+    char new_id[7];
+    new_device_name(command, new_id, sizeof(new_id));
+    change_esp_id(new_id);
+  }
+
+  finish(command, command->failed ? CMD_STATUS_ERROR : CMD_STATUS_SUCCESS);
+}
+
+static void step_connect_wifi(command_t *command) {
+  if (command->step == 0) {
+    command->step++;
+    if (state_is(STATE_WIFI)) {
+      finish(command, CMD_STATUS_SUCCESS);
+      return;
+    }
+
+    const char *ssid = command->params.wifi.ssid;
+    const char *password = command->params.wifi.password;
+
+    // overwrite stored values in NVS
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open("WIFI", NVS_READWRITE, &nvs);
+    if (err != ESP_OK) {
+      ESP_LOGW(TAG, "Could not open NVS namespace for writing");
+    } else {
+      nvs_set_str(nvs, "SSID", ssid);
+      nvs_set_str(nvs, "PASSWORD", password);
+      nvs_set_u8(nvs, "AUTO_CONNECT", command->params.wifi.auto_connect);
+      nvs_commit(nvs);
+      nvs_close(nvs);
+    }
+    state_assign(STATE_AUTO_CONNECT, command->params.wifi.auto_connect);
+
+    wifi_config_t wifi_sta_config = {0};
+    strncpy((char *)wifi_sta_config.sta.ssid, ssid,
+            sizeof(wifi_sta_config.sta.ssid) - 1);
+    if (strlen(password) == 0) {
+      wifi_sta_config.ap.authmode = WIFI_AUTH_OPEN;
+    } else {
+      strncpy((char *)wifi_sta_config.sta.password, password,
+              sizeof(wifi_sta_config.sta.password) - 1);
+    }
+    ESP_LOGI(TAG, "Connecting to AP... SSID: %s", wifi_sta_config.sta.ssid);
+
+    err = esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_sta_config);
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "Failed to set Wi-Fi config: %s", esp_err_to_name(err));
+      finish(command, CMD_STATUS_ERROR);
+      return;
+    }
+
+    // give some time to connect
+    wait_for(command, CMD_WIFI_SETTLE_MS);
+    return;
+  }
+
+  if (command->tries > CMD_WIFI_MAX_TRIES) {
+    ESP_LOGW(TAG, "Could not connect to %s", command->params.wifi.ssid);
+    finish(command, CMD_STATUS_ERROR);
+    return;
+  }
+
+  // the IP event sets this once the router has given an address
+  if (state_is(STATE_WIFI)) {
+    wifi_ap_record_t ap_info;
+    if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK)
+      ESP_LOGI(TAG, "Connected to router. Signal strength: %d dBm",
+               ap_info.rssi);
+    finish(command, CMD_STATUS_SUCCESS);
+    return;
+  }
+  if (!state_is(STATE_STA_LINK)) {
+    if (VERBOSE)
+      ESP_LOGI(TAG, "Not connected. Retrying... %d", command->tries);
+    esp_wifi_connect();
+  }
+  command->tries++;
+
+  wait_for(command, CMD_WIFI_RETRY_MS);
+}
+
+static void step_seal_command(command_t *command) {
+  if (command->step++ == 0) {
+    esp_err_t err = command->kind == CMD_RESET_BMS ? reset(BMS_PRIMARY_PACK)
+                                                   : unseal(BMS_PRIMARY_PACK);
+    if (err != ESP_OK) {
+      finish(command, CMD_STATUS_ERROR);
+      return;
+    }
+
+    // allow the command to complete
+    wait_for(command, I2C_DELAY);
+    return;
+  }
+
+  if (command->kind == CMD_RESET_BMS)
+    flash_invalidate(BMS_PRIMARY_PACK); // read it afresh
+
+  int8_t status = get_sealed_status(BMS_PRIMARY_PACK);
+  if (command->kind == CMD_RESET_BMS && status == 0)
+    ESP_LOGI(TAG, "Reset command sent successfully.");
+  else if (command->kind == CMD_UNSEAL_BMS && status == 1)
+    ESP_LOGI(TAG, "Unseal command sent successfully.");
+  finish(command, CMD_STATUS_SUCCESS);
+}
+
+static void step_flip_inverter(command_t *command) {
+  if (command->params.inverter_enabled) {
+    gpio_set_level(INV_EN_GPIO, 0);
+    data_set_inverter_enabled(false);
+  } else {
+    gpio_set_level(INV_EN_GPIO, 1);
+    data_set_inverter_enabled(true);
+  }
+  change_check();
+  finish(command, CMD_STATUS_SUCCESS);
+}
+
+static void step_set_params(command_t *command) {
+  // already checked, so all of them take
+  for (int i = 0; i < command->params.config.n; i++)
+    param_set(command->params.config.ids[i], command->params.config.values[i]);
+  finish(command, CMD_STATUS_SUCCESS);
+}
+
+static void run_step(command_t *command) {
+  switch (command->kind) {
+  case CMD_QUERY:
+    finish(command, CMD_STATUS_SUCCESS);
+    break;
+
+  case CMD_CHANGE_SETTINGS:
+    step_change_settings(command);
+    break;
+
+  case CMD_CONNECT_WIFI:
+    step_connect_wifi(command);
+    break;
+
+  case CMD_RESET_BMS:
+  case CMD_UNSEAL_BMS:
+    step_seal_command(command);
+    break;
+
+  case CMD_FLIP_INVERTER:
+    step_flip_inverter(command);
+    break;
+
+  case CMD_SET_PARAMS:
+    step_set_params(command);
+    break;
+
+  default:
+    finish(command, CMD_STATUS_ERROR);
+    break;
+  }
+}
+
+static bool parse(const cJSON *message, command_t *command) {
+  // false if the message isn't a command at all. otherwise `command->kind` is
+  // filled in, and `command->step` is left at 0 only if the command is valid
+  cJSON *type = cJSON_GetObjectItem(message, "type");
+  cJSON *content = cJSON_GetObjectItem(message, "content");
+  if (!cJSON_IsString(type) || !content) {
+    ESP_LOGE(TAG, "Error in request message");
+    return false;
+  }
+
+  if (strcmp(type->valuestring, "query") == 0) {
+    command->kind = CMD_QUERY;
+    return cJSON_IsString(content) &&
+           strcmp(content->valuestring, "are you still there?") == 0;
+  }
+  if (strcmp(type->valuestring, "request") != 0)
+    return false;
+
+  cJSON *summary = cJSON_GetObjectItem(content, "summary");
+  if (!cJSON_IsString(summary))
+    return false;
+  int kind = 0;
+  while (kind < N_CMD_KINDS &&
+         strcmp(summary->valuestring, kinds[kind].summary) != 0)
+    kind++;
+  if (kind == CMD_QUERY || kind == N_CMD_KINDS)
+    return false;
+  command->kind = kind;
+
+  cJSON *data = cJSON_GetObjectItem(content, "data");
+  if (kind == CMD_CHANGE_SETTINGS) {
+    cJSON *new_esp_id = cJSON_GetObjectItem(data, "new_esp_id");
+    cJSON *OTC = cJSON_GetObjectItem(data, "OTC");
+    if (cJSON_IsNumber(new_esp_id))
+      command->params.settings.new_esp_id = new_esp_id->valueint;
+    command->params.settings.change_OTC = cJSON_IsNumber(OTC);
+    if (cJSON_IsNumber(OTC))
+      command->params.settings.OTC = OTC->valueint;
+    command->step = data ? 0 : 1;
+  } else if (kind == CMD_CONNECT_WIFI) {
+    cJSON *ssid = cJSON_GetObjectItem(data, "ssid");
+    cJSON *password = cJSON_GetObjectItem(data, "password");
+    cJSON *auto_connect = cJSON_GetObjectItem(data, "auto_connect");
+    if (cJSON_IsString(ssid) && cJSON_IsString(password)) {
+      strncpy(command->params.wifi.ssid, ssid->valuestring,
+              sizeof(command->params.wifi.ssid) - 1);
+      strncpy(command->params.wifi.password, password->valuestring,
+              sizeof(command->params.wifi.password) - 1);
+      command->params.wifi.auto_connect = cJSON_IsTrue(auto_connect);
+    } else {
+      command->step = 1;
+    }
+  } else if (kind == CMD_FLIP_INVERTER) {
+    cJSON *is_enabled = cJSON_GetObjectItem(data, "is-enabled");
+    if (cJSON_IsNumber(is_enabled) || cJSON_IsBool(is_enabled))
+      command->params.inverter_enabled =
+          cJSON_IsTrue(is_enabled) || is_enabled->valueint != 0;
+    else
+      command->step = 1;
+  } else if (kind == CMD_SET_PARAMS) {
+    // every setting has to be known and in range, or none of them is changed
+    if (!cJSON_IsObject(data)) {
+      command->step = 1;
+      return true;
+    }
+    cJSON *setting = NULL;
+    cJSON_ArrayForEach(setting, data) {
+      if (setting->string == NULL)
+        continue;
+      int id = param_find(setting->string);
+      uint8_t n = command->params.config.n;
+      if (id < 0 || !cJSON_IsNumber(setting) ||
+          !param_valid(id, setting->valueint) || n == PARAM_MAX_PER_REQUEST) {
+        ESP_LOGW(TAG, "Can't set %s", setting->string);
+        command->step = 1;
+        break;
+      }
+      command->params.config.ids[n] = id;
+      command->params.config.values[n] = setting->valueint;
+      command->params.config.n++;
+    }
+    if (command->params.config.n == 0)
+      command->step = 1;
+  }
+
+  return true;
+}
+
+esp_err_t cmd_submit(const cJSON *message, cmd_origin_t origin, int fd) {
+  // may be called from the web server's task as well as the job worker, so
+  // the command is only ever run by `cmd_step`
+  command_t command = {
+      .used = true,
+      .origin = origin,
+      .fd = fd,
+      .esp_id = ESP_ID,
+  };
+  if (!parse(message, &command))
+    return ESP_ERR_NOT_SUPPORTED;
+
+  cmd_response_t response = {.esp_id = ESP_ID, .kind = command.kind};
+  if (command.step != 0) {
+    ESP_LOGE(TAG, "Failed to parse %s request", kinds[command.kind].summary);
+    response.status = CMD_STATUS_ERROR;
+    reply(&response, origin, fd);
+    return ESP_FAIL;
+  }
+
+  bool stored = false;
+  taskENTER_CRITICAL(&cmd_lock);
+  for (int i = 0; i < CMD_MAX_PENDING && !stored; i++) {
+    if (!commands[i].used) {
+      command.order = next_order++;
+      commands[i] = command;
+      stored = true;
+    }
+  }
+  taskEXIT_CRITICAL(&cmd_lock);
+
+  if (!stored) {
+    ESP_LOGW(TAG, "Too many commands waiting, rejecting %s",
+             kinds[command.kind].summary);
+    response.status = CMD_STATUS_BUSY;
+    reply(&response, origin, fd);
+    return ESP_ERR_NO_MEM;
+  }
+
+  queue_step();
+  return ESP_OK;
+}
+
+bool cmd_pending(cmd_kind_t kind) {
+  bool pending = false;
+  taskENTER_CRITICAL(&cmd_lock);
+  for (int i = 0; i < CMD_MAX_PENDING; i++)
+    pending |= commands[i].used && commands[i].kind == kind;
+  taskEXIT_CRITICAL(&cmd_lock);
+
+  return pending;
+}
+
+static bool start_waiting() {
+  // start the oldest waiting command for each resource which has room
+  bool started = false;
+  taskENTER_CRITICAL(&cmd_lock);
+  uint8_t in_use[N_CMD_RESOURCES] = {0};
+  for (int i = 0; i < CMD_MAX_PENDING; i++)
+    if (commands[i].used && commands[i].started)
+      in_use[kinds[commands[i].kind].resource]++;
+
+  while (true) {
+    command_t *oldest = NULL;
+    for (int i = 0; i < CMD_MAX_PENDING; i++) {
+      command_t *command = &commands[i];
+      cmd_resource_t resource = kinds[command->kind].resource;
+      if (!command->used || command->started ||
+          in_use[resource] >= resource_limits[resource])
+        continue;
+      if (oldest == NULL || (int32_t)(command->order - oldest->order) < 0)
+        oldest = command;
+    }
+    if (oldest == NULL)
+      break;
+
+    oldest->started = true;
+    oldest->wake_at = 0;
+    in_use[kinds[oldest->kind].resource]++;
+    started = true;
+  }
+  taskEXIT_CRITICAL(&cmd_lock);
+
+  return started;
+}
+
+void cmd_step() {
+  // only ever called from the job worker
+  bool progress = true;
+  while (progress) {
+    progress = start_waiting();
+
+    int64_t now = esp_timer_get_time();
+    for (int i = 0; i < CMD_MAX_PENDING; i++) {
+      taskENTER_CRITICAL(&cmd_lock);
+      bool due = commands[i].used && commands[i].started &&
+                 commands[i].wake_at <= now;
+      taskEXIT_CRITICAL(&cmd_lock);
+      if (!due)
+        continue;
+
+      run_step(&commands[i]);
+      progress = true;
+    }
+  }
+
+  // come back when the next command is due
+  int64_t wake_at = INT64_MAX;
+  taskENTER_CRITICAL(&cmd_lock);
+  for (int i = 0; i < CMD_MAX_PENDING; i++)
+    if (commands[i].used && commands[i].started)
+      wake_at = MIN(wake_at, commands[i].wake_at);
+  taskEXIT_CRITICAL(&cmd_lock);
+
+  if (wake_at == INT64_MAX || cmd_timer == NULL) {
+    if (cmd_timer != NULL)
+      xTimerStop(cmd_timer, 0);
+    return;
+  }
+  int64_t remaining = wake_at - esp_timer_get_time();
+  xTimerChangePeriod(cmd_timer, pdMS_TO_TICKS(MAX(remaining, 0) / 1000) + 1,
+                     0);
+}
+
+void cmd_forward_response(const cJSON *message) {
+  // a response message from a mesh node, for the ROOT (or a node between it
+  // and the ROOT) to pass on
+  cJSON *esp_id = cJSON_GetObjectItem(message, "esp_id");
+  cJSON *content = cJSON_GetObjectItem(message, "content");
+  if (!cJSON_IsNumber(esp_id) || !cJSON_IsObject(content)) {
+    ESP_LOGE(TAG, "Response message not formatted properly");
+    return;
+  }
+
+  cmd_response_t response = {.esp_id = esp_id->valueint, .kind = CMD_QUERY};
+  cJSON *summary = cJSON_GetObjectItem(content, "summary");
+  cJSON *status = cJSON_GetObjectItem(content, "status");
+  if (cJSON_IsString(summary)) {
+    int kind = 0;
+    while (kind < N_CMD_KINDS &&
+           strcmp(summary->valuestring, kinds[kind].summary) != 0)
+      kind++;
+    if (kind == N_CMD_KINDS)
+      return;
+    response.kind = kind;
+  }
+  response.status = CMD_STATUS_SUCCESS;
+  for (int i = 0; i < N_CMD_STATUSES && cJSON_IsString(status); i++)
+    if (strcmp(status->valuestring, status_names[i]) == 0)
+      response.status = i;
+  cJSON *failed = cJSON_GetObjectItem(content, "failed");
+  cJSON *key = NULL;
+  cJSON_ArrayForEach(key, failed) {
+    for (int i = 0; i < N_FLASH_SETTINGS && cJSON_IsString(key); i++)
+      if (strcmp(key->valuestring, setting_keys[i]) == 0)
+        response.failed |= 1 << i;
+  }
+
+  // a node relays it to its own parent
+  reply(&response,
+        state_is(STATE_WIFI) || !state_is(STATE_ROOT) ? CMD_ORIGIN_UPSTREAM
+                                                      : CMD_ORIGIN_RADIO,
+        -1);
+}
+
+bool cmd_radio_pending() {
+  taskENTER_CRITICAL(&cmd_lock);
+  bool pending = n_radio_responses > 0;
+  taskEXIT_CRITICAL(&cmd_lock);
+
+  return pending;
+}
+
+size_t cmd_pack_pending(uint8_t *binary_message) {
+  // every pending response in one radio message, laid out as `json_to_binary`
+  // does
+  size_t packet_start = 1; // after first byte n_responses
+  taskENTER_CRITICAL(&cmd_lock);
+  uint8_t n_responses = n_radio_responses;
+  for (int i = 0; i < n_responses; i++) {
+    uint8_t *packet = &binary_message[packet_start];
+#define PUT(member, value)                                                     \
+  CODEC_PUT_MEMBER(packet, radio_response_packet, member, value)
+    PUT(type, RESPONSE);
+    PUT(esp_id, radio_responses[i].esp_id);
+    PUT(command, radio_responses[i].kind);
+    PUT(status, radio_responses[i].status);
+    PUT(failed, radio_responses[i].failed);
+#undef PUT
+    packet_start += sizeof(radio_response_packet);
+  }
+  n_radio_responses = 0;
+  taskEXIT_CRITICAL(&cmd_lock);
+
+  if (n_responses == 0)
+    return 0;
+
+  binary_message[0] = n_responses;
+  return packet_start;
+}
+
+size_t cmd_unpack(const uint8_t *packet, cmd_response_t *response) {
+#define GET(member) CODEC_GET_MEMBER(packet, radio_response_packet, member)
+  uint8_t command = GET(command);
+  uint8_t status = GET(status);
+  *response = (cmd_response_t){
+      .esp_id = GET(esp_id),
+      .kind = command < N_CMD_KINDS ? command : CMD_QUERY,
+      .status = status < N_CMD_STATUSES ? status : CMD_STATUS_ERROR,
+      .failed = GET(failed),
+  };
+#undef GET
+
+  return sizeof(radio_response_packet);
+}
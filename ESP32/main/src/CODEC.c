@@ -0,0 +1,317 @@
+#include "CODEC.h"
+
+#include "LoRa.h"
+#include "STATE.h"
+#include "config.h"
+#include "global.h"
+#include "utils.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "esp_log.h"
+
+static const char *TAG = "CODEC";
+
+// conversions named in SCHEMA_FIELDS, from a reading to the whole number of
+// 10^-ndp units it is reported in
+static int32_t as_is(int32_t value) { return value; }
+
+static int32_t milli_to_tenths(int32_t milli) {
+  return divide_and_round(milli, 100);
+}
+
+static int32_t milli_to_hundredths(int32_t milli) {
+  return divide_and_round(milli, 10);
+}
+
+static int32_t deci_kelvin_to_hundredths(int32_t deci_kelvin) {
+  // 0.1 K → 0.01 °C is exact
+  return deci_kelvin * 10 - 27315;
+}
+
+static int32_t deci_kelvin_to_tenths(int32_t deci_kelvin) {
+  return divide_and_round(deci_kelvin_to_hundredths(deci_kelvin), 10);
+}
+
+static int32_t to_hundredths(float value) { return lround(value * 100.0); }
+
+static int32_t to_millionths(float value) { return lround(value * 1e6); }
+
+#define SCHEMA_READ_BMS(snapshot, member) ((snapshot)->telemetry.member)
+#define SCHEMA_READ_GPS(snapshot, member) ((snapshot)->gps.member)
+#define SCHEMA_READ_INV(snapshot, member) ((snapshot)->inverter.member)
+#define SCHEMA_READ_WIFI(snapshot, member) (state_is(STATE_WIFI))
+
+const field_info_t field_info[N_FIELDS] = {
+#define X(key, source, member, type, wire_type, conversion, ndp, scaled,      \
+          format, deadband, relative_deadband)                                 \
+  [FIELD_##key] = {#key,                                                       \
+                   ndp,                                                        \
+                   scaled,                                                     \
+                   FORMAT_##format,                                            \
+                   offsetof(radio_data_packet, key),                           \
+                   sizeof(wire_type),                                          \
+                   CODEC_IS_SIGNED(wire_type),                                 \
+                   deadband,                                                   \
+                   relative_deadband},
+    SCHEMA_FIELDS(X)
+#undef X
+};
+
+static const int32_t powers_of_ten[] = {1,      10,      100,     1000,
+                                        10000,  100000,  1000000, 10000000,
+                                        100000000};
+
+const field_info_t *codec_find_field(const char *key) {
+  for (int i = 0; i < N_FIELDS; i++) {
+    if (strcmp(field_info[i].key, key) == 0)
+      return &field_info[i];
+  }
+
+  return NULL;
+}
+
+void codec_from_snapshot(const data_snapshot_t *snapshot, uint8_t esp_id,
+                         report_t *report) {
+  report->esp_id = esp_id;
+#define X(key, source, member, type, wire_type, conversion, ...)              \
+  report->values[FIELD_##key] =                                                \
+      conversion(SCHEMA_READ_##source(snapshot, member));
+  SCHEMA_FIELDS(X)
+#undef X
+}
+
+void codec_read_latest(report_t *report) {
+  // take one coherent copy of the latest sample so that all of the fields
+  // come from the same readings
+  data_snapshot_t snapshot;
+  data_read_snapshot(&snapshot);
+  codec_from_snapshot(&snapshot, ESP_ID, report);
+}
+
+bool codec_read_pack(uint8_t pack, report_t *report) {
+  data_snapshot_t snapshot;
+  uint8_t esp_id = ESP_ID;
+  if (!data_read_pack(pack, &snapshot, &esp_id))
+    return false;
+
+  codec_from_snapshot(&snapshot, esp_id, report);
+  return true;
+}
+
+bool codec_from_json(const cJSON *message, report_t *report) {
+  cJSON *esp_id = cJSON_GetObjectItem(message, "esp_id");
+  if (!esp_id) {
+    ESP_LOGE(TAG, "No \"esp_id\" key in data message");
+    return false;
+  }
+  cJSON *content = cJSON_GetObjectItem(message, "content");
+  if (!content) {
+    ESP_LOGE(TAG, "No \"content\" key in data message");
+    return false;
+  }
+
+  report->esp_id = esp_id->valueint;
+  for (int i = 0; i < N_FIELDS; i++) {
+    const field_info_t *info = &field_info[i];
+    cJSON *item = cJSON_GetObjectItem(content, info->key);
+    if (cJSON_IsBool(item))
+      report->values[i] = cJSON_IsTrue(item);
+    else if (cJSON_IsNumber(item))
+      report->values[i] =
+          lround(item->valuedouble *
+                 (info->scaled ? 1 : powers_of_ten[info->ndp]));
+    else
+      report->values[i] = 0; // missing fields are sent as zero
+  }
+
+  return true;
+}
+
+static bool append(char **cursor, const char *end, const char *text) {
+  size_t len = strlen(text);
+  // always leave room for the terminator
+  if (len >= (size_t)(end - *cursor))
+    return false;
+  memcpy(*cursor, text, len);
+  *cursor += len;
+  return true;
+}
+
+static bool append_number(char **cursor, const char *end, const char *key,
+                          int32_t value, uint8_t ndp, bool first) {
+  char number[16];
+  format_fixed(number, value, ndp);
+  return (first || append(cursor, end, ",")) && append(cursor, end, "\"") &&
+         append(cursor, end, key) && append(cursor, end, "\":") &&
+         append(cursor, end, number);
+}
+
+size_t codec_write_json(const report_t *report, char *out, size_t size,
+                        bool for_frontend) {
+  return codec_write_fields(report, CODEC_ALL_FIELDS, out, size, for_frontend);
+}
+
+size_t codec_write_fields(const report_t *report, uint64_t fields, char *out,
+                          size_t size, bool for_frontend) {
+  // the same JSON as building it with cJSON and printing it unformatted
+  // would give, but written straight from the integers into the buffer. only
+  // the fields with their bit set in `fields` are included
+  char *cursor = out;
+  const char *end = out + size;
+
+  bool ok = append(&cursor, end, "{") &&
+            append_number(&cursor, end, "esp_id", report->esp_id, 0, true) &&
+            append(&cursor, end, ",\"type\":\"data\",\"content\":{") &&
+            append_number(&cursor, end, "esp_id", report->esp_id, 0, true);
+
+  for (int i = 0; ok && i < N_FIELDS; i++) {
+    const field_info_t *info = &field_info[i];
+    if (!(fields & CODEC_FIELD_BIT(i)))
+      continue;
+    if (info->format == FORMAT_BOOL) {
+      ok = append(&cursor, end, ",\"") && append(&cursor, end, info->key) &&
+           append(&cursor, end, "\":") &&
+           append(&cursor, end, report->values[i] ? "true" : "false");
+    } else {
+      uint8_t ndp = for_frontend || !info->scaled ? info->ndp : 0;
+      ok = append_number(&cursor, end, info->key, report->values[i], ndp,
+                         false);
+    }
+  }
+
+  if (!ok || !append(&cursor, end, "}}")) {
+    ESP_LOGE(TAG, "Data message doesn't fit in %zu bytes", size);
+    if (size > 0)
+      out[0] = '\0';
+    return 0;
+  }
+
+  *cursor = '\0';
+  return cursor - out;
+}
+
+size_t codec_write_keys(char *out, size_t size) {
+  // those of the values `codec_write_row` writes, in the same order
+  char *cursor = out;
+  const char *end = out + size;
+
+  bool ok = append(&cursor, end, "[\"esp_id\"");
+  for (int i = 0; ok && i < N_FIELDS; i++)
+    ok = append(&cursor, end, ",\"") &&
+         append(&cursor, end, field_info[i].key) && append(&cursor, end, "\"");
+
+  if (!ok || !append(&cursor, end, "]")) {
+    ESP_LOGE(TAG, "Keys don't fit in %zu bytes", size);
+    if (size > 0)
+      out[0] = '\0';
+    return 0;
+  }
+
+  *cursor = '\0';
+  return cursor - out;
+}
+
+size_t codec_write_row(const report_t *report, char *out, size_t size) {
+  // the content of `codec_write_json`'s message without the keys, for the
+  // web server to match up with `codec_write_keys`
+  char *cursor = out;
+  const char *end = out + size;
+  char number[16];
+
+  format_fixed(number, report->esp_id, 0);
+  bool ok = append(&cursor, end, "[") && append(&cursor, end, number);
+  for (int i = 0; ok && i < N_FIELDS; i++) {
+    const field_info_t *info = &field_info[i];
+    if (info->format == FORMAT_BOOL) {
+      ok = append(&cursor, end, report->values[i] ? ",true" : ",false");
+    } else {
+      format_fixed(number, report->values[i], info->scaled ? 0 : info->ndp);
+      ok = append(&cursor, end, ",") && append(&cursor, end, number);
+    }
+  }
+
+  if (!ok || !append(&cursor, end, "]")) {
+    ESP_LOGE(TAG, "Data row doesn't fit in %zu bytes", size);
+    if (size > 0)
+      out[0] = '\0';
+    return 0;
+  }
+
+  *cursor = '\0';
+  return cursor - out;
+}
+
+void codec_add_to_json(const report_t *report, cJSON *content) {
+  // as sent to the web server
+  cJSON_AddNumberToObject(content, "esp_id", report->esp_id);
+  for (int i = 0; i < N_FIELDS; i++) {
+    const field_info_t *info = &field_info[i];
+    if (info->format == FORMAT_BOOL)
+      cJSON_AddBoolToObject(content, info->key, report->values[i]);
+    else if (info->scaled)
+      cJSON_AddNumberToObject(content, info->key, report->values[i]);
+    else
+      cJSON_AddNumberToObject(content, info->key,
+                              (double)report->values[i] /
+                                  powers_of_ten[info->ndp]);
+  }
+}
+
+static int32_t clamp_to_wire(const field_info_t *info, int32_t value) {
+  if (info->wire_size >= sizeof(int32_t))
+    return value;
+
+  int32_t max = info->wire_signed ? (1 << (8 * info->wire_size - 1)) - 1
+                                  : (1 << (8 * info->wire_size)) - 1;
+  int32_t min = info->wire_signed ? -max - 1 : 0;
+  return MIN(MAX(value, min), max);
+}
+
+void codec_put_le(uint8_t *out, uint32_t value, uint8_t size) {
+  // little endian, whatever the host is
+  for (uint8_t b = 0; b < size; b++)
+    out[b] = (value >> (8 * b)) & 0xFF;
+}
+
+int32_t codec_get_le(const uint8_t *in, uint8_t size, bool is_signed) {
+  uint32_t value = 0;
+  for (uint8_t b = 0; b < size; b++)
+    value |= (uint32_t)in[b] << (8 * b);
+
+  // sign extend
+  uint8_t bits = 8 * size;
+  if (is_signed && bits < 32 && (value >> (bits - 1)) & 1)
+    value |= UINT32_MAX << bits;
+
+  return (int32_t)value;
+}
+
+size_t codec_pack(const report_t *report, uint8_t *packet) {
+  packet[offsetof(radio_data_packet, type)] = DATA;
+  packet[offsetof(radio_data_packet, esp_id)] = report->esp_id;
+
+  for (int i = 0; i < N_FIELDS; i++) {
+    const field_info_t *info = &field_info[i];
+    // out of range values stick at the limit rather than wrapping around
+    codec_put_le(&packet[info->wire_offset],
+                 (uint32_t)clamp_to_wire(info, report->values[i]),
+                 info->wire_size);
+  }
+
+  return sizeof(radio_data_packet);
+}
+
+size_t codec_unpack(const uint8_t *packet, report_t *report) {
+  report->esp_id = packet[offsetof(radio_data_packet, esp_id)];
+
+  for (int i = 0; i < N_FIELDS; i++) {
+    const field_info_t *info = &field_info[i];
+    report->values[i] = codec_get_le(&packet[info->wire_offset],
+                                     info->wire_size, info->wire_signed);
+  }
+
+  return sizeof(radio_data_packet);
+}
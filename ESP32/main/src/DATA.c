@@ -0,0 +1,146 @@
+#include "DATA.h"
+
+#include "config.h"
+
+#include <stdatomic.h>
+#include <string.h>
+
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+// the latest sample from every sensor is kept in a single record guarded by a
+// sequence lock: writers bump `write_seq` to an odd value, update the record
+// and bump it back to even, while readers copy the record and retry if the
+// counter was odd or changed underneath them. readers therefore never block,
+// and never return a record mixing two different samples
+static data_snapshot_t current = {0};
+static atomic_uint_least32_t write_seq = 0;
+
+// the BMS readings of the packs after the first, which report under their own
+// IDs. they are guarded by the same lock, but don't count as a change to
+// `current`
+typedef struct {
+  bool online;
+  uint8_t esp_id;
+  int64_t timestamp;
+  telemetry_data_t telemetry;
+} pack_data_t;
+static pack_data_t packs[BMS_N_PACKS] = {0}; // the primary isn't used
+
+// the acquisition tasks and the command handlers can all publish, so writers
+// are serialised among themselves. a critical section (rather than a mutex)
+// stops a writer being preempted half-way through by a spinning reader
+static portMUX_TYPE writer_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void begin_write() {
+  taskENTER_CRITICAL(&writer_lock);
+  atomic_fetch_add_explicit(&write_seq, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+static void finish_write() {
+  atomic_fetch_add_explicit(&write_seq, 1, memory_order_release);
+  taskEXIT_CRITICAL(&writer_lock);
+}
+
+static void end_write() {
+  current.seq++;
+  current.timestamp = esp_timer_get_time();
+  finish_write();
+}
+
+static void read_consistent(void *copy, const void *source, size_t size) {
+  while (true) {
+    uint32_t before = atomic_load_explicit(&write_seq, memory_order_acquire);
+    if (before & 1)
+      continue; // a write is in progress on the other core
+
+    memcpy(copy, source, size);
+
+    atomic_thread_fence(memory_order_acquire);
+    uint32_t after = atomic_load_explicit(&write_seq, memory_order_relaxed);
+    if (before == after)
+      return;
+  }
+}
+
+void data_publish_telemetry(const telemetry_data_t *telemetry) {
+  begin_write();
+  current.telemetry = *telemetry;
+  end_write();
+}
+
+void data_publish_pack(uint8_t pack, uint8_t esp_id,
+                       const telemetry_data_t *telemetry) {
+  if (pack == BMS_PRIMARY_PACK) {
+    data_publish_telemetry(telemetry);
+    return;
+  }
+  if (pack >= BMS_N_PACKS)
+    return;
+
+  begin_write();
+  packs[pack].online = true;
+  packs[pack].esp_id = esp_id;
+  packs[pack].timestamp = esp_timer_get_time();
+  packs[pack].telemetry = *telemetry;
+  finish_write();
+}
+
+void data_set_pack_offline(uint8_t pack) {
+  if (pack == BMS_PRIMARY_PACK || pack >= BMS_N_PACKS)
+    return;
+
+  begin_write();
+  packs[pack].online = false;
+  finish_write();
+}
+
+void data_publish_gps(const GPRMC_t *gps) {
+  begin_write();
+  current.gps = *gps;
+  end_write();
+}
+
+void data_publish_inverter(const inverter_data_t *inverter) {
+  begin_write();
+  // the enabled flag is owned by `data_set_inverter_enabled`, so a reading
+  // taken before the inverter was flipped cannot undo the change
+  bool enabled = current.inverter.enabled;
+  current.inverter = *inverter;
+  current.inverter.enabled = enabled;
+  end_write();
+}
+
+void data_set_inverter_enabled(bool enabled) {
+  begin_write();
+  current.inverter.enabled = enabled;
+  end_write();
+}
+
+void data_read_snapshot(data_snapshot_t *snapshot) {
+  read_consistent(snapshot, &current, sizeof(*snapshot));
+}
+
+bool data_read_pack(uint8_t pack, data_snapshot_t *snapshot, uint8_t *esp_id) {
+  if (pack >= BMS_N_PACKS)
+    return false;
+
+  data_read_snapshot(snapshot);
+  if (pack == BMS_PRIMARY_PACK)
+    return true; // `esp_id` is left to the caller
+
+  pack_data_t data;
+  read_consistent(&data, &packs[pack], sizeof(data));
+  if (!data.online)
+    return false;
+
+  // the same location as the rest of the sample, but the inverter is only
+  // reported once, with the first pack
+  snapshot->timestamp = data.timestamp;
+  snapshot->telemetry = data.telemetry;
+  memset(&snapshot->inverter, 0, sizeof(snapshot->inverter));
+  *esp_id = data.esp_id;
+
+  return true;
+}
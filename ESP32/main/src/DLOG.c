@@ -0,0 +1,224 @@
+#include "DLOG.h"
+
+#include "PROF.h"
+#include "config.h"
+#include "global.h"
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+static const char *TAG = "DLOG";
+
+// lines logged with the DLOGx macros go into a ring of records, which holds
+// the last `DLOG_RING_LEN` of them. each record is claimed with a single
+// atomic increment and filled in without a lock, so logging costs a few
+// stores, and the formatting and the wait on the UART are left to a low
+// priority task. a record's `seq` is its index plus one once it is filled in,
+// so that a reader can tell it from one still being written or since
+// overwritten
+typedef struct {
+  atomic_uint seq;
+  uint32_t time; // ms since boot
+  uint8_t level;
+  uint8_t n_args;
+  const char *tag;
+  const char *format;
+  intptr_t args[DLOG_MAX_ARGS];
+} dlog_record_t;
+
+_Static_assert((DLOG_RING_LEN & (DLOG_RING_LEN - 1)) == 0,
+               "the ring index has to carry on through `head` wrapping");
+
+static dlog_record_t ring[DLOG_RING_LEN];
+static atomic_uint head = 0; // records ever claimed
+
+typedef enum {
+  RECORD_READY,
+  RECORD_PENDING, // still being written
+  RECORD_LOST,    // overwritten
+} record_state_t;
+
+void dlog_write(esp_log_level_t level, const char *tag, const char *format,
+                const intptr_t *args, uint8_t n_args) {
+  unsigned i = atomic_fetch_add(&head, 1);
+  dlog_record_t *record = &ring[i % DLOG_RING_LEN];
+  atomic_store(&record->seq, 0);
+  record->time = esp_timer_get_time() / 1000;
+  record->level = level;
+  record->n_args = MIN(n_args, DLOG_MAX_ARGS);
+  record->tag = tag;
+  record->format = format;
+  memcpy(record->args, args, record->n_args * sizeof(intptr_t));
+  atomic_store(&record->seq, i + 1);
+}
+
+static record_state_t read_record(unsigned i, dlog_record_t *out) {
+  // copied out, then checked that it wasn't overwritten while being copied
+  const dlog_record_t *record = &ring[i % DLOG_RING_LEN];
+  unsigned seq = atomic_load(&record->seq);
+  if (seq != i + 1)
+    return atomic_load(&head) - i > DLOG_RING_LEN ? RECORD_LOST
+                                                  : RECORD_PENDING;
+
+  out->time = record->time;
+  out->level = record->level;
+  out->n_args = record->n_args;
+  out->tag = record->tag;
+  out->format = record->format;
+  memcpy(out->args, record->args, sizeof(out->args));
+  return atomic_load(&record->seq) == seq ? RECORD_READY : RECORD_LOST;
+}
+
+static void drain() {
+  // only ever called from the task, so these can be reused
+  static unsigned tail = 0;
+  static char line[DLOG_LINE_MAX_LEN];
+  static dlog_record_t record;
+
+  uint32_t lost = 0;
+  while (true) {
+    unsigned claimed = atomic_load(&head);
+    if (claimed - tail > DLOG_RING_LEN) {
+      lost += claimed - DLOG_RING_LEN - tail;
+      tail = claimed - DLOG_RING_LEN;
+    }
+    if (tail == claimed)
+      break;
+
+    record_state_t state = read_record(tail, &record);
+    if (state == RECORD_PENDING)
+      break;
+    tail++;
+    if (state == RECORD_LOST) {
+      lost++;
+      continue;
+    }
+
+    // arguments past those given aren't used by the format
+    snprintf(line, sizeof(line), record.format, record.args[0], record.args[1],
+             record.args[2], record.args[3]);
+    // as ESP_LOGx lays lines out, but with the time the line was logged at
+    // rather than now
+    esp_log_write(record.level, record.tag, "%c (%" PRIu32 ") %s: %s\n",
+                  "NEWIDV"[MIN(record.level, ESP_LOG_VERBOSE)], record.time,
+                  record.tag, line);
+  }
+
+  if (lost > 0)
+    ESP_LOGW(TAG, "%" PRIu32 " lines were overwritten before being printed",
+             lost);
+}
+
+_Static_assert(DLOG_MAX_ARGS == 4, "`drain` passes on four arguments");
+
+void dlog_freertos_task(void *arg) {
+  while (true) {
+    prof_checkin(DLOG_DRAIN_MS);
+    vTaskDelay(pdMS_TO_TICKS(DLOG_DRAIN_MS));
+    drain();
+  }
+}
+
+void start_dlog_task() {
+  // above only the idle task, so that printing waits for everything else
+  xTaskCreate(dlog_freertos_task, "dlog_freertos_task", 3072, NULL,
+              tskIDLE_PRIORITY + 1, NULL);
+}
+
+static const char *next_conversion(const char *format) {
+  // the conversion of the next argument `format` takes, e.g. 'd' or 's'
+  for (const char *c = format; *c != '\0'; c++) {
+    if (*c != '%')
+      continue;
+    if (*++c == '%')
+      continue;
+    while (*c != '\0' && strchr("-+ #0123456789.hlLqjzt", *c) != NULL)
+      c++;
+    return *c != '\0' ? c : NULL;
+  }
+  return NULL;
+}
+
+bool dlog_export(chunk_emit_t emit, void *ctx) {
+  // the records still in the ring, oldest first, for decoding on the host
+  // (see `decode_log.py`). each gives the index of its format in "formats",
+  // and its arguments as numbers, or strings for "%s"
+  chunk_writer_t writer;
+  const char **formats = malloc(DLOG_RING_LEN * sizeof(const char *));
+  const char **tags = malloc(DLOG_RING_LEN * sizeof(const char *));
+  dlog_record_t *record = malloc(sizeof(dlog_record_t));
+  bool ok = formats != NULL && tags != NULL && record != NULL &&
+            chunk_begin(&writer, DLOG_CHUNK_LEN, emit, ctx);
+  if (!ok) {
+    ESP_LOGE(TAG, "Couldn't assign memory to export log");
+    free(formats);
+    free(tags);
+    free(record);
+    return false;
+  }
+
+  unsigned end = atomic_load(&head);
+  unsigned start = end > DLOG_RING_LEN ? end - DLOG_RING_LEN : 0;
+  chunk_printf(&writer,
+               "{\"uptime\":%" PRIu32 ",\"overwritten\":%u,"
+               "\"keys\":[\"time\",\"level\",\"format\",\"args\"],"
+               "\"records\":[",
+               (uint32_t)(esp_timer_get_time() / 1000), start);
+
+  int n_formats = 0;
+  bool first = true;
+  for (unsigned i = start; i != end && writer.ok; i++) {
+    if (read_record(i, record) != RECORD_READY)
+      continue;
+
+    int format = 0;
+    while (format < n_formats && formats[format] != record->format)
+      format++;
+    if (format == n_formats) {
+      formats[n_formats] = record->format;
+      tags[n_formats++] = record->tag;
+    }
+
+    chunk_printf(&writer, "%s[%" PRIu32 ",%u,%d,[", first ? "" : ",",
+                 record->time, record->level, format);
+    const char *conversion = record->format;
+    for (int j = 0; j < record->n_args; j++) {
+      if (j > 0)
+        chunk_printf(&writer, ",");
+      conversion = next_conversion(conversion);
+      if (conversion != NULL && *conversion == 's')
+        chunk_put_string(&writer, (const char *)record->args[j]);
+      else
+        chunk_printf(&writer, "%" PRIdPTR, record->args[j]);
+      if (conversion != NULL)
+        conversion++;
+    }
+    chunk_printf(&writer, "]]");
+    first = false;
+  }
+
+  chunk_printf(&writer, "],\"formats\":[");
+  for (int i = 0; i < n_formats; i++) {
+    chunk_printf(&writer, "%s[", i == 0 ? "" : ",");
+    chunk_put_string(&writer, tags[i]);
+    chunk_printf(&writer, ",");
+    chunk_put_string(&writer, formats[i]);
+    chunk_printf(&writer, "]");
+  }
+  chunk_printf(&writer, "]}");
+  ok = chunk_end(&writer);
+
+  free(formats);
+  free(tags);
+  free(record);
+  if (!ok)
+    ESP_LOGW(TAG, "Log export stopped early");
+  return ok;
+}
@@ -79,7 +79,10 @@ void dns_server_freertos_task(void *arg) {
   int sock;
   struct sockaddr_in dest_addr, source_addr;
   socklen_t socklen = sizeof(source_addr);
-  uint8_t buffer[512];
+  // requests are answered in place, so leave some headroom after the largest
+  // request for the answer
+  size_t max_request = 512;
+  uint8_t buffer[512 + 64]; // probable safe headroom for DNS answer
 
   dest_addr.sin_addr.s_addr = htonl(INADDR_ANY);
   dest_addr.sin_family = AF_INET;
@@ -89,42 +92,22 @@ void dns_server_freertos_task(void *arg) {
   bind(sock, (struct sockaddr *)&dest_addr, sizeof(dest_addr));
 
   while (true) {
-    size_t len = recvfrom(sock, buffer, sizeof(buffer), 0,
+    size_t len = recvfrom(sock, buffer, max_request, 0,
                           (struct sockaddr *)&source_addr, &socklen);
-    size_t max_extra = 64; // probable safe headroom for DNS answer
     if (len > 0) {
-      dns_packet_t *packet = malloc(sizeof(dns_packet_t));
-      if (!packet)
-        continue;
-      packet->buffer = malloc(len + max_extra);
-      if (!packet->buffer) {
-        free(packet);
-        continue;
-      }
-
-      packet->sock = sock;
-      packet->source_addr = source_addr;
-      packet->socklen = socklen;
-      memcpy(packet->buffer, buffer, len);
-      packet->len = len;
-      packet->capacity = len + max_extra;
-
-      /*
-      job_t job = {
-          .type = JOB_DNS_REQUEST,
-          .data = packet,
-          .size = sizeof(dns_packet_t),
+      // the request is handled immediately, so the packet can live on the
+      // stack
+      dns_packet_t packet = {
+          .sock = sock,
+          .source_addr = source_addr,
+          .socklen = socklen,
+          .buffer = buffer,
+          .len = len,
+          .capacity = sizeof(buffer),
       };
 
-      if (xQueueSend(job_queue, &job, 0) != pdPASS) {
-          if (VERBOSE) ESP_LOGW(TAG, "Queue full, dropping job");
-          free(job.data);
-      }
-      */
-
       // just handle the lightweight job immediately
-      handle_dns_request(packet);
-      free(packet);
+      handle_dns_request(&packet);
     } else {
       ESP_LOGE(TAG, "recvfrom failed: errno %d", errno);
     }
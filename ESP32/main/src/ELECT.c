@@ -0,0 +1,296 @@
+#include "ELECT.h"
+
+#include "AP.h"
+#include "CHANGE.h"
+#include "LoRa.h"
+#include "MESH.h"
+#include "PARAM.h"
+#include "SCAN.h"
+#include "SCHED.h"
+#include "STATE.h"
+#include "TASK.h"
+#include "config.h"
+#include "global.h"
+#include "utils.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+
+static const char *TAG = "ELECT";
+
+// every device advertises an `elect_candidate_t` in a vendor specific
+// information element of its beacons and probe responses, so that each scan
+// tells it about its neighbours as well as whether there is a ROOT. from
+// these, a ROOT which hears a better ROOT joins it as a node, and a node
+// which has lost its ROOT becomes the ROOT itself if no better such node is
+// heard. both happen live, with just the AP's SSID and IP changing, rather
+// than by restarting, and since every device ranks candidates the same way
+// a single ROOT is settled on within a round or two. each also advertises its
+// hop count, so that nodes out of the ROOT's range can pick a parent to relay
+// through (see `MESH.c`), and a node with a route doesn't count as lost
+static const uint8_t ie_oui[3] = {0x18, 0xfe, 0x34}; // Espressif
+#define IE_OUI_TYPE 0x4d
+#define IE_VERSION 2
+
+typedef struct __attribute__((packed)) {
+  uint8_t version;
+  uint8_t priority;
+  uint8_t flags;
+  uint8_t n_clients;
+  uint16_t uptime;
+  uint8_t esp_id;
+  uint8_t hop;
+} ie_payload_t;
+
+// filled in by the Wi-Fi task as beacons and probe responses arrive
+static elect_neighbour_t neighbours[ELECT_MAX_HEARD];
+static uint8_t n_neighbours = 0;
+static portMUX_TYPE neighbour_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// only touched by the job worker
+static elect_candidate_t advertised = {0};
+static uint8_t ie[sizeof(vendor_ie_data_t) + sizeof(ie_payload_t)];
+static bool advertising = false;
+
+int elect_compare(const elect_candidate_t *a, const elect_candidate_t *b) {
+  // positive if `a` would make the better ROOT: one connected to the web
+  // server, then the one preferred by configuration, then the one which the
+  // most devices would otherwise have to leave, then the longest running, and
+  // finally the one with the lower MAC
+  bool a_uplink = a->flags & ELECT_FLAG_UPLINK;
+  bool b_uplink = b->flags & ELECT_FLAG_UPLINK;
+  if (a_uplink != b_uplink)
+    return a_uplink ? 1 : -1;
+  if (a->priority != b->priority)
+    return a->priority - b->priority;
+  if (a->n_clients != b->n_clients)
+    return a->n_clients - b->n_clients;
+  if (a->uptime != b->uptime)
+    return a->uptime - b->uptime;
+  return compare_mac(b->mac, a->mac);
+}
+
+elect_action_t elect_decide(const elect_candidate_t *self,
+                            const elect_candidate_t *heard, size_t n_heard) {
+  // ROOTs compete with ROOTs, and nodes without a route with each other. a
+  // node which could still take another child is as good as a ROOT to join
+  const uint8_t role = ELECT_FLAG_ROOT | ELECT_FLAG_ORPHAN;
+  bool root_heard = false;
+  bool better_heard = false;
+  for (size_t i = 0; i < n_heard; i++) {
+    root_heard |= heard[i].flags & ELECT_FLAG_ROOT ||
+                  heard[i].hop < MESH_MAX_HOPS;
+    if ((heard[i].flags & role) == (self->flags & role) &&
+        elect_compare(&heard[i], self) > 0)
+      better_heard = true;
+  }
+
+  // a ROOT connected to the web server never gives that up
+  if (self->flags & ELECT_FLAG_ROOT)
+    return better_heard && !(self->flags & ELECT_FLAG_UPLINK) ? ELECT_DEMOTE
+                                                              : ELECT_STAY;
+  if (self->flags & ELECT_FLAG_ORPHAN)
+    return root_heard || better_heard ? ELECT_STAY : ELECT_PROMOTE;
+
+  return ELECT_STAY;
+}
+
+static void ie_callback(void *ctx, wifi_vendor_ie_type_t type,
+                        const uint8_t sa[6], const vendor_ie_data_t *vnd_ie,
+                        int rssi) {
+  if ((type != WIFI_VND_IE_TYPE_BEACON &&
+       type != WIFI_VND_IE_TYPE_PROBE_RESP) ||
+      vnd_ie->element_id != WIFI_VENDOR_IE_ELEMENT_ID ||
+      memcmp(vnd_ie->vendor_oui, ie_oui, sizeof(ie_oui)) != 0 ||
+      vnd_ie->vendor_oui_type != IE_OUI_TYPE ||
+      vnd_ie->length < sizeof(ie) - 2)
+    return;
+
+  ie_payload_t payload;
+  memcpy(&payload, vnd_ie->payload, sizeof(payload));
+  if (payload.version != IE_VERSION)
+    return;
+
+  elect_candidate_t candidate = {
+      .priority = payload.priority,
+      .flags = payload.flags,
+      .n_clients = payload.n_clients,
+      .uptime = payload.uptime,
+      .esp_id = payload.esp_id,
+      .hop = payload.hop,
+  };
+  memcpy(candidate.mac, sa, sizeof(candidate.mac));
+  int64_t now = esp_timer_get_time();
+
+  // the same device again, or else a new one in place of the oldest
+  taskENTER_CRITICAL(&neighbour_lock);
+  int slot = -1;
+  for (int i = 0; i < n_neighbours && slot < 0; i++)
+    if (memcmp(neighbours[i].candidate.mac, sa, sizeof(candidate.mac)) == 0)
+      slot = i;
+  if (slot < 0 && n_neighbours < ELECT_MAX_HEARD)
+    slot = n_neighbours++;
+  if (slot < 0) {
+    slot = 0;
+    for (int i = 1; i < n_neighbours; i++)
+      if (neighbours[i].heard_at < neighbours[slot].heard_at)
+        slot = i;
+  }
+  neighbours[slot] = (elect_neighbour_t){candidate, rssi, now};
+  taskEXIT_CRITICAL(&neighbour_lock);
+}
+
+size_t elect_neighbours(elect_neighbour_t *out, size_t max,
+                        uint32_t max_age_ms) {
+  // those heard in the last `max_age_ms`
+  int64_t since = esp_timer_get_time() - (int64_t)max_age_ms * 1000;
+  size_t n = 0;
+  taskENTER_CRITICAL(&neighbour_lock);
+  for (int i = 0; i < n_neighbours && n < max; i++)
+    if (neighbours[i].heard_at >= since)
+      out[n++] = neighbours[i];
+  taskEXIT_CRITICAL(&neighbour_lock);
+
+  return n;
+}
+
+void elect_advertise() {
+  elect_candidate_t candidate = {
+      .priority = ELECT_PRIORITY,
+      .flags = state_is(STATE_WIFI) ? ELECT_FLAG_UPLINK : 0,
+      .n_clients = MIN(MAX(num_connected_clients, 0), UINT8_MAX),
+      .uptime = MIN(esp_timer_get_time() / 60000000, UINT16_MAX),
+      .esp_id = ESP_ID,
+      .hop = mesh_hop(),
+  };
+  if (state_is(STATE_ROOT))
+    candidate.flags |= ELECT_FLAG_ROOT;
+  else if (candidate.hop == ELECT_HOP_NONE)
+    candidate.flags |= ELECT_FLAG_ORPHAN;
+  esp_wifi_get_mac(WIFI_IF_AP, candidate.mac);
+
+  vendor_ie_data_t *data = (vendor_ie_data_t *)ie;
+  data->element_id = WIFI_VENDOR_IE_ELEMENT_ID;
+  data->length = sizeof(ie) - 2; // everything after the length
+  memcpy(data->vendor_oui, ie_oui, sizeof(ie_oui));
+  data->vendor_oui_type = IE_OUI_TYPE;
+  ie_payload_t payload = {
+      .version = IE_VERSION,
+      .priority = candidate.priority,
+      .flags = candidate.flags,
+      .n_clients = candidate.n_clients,
+      .uptime = candidate.uptime,
+      .esp_id = candidate.esp_id,
+      .hop = candidate.hop,
+  };
+  memcpy(data->payload, &payload, sizeof(payload));
+
+  // an element has to be removed before it can be changed
+  const wifi_vendor_ie_type_t types[] = {WIFI_VND_IE_TYPE_BEACON,
+                                         WIFI_VND_IE_TYPE_PROBE_RESP};
+  esp_err_t err = ESP_OK;
+  for (int i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+    if (advertising)
+      esp_wifi_set_vendor_ie(false, types[i], WIFI_VND_IE_ID_0, NULL);
+    esp_err_t type_err =
+        esp_wifi_set_vendor_ie(true, types[i], WIFI_VND_IE_ID_0, ie);
+    if (type_err != ESP_OK)
+      err = type_err;
+  }
+  if (err != ESP_OK)
+    ESP_LOGW(TAG, "Failed to advertise: %s", esp_err_to_name(err));
+  advertising = true;
+  advertised = candidate;
+}
+
+static void reset_destinations() {
+  // whoever this device reports to now hasn't had a full report yet
+  for (int i = 0; i < N_DESTINATIONS; i++)
+    change_reset(i);
+}
+
+static void promote() {
+  ESP_LOGW(TAG, "No ROOT heard, becoming the ROOT");
+  esp_wifi_disconnect(); // stop trying to connect to the old one
+  mesh_reset();
+  state_set(STATE_ROOT);
+  ap_configure(true);
+  lora_start();
+  reset_destinations();
+  elect_advertise();
+}
+
+static void demote() {
+  ESP_LOGW(TAG, "Better ROOT heard, becoming a node");
+  state_clear(STATE_ROOT);
+  ap_configure(false);
+  reset_destinations();
+  elect_advertise();
+
+  // join it now rather than on the next tick
+  job_t job = {.type = JOB_MESH_CONNECT};
+  if (xQueueSend(job_queue, &job, 0) != pdPASS)
+    if (VERBOSE)
+      ESP_LOGW(TAG, "Queue full, dropping job");
+}
+
+void elect_round() {
+  elect_advertise();
+  mesh_announce_route();
+
+  // only a ROOT without a connection to the web server, or a node without a
+  // ROOT, has anything to decide
+  if (advertised.flags & ELECT_FLAG_ROOT
+          ? !MESH_ROOT_MERGE_ENABLED || advertised.flags & ELECT_FLAG_UPLINK
+          : !(advertised.flags & ELECT_FLAG_ORPHAN))
+    return;
+
+  // a scan this round, if there hasn't been one, fills in `neighbours`
+  wifi_ap_record_t root;
+  uint32_t period = param_get(PARAM_ELECT_PERIOD);
+  esp_err_t err = scan_find_root(period, false, &root);
+  if (err != ESP_OK && err != ESP_ERR_NOT_FOUND)
+    return;
+
+  elect_neighbour_t heard[ELECT_MAX_HEARD];
+  size_t n_heard = elect_neighbours(heard, ELECT_MAX_HEARD, 2 * period);
+  elect_candidate_t others[ELECT_MAX_HEARD];
+  for (size_t i = 0; i < n_heard; i++)
+    others[i] = heard[i].candidate;
+
+  switch (elect_decide(&advertised, others, n_heard)) {
+  case ELECT_PROMOTE:
+    promote();
+    break;
+
+  case ELECT_DEMOTE:
+    demote();
+    break;
+
+  default:
+    break;
+  }
+}
+
+void elect_init() {
+  esp_err_t err = esp_wifi_set_vendor_ie_cb(ie_callback, NULL);
+  if (err != ESP_OK)
+    ESP_LOGW(TAG, "Failed to register for information elements: %s",
+             esp_err_to_name(err));
+  elect_advertise();
+}
+
+static void wifi_watcher(EventBits_t changed) {
+  // the UPLINK flag is advertised, and acted upon, straight away
+  sched_queue(JOB_MESH_ELECT);
+}
+
+void start_elect_timed_task() {
+  sched_add(JOB_MESH_ELECT, PARAM_ELECT_PERIOD, SCHED_JITTER_MS,
+            SCHED_AFTER_NONE);
+  state_watch(STATE_WIFI, wifi_watcher);
+}
@@ -0,0 +1,299 @@
+#include "FLASH.h"
+
+#include "I2C.h"
+#include "config.h"
+#include "utils.h"
+
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+
+static const char *TAG = "FLASH";
+
+// the settings are cached in RAM for each pack, a region of DataFlash at a
+// time: settings which fit in one ManufacturerBlockAccess block together share
+// a region, which is read in one go the first time any of them is needed.
+// changes are staged against the cache, so that only settings which actually
+// differ are written. `flash_write` then writes each changed region's span of
+// changed bytes in one block (along with the unchanged bytes in between, as
+// they were), and `flash_verify` reads each written region back once and
+// checks every changed setting against it. the cache is dropped when a pack
+// goes offline or is reset, to pick up changes made to it by other means, but
+// changes staged or written and not yet verified are kept through that.
+// the BMS task reads the cache while the job worker changes it, so each call
+// holds `flash_mutex` throughout, including while it reads the pack
+static const struct {
+  uint16_t address;
+  uint8_t size;
+} settings[N_FLASH_SETTINGS] = {
+    [FLASH_DEVICE_NAME] = {I2C_DEVICE_NAME_ADDR, UTILS_ID_LENGTH + 1},
+    [FLASH_OTC_THRESHOLD] = {I2C_OTC_THRESHOLD_ADDR, 2},
+};
+
+typedef struct {
+  uint16_t address;
+  uint8_t size;
+} flash_region_t;
+
+// at most one region per setting
+static flash_region_t regions[N_FLASH_SETTINGS];
+static uint8_t setting_regions[N_FLASH_SETTINGS];
+static uint8_t n_regions = 0;
+
+typedef struct {
+  bool loaded;
+  uint8_t cached[N_FLASH_SETTINGS][FLASH_BLOCK_SIZE];
+  uint8_t staged[N_FLASH_SETTINGS][FLASH_BLOCK_SIZE];
+  uint32_t dirty[N_FLASH_SETTINGS];   // one bit per staged byte which differs
+  uint32_t written[N_FLASH_SETTINGS]; // bytes written but not yet verified
+  esp_err_t write_results[N_FLASH_SETTINGS];
+} pack_cache_t;
+
+static pack_cache_t caches[BMS_N_PACKS] = {0};
+static SemaphoreHandle_t flash_mutex = NULL;
+
+static void lock() {
+  // before initialisation there is nothing to contend with
+  if (flash_mutex != NULL)
+    xSemaphoreTake(flash_mutex, portMAX_DELAY);
+}
+
+static void unlock() {
+  if (flash_mutex != NULL)
+    xSemaphoreGive(flash_mutex);
+}
+
+static uint32_t span_mask(uint8_t offset, uint8_t size) {
+  uint32_t mask = size >= 32 ? UINT32_MAX : (1u << size) - 1;
+  return mask << offset;
+}
+
+static void build_regions() {
+  // in order of address
+  uint8_t order[N_FLASH_SETTINGS];
+  for (int i = 0; i < N_FLASH_SETTINGS; i++) {
+    int j = i;
+    for (; j > 0 && settings[order[j - 1]].address > settings[i].address; j--)
+      order[j] = order[j - 1];
+    order[j] = i;
+  }
+
+  for (int i = 0; i < N_FLASH_SETTINGS; i++) {
+    uint8_t setting = order[i];
+    uint16_t end = settings[setting].address + settings[setting].size;
+    if (n_regions == 0 ||
+        end - regions[n_regions - 1].address > FLASH_BLOCK_SIZE)
+      regions[n_regions++].address = settings[setting].address;
+    flash_region_t *region = &regions[n_regions - 1];
+    region->size = MAX(region->size, end - region->address);
+    setting_regions[setting] = n_regions - 1;
+  }
+}
+
+void flash_init() {
+  build_regions();
+  flash_mutex = xSemaphoreCreateMutex();
+  assert(flash_mutex);
+}
+
+// call with `flash_mutex` held
+static esp_err_t load(uint8_t pack) {
+  pack_cache_t *cache = &caches[pack];
+  if (cache->loaded)
+    return ESP_OK;
+
+  uint8_t data[N_FLASH_SETTINGS][FLASH_BLOCK_SIZE] = {0};
+  for (int i = 0; i < n_regions; i++) {
+    uint8_t address[2] = {0};
+    convert_uint_to_n_bytes(regions[i].address, address, sizeof(address),
+                            true);
+    esp_err_t err = read_data_flash(pack, address, sizeof(address), data[i],
+                                    regions[i].size);
+    if (err != ESP_OK)
+      return err;
+  }
+
+  // anything still staged, or written and still to be checked against what
+  // was staged, goes on top of what the pack holds now
+  for (int i = 0; i < n_regions; i++) {
+    uint32_t dirty = 0;
+    for (int j = 0; j < FLASH_BLOCK_SIZE; j++) {
+      uint32_t bit = 1u << j;
+      if (cache->dirty[i] & bit && cache->staged[i][j] != data[i][j])
+        dirty |= bit;
+      else if (!(cache->written[i] & bit))
+        cache->staged[i][j] = data[i][j];
+    }
+    cache->dirty[i] = dirty;
+  }
+  memcpy(cache->cached, data, sizeof(data));
+  cache->loaded = true;
+
+  return ESP_OK;
+}
+
+size_t flash_setting_size(flash_setting_t setting) {
+  return settings[setting].size;
+}
+
+esp_err_t flash_get(uint8_t pack, flash_setting_t setting, uint8_t *value) {
+  if (pack >= BMS_N_PACKS || setting >= N_FLASH_SETTINGS)
+    return ESP_ERR_INVALID_ARG;
+
+  lock();
+  esp_err_t err = load(pack);
+  if (err == ESP_OK) {
+    uint8_t region = setting_regions[setting];
+    uint8_t offset = settings[setting].address - regions[region].address;
+    memcpy(value, &caches[pack].cached[region][offset],
+           settings[setting].size);
+  }
+  unlock();
+
+  return err;
+}
+
+esp_err_t flash_set(uint8_t pack, flash_setting_t setting,
+                    const uint8_t *value) {
+  if (pack >= BMS_N_PACKS || setting >= N_FLASH_SETTINGS)
+    return ESP_ERR_INVALID_ARG;
+
+  // the cache fills in the bytes around the change
+  lock();
+  esp_err_t err = load(pack);
+  if (err != ESP_OK) {
+    unlock();
+    return err;
+  }
+
+  uint8_t region = setting_regions[setting];
+  uint8_t offset = settings[setting].address - regions[region].address;
+  pack_cache_t *cache = &caches[pack];
+  for (int i = 0; i < settings[setting].size; i++) {
+    cache->staged[region][offset + i] = value[i];
+    if (value[i] != cache->cached[region][offset + i])
+      cache->dirty[region] |= 1u << (offset + i);
+    else
+      cache->dirty[region] &= ~(1u << (offset + i));
+  }
+  unlock();
+
+  return ESP_OK;
+}
+
+bool flash_staged(uint8_t pack) {
+  bool staged = false;
+  lock();
+  for (int i = 0; i < n_regions; i++)
+    staged |= caches[pack].dirty[i] != 0;
+  unlock();
+
+  return staged;
+}
+
+esp_err_t flash_write(uint8_t pack) {
+  // the next changed region, in one block. the gauge takes
+  // `I2C_DATA_FLASH_WRITE_MS` to commit it, so the caller comes back for the
+  // next rather than waiting here
+  pack_cache_t *cache = &caches[pack];
+  uint8_t data[FLASH_BLOCK_SIZE];
+  int region = -1;
+  uint8_t first = 0;
+  uint8_t size = 0;
+  lock();
+  for (int i = 0; i < n_regions && region < 0; i++) {
+    uint32_t dirty = cache->dirty[i];
+    if (dirty == 0)
+      continue;
+    region = i;
+    first = __builtin_ctz(dirty);
+    size = 32 - __builtin_clz(dirty) - first;
+    memcpy(data, &cache->staged[i][first], size);
+    cache->written[i] |= span_mask(first, size);
+    cache->dirty[i] = 0;
+  }
+  if (region < 0) {
+    unlock();
+    return ESP_OK;
+  }
+
+  uint8_t address[2] = {0};
+  convert_uint_to_n_bytes(regions[region].address + first, address,
+                          sizeof(address), true);
+  esp_err_t err =
+      write_data_flash(pack, address, sizeof(address), data, size);
+  if (err != ESP_OK)
+    ESP_LOGE(TAG, "Failed to write %u bytes at 0x%04x on pack %u", size,
+             regions[region].address + first, pack);
+  cache->write_results[region] = err;
+  unlock();
+
+  return err;
+}
+
+void flash_verify(uint8_t pack, esp_err_t results[N_FLASH_SETTINGS]) {
+  // one read per written region, against which every setting that was
+  // changed is checked
+  for (int i = 0; i < N_FLASH_SETTINGS; i++)
+    results[i] = ESP_OK;
+
+  pack_cache_t *cache = &caches[pack];
+  lock();
+  for (int i = 0; i < n_regions; i++) {
+    uint32_t written = cache->written[i];
+    cache->written[i] = 0;
+    if (written == 0)
+      continue;
+
+    uint8_t data[FLASH_BLOCK_SIZE] = {0};
+    esp_err_t err = cache->write_results[i];
+    if (err == ESP_OK) {
+      uint8_t address[2] = {0};
+      convert_uint_to_n_bytes(regions[i].address, address, sizeof(address),
+                              true);
+      err = read_data_flash(pack, address, sizeof(address), data,
+                            regions[i].size);
+    }
+
+    for (int j = 0; j < N_FLASH_SETTINGS; j++) {
+      if (setting_regions[j] != i)
+        continue;
+      uint8_t offset = settings[j].address - regions[i].address;
+      uint32_t changed = written & span_mask(offset, settings[j].size);
+      if (changed == 0)
+        continue;
+      if (err != ESP_OK) {
+        results[j] = err;
+        continue;
+      }
+      for (int k = offset; k < offset + settings[j].size; k++)
+        if (changed & (1u << k) && data[k] != cache->staged[i][k])
+          results[j] = ESP_ERR_INVALID_RESPONSE;
+    }
+    if (err == ESP_OK) {
+      // what the pack holds now
+      memcpy(cache->cached[i], data, sizeof(data));
+      memcpy(cache->staged[i], data, sizeof(data));
+    } else {
+      // unknown, so read it again next time
+      cache->loaded = false;
+    }
+  }
+  unlock();
+
+  for (int i = 0; i < N_FLASH_SETTINGS; i++)
+    if (results[i] != ESP_OK)
+      ESP_LOGW(TAG, "Setting at 0x%04x on pack %u not changed: %s",
+               settings[i].address, pack, esp_err_to_name(results[i]));
+}
+
+void flash_invalidate(uint8_t pack) {
+  if (pack >= BMS_N_PACKS)
+    return;
+
+  // staged changes are kept, to be written over what is read next
+  lock();
+  caches[pack].loaded = false;
+  unlock();
+}
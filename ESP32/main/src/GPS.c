@@ -1,5 +1,9 @@
 #include "GPS.h"
 
+#include "CHANGE.h"
+#include "DATA.h"
+#include "PARAM.h"
+#include "PROF.h"
 #include "TASK.h"
 #include "config.h"
 #include "global.h"
@@ -53,7 +57,7 @@ double nmea_to_decimal(double coord, char hemi) {
   return decimal;
 }
 
-void parse_gprmc(char *gprmc) {
+bool parse_gprmc(char *gprmc, GPRMC_t *out) {
   // initialise empty array
   const size_t n_fields = 12;
   const size_t max_str_len = 10;
@@ -82,30 +86,31 @@ void parse_gprmc(char *gprmc) {
   }
   if (strcmp(data[0], "V") == 0) {
     ESP_LOGE(TAG, "No fix: GPS data void!");
-    return;
+    return false;
   }
 
-  gps_data.time = atof(data[0]);
-  gps_data.status = *data[1];
-  gps_data.latitude = nmea_to_decimal(atof(data[2]), *data[3]);
-  gps_data.lat_dir = *data[3];
-  gps_data.longitude = nmea_to_decimal(atof(data[4]), *data[5]);
-  gps_data.long_dir = *data[5];
-  gps_data.speed = atof(data[6]);
-  gps_data.course = atof(data[7]);
-  gps_data.date = atoi(data[8]);
-  gps_data.magnetic_variation = atoi(data[9]);
-  gps_data.magnetic_variation_dircetion = atoi(data[10]);
-  gps_data.mode = *data[11];
-
-  if (gps_data.mode != 'A')
+  out->time = atof(data[0]);
+  out->status = *data[1];
+  out->latitude = nmea_to_decimal(atof(data[2]), *data[3]);
+  out->lat_dir = *data[3];
+  out->longitude = nmea_to_decimal(atof(data[4]), *data[5]);
+  out->long_dir = *data[5];
+  out->speed = atof(data[6]);
+  out->course = atof(data[7]);
+  out->date = atoi(data[8]);
+  out->magnetic_variation = atoi(data[9]);
+  out->magnetic_variation_dircetion = atoi(data[10]);
+  out->mode = *data[11];
+
+  if (out->mode != 'A')
     ESP_LOGE(TAG, "Mode not autonomous!");
 
-  return;
+  return true;
 }
 
 void update_gps() {
-  uint8_t buff[GPS_BUFF_SIZE];
+  // only ever touched by the GPS acquisition task, so keep it off the stack
+  static uint8_t buff[GPS_BUFF_SIZE];
   int len = uart_read_bytes(GPS_UART_NUM, buff, GPS_BUFF_SIZE - 1,
                             pdMS_TO_TICKS(1000));
   if (len > 0) {
@@ -136,7 +141,12 @@ void update_gps() {
               strncpy(data, &line[sizeof(type) + 1], data_length);
               data[data_length] = '\0';
 
-              parse_gprmc((char *)data);
+              // parse into a local copy and only publish complete fixes
+              GPRMC_t sample = {0};
+              if (parse_gprmc((char *)data, &sample)) {
+                data_publish_gps(&sample);
+                change_check();
+              }
 
               return;
             }
@@ -153,3 +163,19 @@ void update_gps() {
 
   return;
 }
+
+void read_gps_freertos_task(void *arg) {
+  TickType_t last_wake_time = xTaskGetTickCount();
+
+  while (true) {
+    update_gps();
+    uint32_t period = param_get(PARAM_GPS_PERIOD);
+    prof_checkin(period);
+    vTaskDelayUntil(&last_wake_time, pdMS_TO_TICKS(period));
+  }
+}
+
+void start_read_gps_task() {
+  xTaskCreate(read_gps_freertos_task, "read_gps_freertos_task", 2560, NULL, 4,
+              NULL);
+}
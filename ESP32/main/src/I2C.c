@@ -4,22 +4,106 @@
 #include "config.h"
 #include "utils.h"
 
+#include <inttypes.h>
 #include <stdbool.h>
 
 #include "driver/i2c_master.h"
 #include "driver/i2c_types.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 
 static i2c_master_bus_handle_t bms_bus = NULL;
-static i2c_master_dev_handle_t bms_device = NULL;
+// the BMS of each battery pack. they either have their own addresses, or share
+// one address behind a multiplexer which is switched to the pack's channel at
+// the start of each transaction
+typedef struct {
+  uint8_t address;
+  int8_t channel; // on the multiplexer, or -1 if there isn't one
+  i2c_master_dev_handle_t device;
+} bms_pack_t;
+static bms_pack_t packs[BMS_N_PACKS] = {0};
+static i2c_master_dev_handle_t mux_device = NULL;
+static int8_t mux_channel = -1; // currently selected, or -1 if unknown
+// the BMS bus is shared by the acquisition task and the websocket/radio command
+// handlers, so each multi-part transaction holds the bus for its duration
+static SemaphoreHandle_t bms_bus_mutex = NULL;
+
+// every transaction on the BMS bus is timed, and its outcome recorded against
+// the pack. a pack which keeps failing is skipped for exponentially longer, so
+// that a bad connector fails fast rather than holding the bus for a timeout on
+// every transfer. a timeout resets the bus in case a device is holding SDA low,
+// and the clock is lowered when packs which were working start to fail (which
+// points to the bus rather than the pack), and raised again once it's clean.
+// after a DataFlash write the pack's next transaction waits for the gauge to
+// commit it, rather than the write holding up its caller
+typedef struct {
+  uint8_t failures;   // in a row
+  int64_t retry_at;   // skipped until then, us since boot
+  int64_t busy_until; // committing a DataFlash write, us since boot
+} device_health_t;
+static device_health_t health[BMS_N_PACKS] = {0};
+static int64_t transaction_started_at = 0;
+static uint32_t bms_bus_freq_hz = I2C_MASTER_FREQ_HZ;
+static uint16_t window_transactions = 0;
+static uint16_t window_errors = 0;
+static uint8_t clean_windows = 0;
+
+#define I2C_BACKOFF_BASE_MS 100
+#define I2C_CLOCK_WINDOW 32       // transactions between clock adjustments
+#define I2C_CLOCK_CLEAN_WINDOWS 8 // windows without errors before raising it
+
+static i2c_bus_stats_t bus_stats[N_I2C_BUSES] = {0};
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
 
 static i2c_master_bus_handle_t ext_bus = NULL;
 static i2c_master_dev_handle_t slave_esp32_device = NULL;
 
 static const char *TAG = "I2C";
 
+static esp_err_t add_bms_devices(uint32_t freq_hz) {
+  esp_err_t err = ESP_OK;
+  if (BMS_MUX_ADDR != 0) {
+    i2c_device_config_t mux_cfg = {.device_address = BMS_MUX_ADDR,
+                                   .scl_speed_hz = freq_hz};
+    err |= i2c_master_bus_add_device(bms_bus, &mux_cfg, &mux_device);
+  }
+
+  for (int i = 0; i < BMS_N_PACKS; i++) {
+    packs[i].address = BMS_MUX_ADDR != 0 ? I2C_ADDR : I2C_ADDR + i;
+    packs[i].channel = BMS_MUX_ADDR != 0 ? i : -1;
+    if (BMS_MUX_ADDR != 0 && i > 0) {
+      // the same address on every channel
+      packs[i].device = packs[0].device;
+      continue;
+    }
+    i2c_device_config_t bms_cfg = {.device_address = packs[i].address,
+                                   .scl_speed_hz = freq_hz};
+    err |= i2c_master_bus_add_device(bms_bus, &bms_cfg, &packs[i].device);
+  }
+
+  return err;
+}
+
+static void remove_bms_devices() {
+  if (mux_device != NULL)
+    i2c_master_bus_rm_device(mux_device);
+  mux_device = NULL;
+  mux_channel = -1;
+
+  for (int i = 0; i < BMS_N_PACKS; i++) {
+    if ((BMS_MUX_ADDR == 0 || i == 0) && packs[i].device != NULL)
+      i2c_master_bus_rm_device(packs[i].device);
+    packs[i].device = NULL;
+  }
+}
+
 esp_err_t i2c_master_init(void) {
+  bms_bus_mutex = xSemaphoreCreateMutex();
+  if (bms_bus_mutex == NULL)
+    return ESP_ERR_NO_MEM;
+
   // BMS bus
   i2c_master_bus_config_t bms_bus_cfg = {
       .clk_source = I2C_CLK_SRC_DEFAULT,
@@ -34,9 +118,8 @@ esp_err_t i2c_master_init(void) {
   if (err != ESP_OK)
     return err;
 
-  i2c_device_config_t bms_cfg = {.device_address = I2C_ADDR,
-                                 .scl_speed_hz = I2C_MASTER_FREQ_HZ};
-  err |= i2c_master_bus_add_device(bms_bus, &bms_cfg, &bms_device);
+  err |= add_bms_devices(bms_bus_freq_hz);
+  bus_stats[I2C_BUS_BMS].freq_hz = bms_bus_freq_hz;
 
   // slave bus
   i2c_master_bus_config_t ext_bus_cfg = {
@@ -56,23 +139,44 @@ esp_err_t i2c_master_init(void) {
                                          .scl_speed_hz = I2C_MASTER_FREQ_HZ};
   err |=
       i2c_master_bus_add_device(ext_bus, &slave_esp32_cfg, &slave_esp32_device);
+  bus_stats[I2C_BUS_EXT].freq_hz = I2C_MASTER_FREQ_HZ;
 
   return err;
 }
 
-esp_err_t check_device() {
-  esp_err_t ret = i2c_master_probe(bms_bus, I2C_ADDR, I2C_MASTER_TIMEOUT_MS);
+static esp_err_t select_channel(int8_t channel) {
+  if (channel < 0 || channel == mux_channel)
+    return ESP_OK;
+
+  // one bit per channel
+  uint8_t control = 1 << channel;
+  esp_err_t ret =
+      i2c_master_transmit(mux_device, &control, 1, I2C_TRANSFER_TIMEOUT_MS);
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to switch multiplexer to channel %d.", channel);
+    mux_channel = -1;
+    return ret;
+  }
+  mux_channel = channel;
+
+  return ESP_OK;
+}
+
+// call with the bus held, and the pack's channel selected
+static esp_err_t check_device_unlocked(uint8_t pack) {
+  esp_err_t ret =
+      i2c_master_probe(bms_bus, packs[pack].address, I2C_TRANSFER_TIMEOUT_MS);
   if (ret != ESP_OK)
-    ESP_LOGE(TAG, "I2C device not found at address 0x%x.", I2C_ADDR);
+    ESP_LOGE(TAG, "I2C device for pack %u not found at address 0x%x.", pack,
+             packs[pack].address);
 
   return ret;
 }
 
-void device_scan(void) {
-  ESP_LOGI(TAG, "Scanning for devices...");
+static void scan_channel() {
   uint8_t n_devices = 0;
   for (uint8_t i = 1; i < 127; i++) {
-    esp_err_t ret = i2c_master_probe(bms_bus, i, pdMS_TO_TICKS(1000));
+    esp_err_t ret = i2c_master_probe(bms_bus, i, I2C_TRANSFER_TIMEOUT_MS);
 
     if (ret == ESP_OK) {
       ESP_LOGI(TAG, "I2C device found at address 0x%02X", i);
@@ -84,8 +188,9 @@ void device_scan(void) {
     ESP_LOGW(TAG, "No devices found.");
 }
 
-esp_err_t read_SBS_data(uint8_t reg, uint8_t *data, size_t data_size) {
-  esp_err_t ret = check_device();
+static esp_err_t read_SBS_data_unlocked(uint8_t pack, uint8_t reg,
+                                        uint8_t *data, size_t data_size) {
+  esp_err_t ret = check_device_unlocked(pack);
   if (ret != ESP_OK)
     return ret;
 
@@ -95,39 +200,43 @@ esp_err_t read_SBS_data(uint8_t reg, uint8_t *data, size_t data_size) {
   }
 
   // transmit the register address
-  ret = i2c_master_transmit(bms_device, &reg, 1, I2C_MASTER_TIMEOUT_MS);
+  ret =
+      i2c_master_transmit(packs[pack].device, &reg, 1, I2C_TRANSFER_TIMEOUT_MS);
   if (ret != ESP_OK)
     return ret;
 
   // receive the response data
-  ret = i2c_master_receive(bms_device, data, data_size, I2C_MASTER_TIMEOUT_MS);
+  ret = i2c_master_receive(packs[pack].device, data, data_size,
+                           I2C_TRANSFER_TIMEOUT_MS);
 
   return ret;
 }
 
-void write_word(uint8_t command, uint8_t *word, size_t word_size) {
-  esp_err_t ret = check_device();
+static esp_err_t write_word_unlocked(uint8_t pack, uint8_t command,
+                                     uint8_t *word, size_t word_size) {
+  esp_err_t ret = check_device_unlocked(pack);
   if (ret != ESP_OK)
-    return;
+    return ret;
 
   uint8_t data[1 + word_size];
   data[0] = command;
   for (size_t i = 0; i < word_size; i++)
     data[1 + i] = word[word_size - 1 - i]; // assumed little-endian(?)
 
-  ret = i2c_master_transmit(bms_device, data, sizeof(data),
-                            I2C_MASTER_TIMEOUT_MS);
-  if (ret != ESP_OK) {
+  ret = i2c_master_transmit(packs[pack].device, data, sizeof(data),
+                            I2C_TRANSFER_TIMEOUT_MS);
+  if (ret != ESP_OK)
     ESP_LOGE(TAG, "Failed to write word!");
-    return;
-  }
+
+  return ret;
 }
 
-void read_data_flash(uint8_t *address, size_t address_size, uint8_t *data,
-                     size_t data_size) {
-  esp_err_t ret = check_device();
+static esp_err_t read_data_flash_unlocked(uint8_t pack, uint8_t *address,
+                                          size_t address_size, uint8_t *data,
+                                          size_t data_size) {
+  esp_err_t ret = check_device_unlocked(pack);
   if (ret != ESP_OK)
-    return;
+    return ret;
 
   uint8_t addr[2 + address_size];
   addr[0] = I2C_MANUFACTURER_BLOCK_ACCESS;
@@ -137,15 +246,16 @@ void read_data_flash(uint8_t *address, size_t address_size, uint8_t *data,
 
   // write the number of bytes of the address of the data we want to read, and
   // the address itself
-  ret = i2c_master_transmit(bms_device, addr, sizeof(addr),
-                            I2C_MASTER_TIMEOUT_MS);
+  ret = i2c_master_transmit(packs[pack].device, addr, sizeof(addr),
+                            I2C_TRANSFER_TIMEOUT_MS);
   if (ret != ESP_OK) {
     ESP_LOGE(TAG, "Failed to write in read_data_flash!");
-    return;
+    return ret;
   }
   // initiate read
   uint8_t MAC = I2C_MANUFACTURER_BLOCK_ACCESS;
-  ret = i2c_master_transmit(bms_device, &MAC, 1, I2C_MASTER_TIMEOUT_MS);
+  ret =
+      i2c_master_transmit(packs[pack].device, &MAC, 1, I2C_TRANSFER_TIMEOUT_MS);
 
   uint8_t buff[1 + address_size +
                32]; // each ManufacturerBlockAccess() block is maximum 32 bytes,
@@ -154,21 +264,24 @@ void read_data_flash(uint8_t *address, size_t address_size, uint8_t *data,
   for (size_t i = 0; i < sizeof(buff); i++)
     buff[i] = 0; // initialise to zeros
 
-  ret =
-      i2c_master_receive(bms_device, buff, sizeof(buff), I2C_MASTER_TIMEOUT_MS);
+  ret = i2c_master_receive(packs[pack].device, buff, sizeof(buff),
+                           I2C_TRANSFER_TIMEOUT_MS);
   if (ret == ESP_OK) {
     for (size_t i = 0; i < MIN(data_size, sizeof(buff) - 1 - address_size); i++)
       data[i] = buff[1 + address_size + i];
   } else {
     ESP_LOGE(TAG, "Failed to read in read_data_flash!");
   }
+
+  return ret;
 }
 
-void write_data_flash(uint8_t *address, size_t address_size, uint8_t *data,
-                      size_t data_size) {
-  esp_err_t ret = check_device();
+static esp_err_t write_data_flash_unlocked(uint8_t pack, uint8_t *address,
+                                           size_t address_size, uint8_t *data,
+                                           size_t data_size) {
+  esp_err_t ret = check_device_unlocked(pack);
   if (ret != ESP_OK)
-    return;
+    return ret;
 
   uint8_t block[1 + 1 + address_size + data_size];
   block[0] = I2C_MANUFACTURER_BLOCK_ACCESS;
@@ -180,20 +293,285 @@ void write_data_flash(uint8_t *address, size_t address_size, uint8_t *data,
   for (uint8_t i = 0; i < data_size; i++)
     block[2 + address_size + i] = data[i];
 
-  ret = i2c_master_transmit(bms_device, block, sizeof(block),
-                            I2C_MASTER_TIMEOUT_MS);
+  ret = i2c_master_transmit(packs[pack].device, block, sizeof(block),
+                            I2C_TRANSFER_TIMEOUT_MS);
   if (ret != ESP_OK) {
     ESP_LOGE(TAG, "Failed to write block!");
+  } else {
+    health[pack].busy_until =
+        esp_timer_get_time() + I2C_DATA_FLASH_WRITE_MS * 1000;
+  }
+
+  return ret;
+}
+
+static bool lock_bms_bus() {
+  // before initialisation there is nothing to contend with
+  if (bms_bus_mutex == NULL)
+    return true;
+
+  if (xSemaphoreTake(bms_bus_mutex, pdMS_TO_TICKS(I2C_MASTER_TIMEOUT_MS)) !=
+      pdTRUE) {
+    ESP_LOGE(TAG, "Timed out waiting for the BMS bus.");
+    return false;
+  }
+
+  return true;
+}
+
+static void unlock_bms_bus() {
+  if (bms_bus_mutex != NULL)
+    xSemaphoreGive(bms_bus_mutex);
+}
+
+static void record_transaction(i2c_bus_t bus, esp_err_t ret,
+                               int64_t latency_us) {
+  taskENTER_CRITICAL(&stats_lock);
+  i2c_bus_stats_t *stats = &bus_stats[bus];
+  stats->transactions++;
+  if (ret == ESP_ERR_TIMEOUT)
+    stats->timeouts++;
+  else if (ret != ESP_OK)
+    stats->nacks++;
+  if (stats->transactions == 1 || latency_us < stats->min_latency_us)
+    stats->min_latency_us = latency_us;
+  if (latency_us > stats->max_latency_us)
+    stats->max_latency_us = latency_us;
+  stats->total_latency_us += latency_us;
+  taskEXIT_CRITICAL(&stats_lock);
+}
+
+// call with the bus held
+static void recover_bus() {
+  // clocks SCL until whichever device is holding SDA low lets go, then sends a
+  // stop condition
+  esp_err_t ret = i2c_master_bus_reset(bms_bus);
+  mux_channel = -1;
+
+  taskENTER_CRITICAL(&stats_lock);
+  bus_stats[I2C_BUS_BMS].recoveries++;
+  taskEXIT_CRITICAL(&stats_lock);
+
+  if (ret != ESP_OK)
+    ESP_LOGE(TAG, "Failed to recover the BMS bus: %s", esp_err_to_name(ret));
+  else
+    ESP_LOGW(TAG, "Reset the BMS bus after a timeout.");
+}
+
+// call with the bus held
+static void adapt_clock(bool error) {
+  if (!I2C_ADAPTIVE_CLOCK)
+    return;
+
+  window_transactions++;
+  if (error)
+    window_errors++;
+  if (window_transactions < I2C_CLOCK_WINDOW)
+    return;
+
+  uint32_t freq_hz = bms_bus_freq_hz;
+  if (window_errors * 10 >= window_transactions) {
+    // one in ten or worse
+    freq_hz = MAX(freq_hz / 2, I2C_MIN_FREQ_HZ);
+    clean_windows = 0;
+  } else if (window_errors > 0) {
+    clean_windows = 0;
+  } else if (++clean_windows >= I2C_CLOCK_CLEAN_WINDOWS) {
+    freq_hz = MIN(freq_hz + freq_hz / 4, I2C_MAX_FREQ_HZ);
+    clean_windows = 0;
+  }
+  window_transactions = 0;
+  window_errors = 0;
+
+  if (freq_hz == bms_bus_freq_hz)
+    return;
+
+  // devices take their clock speed when they're added, so add them again
+  ESP_LOGW(TAG, "%s the BMS bus clock to %" PRIu32 " Hz.",
+           freq_hz < bms_bus_freq_hz ? "Lowering" : "Raising", freq_hz);
+  remove_bms_devices();
+  if (add_bms_devices(freq_hz) != ESP_OK)
+    ESP_LOGE(TAG, "Failed to add the BMS devices again.");
+  bms_bus_freq_hz = freq_hz;
+
+  taskENTER_CRITICAL(&stats_lock);
+  bus_stats[I2C_BUS_BMS].freq_hz = freq_hz;
+  taskEXIT_CRITICAL(&stats_lock);
+}
+
+static void end_transaction(uint8_t pack, esp_err_t ret) {
+  record_transaction(I2C_BUS_BMS, ret,
+                     esp_timer_get_time() - transaction_started_at);
+
+  device_health_t *device = &health[pack];
+  bool was_working = device->failures == 0;
+  if (ret == ESP_OK) {
+    device->failures = 0;
+    device->retry_at = 0;
+  } else {
+    if (device->failures < UINT8_MAX)
+      device->failures++;
+    int64_t backoff = (int64_t)I2C_BACKOFF_BASE_MS
+                      << MIN(device->failures - 1, 16);
+    device->retry_at =
+        esp_timer_get_time() + MIN(backoff, I2C_BACKOFF_MAX) * 1000;
+
+    if (ret == ESP_ERR_TIMEOUT)
+      recover_bus();
+  }
+  adapt_clock(ret != ESP_OK && was_working);
+
+  unlock_bms_bus();
+}
+
+static esp_err_t begin_transaction(uint8_t pack) {
+  if (pack >= BMS_N_PACKS) {
+    ESP_LOGE(TAG, "No pack %u.", pack);
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  if (!lock_bms_bus())
+    return ESP_ERR_TIMEOUT;
+
+  int64_t busy = health[pack].busy_until - esp_timer_get_time();
+  if (busy > 0) {
+    // let the other packs use the bus in the meantime
+    unlock_bms_bus();
+    vTaskDelay(pdMS_TO_TICKS(busy / 1000) + 1);
+    if (!lock_bms_bus())
+      return ESP_ERR_TIMEOUT;
+  }
+
+  // fail straight away while the pack is backed off
+  if (esp_timer_get_time() < health[pack].retry_at) {
+    taskENTER_CRITICAL(&stats_lock);
+    bus_stats[I2C_BUS_BMS].skipped++;
+    taskEXIT_CRITICAL(&stats_lock);
+    unlock_bms_bus();
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  transaction_started_at = esp_timer_get_time();
+  esp_err_t ret = select_channel(packs[pack].channel);
+  if (ret != ESP_OK)
+    end_transaction(pack, ret);
+
+  return ret;
+}
+
+esp_err_t check_device(uint8_t pack) {
+  esp_err_t ret = begin_transaction(pack);
+  if (ret != ESP_OK)
+    return ret;
+  ret = check_device_unlocked(pack);
+  end_transaction(pack, ret);
+
+  return ret;
+}
+
+void device_scan(void) {
+  ESP_LOGI(TAG, "Scanning for devices...");
+  if (BMS_MUX_ADDR == 0) {
+    scan_channel();
+    return;
+  }
+
+  // behind each channel of the multiplexer in turn
+  for (int i = 0; i < BMS_N_PACKS; i++) {
+    if (!lock_bms_bus())
+      continue;
+    ESP_LOGI(TAG, "Multiplexer channel %d:", i);
+    if (select_channel(packs[i].channel) == ESP_OK)
+      scan_channel();
+    unlock_bms_bus();
+  }
+}
+
+esp_err_t read_SBS_data(uint8_t pack, uint8_t reg, uint8_t *data,
+                        size_t data_size) {
+  esp_err_t ret = begin_transaction(pack);
+  if (ret != ESP_OK)
+    return ret;
+  ret = read_SBS_data_unlocked(pack, reg, data, data_size);
+  end_transaction(pack, ret);
+
+  return ret;
+}
+
+esp_err_t write_word(uint8_t pack, uint8_t command, uint8_t *word,
+                     size_t word_size) {
+  esp_err_t ret = begin_transaction(pack);
+  if (ret != ESP_OK)
+    return ret;
+  ret = write_word_unlocked(pack, command, word, word_size);
+  end_transaction(pack, ret);
+
+  return ret;
+}
+
+esp_err_t read_data_flash(uint8_t pack, uint8_t *address, size_t address_size,
+                          uint8_t *data, size_t data_size) {
+  esp_err_t ret = begin_transaction(pack);
+  if (ret != ESP_OK)
+    return ret;
+  ret = read_data_flash_unlocked(pack, address, address_size, data, data_size);
+  end_transaction(pack, ret);
+
+  return ret;
+}
+
+esp_err_t write_data_flash(uint8_t pack, uint8_t *address,
+                           size_t address_size, uint8_t *data,
+                           size_t data_size) {
+  esp_err_t ret = begin_transaction(pack);
+  if (ret != ESP_OK)
+    return ret;
+  ret = write_data_flash_unlocked(pack, address, address_size, data,
+                                  data_size);
+  end_transaction(pack, ret);
+
+  return ret;
+}
+
+void i2c_get_bus_stats(i2c_bus_t bus, i2c_bus_stats_t *stats) {
+  taskENTER_CRITICAL(&stats_lock);
+  *stats = bus_stats[bus];
+  taskEXIT_CRITICAL(&stats_lock);
+}
+
+void i2c_log_stats() {
+  static const char *names[N_I2C_BUSES] = {
+      [I2C_BUS_BMS] = "BMS",
+      [I2C_BUS_EXT] = "External",
+  };
+
+  for (int i = 0; i < N_I2C_BUSES; i++) {
+    i2c_bus_stats_t stats;
+    i2c_get_bus_stats(i, &stats);
+    if (stats.transactions == 0)
+      continue;
+
+    ESP_LOGI(TAG,
+             "%s bus at %" PRIu32 " Hz: %" PRIu32 " transactions, %" PRIu32
+             "/%" PRIu64 "/%" PRIu32 " us min/mean/max, %" PRIu32
+             " NACKs, %" PRIu32 " timeouts, %" PRIu32 " skipped, %" PRIu32
+             " recoveries",
+             names[i], stats.freq_hz, stats.transactions,
+             stats.min_latency_us,
+             stats.total_latency_us / stats.transactions,
+             stats.max_latency_us, stats.nacks, stats.timeouts, stats.skipped,
+             stats.recoveries);
   }
-  vTaskDelay(pdMS_TO_TICKS(100));
 }
 
 void write_to_slave_esp32() {
   uint8_t data[4] = {0};
   get_display_data(data);
 
+  int64_t started_at = esp_timer_get_time();
   esp_err_t ret = i2c_master_transmit(slave_esp32_device, data, sizeof(data),
                                       I2C_SLAVE_TIMEOUT_MS);
+  record_transaction(I2C_BUS_EXT, ret, esp_timer_get_time() - started_at);
   if (ret != ESP_OK) {
     ESP_LOGE(TAG, "Failed to write to Ben's ESP32!");
     return;
@@ -202,8 +580,10 @@ void write_to_slave_esp32() {
 
 void read_from_slave_esp32() {
   uint8_t data[16] = {0};
-  i2c_master_receive(slave_esp32_device, data, sizeof(data),
-                     I2C_SLAVE_TIMEOUT_MS);
+  int64_t started_at = esp_timer_get_time();
+  esp_err_t ret = i2c_master_receive(slave_esp32_device, data, sizeof(data),
+                                     I2C_SLAVE_TIMEOUT_MS);
+  record_transaction(I2C_BUS_EXT, ret, esp_timer_get_time() - started_at);
   printf("requestFrom: %zu\n", sizeof(data));
   for (uint8_t i = 0; i < sizeof(data); i++)
     printf("0x%x ", data[i]);
@@ -1,5 +1,9 @@
 #include "INV.h"
 
+#include "CHANGE.h"
+#include "DATA.h"
+#include "PARAM.h"
+#include "PROF.h"
 #include "TASK.h"
 #include "config.h"
 #include "global.h"
@@ -25,7 +29,7 @@ void inv_init() {
   ESP_ERROR_CHECK(uart_driver_install(INV_UART_NUM, INV_BUFF_SIZE,
                                       INV_BUFF_SIZE, 0, NULL, 0));
 
-  inverter_data.enabled = true; // enabled by default on startup
+  data_set_inverter_enabled(true); // enabled by default on startup
 
   gpio_config_t io_conf = {
       .intr_type = GPIO_INTR_DISABLE,
@@ -38,7 +42,10 @@ void inv_init() {
 }
 
 void update_inv() {
-  if (inverter_data.enabled) {
+  data_snapshot_t snapshot;
+  data_read_snapshot(&snapshot);
+
+  if (snapshot.inverter.enabled) {
     uint8_t msg[3] = {0x51, 0x30, 0x0D};
     uart_write_bytes(INV_UART_NUM, msg, sizeof(msg));
 
@@ -46,13 +53,33 @@ void update_inv() {
     int len =
         uart_read_bytes(INV_UART_NUM, buff, sizeof(buff), pdMS_TO_TICKS(1000));
     if (len > 0) {
-      inverter_data.status = buff[3];
-      inverter_data.output_voltage = buff[4] << 8 | buff[5];
-      inverter_data.battery_voltage = buff[6] << 8 | buff[7];
-      inverter_data.temperature = buff[8];
-      inverter_data.output_power = buff[9] << 8 | buff[10];
+      // build the full reading before publishing it
+      inverter_data_t sample = {0};
+      sample.status = buff[3];
+      sample.output_voltage = buff[4] << 8 | buff[5];
+      sample.battery_voltage = buff[6] << 8 | buff[7];
+      sample.temperature = buff[8];
+      sample.output_power = buff[9] << 8 | buff[10];
+      data_publish_inverter(&sample);
+      change_check();
     }
   }
 
   return;
 }
+
+void read_inv_freertos_task(void *arg) {
+  TickType_t last_wake_time = xTaskGetTickCount();
+
+  while (true) {
+    update_inv();
+    uint32_t period = param_get(PARAM_INV_PERIOD);
+    prof_checkin(period);
+    vTaskDelayUntil(&last_wake_time, pdMS_TO_TICKS(period));
+  }
+}
+
+void start_read_inv_task() {
+  xTaskCreate(read_inv_freertos_task, "read_inv_freertos_task", 2048, NULL, 4,
+              NULL);
+}
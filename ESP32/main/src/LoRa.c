@@ -1,8 +1,19 @@
 #include "LoRa.h"
 
+#include "ALARM.h"
 #include "BMS.h"
+#include "CHANGE.h"
+#include "CMD.h"
+#include "CODEC.h"
+#include "DLOG.h"
+#include "MESH.h"
+#include "PARAM.h"
+#include "SCHED.h"
 #include "SPI.h"
+#include "STATE.h"
 #include "TASK.h"
+#include "TRACE.h"
+#include "UPLINK.h"
 #include "WS.h"
 #include "config.h"
 #include "global.h"
@@ -18,28 +29,28 @@
 
 static const char *TAG = "LoRa";
 
-static TimerHandle_t transmit_timer;
+static TimerHandle_t alarm_transmit_timer;
 
-void lora_init() {
-  if (spi_init() != ESP_OK)
-    return;
+static void configure_modem() {
+  // from the settings, which can change while running
+  uint8_t sf = param_get(PARAM_RADIO_SF);
+  uint8_t bw = param_get(PARAM_RADIO_BW);
+  uint8_t cr = param_get(PARAM_RADIO_CR);
 
   // Set carrier frequency
-  uint64_t frf = ((uint64_t)(LORA_FREQ * 1E6) << 19) / 32000000;
+  uint64_t frf =
+      ((uint64_t)(param_get(PARAM_RADIO_FREQ) * 1E6) << 19) / 32000000;
   spi_write_register(REG_FRF_MSB, (uint8_t)(frf >> 16));
   spi_write_register(REG_FRF_MID, (uint8_t)(frf >> 8));
   spi_write_register(REG_FRF_LSB, (uint8_t)(frf >> 0));
 
-  // Set LNA gain to maximum
-  spi_write_register(REG_LNA, 0b00100011); // LNA_MAX_GAIN | LNA_BOOST
-
   // Enable AGC (bit 2 of RegModemConfig3)
   spi_write_register(
       REG_MODEM_CONFIG_3,     // bits:
       (0b00001111 & 0) << 4 | //  7-4
           (0b00000001 &
            (LORA_LDRO |
-            (calculate_symbol_length(LORA_SF, LORA_BW) > 16.0 ? true : false)))
+            (calculate_symbol_length(sf, bw) > 16.0 ? true : false)))
               << 3 |              //  3
           (0b00000001 & 1) << 2 | //  2    AGC on
           (0b00000011 & 0)        //  1-0
@@ -48,34 +59,44 @@ void lora_init() {
   // Configure modem parameters:
   //  bandwidth, coding rate, header
   spi_write_register(REG_MODEM_CONFIG_1,               // bits:
-                     (0b00001111 & LORA_BW) << 4 |     //  7-4
-                         (0b00000111 & LORA_CR) << 1 | //  3-1
+                     (0b00001111 & bw) << 4 |          //  7-4
+                         (0b00000111 & cr) << 1 |      //  3-1
                          (0b00000001 & LORA_HEADER)    //  0
   );
   //  spreading factor, cyclic redundancy check
   spi_write_register(REG_MODEM_CONFIG_2,                        // bits:
-                     (0b00001111 & LORA_SF) << 4 |              //  7-4
+                     (0b00001111 & sf) << 4 |                   //  7-4
                          (0b00000001 & LORA_Tx_CONT) << 3 |     //  3
                          (0b00000001 & LORA_Rx_PAYL_CRC) << 2 | //  2
                          (0b00000011 & 0)                       //  1-0
   ); // SF7, TxContinuousMode=0, CRC on
 
-  // Preamble length (8 bytes = 0x0008)
-  spi_write_register(REG_PREAMBLE_MSB, 0x00);
-  spi_write_register(REG_PREAMBLE_LSB, 0x08);
-
   // Set output power to 13 dBm using PA_BOOST
   spi_write_register(REG_PA_CONFIG,                 // bits:
                      (0b00000001 & 1) << 7 |        // 7   PA BOOST
                          (0b00000111 & 0x04) << 4 | // 6-4
-                         (0b00001111 & LORA_OUTPUT_POWER));
+                         (0b00001111 & param_get(PARAM_RADIO_POWER)));
+}
+
+void lora_init() {
+  if (spi_init() != ESP_OK)
+    return;
+
+  // Set LNA gain to maximum
+  spi_write_register(REG_LNA, 0b00100011); // LNA_MAX_GAIN | LNA_BOOST
+
+  configure_modem();
+
+  // Preamble length (8 bytes = 0x0008)
+  spi_write_register(REG_PREAMBLE_MSB, 0x00);
+  spi_write_register(REG_PREAMBLE_LSB, 0x08);
 
   if (LORA_POWER_BOOST)
     spi_write_register(REG_PA_DAC, 0x87);
   else
     spi_write_register(REG_PA_DAC, 0x84);
 
-  LoRa_configured = true;
+  state_set(STATE_LORA);
   ESP_LOGI(TAG, "SX127x configured to RadioHead defaults");
 
   // final setup
@@ -86,6 +107,36 @@ void lora_init() {
   spi_write_register(REG_IRQ_FLAGS, 0b11111111); // clear IRQ flags
 }
 
+static void radio_watcher(param_id_t id, int32_t value) {
+  // from the job worker, like every other use of the radio, so nothing is
+  // being sent. the registers are only written in standby
+  if (!state_is(STATE_LORA))
+    return;
+  spi_write_register(REG_OP_MODE, 0b10000001); // LoRa + standby
+  configure_modem();
+  spi_write_register(REG_OP_MODE, 0b10000101); // return to LoRa + RX mode
+}
+
+void lora_start() {
+  // once, when this device first needs the radio: at boot, or on being
+  // elected the ROOT
+  static bool started = false;
+  if (started)
+    return;
+  started = true;
+
+  lora_init();
+  if (!state_is(STATE_LORA))
+    return;
+  param_watch(PARAM_RADIO, radio_watcher);
+
+  if (LORA_RECEIVE_ENABLED)
+    start_receive_interrupt_task();
+
+  if (LORA_TRANSMIT_ENABLED)
+    start_transmit_timed_task();
+}
+
 size_t json_to_binary(uint8_t *binary_message, cJSON *json_array) {
   // build binary_message from json_array
   uint8_t n_devices = 0;
@@ -108,184 +159,25 @@ size_t json_to_binary(uint8_t *binary_message, cJSON *json_array) {
     }
 
     if (strcmp(type->valuestring, "data") == 0) {
-      radio_data_packet *packet = malloc(sizeof(radio_data_packet));
-      if (packet == NULL) {
-        ESP_LOGE(TAG, "Failed to allocate packet memory\n");
-        return 0;
-      }
-      memset(packet, 0, sizeof(radio_data_packet));
-      packet->type = DATA;
-
-      cJSON *esp_id = cJSON_GetObjectItem(item, "esp_id");
-      if (!esp_id) {
-        ESP_LOGE(TAG, "No \"esp_id\" key in cJSON array item");
-        return 0;
-      }
-
-      packet->esp_id = esp_id->valueint;
-
-      cJSON *content = cJSON_GetObjectItem(item, "content");
-      if (!content) {
-        ESP_LOGE(TAG, "No \"content\" key in cJSON array item");
+      report_t report;
+      if (!codec_from_json(item, &report))
         return 0;
-      }
-      cJSON *obj;
-
-      obj = cJSON_GetObjectItem(content, "t");
-      if (obj)
-        packet->t = (double)obj->valuedouble;
-      obj = NULL;
-
-      obj = cJSON_GetObjectItem(content, "d");
-      if (obj)
-        packet->d = (uint32_t)obj->valueint;
-      obj = NULL;
-
-      obj = cJSON_GetObjectItem(content, "lat");
-      if (obj)
-        packet->lat = (double)obj->valuedouble;
-      obj = NULL;
-
-      obj = cJSON_GetObjectItem(content, "lon");
-      if (obj)
-        packet->lon = (double)obj->valuedouble;
-      obj = NULL;
-
-      obj = cJSON_GetObjectItem(content, "Q");
-      if (obj)
-        packet->Q = (uint8_t)obj->valueint;
-      obj = NULL;
-
-      obj = cJSON_GetObjectItem(content, "H");
-      if (obj)
-        packet->H = (uint8_t)obj->valueint;
-      obj = NULL;
-
-      obj = cJSON_GetObjectItem(content, "V");
-      if (obj)
-        packet->V = (uint8_t)obj->valueint;
-      obj = NULL;
-
-      obj = cJSON_GetObjectItem(content, "V1");
-      if (obj)
-        packet->V1 = (uint16_t)obj->valueint;
-      obj = NULL;
-
-      obj = cJSON_GetObjectItem(content, "V2");
-      if (obj)
-        packet->V2 = (uint16_t)obj->valueint;
-      obj = NULL;
-
-      obj = cJSON_GetObjectItem(content, "V3");
-      if (obj)
-        packet->V3 = (uint16_t)obj->valueint;
-      obj = NULL;
-
-      obj = cJSON_GetObjectItem(content, "V4");
-      if (obj)
-        packet->V4 = (uint16_t)obj->valueint;
-      obj = NULL;
-
-      obj = cJSON_GetObjectItem(content, "I");
-      if (obj)
-        packet->I = (int8_t)obj->valueint;
-      obj = NULL;
-
-      obj = cJSON_GetObjectItem(content, "I1");
-      if (obj)
-        packet->I1 = (int16_t)obj->valueint;
-      obj = NULL;
-
-      obj = cJSON_GetObjectItem(content, "I2");
-      if (obj)
-        packet->I2 = (int16_t)obj->valueint;
-      obj = NULL;
-
-      obj = cJSON_GetObjectItem(content, "I3");
-      if (obj)
-        packet->I3 = (int16_t)obj->valueint;
-      obj = NULL;
-
-      obj = cJSON_GetObjectItem(content, "I4");
-      if (obj)
-        packet->I4 = (int16_t)obj->valueint;
-      obj = NULL;
-
-      obj = cJSON_GetObjectItem(content, "aT");
-      if (obj)
-        packet->aT = (int16_t)obj->valueint;
-      obj = NULL;
-
-      obj = cJSON_GetObjectItem(content, "cT");
-      if (obj)
-        packet->cT = (int16_t)obj->valueint;
-      obj = NULL;
-
-      obj = cJSON_GetObjectItem(content, "T1");
-      if (obj)
-        packet->T1 = (int16_t)obj->valueint;
-      obj = NULL;
-
-      obj = cJSON_GetObjectItem(content, "T2");
-      if (obj)
-        packet->T2 = (int16_t)obj->valueint;
-      obj = NULL;
-
-      obj = cJSON_GetObjectItem(content, "T3");
-      if (obj)
-        packet->T3 = (int16_t)obj->valueint;
-      obj = NULL;
-
-      obj = cJSON_GetObjectItem(content, "T4");
-      if (obj)
-        packet->T4 = (int16_t)obj->valueint;
-      obj = NULL;
-
-      obj = cJSON_GetObjectItem(content, "OTC");
-      if (obj)
-        packet->OTC = (int16_t)obj->valueint;
-      obj = NULL;
-
-      obj = cJSON_GetObjectItem(content, "CC");
-      if (obj)
-        packet->CC = (uint16_t)obj->valueint;
-      obj = NULL;
-
-      obj = cJSON_GetObjectItem(content, "P");
-      if (obj)
-        packet->P = (uint16_t)obj->valueint;
-      obj = NULL;
-
-      obj = cJSON_GetObjectItem(content, "inv");
-      if (obj)
-        packet->inv = (bool)obj->valueint;
-
-      obj = cJSON_GetObjectItem(content, "wifi");
-      if (obj)
-        packet->wifi = (bool)obj->valueint;
 
-      // now copy the packet into the returned binary_message which will be
-      // broadcasted
-      memcpy(&binary_message[packet_start], packet, sizeof(radio_data_packet));
-      // and shift the position along for the next iteration
-      packet_start += sizeof(radio_data_packet);
+      // pack straight into the returned binary_message which will be
+      // broadcasted, and shift the position along for the next iteration
+      packet_start += codec_pack(&report, &binary_message[packet_start]);
     }
 
     else if (strcmp(type->valuestring, "query") == 0) {
-      radio_query_packet *packet = malloc(sizeof(radio_query_packet));
-      if (packet == NULL) {
-        ESP_LOGE(TAG, "Failed to allocate packet memory\n");
-        return 0;
-      }
-      memset(packet, 0, sizeof(radio_query_packet));
-      packet->type = QUERY;
+      radio_query_packet packet = {0};
+      packet.type = QUERY;
 
       cJSON *esp_id = cJSON_GetObjectItem(item, "esp_id");
       if (!esp_id) {
         ESP_LOGE(TAG, "No \"esp_id\" key in cJSON array item");
         return 0;
       }
-      packet->esp_id = atoi(&esp_id->valuestring[4]);
+      packet.esp_id = atoi(&esp_id->valuestring[4]);
 
       cJSON *content = cJSON_GetObjectItem(item, "content");
       if (!content) {
@@ -293,30 +185,26 @@ size_t json_to_binary(uint8_t *binary_message, cJSON *json_array) {
         return 0;
       }
       if (strcmp(content->valuestring, "are you still there?") == 0)
-        packet->query = 1;
+        packet.query = 1;
 
       // now copy the packet into the returned binary_message which will be
       // broadcasted
-      memcpy(&binary_message[packet_start], packet, sizeof(radio_query_packet));
+      memcpy(&binary_message[packet_start], &packet,
+             sizeof(radio_query_packet));
       // and shift the position along for the next iteration
       packet_start += sizeof(radio_query_packet);
     }
 
     else if (strcmp(type->valuestring, "request") == 0) {
-      radio_request_packet *packet = malloc(sizeof(radio_request_packet));
-      if (packet == NULL) {
-        ESP_LOGE(TAG, "Failed to allocate packet memory\n");
-        return 0;
-      }
-      memset(packet, 0, sizeof(radio_request_packet));
-      packet->type = REQUEST;
+      radio_request_packet packet = {0};
+      packet.type = REQUEST;
 
       cJSON *esp_id = cJSON_GetObjectItem(item, "esp_id");
       if (!esp_id) {
         ESP_LOGE(TAG, "No \"esp_id\" key in cJSON array item");
         return 0;
       }
-      packet->esp_id = esp_id->valueint;
+      packet.esp_id = esp_id->valueint;
 
       cJSON *summary = cJSON_GetObjectItem(content, "summary");
       if (!summary) {
@@ -329,22 +217,22 @@ size_t json_to_binary(uint8_t *binary_message, cJSON *json_array) {
           ESP_LOGE(TAG, "No \"data\" key in cJSON array item");
           return 0;
         }
-        packet->request = CHANGE_SETTINGS;
+        packet.request = CHANGE_SETTINGS;
 
         cJSON *new_esp_id = cJSON_GetObjectItem(data, "new_esp_id");
         if (new_esp_id)
-          packet->new_esp_id = new_esp_id->valueint;
+          packet.new_esp_id = new_esp_id->valueint;
 
         cJSON *OTC = cJSON_GetObjectItem(data, "OTC");
         if (OTC)
-          packet->OTC = OTC->valueint;
+          packet.OTC = OTC->valueint;
       } else if (strcmp(summary->valuestring, "connect-wifi") == 0) {
         cJSON *data = cJSON_GetObjectItem(content, "data");
         if (!data) {
           ESP_LOGE(TAG, "No \"data\" key in cJSON array item");
           return 0;
         }
-        packet->request = CONNECT_WIFI;
+        packet.request = CONNECT_WIFI;
 
         cJSON *ssid = cJSON_GetObjectItem(data, "ssid");
         if (!ssid) {
@@ -361,19 +249,40 @@ size_t json_to_binary(uint8_t *binary_message, cJSON *json_array) {
           ESP_LOGE(TAG, "No \"auto_connect\" key in cJSON array item");
           return 0;
         }
-        for (size_t i = 0; i < sizeof(packet->ssid); i++)
-          packet->ssid[i] = (uint8_t)ssid->valuestring[i];
-        for (size_t i = 0; i < sizeof(packet->password); i++)
-          packet->password[i] = (uint8_t)password->valuestring[i];
-        packet->auto_connect = (bool)auto_connect->valueint;
+        for (size_t i = 0; i < sizeof(packet.ssid); i++)
+          packet.ssid[i] = (uint8_t)ssid->valuestring[i];
+        for (size_t i = 0; i < sizeof(packet.password); i++)
+          packet.password[i] = (uint8_t)password->valuestring[i];
+        packet.auto_connect = (bool)auto_connect->valueint;
+      } else if (strcmp(summary->valuestring, "set-params") == 0) {
+        cJSON *data = cJSON_GetObjectItem(content, "data");
+        if (!cJSON_IsObject(data)) {
+          ESP_LOGE(TAG, "No \"data\" key in cJSON array item");
+          return 0;
+        }
+        packet.request = SET_PARAMS;
+
+        // by number rather than by key, with the ROOT checking the values
+        cJSON *setting = NULL;
+        cJSON_ArrayForEach(setting, data) {
+          int id = param_find(setting->string);
+          if (id < 0 || !cJSON_IsNumber(setting) ||
+              packet.n_params == RADIO_MAX_PARAMS) {
+            ESP_LOGE(TAG, "Can't send setting %s by radio", setting->string);
+            return 0;
+          }
+          packet.param_ids[packet.n_params] = id;
+          packet.param_values[packet.n_params] = setting->valueint;
+          packet.n_params++;
+        }
       } else if (strcmp(summary->valuestring, "reset-bms") == 0)
-        packet->request = RESET_BMS;
+        packet.request = RESET_BMS;
       else if (strcmp(summary->valuestring, "unseal-bms") == 0)
-        packet->request = UNSEAL_BMS;
+        packet.request = UNSEAL_BMS;
 
       // now copy the packet into the returned binary_message which will be
       // broadcasted
-      memcpy(&binary_message[packet_start], packet,
+      memcpy(&binary_message[packet_start], &packet,
              sizeof(radio_request_packet));
       // and shift the position along for the next iteration
       packet_start += sizeof(radio_request_packet);
@@ -463,8 +372,8 @@ void binary_to_json(uint8_t *binary_message, cJSON *json_array) {
     }
 
     if (type == DATA) {
-      radio_data_packet *packet =
-          (radio_data_packet *)&binary_message[packet_start];
+      report_t report;
+      packet_start += codec_unpack(&binary_message[packet_start], &report);
       cJSON_AddStringToObject(message, "type", "data");
 
       cJSON *content = cJSON_CreateObject();
@@ -474,51 +383,13 @@ void binary_to_json(uint8_t *binary_message, cJSON *json_array) {
         cJSON_Delete(json_array);
         return;
       }
-      cJSON_AddNumberToObject(
-          content, "t",
-          packet->t); // TODO: these are wrong while the rest below are correct
-      cJSON_AddNumberToObject(
-          content, "d",
-          packet->d); // TODO: these are wrong while the rest below are correct
-      cJSON_AddNumberToObject(
-          content, "lat",
-          packet
-              ->lat); // TODO: these are wrong while the rest below are correct
-      cJSON_AddNumberToObject(
-          content, "lon",
-          packet
-              ->lon); // TODO: these are wrong while the rest below are correct
-      cJSON_AddNumberToObject(content, "Q", packet->Q);
-      cJSON_AddNumberToObject(content, "H", packet->H);
-      cJSON_AddNumberToObject(content, "V", packet->V);
-      cJSON_AddNumberToObject(content, "V1", packet->V1);
-      cJSON_AddNumberToObject(content, "V2", packet->V2);
-      cJSON_AddNumberToObject(content, "V3", packet->V3);
-      cJSON_AddNumberToObject(content, "V4", packet->V4);
-      cJSON_AddNumberToObject(content, "I", packet->I);
-      cJSON_AddNumberToObject(content, "I1", packet->I1);
-      cJSON_AddNumberToObject(content, "I2", packet->I2);
-      cJSON_AddNumberToObject(content, "I3", packet->I3);
-      cJSON_AddNumberToObject(content, "I4", packet->I4);
-      cJSON_AddNumberToObject(content, "aT", packet->aT);
-      cJSON_AddNumberToObject(content, "cT", packet->cT);
-      cJSON_AddNumberToObject(content, "T1", packet->T1);
-      cJSON_AddNumberToObject(content, "T2", packet->T2);
-      cJSON_AddNumberToObject(content, "T3", packet->T3);
-      cJSON_AddNumberToObject(content, "T4", packet->T4);
-      cJSON_AddNumberToObject(content, "OTC", packet->OTC);
-      cJSON_AddNumberToObject(content, "CC", packet->CC);
-      cJSON_AddNumberToObject(content, "P", packet->P);
-      cJSON_AddBoolToObject(content, "inv", packet->inv);
-      cJSON_AddBoolToObject(content, "wifi", packet->wifi);
+      codec_add_to_json(&report, content);
 
-      cJSON_AddNumberToObject(message, "esp_id", packet->esp_id);
+      cJSON_AddNumberToObject(message, "esp_id", report.esp_id);
 
       cJSON_AddItemToObject(message, "content", content);
 
       cJSON_AddItemToArray(json_array, message);
-
-      packet_start += sizeof(radio_data_packet);
     }
 
     else if (type == QUERY) {
@@ -574,6 +445,15 @@ void binary_to_json(uint8_t *binary_message, cJSON *json_array) {
         cJSON_AddStringToObject(data, "password", (char *)packet->password);
         cJSON_AddBoolToObject(data, "auto_connect", packet->auto_connect);
 
+        cJSON_AddItemToObject(content, "data", data);
+      } else if (packet->request == SET_PARAMS) {
+        cJSON_AddStringToObject(content, "summary", "set-params");
+
+        for (int i = 0; i < packet->n_params && i < RADIO_MAX_PARAMS; i++)
+          if (packet->param_ids[i] < N_PARAMS)
+            cJSON_AddNumberToObject(data, param_key(packet->param_ids[i]),
+                                    packet->param_values[i]);
+
         cJSON_AddItemToObject(content, "data", data);
       } else if (packet->request == RESET_BMS)
         cJSON_AddStringToObject(content, "summary", "reset-bms");
@@ -586,7 +466,129 @@ void binary_to_json(uint8_t *binary_message, cJSON *json_array) {
 
       packet_start += sizeof(radio_request_packet);
     }
+
+    else if (type == RESPONSE) {
+      cmd_response_t response;
+      packet_start += cmd_unpack(&binary_message[packet_start], &response);
+      cJSON_AddStringToObject(message, "type", "response");
+
+      cJSON *content = cJSON_CreateObject();
+      if (content == NULL) {
+        ESP_LOGE(TAG, "Failed to create content object");
+        cJSON_Delete(message);
+        cJSON_Delete(json_array);
+        return;
+      }
+      cmd_add_to_json(&response, content);
+
+      cJSON_AddNumberToObject(message, "esp_id", response.esp_id);
+
+      cJSON_AddItemToObject(message, "content", content);
+
+      cJSON_AddItemToArray(json_array, message);
+    }
+
+    else if (type == ALARM) {
+      alarm_report_t report;
+      packet_start += alarm_unpack(&binary_message[packet_start], &report);
+      cJSON_AddStringToObject(message, "type", "alarm");
+
+      cJSON *content = cJSON_CreateObject();
+      if (content == NULL) {
+        ESP_LOGE(TAG, "Failed to create content object");
+        cJSON_Delete(message);
+        cJSON_Delete(json_array);
+        return;
+      }
+      alarm_add_to_json(&report, content);
+
+      cJSON_AddNumberToObject(message, "esp_id", report.esp_id);
+
+      cJSON_AddItemToObject(message, "content", content);
+
+      cJSON_AddItemToArray(json_array, message);
+    }
+  }
+}
+
+static bool batch_radio_frame(const cJSON *json_array) {
+  // only ever called from the job worker, so this can be reused
+  static report_t frame[BMS_N_PACKS + MESH_SIZE];
+  size_t n_reports = 0;
+  const cJSON *message = NULL;
+  cJSON_ArrayForEach(message, json_array) {
+    cJSON *type = cJSON_GetObjectItem(message, "type");
+    if (n_reports == sizeof(frame) / sizeof(frame[0]) ||
+        !cJSON_IsString(type) || strcmp(type->valuestring, "data") != 0 ||
+        !codec_from_json(message, &frame[n_reports]))
+      return false;
+    n_reports++;
   }
+
+  return n_reports > 0 && uplink_batch(frame, n_reports);
+}
+
+void receive_frame(const uint8_t *encoded, size_t length, int rssi_dbm) {
+  // everything done with a whole frame once it has been read off the radio
+  uint8_t decoded_payload[length];
+  decode_frame(encoded, length, decoded_payload);
+
+  DLOGI(TAG, "Received radio message with RSSI: %d dBm", rssi_dbm);
+  cJSON *json_array = cJSON_CreateArray();
+  if (json_array == NULL) {
+    ESP_LOGE(TAG, "Failed to create JSON array");
+    return;
+  }
+  binary_to_json(decoded_payload, json_array);
+  if (LORA_IS_RECEIVER) {
+    if (VERBOSE)
+      DLOGI(TAG, "Forwarding %d message(s) on to web server",
+            cJSON_GetArraySize(json_array));
+    // telemetry goes with the uplink's next batch, anything else
+    // straight away, so is only printed then
+    if (!batch_radio_frame(json_array)) {
+      char *message_string = cJSON_PrintUnformatted(json_array);
+      if (message_string == NULL) {
+        ESP_LOGE(TAG, "Failed to print cJSON to string");
+      } else {
+        uplink_send(message_string);
+        cJSON_free(message_string);
+      }
+    }
+  } else {
+    if (VERBOSE)
+      DLOGI(TAG, "Processing %d message(s) received from web server",
+            cJSON_GetArraySize(json_array));
+    cJSON *message = NULL;
+    cJSON_ArrayForEach(message, json_array) {
+      // should just be one message at a time from the web server
+      if (!cJSON_IsObject(message))
+        break;
+
+      cJSON *esp_id = cJSON_GetObjectItem(message, "esp_id");
+      if (esp_id) {
+        uint8_t id_int = esp_id->valueint;
+        if (id_int == ESP_ID) {
+          if (VERBOSE)
+            DLOGI(TAG, "This request is for me, the mesh ROOT");
+          // the response goes back with a later transmission
+          cJSON_DeleteItemFromObject(message, "esp_id");
+          cmd_submit(message, CMD_ORIGIN_RADIO, -1);
+        } else {
+          if (VERBOSE)
+            DLOGI(TAG, "This request is for mesh client bms_%u", id_int);
+          // keeping the "esp_id" key for any node it is relayed through
+          char *remainder_string = cJSON_PrintUnformatted(message);
+          if (remainder_string != NULL) {
+            // send to the WebSocket client it is reached through
+            mesh_send_down(id_int, remainder_string);
+            cJSON_free(remainder_string);
+          }
+        }
+      }
+    }
+  }
+  cJSON_Delete(json_array);
 }
 
 // persisted receiver variables
@@ -594,7 +596,8 @@ static size_t full_message_length = 0;
 static bool chunked = false;
 void receive() {
   // should only run if receiver or ROOT but not connected to Wi-Fi
-  if (!(LORA_IS_RECEIVER || (is_root && !connected_to_WiFi)))
+  if (!(LORA_IS_RECEIVER ||
+        (state_is(STATE_ROOT) && !state_is(STATE_WIFI))))
     return;
 
   uint8_t
@@ -629,102 +632,9 @@ void receive() {
       uint8_t rssi_raw = spi_read_register(0x1A);
       int rssi_dbm = -157 + rssi_raw;
 
-      uint8_t decoded_payload[full_message_length];
-      decode_frame(encoded_buffer, full_message_length, decoded_payload);
+      size_t length_received = full_message_length;
       full_message_length = 0;
-
-      ESP_LOGI(TAG, "Received radio message with RSSI: %d dBm", rssi_dbm);
-      cJSON *json_array = cJSON_CreateArray();
-      if (json_array == NULL) {
-        ESP_LOGE(TAG, "Failed to create JSON array");
-        return;
-      }
-      binary_to_json(decoded_payload, json_array);
-      char *message_string = malloc(WS_MESSAGE_MAX_LEN);
-      snprintf(message_string, WS_MESSAGE_MAX_LEN, "%s",
-               cJSON_PrintUnformatted(json_array));
-      if (message_string == NULL) {
-        ESP_LOGE(TAG, "Failed to print cJSON to string\n");
-        return;
-      } else {
-        if (LORA_IS_RECEIVER) {
-          if (VERBOSE) {
-            ESP_LOGI(TAG, "Forwarding message:");
-            ESP_LOGI(TAG, "%s", message_string);
-            ESP_LOGI(TAG, "on to web server");
-          }
-          send_message(message_string);
-        } else {
-          if (VERBOSE) {
-            ESP_LOGI(TAG, "Processing messaged received from web server:");
-            ESP_LOGI(TAG, "%s", message_string);
-          }
-          cJSON *message = NULL;
-          cJSON_ArrayForEach(message, json_array) {
-            // should just be one message at a time from the web server
-            if (!cJSON_IsObject(message))
-              return;
-
-            // pop the "esp_id" key
-            cJSON *esp_id = cJSON_DetachItemFromObject(message, "esp_id");
-            if (esp_id) {
-              uint8_t id_int = esp_id->valueint;
-              if (id_int == ESP_ID) {
-                if (VERBOSE)
-                  ESP_LOGI(TAG, "This request is for me, the mesh ROOT");
-                cJSON *response = cJSON_CreateObject();
-                perform_request(message, response);
-              } else {
-                if (VERBOSE)
-                  ESP_LOGI(TAG,
-                           "This request is for mesh client bms_%u:", id_int);
-                char *remainder_string = cJSON_PrintUnformatted(message);
-                if (remainder_string != NULL) {
-                  if (VERBOSE)
-                    ESP_LOGI(TAG, "%s", remainder_string);
-                  // send to correct WebSocket client
-                  for (int i = 0; i < WS_CONFIG_MAX_CLIENTS; i++) {
-                    if (!client_sockets[i].is_browser_not_mesh &&
-                        client_sockets[i].descriptor >= 0 &&
-                        client_sockets[i].esp_id == id_int) {
-                      httpd_ws_frame_t ws_pkt = {
-                          .payload = (uint8_t *)remainder_string,
-                          .len = strlen(remainder_string),
-                          .type = HTTPD_WS_TYPE_TEXT,
-                      };
-
-                      int tries = 0;
-                      int max_tries = 5;
-                      esp_err_t err;
-                      while (tries < max_tries) {
-                        err = httpd_ws_send_frame_async(
-                            server, client_sockets[i].descriptor, &ws_pkt);
-                        if (err == ESP_OK)
-                          break;
-                        vTaskDelay(pdMS_TO_TICKS(1000));
-                        tries++;
-                      }
-
-                      if (err != ESP_OK) {
-                        ESP_LOGE(TAG, "Failed to send frame to client %d: %s",
-                                 client_sockets[i].descriptor,
-                                 esp_err_to_name(err));
-                        remove_client(
-                            client_sockets[i]
-                                .descriptor); // Clean up disconnected clients
-                      }
-                    }
-                  }
-                  free(remainder_string);
-                }
-              }
-              cJSON_Delete(esp_id);
-            }
-          }
-        }
-        free(message_string);
-      }
-      cJSON_Delete(json_array);
+      receive_frame(encoded_buffer, length_received, rssi_dbm);
     }
 
     // Clear IRQ flags again
@@ -734,6 +644,7 @@ void receive() {
 
 void dio0_isr_handler(void *arg) {
   BaseType_t woken = pdFALSE;
+  trace_isr("lora_dio0");
 
   job_t job = {.type = JOB_LORA_RECEIVE};
   xQueueSendToFrontFromISR(job_queue, &job,
@@ -791,9 +702,62 @@ void execute_transmission(uint8_t *message, size_t n_bytes) {
 
 // persisted transmitter variables
 static int64_t delay_transmission_until = 0; // microseconds
+
+static int airtime(size_t full_len) {
+  // ms, with the radio settings in use now
+  return calculate_transmission_delay(
+      param_get(PARAM_RADIO_SF), param_get(PARAM_RADIO_BW), 8, full_len,
+      param_get(PARAM_RADIO_CR), LORA_HEADER, LORA_LDRO);
+}
+
+static bool transmit_alarms() {
+  // alarms go out in a message of their own, ahead of the telemetry data
+  uint8_t binary_message[1 + (MESH_SIZE + 1) * sizeof(radio_alarm_packet)];
+  size_t binary_message_length = alarm_pack_pending(binary_message);
+  if (binary_message_length == 0)
+    return false;
+
+  // small enough for a single chunk, even if every byte is escaped
+  uint8_t encoded_alarms[2 * sizeof(binary_message) + 2];
+  size_t full_len =
+      encode_frame(binary_message, binary_message_length, encoded_alarms);
+  execute_transmission(encoded_alarms, full_len);
+
+  int transmission_delay = airtime(full_len);
+  DLOGI(TAG, "Radio alarm sent. Delaying for %d ms", transmission_delay);
+
+  delay_transmission_until =
+      (int64_t)(transmission_delay * 1000) + esp_timer_get_time();
+
+  return true;
+}
+
+static bool transmit_responses() {
+  // as do the responses to requests which came by radio
+  uint8_t binary_message[1 + CMD_MAX_PENDING * sizeof(radio_response_packet) +
+                         MESH_SIZE * sizeof(radio_response_packet)];
+  size_t binary_message_length = cmd_pack_pending(binary_message);
+  if (binary_message_length == 0)
+    return false;
+
+  uint8_t encoded_responses[2 * sizeof(binary_message) + 2];
+  size_t full_len =
+      encode_frame(binary_message, binary_message_length, encoded_responses);
+  execute_transmission(encoded_responses, full_len);
+
+  int transmission_delay = airtime(full_len);
+  DLOGI(TAG, "Radio response sent. Delaying for %d ms", transmission_delay);
+
+  delay_transmission_until =
+      (int64_t)(transmission_delay * 1000) + esp_timer_get_time();
+
+  return true;
+}
+
 void transmit() {
   // should only run if receiver or ROOT but not connected to Wi-Fi
-  if (!(LORA_IS_RECEIVER || (is_root && !connected_to_WiFi)))
+  if (!(LORA_IS_RECEIVER ||
+        (state_is(STATE_ROOT) && !state_is(STATE_WIFI))))
     return;
 
   if (esp_timer_get_time() > delay_transmission_until) {
@@ -801,11 +765,9 @@ void transmit() {
       if (strcmp(forwarded_message, "") != 0) {
         // forward requests made on the webserver
         // to all master nodes out there
-        if (VERBOSE) {
-          ESP_LOGI(TAG, "Now forwarding:");
-          ESP_LOGI(TAG, "%s", forwarded_message);
-          ESP_LOGI(TAG, "by radio transmission");
-        }
+        if (VERBOSE)
+          DLOGI(TAG, "Now forwarding a %u byte request by radio transmission",
+                (unsigned)strlen(forwarded_message));
         cJSON *json_message = cJSON_Parse(forwarded_message);
         cJSON *json_array = cJSON_CreateArray();
         if (json_message && json_array) {
@@ -816,17 +778,17 @@ void transmit() {
           size_t binary_message_length =
               json_to_binary(binary_message, json_array);
           if (binary_message_length > 0) {
-            uint8_t encoded_forwarded_message[binary_message_length];
+            // room for the framing, and for every byte to be escaped
+            uint8_t encoded_forwarded_message[2 * binary_message_length + 2];
             size_t full_len =
                 encode_frame(binary_message, binary_message_length,
                              encoded_forwarded_message);
 
             execute_transmission(encoded_forwarded_message, full_len);
 
-            int transmission_delay = calculate_transmission_delay(
-                LORA_SF, LORA_BW, 8, full_len, LORA_CR, LORA_HEADER, LORA_LDRO);
-            ESP_LOGI(TAG, "Radio packet sent. Delaying for %d ms",
-                     transmission_delay);
+            int transmission_delay = airtime(full_len);
+            DLOGI(TAG, "Radio packet sent. Delaying for %d ms",
+                  transmission_delay);
 
             delay_transmission_until =
                 (int64_t)(transmission_delay * 1000) + esp_timer_get_time();
@@ -834,92 +796,106 @@ void transmit() {
         }
         strcpy(forwarded_message, "\0");
       }
-    } else {
-      uint8_t n_devices = 1; // the transmitter, at least
-
-      // now form the LoRa message out of non-empty messages and transmit
-      for (int i = 0; i < MESH_SIZE; i++) {
-        if (all_messages[i].esp_id != 0)
-          n_devices++;
+    } else if (!transmit_alarms() && !transmit_responses()) {
+      // nothing to send unless own packs' data has changed enough, or the
+      // mesh nodes have sent theirs. only ever run by the job worker, so
+      // these can be reused
+      static report_t reports[BMS_N_PACKS];
+      static bool pack_due[BMS_N_PACKS];
+      static report_t mesh_reports[MESH_SIZE];
+      static bool mesh_waiting[MESH_SIZE];
+      size_t n_mesh = mesh_peek_reports(mesh_reports, mesh_waiting);
+      bool due = n_mesh > 0;
+      for (int i = 0; i < BMS_N_PACKS; i++) {
+        pack_due[i] = codec_read_pack(i, &reports[i]) &&
+                      change_is_due(DESTINATION_RADIO, i, &reports[i]);
+        due |= pack_due[i];
       }
-
-      cJSON *json_array = cJSON_CreateArray();
-      if (json_array == NULL) {
-        ESP_LOGE(TAG, "Failed to create JSON array");
+      if (!due)
         return;
+      pack_due[BMS_PRIMARY_PACK] = true; // always goes first
+
+      // own data first, then that of any other packs, then that of the
+      // devices in the mesh, each packed straight from its report
+      static uint8_t binary_message[1 + (BMS_N_PACKS + MESH_SIZE) *
+                                            sizeof(radio_data_packet)];
+      static uint8_t encoded_combined_payload[2 * sizeof(binary_message) + 2];
+      uint8_t n_devices = 0;
+      size_t binary_message_length = 1; // after first byte n_devices
+      for (int i = 0; i < BMS_N_PACKS; i++) {
+        if (!pack_due[i])
+          continue;
+        binary_message_length +=
+            codec_pack(&reports[i], &binary_message[binary_message_length]);
+        n_devices++;
       }
-
-      // get own data first
-      char *data_string = get_data();
-      cJSON *item = cJSON_Parse(data_string);
-      cJSON_AddItemToArray(json_array, item);
-
-      // now add the data of other devices in mesh to payload
-      n_devices = 1;
       for (int i = 0; i < MESH_SIZE; i++) {
-        if (all_messages[i].esp_id != 0) {
-          n_devices++;
-
-          item = cJSON_Parse(all_messages[i].message);
-          cJSON_AddItemToArray(json_array, item);
-
-          // clear the message slot again in case of disconnect
-          all_messages[i].esp_id = 0;
-          strcpy(all_messages[i].message, "");
-          all_messages[i].message[0] = '\0';
-        }
+        if (!mesh_waiting[i])
+          continue;
+        binary_message_length += codec_pack(
+            &mesh_reports[i], &binary_message[binary_message_length]);
+        n_devices++;
       }
-      n_devices = 1; // reset
+      binary_message[0] = n_devices;
 
-      if (VERBOSE) {
-        ESP_LOGI(TAG, "ROOT: now transmitting:");
-        ESP_LOGI(TAG, "%s", cJSON_PrintUnformatted(json_array));
-        ESP_LOGI(TAG, "to receiver");
-      }
+      if (VERBOSE)
+        DLOGI(TAG, "ROOT: now transmitting %u message(s) to receiver",
+              n_devices);
 
-      uint8_t binary_message[5 * LORA_MAX_PACKET_LEN]; // this length likely
-                                                       // needs to be changed
-      size_t binary_message_length = json_to_binary(binary_message, json_array);
-      if (binary_message_length > 0) {
+      size_t full_len = encode_frame(binary_message, binary_message_length,
+                                     encoded_combined_payload);
+      uint8_t chunk[LORA_MAX_PACKET_LEN] = {0};
+      for (int offset = 0; offset < full_len; offset += LORA_MAX_PACKET_LEN) {
+        int chunk_len = MIN(LORA_MAX_PACKET_LEN, full_len - offset);
+        memcpy(chunk, encoded_combined_payload + offset, chunk_len);
 
-        uint8_t encoded_combined_payload[binary_message_length];
-        size_t full_len = encode_frame(binary_message, binary_message_length,
-                                       encoded_combined_payload);
-        uint8_t chunk[LORA_MAX_PACKET_LEN] = {0};
-        for (int offset = 0; offset < full_len; offset += LORA_MAX_PACKET_LEN) {
-          int chunk_len = MIN(LORA_MAX_PACKET_LEN, full_len - offset);
-          memcpy(chunk, encoded_combined_payload + offset, chunk_len);
-
-          execute_transmission(chunk, chunk_len);
+        execute_transmission(chunk, chunk_len);
 
+        if (offset + LORA_MAX_PACKET_LEN < full_len)
           vTaskDelay(pdMS_TO_TICKS(50)); // brief delay between chunks
-        }
-        int transmission_delay = calculate_transmission_delay(
-            LORA_SF, LORA_BW, 8, full_len, LORA_CR, LORA_HEADER, LORA_LDRO);
-        ESP_LOGI(TAG, "Radio packet sent. Delaying for %d ms",
-                 transmission_delay);
-
-        delay_transmission_until =
-            (int64_t)(transmission_delay * 1000) + esp_timer_get_time();
       }
-      cJSON_Delete(json_array);
+      int transmission_delay = airtime(full_len);
+      DLOGI(TAG, "Radio packet sent. Delaying for %d ms", transmission_delay);
+
+      delay_transmission_until =
+          (int64_t)(transmission_delay * 1000) + esp_timer_get_time();
+
+      for (int i = 0; i < BMS_N_PACKS; i++)
+        if (pack_due[i])
+          change_mark_sent(DESTINATION_RADIO, i, &reports[i]);
+      mesh_commit_reports(mesh_reports, mesh_waiting);
     }
 
     spi_write_register(REG_OP_MODE, 0b10000101); // return to LoRa + RX mode
+  } else if (!LORA_IS_RECEIVER && alarm_transmit_timer != NULL &&
+             (alarm_radio_pending() || cmd_radio_pending())) {
+    // try again as soon as the duty cycle allows, rather than on the next
+    // run of the scheduled transmission
+    int64_t remaining = delay_transmission_until - esp_timer_get_time();
+    xTimerChangePeriod(alarm_transmit_timer,
+                       pdMS_TO_TICKS(remaining / 1000) + 1, 0);
   }
 }
 
-void transmit_callback(TimerHandle_t xTimer) {
+int64_t transmit_ready_at() { return delay_transmission_until; }
+
+void alarm_transmit_callback(TimerHandle_t xTimer) {
   job_t job = {.type = JOB_LORA_TRANSMIT};
 
-  if (xQueueSend(job_queue, &job, 0) != pdPASS)
+  if (xQueueSendToFront(job_queue, &job, 0) != pdPASS)
     if (VERBOSE)
       ESP_LOGW(TAG, "Queue full, dropping job");
 }
 
 void start_transmit_timed_task() {
-  transmit_timer = xTimerCreate("transmit_timer", pdMS_TO_TICKS(5000), pdTRUE,
-                                NULL, transmit_callback);
-  assert(transmit_timer);
-  xTimerStart(transmit_timer, 0);
+  // straight after the data has been published, so the radio carries the
+  // same readings as the web server
+  sched_add(JOB_LORA_TRANSMIT, PARAM_RADIO_PERIOD, SCHED_JITTER_MS,
+            JOB_WS_SEND);
+
+  // one-shot, started by `transmit` when alarms are waiting on the duty cycle
+  alarm_transmit_timer =
+      xTimerCreate("alarm_transmit_timer", pdMS_TO_TICKS(1000), pdFALSE, NULL,
+                   alarm_transmit_callback);
+  assert(alarm_transmit_timer);
 }
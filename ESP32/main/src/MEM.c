@@ -0,0 +1,190 @@
+#include "MEM.h"
+
+#include "config.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cJSON.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+
+static const char *TAG = "MEM";
+
+// JSON arena: every cJSON allocation made by the job worker while a job is
+// running is bumped out of this buffer, and the whole lot is released at once
+// when the job finishes. this keeps the short-lived parse / print churn off
+// the heap entirely, so it can't fragment it. allocations from other tasks
+// (e.g. the HTTP server) or which don't fit go to the heap as before
+static uint8_t json_arena[MEM_JSON_ARENA_SIZE] __attribute__((aligned(8)));
+static size_t json_arena_used = 0;
+static TaskHandle_t json_arena_owner = NULL;
+static uint32_t json_arena_overflows = 0;
+
+// job payload pool: fixed-size blocks handed from producer tasks to the job
+// worker through `job_t.data`, so that queueing a job doesn't need the heap
+static uint8_t payload_blocks[MEM_BLOCK_COUNT][MEM_BLOCK_SIZE]
+    __attribute__((aligned(4)));
+static bool payload_block_used[MEM_BLOCK_COUNT] = {false};
+static mem_pool_stats_t pool_stats = {0};
+static portMUX_TYPE pool_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static mem_job_stats_t job_stats[N_JOB_TYPES] = {0};
+static uint32_t job_start_free_heap = 0;
+
+static bool in_json_arena(const void *ptr) {
+  return (const uint8_t *)ptr >= json_arena &&
+         (const uint8_t *)ptr < json_arena + sizeof(json_arena);
+}
+
+static void *json_malloc(size_t size) {
+  if (json_arena_owner != NULL &&
+      xTaskGetCurrentTaskHandle() == json_arena_owner) {
+    size_t aligned = (size + 7) & ~(size_t)7;
+    if (aligned <= sizeof(json_arena) - json_arena_used) {
+      void *ptr = &json_arena[json_arena_used];
+      json_arena_used += aligned;
+      return ptr;
+    }
+    json_arena_overflows++;
+  }
+
+  return malloc(size);
+}
+
+static void json_free(void *ptr) {
+  // arena memory is reclaimed in bulk by `mem_job_end`
+  if (in_json_arena(ptr))
+    return;
+
+  free(ptr);
+}
+
+void mem_init() {
+  cJSON_Hooks hooks = {.malloc_fn = json_malloc, .free_fn = json_free};
+  cJSON_InitHooks(&hooks);
+
+  for (int i = 0; i < N_JOB_TYPES; i++)
+    job_stats[i].min_free_heap = UINT32_MAX;
+}
+
+void mem_job_begin(job_type_t type) {
+  json_arena_used = 0;
+  json_arena_overflows = 0;
+  json_arena_owner = xTaskGetCurrentTaskHandle();
+  job_start_free_heap = esp_get_free_heap_size();
+}
+
+void mem_job_end(job_type_t type, const char *name) {
+  size_t arena_used = json_arena_used;
+
+  // release everything the job allocated from the arena
+  json_arena_owner = NULL;
+  json_arena_used = 0;
+
+  if (type < 0 || type >= N_JOB_TYPES)
+    return;
+
+  uint32_t free_heap = esp_get_free_heap_size();
+  int32_t heap_drop = (int32_t)job_start_free_heap - (int32_t)free_heap;
+
+  mem_job_stats_t *stats = &job_stats[type];
+  if (stats->runs == 0)
+    snprintf(stats->name, sizeof(stats->name), "%s", name);
+  stats->runs++;
+  if (arena_used > stats->arena_high_water)
+    stats->arena_high_water = arena_used;
+  stats->arena_overflows += json_arena_overflows;
+  if (heap_drop > stats->largest_heap_drop)
+    stats->largest_heap_drop = heap_drop;
+  if (free_heap < stats->min_free_heap)
+    stats->min_free_heap = free_heap;
+}
+
+void *mem_block_alloc(size_t size) {
+  if (size <= MEM_BLOCK_SIZE) {
+    taskENTER_CRITICAL(&pool_lock);
+    for (int i = 0; i < MEM_BLOCK_COUNT; i++) {
+      if (!payload_block_used[i]) {
+        payload_block_used[i] = true;
+        pool_stats.in_use++;
+        if (pool_stats.in_use > pool_stats.high_water)
+          pool_stats.high_water = pool_stats.in_use;
+        taskEXIT_CRITICAL(&pool_lock);
+        return payload_blocks[i];
+      }
+    }
+    pool_stats.heap_fallbacks++;
+    taskEXIT_CRITICAL(&pool_lock);
+  } else {
+    taskENTER_CRITICAL(&pool_lock);
+    pool_stats.heap_fallbacks++;
+    taskEXIT_CRITICAL(&pool_lock);
+  }
+
+  return malloc(size);
+}
+
+void mem_block_free(void *ptr) {
+  if (ptr == NULL)
+    return;
+
+  if ((uint8_t *)ptr >= &payload_blocks[0][0] &&
+      (uint8_t *)ptr < &payload_blocks[0][0] + sizeof(payload_blocks)) {
+    size_t i = ((uint8_t *)ptr - &payload_blocks[0][0]) / MEM_BLOCK_SIZE;
+    taskENTER_CRITICAL(&pool_lock);
+    payload_block_used[i] = false;
+    pool_stats.in_use--;
+    taskEXIT_CRITICAL(&pool_lock);
+    return;
+  }
+
+  free(ptr);
+}
+
+void mem_get_job_stats(job_type_t type, mem_job_stats_t *stats) {
+  if (type < 0 || type >= N_JOB_TYPES) {
+    memset(stats, 0, sizeof(*stats));
+    return;
+  }
+
+  *stats = job_stats[type];
+}
+
+void mem_get_pool_stats(mem_pool_stats_t *stats) {
+  taskENTER_CRITICAL(&pool_lock);
+  *stats = pool_stats;
+  taskEXIT_CRITICAL(&pool_lock);
+}
+
+void mem_log_stats() {
+  ESP_LOGI(TAG, "Heap: %" PRIu32 " bytes free, %" PRIu32 " minimum",
+           esp_get_free_heap_size(), esp_get_minimum_free_heap_size());
+
+  mem_pool_stats_t pool;
+  mem_get_pool_stats(&pool);
+  ESP_LOGI(TAG,
+           "Payload pool: %u/%d in use, high water %u, %" PRIu32
+           " heap fallbacks",
+           (unsigned)pool.in_use, MEM_BLOCK_COUNT, (unsigned)pool.high_water,
+           pool.heap_fallbacks);
+
+  for (int i = 0; i < N_JOB_TYPES; i++) {
+    mem_job_stats_t *stats = &job_stats[i];
+    if (stats->runs == 0)
+      continue;
+
+    ESP_LOGI(TAG,
+             "%s: %" PRIu32 " runs, arena high water %u/%d, %" PRIu32
+             " arena overflows, largest heap drop %" PRId32
+             ", minimum free heap %" PRIu32,
+             stats->name, stats->runs, (unsigned)stats->arena_high_water,
+             MEM_JSON_ARENA_SIZE, stats->arena_overflows,
+             stats->largest_heap_drop, stats->min_free_heap);
+  }
+}
@@ -2,6 +2,15 @@
 
 #include "AP.h"
 #include "BMS.h"
+#include "CHANGE.h"
+#include "CODEC.h"
+#include "ELECT.h"
+#include "LoRa.h"
+#include "PARAM.h"
+#include "SCAN.h"
+#include "SCHED.h"
+#include "STATE.h"
+#include "SUB.h"
 #include "TASK.h"
 #include "WS.h"
 #include "global.h"
@@ -9,10 +18,12 @@
 
 #include <inttypes.h>
 #include <stdbool.h>
+#include <string.h>
 
 #include "esp_log.h"
 #include "esp_netif.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "esp_websocket_client.h"
 #include "esp_wifi.h"
 #include "esp_wifi_types_generic.h"
@@ -21,39 +32,317 @@
 
 static const char *TAG = "MESH";
 
+// a node joins whichever neighbour, ROOT or node, gives it the best route to
+// the ROOT: one heard above `MESH_MIN_RSSI` if possible, then the fewest hops,
+// then the strongest. it connects to that parent's AP, at its gateway, just as
+// it would to the ROOT, and sends its own data and that of its children up in
+// one message per tick. each parent tells its children its hop count, so a
+// node takes its parent's plus one and a node without a route tells its own
+// children at once, which then look for another. the devices relayed through
+// each child are remembered, so a node never picks one of them as its parent,
+// and requests from the ROOT go back down the same way. a node asks for
+// "proto=bin" when it connects, and once its parent's route messages say that
+// was understood it sends the data as radio data packets in a binary frame,
+// rather than as JSON, so neither end has to write or parse text
 static esp_websocket_client_handle_t ws_client = NULL;
-static char *mesh_ws_auth_token = "";
+static char mesh_ws_auth_token[UTILS_AUTH_TOKEN_LENGTH] = "";
+static char parent_ip[16] = "";
+static uint8_t parent_hop = ELECT_HOP_NONE;
+static bool parent_binary = false;
+
+typedef struct {
+  bool used;
+  uint8_t esp_id;
+  int fd;          // of the child it is relayed through
+  bool direct;     // the child itself, until it disconnects
+  int64_t seen_at; // us
+} route_t;
+
+// filled in by the web server's task as children connect and send messages
+static route_t routes[MESH_SIZE];
+static portMUX_TYPE route_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// `all_messages` is filled in by the web server's task as reports come up
+// from the mesh, and emptied by the job worker as they are passed on, so it is
+// only ever touched with this held
+static portMUX_TYPE report_lock = portMUX_INITIALIZER_UNLOCKED;
+
+uint8_t mesh_hop() {
+  if (state_is(STATE_ROOT))
+    return 0;
+  if (!state_is(STATE_PARENT) || parent_hop >= MESH_MAX_HOPS)
+    return ELECT_HOP_NONE;
+  return parent_hop + 1;
+}
+
+static bool route_fresh(const route_t *route, int64_t now) {
+  return route->used &&
+         (route->direct ||
+          now - route->seen_at < (int64_t)MESH_ROUTE_TIMEOUT_MS * 1000);
+}
+
+void mesh_learn_route(uint8_t esp_id, int fd, bool direct) {
+  if (esp_id == 0 || esp_id == ESP_ID)
+    return;
+
+  // the same device again, or else a new one in place of a stale one
+  int64_t now = esp_timer_get_time();
+  taskENTER_CRITICAL(&route_lock);
+  int slot = -1;
+  for (int i = 0; i < MESH_SIZE && slot < 0; i++)
+    if (routes[i].used && routes[i].esp_id == esp_id)
+      slot = i;
+  for (int i = 0; i < MESH_SIZE && slot < 0; i++)
+    if (!route_fresh(&routes[i], now))
+      slot = i;
+  if (slot >= 0) {
+    direct |= routes[slot].used && routes[slot].esp_id == esp_id &&
+              routes[slot].fd == fd && routes[slot].direct;
+    routes[slot] = (route_t){true, esp_id, fd, direct, now};
+  }
+  taskEXIT_CRITICAL(&route_lock);
+
+  if (slot < 0)
+    ESP_LOGW(TAG, "No space for a route to bms_%u", esp_id);
+}
+
+void mesh_forget_routes(int fd) {
+  taskENTER_CRITICAL(&route_lock);
+  for (int i = 0; i < MESH_SIZE; i++)
+    if (routes[i].fd == fd)
+      routes[i].used = false;
+  taskEXIT_CRITICAL(&route_lock);
+}
+
+int mesh_route(uint8_t esp_id) {
+  // the descriptor of the child which `esp_id` is reached through, or -1
+  int fd = -1;
+  int64_t now = esp_timer_get_time();
+  taskENTER_CRITICAL(&route_lock);
+  for (int i = 0; i < MESH_SIZE && fd < 0; i++)
+    if (routes[i].esp_id == esp_id && route_fresh(&routes[i], now))
+      fd = routes[i].fd;
+  taskEXIT_CRITICAL(&route_lock);
+
+  return fd;
+}
+
+bool mesh_send_down(uint8_t esp_id, const char *message) {
+  int fd = mesh_route(esp_id);
+  if (fd < 0) {
+    ESP_LOGW(TAG, "No route to bms_%u, dropping message", esp_id);
+    return false;
+  }
+
+  if (!send_to_client(fd, message)) {
+    remove_client(fd); // clean up disconnected clients
+    return false;
+  }
+  return true;
+}
 
-static TimerHandle_t connect_to_root_timer;
-static TimerHandle_t mesh_websocket_timer;
-static TimerHandle_t merge_root_timer;
+void mesh_announce_route() {
+  // tell the children how far this device is from the ROOT, and those which
+  // asked for binary frames that they will be read
+  char message[48];
+  uint8_t hop = mesh_hop();
+  for (int i = 0; i < WS_CONFIG_MAX_CLIENTS; i++) {
+    if (client_sockets[i].is_browser_not_mesh ||
+        client_sockets[i].descriptor < 0)
+      continue;
+    snprintf(message, sizeof(message), "{\"type\":\"route\",\"hop\":%u%s}",
+             hop, client_sockets[i].binary ? ",\"proto\":\"bin\"" : "");
+    send_to_client(client_sockets[i].descriptor, message);
+  }
+}
+
+static void lose_route(const char *reason) {
+  ESP_LOGW(TAG, "No route to the ROOT: %s", reason);
+  esp_wifi_disconnect();
+  mesh_reset();
+  mesh_announce_route();
+  elect_advertise();
+}
+
+void mesh_set_parent_hop(uint8_t hop) {
+  if (state_is(STATE_ROOT) || !state_is(STATE_PARENT) ||
+      hop == parent_hop)
+    return;
+
+  // counting up to `MESH_MAX_HOPS` ends any loop a stale route makes
+  parent_hop = hop;
+  if (mesh_hop() == ELECT_HOP_NONE) {
+    lose_route("parent has none");
+    return;
+  }
+  mesh_announce_route();
+  elect_advertise();
+}
+
+void mesh_set_parent_binary(bool binary) {
+  // a parent running older firmware never says so, and keeps getting JSON
+  if (state_is(STATE_ROOT) || !state_is(STATE_PARENT))
+    return;
+  parent_binary = MESH_BINARY_ENABLED && binary;
+}
+
+bool mesh_keep_report(const report_t *report) {
+  // only the latest from each device is kept, until it is passed on
+  if (report->esp_id == 0)
+    return false;
+  taskENTER_CRITICAL(&report_lock);
+  int slot = -1;
+  for (int i = 0; i < MESH_SIZE; i++) {
+    if (all_messages[i].esp_id == report->esp_id) {
+      slot = i;
+      break;
+    }
+    if (slot < 0 && all_messages[i].esp_id == 0)
+      slot = i;
+  }
+  if (slot >= 0) {
+    all_messages[slot].report = *report;
+    all_messages[slot].esp_id = report->esp_id;
+  }
+  taskEXIT_CRITICAL(&report_lock);
+
+  if (slot < 0) {
+    ESP_LOGE(TAG, "LoRa queue full! Dropping message from bms_%u",
+             report->esp_id);
+    return false;
+  }
+  sub_note_report(report);
+  return true;
+}
+
+bool mesh_reports_waiting() {
+  bool waiting = false;
+  taskENTER_CRITICAL(&report_lock);
+  for (int i = 0; i < MESH_SIZE; i++)
+    waiting |= all_messages[i].esp_id != 0;
+  taskEXIT_CRITICAL(&report_lock);
+
+  return waiting;
+}
+
+size_t mesh_peek_reports(report_t reports[MESH_SIZE],
+                         bool waiting[MESH_SIZE]) {
+  // a copy of each slot's report, which stays in its slot until
+  // `mesh_commit_reports` is told it was passed on
+  size_t n_waiting = 0;
+  taskENTER_CRITICAL(&report_lock);
+  for (int i = 0; i < MESH_SIZE; i++) {
+    waiting[i] = all_messages[i].esp_id != 0;
+    if (waiting[i]) {
+      reports[i] = all_messages[i].report;
+      n_waiting++;
+    }
+  }
+  taskEXIT_CRITICAL(&report_lock);
+
+  return n_waiting;
+}
+
+void mesh_commit_reports(const report_t reports[MESH_SIZE],
+                         const bool sent[MESH_SIZE]) {
+  // a slot given a newer report since it was peeked at keeps it
+  taskENTER_CRITICAL(&report_lock);
+  for (int i = 0; i < MESH_SIZE; i++)
+    if (sent[i] && all_messages[i].esp_id != 0 &&
+        memcmp(&all_messages[i].report, &reports[i], sizeof(report_t)) == 0)
+      all_messages[i].esp_id = 0;
+  taskEXIT_CRITICAL(&report_lock);
+}
+
+static bool better_parent(const elect_neighbour_t *a,
+                          const elect_neighbour_t *b) {
+  // a link above `MESH_MIN_RSSI`, then fewer hops, then a stronger link
+  bool a_good = a->rssi >= MESH_MIN_RSSI;
+  bool b_good = b->rssi >= MESH_MIN_RSSI;
+  if (a_good != b_good)
+    return a_good;
+  if (a->candidate.hop != b->candidate.hop)
+    return a->candidate.hop < b->candidate.hop;
+  return a->rssi > b->rssi;
+}
+
+static bool pick_parent(elect_neighbour_t *parent) {
+  elect_neighbour_t heard[ELECT_MAX_HEARD];
+  size_t n_heard = elect_neighbours(heard, ELECT_MAX_HEARD, SCAN_MAX_AGE_MS);
+
+  bool found = false;
+  for (size_t i = 0; i < n_heard; i++) {
+    // one with room for a child below it, and not relaying through this
+    // device already
+    if (heard[i].candidate.hop >= MESH_MAX_HOPS ||
+        mesh_route(heard[i].candidate.esp_id) >= 0)
+      continue;
+    if (!found || better_parent(&heard[i], parent)) {
+      *parent = heard[i];
+      found = true;
+    }
+  }
+
+  return found;
+}
+
+static bool find_parent(wifi_ap_record_t *ap, uint8_t *hop) {
+  // a ROOT heard recently, including by the set-up scan, will do, and the
+  // same scans tell this device about its other neighbours
+  wifi_ap_record_t root;
+  esp_err_t err = scan_find_root(SCAN_MAX_AGE_MS, false, &root);
+  if (err != ESP_OK && err != ESP_ERR_NOT_FOUND)
+    return false;
+
+  elect_neighbour_t parent;
+  if (pick_parent(&parent) &&
+      scan_lookup(parent.candidate.mac, ap) == ESP_OK) {
+    *hop = parent.candidate.hop;
+    return true;
+  }
+
+  // a ROOT which doesn't advertise, straight to it
+  if (err != ESP_OK)
+    return false;
+  *ap = root;
+  *hop = 0;
+  return true;
+}
+
+static bool get_parent_ip() {
+  // the parent's AP is this STA's gateway
+  esp_netif_ip_info_t ip_info;
+  esp_netif_t *netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
+  if (netif == NULL || esp_netif_get_ip_info(netif, &ip_info) != ESP_OK ||
+      ip_info.gw.addr == 0)
+    return false;
+
+  esp_ip4addr_ntoa(&ip_info.gw, parent_ip, sizeof(parent_ip));
+  return true;
+}
 
 void connect_to_root() {
-  wifi_ap_record_t ap_info;
-  if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK &&
-      !connected_to_WiFi) { // if no wifi connection
+  // if no wifi connection
+  if (!(state_get() & (STATE_ROOT | STATE_STA_LINK | STATE_WIFI))) {
+    if (state_is(STATE_PARENT))
+      lose_route("parent gone");
     bool reconnected = false;
 
-    // initial scan for other ROOT APs
-    ESP_ERROR_CHECK(esp_wifi_stop());
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-    ESP_ERROR_CHECK(esp_wifi_start());
-    vTaskDelay(pdMS_TO_TICKS(100));
-    wifi_ap_record_t *ap_info = wifi_scan();
-    ESP_ERROR_CHECK(esp_wifi_stop());
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_APSTA));
-    ESP_ERROR_CHECK(esp_wifi_start());
-
-    if (ap_info) {
-      // try to connect to ROOT AP
-      wifi_config_t *wifi_sta_config = malloc(sizeof(wifi_config_t));
-      memset(wifi_sta_config, 0, sizeof(wifi_config_t));
-
-      strncpy((char *)wifi_sta_config->sta.ssid, (char *)ap_info->ssid,
-              sizeof(wifi_sta_config->sta.ssid) - 1);
-      wifi_sta_config->ap.authmode = WIFI_AUTH_OPEN;
-      ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, wifi_sta_config));
-      ESP_LOGI(TAG, "Connecting to AP... SSID: %s", wifi_sta_config->sta.ssid);
+    wifi_ap_record_t parent;
+    uint8_t hop;
+    if (find_parent(&parent, &hop)) {
+      // try to connect to its AP
+      wifi_config_t wifi_sta_config = {0};
+
+      strncpy((char *)wifi_sta_config.sta.ssid, (char *)parent.ssid,
+              sizeof(wifi_sta_config.sta.ssid) - 1);
+      memcpy(wifi_sta_config.sta.bssid, parent.bssid,
+             sizeof(wifi_sta_config.sta.bssid));
+      wifi_sta_config.sta.bssid_set = true;
+      wifi_sta_config.ap.authmode = WIFI_AUTH_OPEN;
+      ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_sta_config));
+      ESP_LOGI(TAG, "Connecting to AP... SSID: %s, %u hop(s) from ROOT",
+               wifi_sta_config.sta.ssid, hop);
 
       uint8_t tries = 0;
       uint8_t max_tries = 10;
@@ -61,88 +350,134 @@ void connect_to_root() {
         esp_err_t err = esp_wifi_connect();
         if (err == ESP_OK) {
           ESP_LOGI(TAG, "Success, waiting for connection...");
-          connected_to_root = true;
+          state_set(STATE_PARENT);
+          parent_hop = hop;
           reconnected = true;
           vTaskDelay(pdMS_TO_TICKS(1000));
           break;
         } else {
           ESP_LOGW(TAG, "Failed to connect: %s. Retrying...",
                    esp_err_to_name(err));
-          connected_to_root = false;
+          state_clear(STATE_PARENT);
           tries++;
         }
       }
-
-      free(wifi_sta_config);
     }
 
     if (!reconnected) {
-      connected_to_root = false;
-
-      // scan to double check there really is no existing ROOT AP
-      ESP_ERROR_CHECK(esp_wifi_stop());
-      ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
-      ESP_ERROR_CHECK(esp_wifi_start());
-      vTaskDelay(pdMS_TO_TICKS(100));
-      wifi_ap_record_t *ap_info = wifi_scan();
-
-      // if not, nominate a new one using MAC addresses
-      if (!ap_info) {
-        uint8_t my_mac[6];
-        esp_wifi_get_mac(WIFI_IF_AP, my_mac);
-        uint32_t unique_number =
-            ((uint32_t)my_mac[2] << 24) | ((uint32_t)my_mac[3] << 16) |
-            ((uint32_t)my_mac[4] << 8) | ((uint32_t)my_mac[5]);
-        int time_delay = unique_number % 100000 + 5000;
-        ESP_LOGI(TAG, "delaying for %d ms...", time_delay);
-        vTaskDelay(pdMS_TO_TICKS(time_delay));
-        ESP_LOGI(TAG, "trying for last time... ");
-        // try to connect to new ROOT AP which has possibly restarted earlier
-        // than this
-        ap_info = wifi_scan();
-        if (!ap_info) {
-          ESP_LOGI(TAG, "fail, restarting");
-          // hopefully become now the only ROOT AP
-          esp_restart();
-        }
-      }
+      state_clear(STATE_PARENT);
 
-      ESP_ERROR_CHECK(esp_wifi_stop());
-      ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_APSTA));
-      ESP_ERROR_CHECK(esp_wifi_start());
+      // scan all channels to double check there really is no existing ROOT AP
+      wifi_ap_record_t root;
+      esp_err_t err = scan_find_root(0, true, &root);
+
+      // if not, see whether this or another node without one should take
+      // over, from what they advertised in that scan
+      if (err == ESP_ERR_NOT_FOUND)
+        elect_round();
     } else {
+      elect_advertise();
+      mesh_announce_route();
+
       // make sure the mesh ws client is "authenticated"
       vTaskDelay(pdMS_TO_TICKS(5000));
-      mesh_ws_auth_token = send_fake_login_post_request();
+      if (!get_parent_ip() ||
+          !send_fake_login_post_request(parent_ip, mesh_ws_auth_token,
+                                        sizeof(mesh_ws_auth_token)))
+        mesh_ws_auth_token[0] = '\0';
     }
   }
 }
 
-void connect_to_root_callback(TimerHandle_t xTimer) {
-  job_t job = {.type = JOB_MESH_CONNECT};
-
-  if (xQueueSend(job_queue, &job, 0) != pdPASS)
-    if (VERBOSE)
-      ESP_LOGW(TAG, "Queue full, dropping job");
+static void link_watcher(EventBits_t changed) {
+  // look for a new parent as soon as the link to the old one goes, rather
+  // than on the next tick
+  if (!state_is(STATE_STA_LINK) && !state_is(STATE_ROOT))
+    sched_queue(JOB_MESH_CONNECT);
 }
 
 void start_connect_to_root_timed_task() {
-  connect_to_root_timer =
-      xTimerCreate("connect_to_root_timer", pdMS_TO_TICKS(5000), pdTRUE, NULL,
-                   connect_to_root_callback);
-  assert(connect_to_root_timer);
-  xTimerStart(connect_to_root_timer, 0);
+  sched_add(JOB_MESH_CONNECT, PARAM_MESH_CONNECT_PERIOD, SCHED_JITTER_MS,
+            SCHED_AFTER_NONE);
+  state_watch(STATE_STA_LINK, link_watcher);
 }
 
-void send_mesh_websocket_data() {
-  char *data_string = get_data();
+static size_t append(char *cursor, const char *end, const char *item) {
+  // an item of the message array, if it fits with room for the closing ']'
+  size_t length = strlen(item);
+  if (cursor + 1 + length + 1 >= end)
+    return 0;
+  *cursor++ = ',';
+  memcpy(cursor, item, length);
+  return 1 + length;
+}
+
+static size_t write_json(const report_t *const *items, bool *included,
+                         char *message, size_t size) {
+  // one JSON array, whatever doesn't fit going next time. only ever called
+  // from the job worker, so this can be reused
+  static char data_string[WS_DATA_MAX_LEN];
+  char *cursor = message;
+  const char *end = message + size;
+  for (int i = 0; i < BMS_N_PACKS + MESH_SIZE; i++) {
+    included[i] = false;
+    if (items[i] == NULL || codec_write_json(items[i], data_string,
+                                             sizeof(data_string), false) == 0)
+      continue;
+    size_t length = append(cursor, end, data_string);
+    cursor += length;
+    included[i] = length > 0;
+  }
+  message[0] = '[';
+  *cursor++ = ']';
+  *cursor = '\0';
+
+  return cursor - message;
+}
+
+static size_t write_packets(const report_t *const *items, bool *included,
+                            uint8_t *message, size_t size) {
+  // radio data packets back to back, whatever doesn't fit going next time
+  size_t length = 0;
+  for (int i = 0; i < BMS_N_PACKS + MESH_SIZE; i++) {
+    included[i] =
+        items[i] != NULL && length + sizeof(radio_data_packet) <= size;
+    if (included[i])
+      length += codec_pack(items[i], &message[length]);
+  }
 
-  if (connected_to_root && data_string != NULL &&
-      strcmp(mesh_ws_auth_token, "") != 0 && !connected_to_WiFi) {
-    char uri[40 + UTILS_AUTH_TOKEN_LENGTH + 11];
+  return length;
+}
+
+void send_mesh_websocket_data() {
+  // only ever called from the job worker, so these can be reused
+  static char message[WS_MESSAGE_MAX_LEN];
+  static report_t reports[BMS_N_PACKS];
+  static bool pack_due[BMS_N_PACKS];
+  static report_t mesh_reports[MESH_SIZE];
+  static bool mesh_waiting[MESH_SIZE];
+
+  // each pack goes to the parent as an item of its own, as if from a node of
+  // its own, along with the latest from each device relayed through this one
+  bool due = false;
+  for (int i = 0; i < BMS_N_PACKS; i++) {
+    pack_due[i] = codec_read_pack(i, &reports[i]) &&
+                  change_is_due(DESTINATION_MESH, i, &reports[i]);
+    due |= pack_due[i];
+  }
+  size_t n_mesh = mesh_peek_reports(mesh_reports, mesh_waiting);
+  due |= n_mesh > 0 && !state_is(STATE_ROOT);
+  if (!due)
+    return;
+
+  bool sent = false;
+  if (state_is(STATE_PARENT) && strcmp(mesh_ws_auth_token, "") != 0 &&
+      !state_is(STATE_WIFI)) {
+    char uri[64 + UTILS_AUTH_TOKEN_LENGTH];
     snprintf(uri, sizeof(uri),
-             "ws://192.168.4.1:80/mesh_ws?auth_token=%s&esp_id=%u",
-             mesh_ws_auth_token, ESP_ID);
+             "ws://%s:80/mesh_ws?auth_token=%s&esp_id=%u%s", parent_ip,
+             mesh_ws_auth_token, ESP_ID,
+             MESH_BINARY_ENABLED ? "&proto=bin" : "");
     const esp_websocket_client_config_t websocket_cfg = {
         .uri = uri,
         .reconnect_timeout_ms = 10000,
@@ -165,206 +500,77 @@ void send_mesh_websocket_data() {
         vTaskDelay(pdMS_TO_TICKS(1000));
         return;
       }
+      // give the new client time to connect
+      vTaskDelay(pdMS_TO_TICKS(5000));
     }
 
-    vTaskDelay(pdMS_TO_TICKS(5000));
-
     if (!esp_websocket_client_is_connected(ws_client)) {
       esp_websocket_client_stop(ws_client);
       esp_websocket_client_destroy(ws_client);
       ws_client = NULL;
     } else {
-      esp_websocket_client_send_text(ws_client, data_string,
-                                     strlen(data_string), portMAX_DELAY);
-    }
-  }
-
-  // clean up
-  free(data_string);
-}
-
-void mesh_websocket_callback(TimerHandle_t xTimer) {
-  job_t job = {.type = JOB_MESH_WS_SEND};
-
-  if (xQueueSend(job_queue, &job, 0) != pdPASS)
-    if (VERBOSE)
-      ESP_LOGW(TAG, "Queue full, dropping job");
-}
-
-void start_mesh_websocket_timed_task() {
-  mesh_websocket_timer =
-      xTimerCreate("mesh_websocket_timer", pdMS_TO_TICKS(5000), pdTRUE, NULL,
-                   mesh_websocket_callback);
-  assert(mesh_websocket_timer);
-  xTimerStart(mesh_websocket_timer, 0);
-}
-
-esp_err_t ap_n_client_comparison_handler(esp_http_client_event_t *evt) {
-  static char *output_buffer; // Buffer to store response
-  static int output_len;      // Length of valid content
-
-  switch (evt->event_id) {
-  case HTTP_EVENT_ON_DATA:
-    ESP_LOGI(TAG, "HTTP_EVENT_ON_DATA, len=%d", evt->data_len);
-    if (!esp_http_client_is_chunked_response(evt->client)) {
-      // Copy into output_buffer
-      if (output_buffer == NULL) {
-        output_buffer = malloc(MESH_MAX_HTTP_RECV_BUFFER);
-        output_len = 0;
-      }
-      int copy_len = evt->data_len;
-      if (output_len + copy_len < MESH_MAX_HTTP_RECV_BUFFER) {
-        memcpy(output_buffer + output_len, evt->data, copy_len);
-        output_len += copy_len;
+      const report_t *items[BMS_N_PACKS + MESH_SIZE];
+      for (int i = 0; i < BMS_N_PACKS; i++)
+        items[i] = pack_due[i] ? &reports[i] : NULL;
+      for (int i = 0; i < MESH_SIZE; i++)
+        items[BMS_N_PACKS + i] = mesh_waiting[i] ? &mesh_reports[i] : NULL;
+
+      bool included[BMS_N_PACKS + MESH_SIZE];
+      int result = -1;
+      if (parent_binary) {
+        size_t length = write_packets(items, included, (uint8_t *)message,
+                                      sizeof(message));
+        if (length > 0)
+          result = esp_websocket_client_send_bin(ws_client, message, length,
+                                                 portMAX_DELAY);
+      } else {
+        size_t length = write_json(items, included, message, sizeof(message));
+        if (length > 2) // not just "[]"
+          result = esp_websocket_client_send_text(ws_client, message, length,
+                                                  portMAX_DELAY);
       }
-    }
-    break;
-
-  case HTTP_EVENT_ON_FINISH:
-    if (output_buffer != NULL) {
-      output_buffer[output_len] = '\0';
-      ESP_LOGI(TAG, "Full response: %s", output_buffer);
-
-      cJSON *message = cJSON_Parse(output_buffer);
-      if (message) {
-        cJSON *ext_num_object =
-            cJSON_GetObjectItem(message, "num_connected_clients");
-        if (ext_num_object) {
-          int ext_num = ext_num_object->valueint;
-          if (ext_num - 1 >= num_connected_clients) {
-            // -1 to account for the connection of this ESP32 to the other ROOT
-            // AP
-            ESP_LOGI(TAG, "I will restart!");
-            esp_restart();
-          } else {
-            esp_http_client_config_t config = {
-                .url = "http://192.168.4.1/no_you_restart",
-            };
-            esp_http_client_handle_t client = esp_http_client_init(&config);
-            esp_http_client_set_method(client, HTTP_METHOD_POST);
-            esp_err_t err = esp_http_client_perform(client);
-            if (err == ESP_OK) {
-              ESP_LOGI("HTTP_CLIENT", "POST Status = %d",
-                       esp_http_client_get_status_code(client));
-            } else {
-              ESP_LOGE("HTTP_CLIENT", "POST failed: %s", esp_err_to_name(err));
-            }
-            esp_http_client_cleanup(client);
-          }
-        }
+
+      if (result >= 0) {
+        for (int i = 0; i < BMS_N_PACKS; i++)
+          if (included[i])
+            change_mark_sent(DESTINATION_MESH, i, &reports[i]);
+        mesh_commit_reports(mesh_reports, &included[BMS_N_PACKS]);
+        sent = true;
       }
-      free(output_buffer);
-      output_buffer = NULL;
-      output_len = 0;
     }
-    break;
-
-  default:
-    break;
   }
-  return ESP_OK;
-}
-
-void merge_root() {
-  if (!connected_to_WiFi) {
 
-    uint8_t my_mac[6];
-    esp_wifi_get_mac(WIFI_IF_AP, my_mac);
-
-    wifi_ap_record_t *ap_info = wifi_scan();
-    if (ap_info) {
-      ESP_LOGW(TAG, "Another ROOT AP found!!\n SSID: %s", ap_info->ssid);
-
-      int my_int = compare_mac(my_mac, ap_info->bssid);
-
-      wifi_config_t *wifi_sta_config = malloc(sizeof(wifi_config_t));
-      memset(wifi_sta_config, 0, sizeof(wifi_config_t));
-
-      strncpy((char *)wifi_sta_config->sta.ssid, (char *)ap_info->ssid,
-              sizeof(wifi_sta_config->sta.ssid) - 1);
-      wifi_sta_config->ap.authmode = WIFI_AUTH_OPEN;
-      ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, wifi_sta_config));
-      ESP_LOGI(TAG, "Connecting to AP... SSID: %s", wifi_sta_config->sta.ssid);
-
-      uint8_t tries = 0;
-      uint8_t max_tries = 10;
-      bool connected = false;
-      while (tries < max_tries) {
-        esp_err_t err = esp_wifi_connect();
-        if (err == ESP_OK) {
-          ESP_LOGI(TAG, "Success, waiting for connection...");
-          vTaskDelay(pdMS_TO_TICKS(1000));
-          connected = true;
-          break;
-        } else {
-          ESP_LOGW(TAG, "Failed to connect: %s. Retrying...",
-                   esp_err_to_name(err));
-          tries++;
-        }
-      }
-
-      free(wifi_sta_config);
-
-      if (connected) {
-        // change to another IP so we can communicate with other ROOT AP on it's
-        // default IP
-        esp_netif_ip_info_t ip_info = {0};
-        if (my_int < 0) {
-          IP4_ADDR(&ip_info.ip, 192, 168, 10, 1);
-          IP4_ADDR(&ip_info.gw, 192, 168, 10, 1);
-          IP4_ADDR(&ip_info.netmask, 255, 255, 255, 0);
-          esp_netif_dhcps_stop(ap_netif);
-          esp_netif_set_ip_info(ap_netif, &ip_info);
-          esp_netif_dhcps_start(ap_netif);
-          ESP_LOGI(TAG, "changed IP to 192.168.10.1");
-          // delay to allow it to update
-          vTaskDelay(pdMS_TO_TICKS(5000));
-        }
-
-        // fetch the number of clients connected to the other AP
-        esp_http_client_config_t config = {
-            .url = "http://192.168.4.1/api_num_clients",
-            .event_handler = ap_n_client_comparison_handler,
-        };
-        esp_http_client_handle_t client = esp_http_client_init(&config);
-        esp_err_t err = esp_http_client_perform(client);
-        if (err == ESP_OK) {
-          ESP_LOGI(TAG, "HTTP GET Status = %d, content_length = %lld",
-                   esp_http_client_get_status_code(client),
-                   esp_http_client_get_content_length(client));
-        } else {
-          ESP_LOGE(TAG, "HTTP GET request failed: %s", esp_err_to_name(err));
-        }
-        esp_http_client_cleanup(client);
-
-        if (my_int < 0) {
-          // change back to default
-          IP4_ADDR(&ip_info.ip, 192, 168, 4, 1); // Change to a temporary IP
-          IP4_ADDR(&ip_info.gw, 192, 168, 4, 1); // Gateway IP
-          IP4_ADDR(&ip_info.netmask, 255, 255, 255, 0); // Subnet mask
-          esp_netif_dhcps_stop(ap_netif);
-          esp_netif_set_ip_info(ap_netif, &ip_info);
-          esp_netif_dhcps_start(ap_netif);
-          ESP_LOGI(TAG, "changed IP back to 192.168.4.1");
-        }
+  if (!sent)
+    change_reset(DESTINATION_MESH);
+}
 
-        esp_wifi_disconnect();
-      }
-    }
+void mesh_reset() {
+  // on becoming the ROOT, or losing the parent, the connection to the old one
+  // is no use
+  if (ws_client != NULL) {
+    esp_websocket_client_stop(ws_client);
+    esp_websocket_client_destroy(ws_client);
+    ws_client = NULL;
   }
+  mesh_ws_auth_token[0] = '\0';
+  parent_ip[0] = '\0';
+  parent_hop = ELECT_HOP_NONE;
+  parent_binary = false;
+  state_clear(STATE_PARENT);
 }
 
-void merge_root_callback(TimerHandle_t xTimer) {
-  job_t job = {.type = JOB_MESH_MERGE};
+bool send_mesh_message(const char *message) {
+  if (!esp_websocket_client_is_connected(ws_client)) {
+    ESP_LOGW(TAG, "Not connected to parent, dropping message: %s", message);
+    return false;
+  }
 
-  if (xQueueSend(job_queue, &job, 0) != pdPASS)
-    if (VERBOSE)
-      ESP_LOGW(TAG, "Queue full, dropping job");
+  esp_websocket_client_send_text(ws_client, message, strlen(message),
+                                 portMAX_DELAY);
+  return true;
 }
 
-void start_merge_root_timed_task() {
-  merge_root_timer = xTimerCreate("merge_root_timer", pdMS_TO_TICKS(60000),
-                                  pdTRUE, NULL, merge_root_callback);
-  assert(merge_root_timer);
-  xTimerStart(merge_root_timer, 0);
+void start_mesh_websocket_timed_task() {
+  sched_add(JOB_MESH_WS_SEND, PARAM_MESH_WS_PERIOD, SCHED_JITTER_MS,
+            SCHED_AFTER_SAMPLE);
 }
@@ -0,0 +1,168 @@
+#include "PARAM.h"
+
+#include "TASK.h"
+#include "config.h"
+#include "global.h"
+
+#include <inttypes.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "nvs_flash.h"
+
+static const char *TAG = "PARAM";
+
+// settings are read from RAM wherever they are used, so that a change takes
+// effect on the next read, and watchers (e.g. the scheduler, for the periods
+// of jobs) are told of it straight away. changes are written to NVS by the job
+// worker once they have stopped coming for `PARAM_SAVE_DELAY_MS`, so that a
+// burst of them costs a single write
+typedef struct {
+  const char *key;
+  int32_t min;
+  int32_t max;
+} param_info_t;
+
+static const param_info_t infos[N_PARAMS] = {
+#define X(id, key, fallback, min, max) [PARAM_##id] = {#key, min, max},
+    PARAM_LIST(X)
+#undef X
+};
+
+_Static_assert(N_PARAMS <= 32, "settings are marked in a 32-bit mask");
+
+// usable before `param_init`, e.g. by the host-side harnesses
+static int32_t values[N_PARAMS] = {
+#define X(id, key, fallback, ...) [PARAM_##id] = fallback,
+    PARAM_LIST(X)
+#undef X
+};
+static uint32_t dirty = 0; // changed since last written to NVS
+static portMUX_TYPE param_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static struct {
+  uint32_t ids;
+  param_watcher_t watcher;
+} watches[PARAM_MAX_WATCHERS];
+static uint8_t n_watches = 0;
+
+static TimerHandle_t save_timer = NULL;
+
+static void save_callback(TimerHandle_t xTimer) {
+  job_t job = {.type = JOB_PARAM_SAVE};
+
+  if (xQueueSend(job_queue, &job, 0) != pdPASS)
+    if (VERBOSE)
+      ESP_LOGW(TAG, "Queue full, dropping job");
+}
+
+void param_init() {
+  // once NVS is initialised
+  nvs_handle_t nvs;
+  if (nvs_open("PARAMS", NVS_READONLY, &nvs) == ESP_OK) {
+    for (int i = 0; i < N_PARAMS; i++) {
+      int32_t value;
+      if (nvs_get_i32(nvs, infos[i].key, &value) != ESP_OK)
+        continue;
+      if (param_valid(i, value))
+        values[i] = value;
+      else
+        ESP_LOGW(TAG, "Ignoring stored %s of %" PRId32, infos[i].key, value);
+    }
+    nvs_close(nvs);
+  }
+
+  save_timer = xTimerCreate("param_save_timer",
+                            pdMS_TO_TICKS(PARAM_SAVE_DELAY_MS), pdFALSE, NULL,
+                            save_callback);
+  assert(save_timer);
+}
+
+int32_t param_get(param_id_t id) { return values[id]; }
+
+int param_find(const char *key) {
+  // -1 if there's no such setting
+  if (key == NULL)
+    return -1;
+  for (int i = 0; i < N_PARAMS; i++)
+    if (strcmp(key, infos[i].key) == 0)
+      return i;
+  return -1;
+}
+
+const char *param_key(param_id_t id) { return infos[id].key; }
+
+bool param_valid(param_id_t id, int32_t value) {
+  return (unsigned)id < N_PARAMS && value >= infos[id].min &&
+         value <= infos[id].max;
+}
+
+esp_err_t param_set(param_id_t id, int32_t value) {
+  if (!param_valid(id, value))
+    return ESP_ERR_INVALID_ARG;
+
+  taskENTER_CRITICAL(&param_lock);
+  bool changed = values[id] != value;
+  values[id] = value;
+  if (changed)
+    dirty |= PARAM_BIT(id);
+  taskEXIT_CRITICAL(&param_lock);
+  if (!changed)
+    return ESP_OK;
+
+  ESP_LOGI(TAG, "%s set to %" PRId32, infos[id].key, value);
+  for (int i = 0; i < n_watches; i++)
+    if (watches[i].ids & PARAM_BIT(id))
+      watches[i].watcher(id, value);
+
+  // (re)starting the timer puts off writing until the changes stop
+  if (save_timer != NULL)
+    xTimerReset(save_timer, 0);
+
+  return ESP_OK;
+}
+
+bool param_watch(uint32_t ids, param_watcher_t watcher) {
+  // at start up, or from the job worker, which is what changes settings
+  if (n_watches == PARAM_MAX_WATCHERS) {
+    ESP_LOGE(TAG, "No space to watch settings");
+    return false;
+  }
+  watches[n_watches].ids = ids;
+  watches[n_watches].watcher = watcher;
+  n_watches++;
+
+  return true;
+}
+
+void param_save() {
+  // only ever called from the job worker
+  taskENTER_CRITICAL(&param_lock);
+  uint32_t saving = dirty;
+  int32_t saved[N_PARAMS];
+  memcpy(saved, values, sizeof(saved));
+  dirty = 0;
+  taskEXIT_CRITICAL(&param_lock);
+  if (saving == 0)
+    return;
+
+  nvs_handle_t nvs;
+  esp_err_t err = nvs_open("PARAMS", NVS_READWRITE, &nvs);
+  if (err == ESP_OK) {
+    for (int i = 0; i < N_PARAMS && err == ESP_OK; i++)
+      if (saving & PARAM_BIT(i))
+        err = nvs_set_i32(nvs, infos[i].key, saved[i]);
+    if (err == ESP_OK)
+      err = nvs_commit(nvs);
+    nvs_close(nvs);
+  }
+
+  if (err != ESP_OK) {
+    // try again with the next change
+    ESP_LOGE(TAG, "Failed to save settings: %s", esp_err_to_name(err));
+    taskENTER_CRITICAL(&param_lock);
+    dirty |= saving;
+    taskEXIT_CRITICAL(&param_lock);
+  }
+}
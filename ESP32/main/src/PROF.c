@@ -0,0 +1,270 @@
+#include "PROF.h"
+
+#include "PARAM.h"
+#include "UPLINK.h"
+#include "config.h"
+#include "global.h"
+#include "utils.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+static const char *TAG = "PROF";
+
+// each task's share of the CPU and the least stack it has ever had spare,
+// sampled from FreeRTOS every time round the main task's loop so that stack
+// sizes can be set from what is actually used. following every task needs
+// CONFIG_FREERTOS_USE_TRACE_FACILITY, and their CPU time
+// CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS; without them only the tasks which
+// check in are followed. a task which checks in says when it next will, before
+// it waits, and has stalled once it is more than `PROF_STALL_MS` late
+typedef struct {
+  TaskHandle_t handle;
+  char name[configMAX_TASK_NAME_LEN];
+  uint32_t run_time;  // counter at the last sample
+  int8_t cpu;         // % of one core between the last two samples, or -1
+  int32_t stack_free; // bytes, the least there has ever been, or -1
+  bool stack_low;     // and it has been warned about
+  bool checks_in;
+  int64_t deadline; // us, for the next check in
+  bool stalled;
+  uint32_t stalls;
+} prof_task_t;
+
+static prof_task_t tasks[PROF_MAX_TASKS];
+static uint8_t n_tasks = 0;
+static uint32_t total_stalls = 0;
+static portMUX_TYPE prof_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// call with `prof_lock` held. a task not seen before is added if it is
+// given a name and there is space
+static prof_task_t *find_task(TaskHandle_t handle, const char *name) {
+  for (int i = 0; i < n_tasks; i++)
+    if (tasks[i].handle == handle)
+      return &tasks[i];
+  if (name == NULL || n_tasks == PROF_MAX_TASKS)
+    return NULL;
+
+  prof_task_t *task = &tasks[n_tasks++];
+  *task = (prof_task_t){
+      .handle = handle,
+      .cpu = -1,
+      .stack_free = -1,
+      .deadline = INT64_MAX,
+  };
+  strncpy(task->name, name, sizeof(task->name) - 1);
+  return task;
+}
+
+void prof_checkin(uint32_t next_ms) {
+  // from the task itself, before it waits for up to `next_ms`
+  TaskHandle_t handle = xTaskGetCurrentTaskHandle();
+  const char *name = pcTaskGetName(handle);
+  int64_t deadline =
+      next_ms == PROF_FOREVER
+          ? INT64_MAX
+          : esp_timer_get_time() + ((int64_t)next_ms + PROF_STALL_MS) * 1000;
+
+  taskENTER_CRITICAL(&prof_lock);
+  prof_task_t *task = find_task(handle, name);
+  bool recovered = false;
+  if (task != NULL) {
+    task->checks_in = true;
+    task->deadline = deadline;
+    recovered = task->stalled;
+    task->stalled = false;
+  }
+  taskEXIT_CRITICAL(&prof_lock);
+
+  if (recovered)
+    ESP_LOGW(TAG, "%s has checked in again", name);
+}
+
+#if configUSE_TRACE_FACILITY
+static void sample_tasks() {
+  // only ever called from the main task, so these can be reused
+  static TaskStatus_t statuses[PROF_MAX_TASKS];
+  static uint32_t last_total = 0;
+
+  uint32_t total = 0;
+  UBaseType_t n = uxTaskGetSystemState(statuses, PROF_MAX_TASKS, &total);
+  if (n == 0) {
+    ESP_LOGW(TAG, "More than %d tasks to profile", PROF_MAX_TASKS);
+    return;
+  }
+  uint32_t elapsed = total - last_total;
+  last_total = total;
+
+  taskENTER_CRITICAL(&prof_lock);
+  // forget the tasks which have been deleted
+  for (int i = n_tasks - 1; i >= 0; i--) {
+    bool exists = false;
+    for (UBaseType_t j = 0; j < n && !exists; j++)
+      exists = statuses[j].xHandle == tasks[i].handle;
+    if (!exists)
+      tasks[i] = tasks[--n_tasks];
+  }
+
+  for (UBaseType_t i = 0; i < n; i++) {
+    prof_task_t *task =
+        find_task(statuses[i].xHandle, statuses[i].pcTaskName);
+    if (task == NULL)
+      continue;
+    task->stack_free = statuses[i].usStackHighWaterMark;
+#if configGENERATE_RUN_TIME_STATS
+    uint32_t ran = statuses[i].ulRunTimeCounter - task->run_time;
+    task->run_time = statuses[i].ulRunTimeCounter;
+    if (elapsed > 0)
+      task->cpu = MIN((uint64_t)ran * 100 / elapsed, 100);
+#endif
+  }
+  taskEXIT_CRITICAL(&prof_lock);
+}
+#else
+static void sample_tasks() {
+  // just those which have checked in, one at a time
+  for (int i = 0;; i++) {
+    taskENTER_CRITICAL(&prof_lock);
+    TaskHandle_t handle = i < n_tasks ? tasks[i].handle : NULL;
+    taskEXIT_CRITICAL(&prof_lock);
+    if (handle == NULL)
+      break;
+
+    int32_t stack_free = uxTaskGetStackHighWaterMark(handle);
+    taskENTER_CRITICAL(&prof_lock);
+    prof_task_t *task = find_task(handle, NULL);
+    if (task != NULL)
+      task->stack_free = stack_free;
+    taskEXIT_CRITICAL(&prof_lock);
+  }
+}
+#endif
+
+void prof_sample() {
+  // only ever called from the main task, so these can be reused
+  static char stalled[PROF_MAX_TASKS][configMAX_TASK_NAME_LEN];
+  static char low[PROF_MAX_TASKS][configMAX_TASK_NAME_LEN];
+  static int32_t low_free[PROF_MAX_TASKS];
+
+  sample_tasks();
+
+  int64_t now = esp_timer_get_time();
+  int n_stalled = 0;
+  int n_low = 0;
+  taskENTER_CRITICAL(&prof_lock);
+  for (int i = 0; i < n_tasks; i++) {
+    prof_task_t *task = &tasks[i];
+    if (task->checks_in && !task->stalled && now > task->deadline) {
+      task->stalled = true;
+      task->stalls++;
+      total_stalls++;
+      memcpy(stalled[n_stalled++], task->name, sizeof(task->name));
+    }
+    if (task->stack_free >= 0 && task->stack_free < PROF_STACK_LOW &&
+        !task->stack_low) {
+      task->stack_low = true;
+      low_free[n_low] = task->stack_free;
+      memcpy(low[n_low++], task->name, sizeof(task->name));
+    }
+  }
+  taskEXIT_CRITICAL(&prof_lock);
+
+  for (int i = 0; i < n_stalled; i++)
+    ESP_LOGE(TAG, "%s has stalled, over %d ms late to check in", stalled[i],
+             PROF_STALL_MS);
+  for (int i = 0; i < n_low; i++)
+    ESP_LOGW(TAG, "%s is low on stack, %" PRId32 " bytes have been spare",
+             low[i], low_free[i]);
+}
+
+size_t prof_write_json(char *out, size_t size) {
+  // one row per task, under "keys"
+  size_t length = snprintf(
+      out, size,
+      "{\"uptime\":%" PRId64 ",\"free_heap\":%" PRIu32
+      ",\"min_free_heap\":%" PRIu32 ",\"stalls\":%" PRIu32
+      ",\"keys\":[\"name\",\"cpu\",\"stack_free\",\"stalls\",\"stalled\"],"
+      "\"tasks\":[",
+      esp_timer_get_time() / 1000000, esp_get_free_heap_size(),
+      esp_get_minimum_free_heap_size(), total_stalls);
+
+  for (int i = 0; length < size; i++) {
+    taskENTER_CRITICAL(&prof_lock);
+    bool more = i < n_tasks;
+    prof_task_t task = more ? tasks[i] : (prof_task_t){0};
+    taskEXIT_CRITICAL(&prof_lock);
+    if (!more)
+      break;
+
+    length += snprintf(out + length, size - length,
+                       "%s[\"%s\",%d,%" PRId32 ",%" PRIu32 ",%d]",
+                       i == 0 ? "" : ",", task.name, task.cpu,
+                       task.stack_free, task.stalls, task.stalled);
+  }
+  if (length < size)
+    length += snprintf(out + length, size - length, "]}");
+
+  if (length >= size) {
+    ESP_LOGE(TAG, "Task profile doesn't fit in %zu bytes", size);
+    out[0] = '\0';
+    return 0;
+  }
+  return length;
+}
+
+void prof_send() {
+  // only ever called from the job worker, with the data for the web server.
+  // on the heartbeat period, or as soon as a task has stalled
+  static char message[PROF_MESSAGE_MAX_LEN];
+  static int64_t sent_at = 0;
+  static uint32_t sent_stalls = 0;
+
+  int64_t now = esp_timer_get_time();
+  int64_t period =
+      (int64_t)MAX(param_get(PARAM_HEARTBEAT), PROF_REPORT_MIN_MS) * 1000;
+  taskENTER_CRITICAL(&prof_lock);
+  uint32_t stalls = total_stalls;
+  taskEXIT_CRITICAL(&prof_lock);
+  if (sent_at != 0 && stalls == sent_stalls && now - sent_at < period)
+    return;
+
+  // as the web server expects, in a list
+  size_t length = snprintf(message, sizeof(message),
+                           "[{\"esp_id\":%u,\"type\":\"health\",\"content\":",
+                           ESP_ID);
+  size_t content =
+      prof_write_json(message + length, sizeof(message) - length - 2);
+  if (content == 0)
+    return;
+  memcpy(message + length + content, "}]", 3);
+
+  if (uplink_send(message)) {
+    sent_at = now;
+    sent_stalls = stalls;
+  }
+}
+
+void prof_log_stats() {
+  ESP_LOGI(TAG, "%" PRIu32 " stalls", total_stalls);
+  for (int i = 0;; i++) {
+    taskENTER_CRITICAL(&prof_lock);
+    bool more = i < n_tasks;
+    prof_task_t task = more ? tasks[i] : (prof_task_t){0};
+    taskEXIT_CRITICAL(&prof_lock);
+    if (!more)
+      break;
+
+    ESP_LOGI(TAG,
+             "%s: %d%% CPU, %" PRId32 " bytes of stack spare, %" PRIu32
+             " stalls%s",
+             task.name, task.cpu, task.stack_free, task.stalls,
+             task.stalled ? ", stalled" : "");
+  }
+}
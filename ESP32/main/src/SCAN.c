@@ -0,0 +1,218 @@
+#include "SCAN.h"
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+
+static const char *TAG = "SCAN";
+
+// every scan feeds a small table of the MESH APs heard (ROOTs and nodes), each
+// with when it was last heard, so that the set-up, join and merge logic share
+// results rather than each scanning every channel for itself. once a ROOT's
+// channel is known, a fresh scan only probes that channel, with short dwells,
+// and all channels are only listened to when asked for or every
+// `SCAN_FULL_PERIOD_MS`. the scans are made in whatever mode Wi-Fi is in,
+// which is only changed (as a last resort) while no stations are attached to
+// this AP. only used by `wifi_init` and then the job worker, so the table
+// needs no lock
+typedef struct {
+  wifi_ap_record_t record;
+  int64_t seen_at; // us
+} ap_entry_t;
+
+static ap_entry_t aps[SCAN_MAX_APS];
+static uint8_t n_aps = 0;
+static int64_t scanned_at = -1;      // us, on any channel
+static int64_t full_scanned_at = -1; // us, on all channels
+
+static bool is_root_ssid(const uint8_t *ssid) {
+  return strncmp((const char *)ssid, "ROOT ", 5) == 0;
+}
+
+static bool is_mesh_ssid(const uint8_t *ssid) {
+  return is_root_ssid(ssid) || strncmp((const char *)ssid, "bms_", 4) == 0;
+}
+
+static int clients_attached() {
+  // fails outside of AP mode, where there can't be any
+  wifi_sta_list_t stations = {0};
+  if (esp_wifi_ap_get_sta_list(&stations) != ESP_OK)
+    return 0;
+  return stations.num;
+}
+
+static void set_mode(wifi_mode_t mode) {
+  esp_wifi_stop();
+  esp_wifi_set_mode(mode);
+  esp_wifi_start();
+  vTaskDelay(pdMS_TO_TICKS(100));
+}
+
+static esp_err_t collect(uint8_t channel) {
+  uint16_t n_records = 0;
+  esp_err_t err = esp_wifi_scan_get_ap_num(&n_records);
+  if (err != ESP_OK)
+    return err;
+
+  wifi_ap_record_t *records = malloc(sizeof(wifi_ap_record_t) * n_records);
+  if (records == NULL && n_records > 0) {
+    ESP_LOGE(TAG, "Failed to allocate memory for AP list");
+    esp_wifi_clear_ap_list();
+    return ESP_ERR_NO_MEM;
+  }
+  err = esp_wifi_scan_get_ap_records(&n_records, records);
+  if (err != ESP_OK) {
+    free(records);
+    return err;
+  }
+
+  // APs on the channels scanned which weren't heard this time have gone
+  int64_t now = esp_timer_get_time();
+  for (int i = 0; i < n_aps;) {
+    if (channel == 0 || aps[i].record.primary == channel)
+      aps[i] = aps[--n_aps];
+    else
+      i++;
+  }
+  for (int i = 0; i < n_records; i++) {
+    if (!is_mesh_ssid(records[i].ssid))
+      continue;
+    if (n_aps == SCAN_MAX_APS) {
+      ESP_LOGW(TAG, "Too many MESH APs, ignoring %s", records[i].ssid);
+      continue;
+    }
+    aps[n_aps++] = (ap_entry_t){records[i], now};
+  }
+  free(records);
+
+  scanned_at = now;
+  if (channel == 0)
+    full_scanned_at = now;
+  if (VERBOSE)
+    ESP_LOGI(TAG, "Scanned channel %u, %u MESH AP(s) known", channel, n_aps);
+
+  return ESP_OK;
+}
+
+static esp_err_t scan(uint8_t channel) {
+  // a ROOT answers probes straight away, so one channel takes tens of ms
+  // actively. all channels are listened to passively, for beacons, as the
+  // set-up scan always has been
+  wifi_scan_config_t scan_config = {
+      .ssid = NULL,  // ROOT SSIDs change with charge, so matched below
+      .bssid = NULL, // all BSSIDs
+      .channel = channel,
+      .show_hidden = false,
+      .scan_type =
+          channel != 0 ? WIFI_SCAN_TYPE_ACTIVE : WIFI_SCAN_TYPE_PASSIVE,
+  };
+  if (channel != 0) {
+    scan_config.scan_time.active.min = SCAN_ACTIVE_DWELL_MIN_MS;
+    scan_config.scan_time.active.max = SCAN_ACTIVE_DWELL_MAX_MS;
+  }
+
+  esp_err_t err = esp_wifi_scan_start(&scan_config, true); // blocking scan
+  if (err == ESP_ERR_WIFI_STATE) {
+    // the station is still trying to connect, which a scan can't interrupt
+    esp_wifi_disconnect();
+    err = esp_wifi_scan_start(&scan_config, true);
+  }
+
+  // as a last resort, from STA mode alone. this drops any stations attached
+  // to the AP, so isn't done while there are some
+  bool changed_mode = false;
+  if (err == ESP_ERR_WIFI_STATE && clients_attached() == 0) {
+    ESP_LOGW(TAG, "Scanning from STA mode");
+    set_mode(WIFI_MODE_STA);
+    changed_mode = true;
+    err = esp_wifi_scan_start(&scan_config, true);
+  }
+
+  if (err == ESP_OK)
+    err = collect(channel);
+  if (changed_mode)
+    set_mode(WIFI_MODE_APSTA);
+
+  if (err != ESP_OK)
+    ESP_LOGW(TAG, "Failed to scan channel %u: %s", channel,
+             esp_err_to_name(err));
+
+  return err;
+}
+
+static const ap_entry_t *strongest(int64_t since) {
+  const ap_entry_t *best = NULL;
+  for (int i = 0; i < n_aps; i++)
+    if (is_root_ssid(aps[i].record.ssid) && aps[i].seen_at >= since &&
+        (best == NULL || aps[i].record.rssi > best->record.rssi))
+      best = &aps[i];
+
+  return best;
+}
+
+static uint8_t root_channel() {
+  // that of the ROOT heard most recently...
+  const ap_entry_t *newest = NULL;
+  for (int i = 0; i < n_aps; i++)
+    if (is_root_ssid(aps[i].record.ssid) &&
+        (newest == NULL || aps[i].seen_at > newest->seen_at))
+      newest = &aps[i];
+  if (newest != NULL)
+    return newest->record.primary;
+
+  // ...or else this device's own, which a ROOT not connected to a router
+  // shares with its nodes and any other such ROOT
+  uint8_t primary = 0;
+  wifi_second_chan_t second;
+  if (esp_wifi_get_channel(&primary, &second) != ESP_OK)
+    return 0;
+  return primary;
+}
+
+esp_err_t scan_find_root(uint32_t max_age_ms, bool all_channels,
+                         wifi_ap_record_t *root) {
+  // the strongest ROOT heard in the last `max_age_ms`, scanning again only if
+  // there hasn't been a scan that recently
+  int64_t now = esp_timer_get_time();
+  int64_t since = now - (int64_t)max_age_ms * 1000;
+  const ap_entry_t *found = strongest(since);
+  if (found == NULL) {
+    int64_t last = all_channels ? full_scanned_at : scanned_at;
+    if (last >= 0 && last >= since)
+      return ESP_ERR_NOT_FOUND;
+
+    uint8_t channel = 0;
+    if (!all_channels && full_scanned_at >= 0 &&
+        now - full_scanned_at < (int64_t)SCAN_FULL_PERIOD_MS * 1000)
+      channel = root_channel();
+
+    esp_err_t err = scan(channel);
+    if (err != ESP_OK)
+      return err;
+    found = strongest(now);
+  }
+
+  if (found == NULL)
+    return ESP_ERR_NOT_FOUND;
+  *root = found->record;
+
+  return ESP_OK;
+}
+
+esp_err_t scan_lookup(const uint8_t bssid[6], wifi_ap_record_t *record) {
+  // a MESH AP from the last scan to hear it, for its SSID
+  for (int i = 0; i < n_aps; i++) {
+    if (memcmp(aps[i].record.bssid, bssid, sizeof(aps[i].record.bssid)) == 0) {
+      *record = aps[i].record;
+      return ESP_OK;
+    }
+  }
+
+  return ESP_ERR_NOT_FOUND;
+}
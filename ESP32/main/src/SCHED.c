@@ -0,0 +1,209 @@
+#include "SCHED.h"
+
+#include "PARAM.h"
+#include "TASK.h"
+#include "config.h"
+#include "global.h"
+
+#include <stdbool.h>
+
+#include "esp_log.h"
+#include "esp_random.h"
+#include "freertos/FreeRTOS.h"
+
+static const char *TAG = "SCHED";
+
+// every recurring job is run from a single timer, which turns a wheel of
+// `SCHED_WHEEL_SLOTS` ticks. each job sits in the slot of the tick it is next
+// due on, however many turns away that is, so a tick only looks at the jobs
+// which might be due on it. jobs with the same period are spread evenly across
+// it rather than all landing in `job_queue` on the same tick, and each run is
+// moved by up to its jitter either way so that they don't fall back into step.
+// a job chained after another stage (e.g. publishing after a new sample) runs
+// just after it, as long as most of its period has passed, and only goes back
+// to its own clock if the stage stops happening
+typedef struct {
+  job_type_t type;
+  param_id_t period;
+  uint32_t ticks;  // the period when it was last spread
+  uint32_t jitter; // ticks
+  int after;       // SCHED_AFTER_NONE, a job type or SCHED_AFTER_SAMPLE
+  bool triggered;  // `after` has happened since the last run
+  bool chained;    // the last run was straight after `after`
+  uint32_t anchor; // tick the current period started on
+  uint32_t due;    // tick of the next run
+} entry_t;
+
+_Static_assert(SCHED_MAX_ENTRIES <= 32, "entries are marked in a 32-bit mask");
+
+static entry_t entries[SCHED_MAX_ENTRIES];
+static uint8_t n_entries = 0;
+static uint32_t wheel[SCHED_WHEEL_SLOTS] = {0}; // one bit per entry
+static uint32_t now = 0;                        // ticks since `sched_init`
+static portMUX_TYPE sched_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static TimerHandle_t tick_timer = NULL;
+
+static uint32_t period_ticks(const entry_t *entry) {
+  uint32_t ticks = param_get(entry->period) / SCHED_TICK_MS;
+  return ticks > 0 ? ticks : 1;
+}
+
+// call with `sched_lock` held
+static void place(int i, uint32_t due) {
+  // never on the tick being turned, or one already gone
+  if ((int32_t)(due - now) <= 0)
+    due = now + 1;
+  wheel[entries[i].due % SCHED_WHEEL_SLOTS] &= ~(1u << i);
+  entries[i].due = due;
+  wheel[due % SCHED_WHEEL_SLOTS] |= 1u << i;
+}
+
+// call with `sched_lock` held
+static void plan(int i) {
+  entry_t *entry = &entries[i];
+  uint32_t period = period_ticks(entry);
+  if (entry->chained) {
+    // give the stage a quarter of a period to be late by before giving up
+    // on it
+    place(i, entry->anchor + period + period / 4);
+    return;
+  }
+
+  uint32_t jitter = entry->jitter < period / 2 ? entry->jitter : period / 2;
+  int32_t offset = 0;
+  if (jitter > 0)
+    offset = (int32_t)(esp_random() % (2 * jitter + 1)) - (int32_t)jitter;
+  place(i, entry->anchor + period + offset);
+}
+
+// call with `sched_lock` held
+static void spread(uint32_t period) {
+  // the jobs sharing a period, evenly across it
+  int group[SCHED_MAX_ENTRIES];
+  int n = 0;
+  for (int i = 0; i < n_entries; i++)
+    if (period_ticks(&entries[i]) == period)
+      group[n++] = i;
+
+  for (int k = 0; k < n; k++) {
+    entry_t *entry = &entries[group[k]];
+    entry->ticks = period;
+    entry->chained = false;
+    entry->anchor = now + (k + 1) * period / n - period;
+    place(group[k], entry->anchor + period);
+  }
+}
+
+// call with `sched_lock` held
+static void run(int i) {
+  entry_t *entry = &entries[i];
+  uint32_t period = period_ticks(entry);
+  entry->chained = entry->triggered;
+  entry->triggered = false;
+
+  // on a fixed period, unless it was chained or has fallen behind
+  if (entry->chained || now - entry->anchor >= 2 * period)
+    entry->anchor = now;
+  else
+    entry->anchor += period;
+  plan(i);
+}
+
+static void tick_callback(TimerHandle_t xTimer) {
+  job_type_t due[SCHED_MAX_ENTRIES];
+  int n_due = 0;
+
+  taskENTER_CRITICAL(&sched_lock);
+  now++;
+  uint32_t slot = wheel[now % SCHED_WHEEL_SLOTS];
+  for (int i = 0; slot != 0; i++, slot >>= 1)
+    if ((slot & 1) && entries[i].due == now) {
+      due[n_due++] = entries[i].type;
+      run(i);
+    }
+  taskEXIT_CRITICAL(&sched_lock);
+
+  for (int i = 0; i < n_due; i++)
+    sched_queue(due[i]);
+}
+
+static void period_watcher(param_id_t id, int32_t value) {
+  // settings which aren't the period of a job are ignored. the jobs left
+  // behind are spread again too, to close the gap where the moved ones were
+  taskENTER_CRITICAL(&sched_lock);
+  for (int i = 0; i < n_entries; i++) {
+    if (entries[i].period != id)
+      continue;
+    uint32_t old_period = entries[i].ticks;
+    uint32_t new_period = period_ticks(&entries[i]);
+    spread(new_period);
+    if (old_period != new_period)
+      spread(old_period);
+    break;
+  }
+  taskEXIT_CRITICAL(&sched_lock);
+}
+
+void sched_init() {
+  tick_timer = xTimerCreate("sched_timer", pdMS_TO_TICKS(SCHED_TICK_MS),
+                            pdTRUE, NULL, tick_callback);
+  assert(tick_timer);
+  xTimerStart(tick_timer, 0);
+  param_watch(~0u, period_watcher);
+}
+
+void sched_add(job_type_t type, param_id_t period, uint32_t jitter_ms,
+               int after) {
+  // the first run is within a period of being added
+  taskENTER_CRITICAL(&sched_lock);
+  bool full = n_entries == SCHED_MAX_ENTRIES;
+  if (!full) {
+    entry_t *entry = &entries[n_entries++];
+    *entry = (entry_t){
+        .type = type,
+        .period = period,
+        .jitter = jitter_ms / SCHED_TICK_MS,
+        .after = after,
+    };
+    spread(period_ticks(entry));
+  }
+  taskEXIT_CRITICAL(&sched_lock);
+
+  if (full)
+    ESP_LOGE(TAG, "No space to schedule job %d", type);
+}
+
+void sched_ran(int stage) {
+  // from the job worker after each job, and the BMS task after each sample
+  taskENTER_CRITICAL(&sched_lock);
+  uint32_t next = now + 1;
+  for (int i = 0; i < n_entries; i++) {
+    entry_t *entry = &entries[i];
+    if (entry->after != stage || entry->triggered)
+      continue;
+
+    // no more often than about once a period
+    uint32_t period = period_ticks(entry);
+    if (now - entry->anchor >= period - period / 4) {
+      // a tick apart, when several follow the same stage
+      entry->triggered = true;
+      place(i, next++);
+    } else if (!entry->chained) {
+      // too soon after its last run on its own clock, so follow the stage
+      // from the next time instead
+      entry->chained = true;
+      entry->anchor = now;
+      plan(i);
+    }
+  }
+  taskEXIT_CRITICAL(&sched_lock);
+}
+
+void sched_queue(job_type_t type) {
+  job_t job = {.type = type};
+
+  if (xQueueSend(job_queue, &job, 0) != pdPASS)
+    if (VERBOSE)
+      ESP_LOGW(TAG, "Queue full, dropping job");
+}
@@ -0,0 +1,271 @@
+#include "SOAK.h"
+
+#include "BMS.h"
+#include "CHANGE.h"
+#include "CODEC.h"
+#include "GPS.h"
+#include "I2C.h"
+#include "INV.h"
+#include "LoRa.h"
+#include "MEM.h"
+#include "MESH.h"
+#include "STATE.h"
+#include "WS.h"
+#include "config.h"
+#include "global.h"
+
+#include <inttypes.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cJSON.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static const char *TAG = "SOAK";
+
+// the simulated clock moves on by this much between scheduling passes
+#define SOAK_STEP_MS 1000
+// runs of each job which aren't counted, while lazily created state settles
+#define SOAK_WARMUP_RUNS 10
+// number of progress reports over the whole run
+#define SOAK_N_REPORTS 10
+
+// a mesh node's data message as it would arrive at the ROOT over the mesh
+// WebSocket, so that the transmit path also has to aggregate other devices
+static const char *mesh_node_message =
+    "{\"esp_id\":2,\"type\":\"data\",\"content\":{\"esp_id\":2,\"Q\":80,"
+    "\"H\":100,\"aT\":250,\"V\":148,\"I\":-12,\"V1\":370,\"V2\":371,\"V3\":"
+    "370,\"V4\":372,\"I1\":-3,\"I2\":-3,\"I3\":-3,\"I4\":-3,\"T1\":2500,"
+    "\"T2\":2510,\"T3\":2490,\"T4\":2500,\"cT\":251,\"OTC\":550,\"CC\":12,"
+    "\"wifi\":false,\"t\":0,\"d\":0,\"lat\":0,\"lon\":0,\"P\":0,\"inv\":1}}";
+
+// a request as it would arrive from the web server
+static const char *ws_request_message =
+    "{\"type\":\"query\",\"content\":\"are you still there?\"}";
+
+#if defined(__SANITIZE_ADDRESS__)
+// from <sanitizer/allocator_interface.h>, part of the runtime linked in
+size_t __sanitizer_get_current_allocated_bytes(void);
+#endif
+
+static size_t heap_in_use() {
+#if defined(__SANITIZE_ADDRESS__)
+  // AddressSanitizer's allocator replaces glibc's, which no longer sees it
+  return __sanitizer_get_current_allocated_bytes();
+#else
+  struct mallinfo2 info = mallinfo2();
+  return info.uordblks;
+#endif
+}
+
+static void soak_ws_receive() {
+  // handed over the same way as by `websocket_event_handler`
+  size_t len = strlen(ws_request_message);
+  char *data = mem_block_alloc(len + 1);
+  memcpy(data, ws_request_message, len + 1);
+  process_event(data);
+  mem_block_free(data);
+}
+
+static size_t soak_radio_frame(uint8_t *binary_message) {
+  // what the other end of the radio link sends: data from a ROOT to the
+  // receiver, or queries from the web server to this ROOT and to a mesh node
+  // reached through it
+  cJSON *json_array = cJSON_CreateArray();
+  if (LORA_IS_RECEIVER) {
+    cJSON_AddItemToArray(json_array, cJSON_Parse(mesh_node_message));
+  } else {
+    uint8_t esp_ids[] = {ESP_ID, 2};
+    for (size_t i = 0; i < sizeof(esp_ids); i++) {
+      char name[sizeof("bms_255")];
+      snprintf(name, sizeof(name), "bms_%02u", esp_ids[i]);
+      cJSON *query = cJSON_CreateObject();
+      cJSON_AddStringToObject(query, "type", "query");
+      cJSON_AddStringToObject(query, "esp_id", name);
+      cJSON_AddStringToObject(query, "content", "are you still there?");
+      cJSON_AddItemToArray(json_array, query);
+    }
+  }
+
+  size_t binary_message_length = json_to_binary(binary_message, json_array);
+  cJSON_Delete(json_array);
+  return binary_message_length;
+}
+
+static void soak_radio_receive() {
+  // framed as on air, and handed to the same handler as a frame `receive`
+  // has read off the radio
+  uint8_t binary_message[5 * LORA_MAX_PACKET_LEN];
+  size_t binary_message_length = soak_radio_frame(binary_message);
+
+  uint8_t encoded[2 * sizeof(binary_message) + 2];
+  size_t encoded_length =
+      encode_frame(binary_message, binary_message_length, encoded);
+  receive_frame(encoded, encoded_length, -60);
+}
+
+static void soak_transmit() {
+  // pretend a mesh node has reported since the last transmission
+  report_t report;
+  cJSON *message = cJSON_Parse(mesh_node_message);
+  if (codec_from_json(message, &report))
+    mesh_keep_report(&report);
+  cJSON_Delete(message);
+  transmit();
+}
+
+static void soak_bms_read() {
+  // one round of the BMS task
+  for (int i = 0; i < BMS_N_PACKS; i++)
+    update_telemetry_data(i);
+}
+
+static soak_job_t jobs[] = {
+    {.name = "BMS read",
+     .type = N_JOB_TYPES,
+     .period_ms = BMS_READ_PERIOD,
+     .run = soak_bms_read},
+    {.name = "GPS read",
+     .type = N_JOB_TYPES,
+     .period_ms = GPS_READ_PERIOD,
+     .run = update_gps},
+    {.name = "INV read",
+     .type = N_JOB_TYPES,
+     .period_ms = INV_READ_PERIOD,
+     .run = update_inv},
+    {.name = "JOB_WS_SEND",
+     .type = JOB_WS_SEND,
+     .period_ms = WS_DELAY,
+     .run = send_websocket_data},
+    {.name = "JOB_WS_RECEIVE",
+     .type = JOB_WS_RECEIVE,
+     .period_ms = 10000,
+     .run = soak_ws_receive},
+    {.name = "JOB_MESH_WS_SEND",
+     .type = JOB_MESH_WS_SEND,
+     .period_ms = 5000,
+     .run = send_mesh_websocket_data},
+    {.name = "JOB_LORA_TRANSMIT",
+     .type = JOB_LORA_TRANSMIT,
+     .period_ms = 5000,
+     .run = soak_transmit},
+    {.name = "JOB_LORA_RECEIVE",
+     .type = JOB_LORA_RECEIVE,
+     .period_ms = 5000,
+     .run = soak_radio_receive},
+};
+static const size_t n_jobs = sizeof(jobs) / sizeof(jobs[0]);
+
+static void run_job(soak_job_t *job) {
+  // send jobs always take their whole path, rather than only when the stub
+  // readings have changed enough
+  for (int i = 0; i < N_DESTINATIONS; i++)
+    change_reset(i);
+
+  size_t before = heap_in_use();
+  int64_t start_time = esp_timer_get_time();
+
+  // run jobs inside the same memory scope as the job worker does
+  if (job->type != N_JOB_TYPES)
+    mem_job_begin(job->type);
+  job->run();
+  if (job->type != N_JOB_TYPES)
+    mem_job_end(job->type, job->name);
+
+  int64_t end_time = esp_timer_get_time();
+  int64_t leaked = (int64_t)heap_in_use() - (int64_t)before;
+
+  job->runs++;
+  if (job->runs <= SOAK_WARMUP_RUNS)
+    return;
+
+  job->total_time += end_time - start_time;
+  job->growth += leaked;
+  if (leaked > job->worst_run)
+    job->worst_run = leaked;
+}
+
+static bool report(bool final) {
+  bool passed = true;
+
+  for (size_t i = 0; i < n_jobs; i++) {
+    soak_job_t *job = &jobs[i];
+    uint64_t counted = job->runs > SOAK_WARMUP_RUNS
+                           ? job->runs - SOAK_WARMUP_RUNS
+                           : 0;
+    bool job_passed = job->growth <= SOAK_TOLERANCE;
+    passed &= job_passed;
+
+    ESP_LOGI(TAG,
+             "  %-18s %10" PRIu64 " runs, %8.1f us/run, growth %" PRId64
+             " B (worst run %" PRId64 " B)%s",
+             job->name, job->runs,
+             counted ? (double)job->total_time / counted : 0.0, job->growth,
+             job->worst_run, job_passed ? "" : "  <-- LEAK");
+
+    if (final && job->type != N_JOB_TYPES) {
+      mem_job_stats_t stats;
+      mem_get_job_stats(job->type, &stats);
+      if (stats.arena_overflows > 0)
+        ESP_LOGW(TAG, "  %-18s %" PRIu32 " allocations overflowed the arena",
+                 job->name, stats.arena_overflows);
+    }
+  }
+
+  return passed;
+}
+
+void soak_run() {
+  // the stub components are chatty, keep the output to this harness
+  esp_log_level_set("*", ESP_LOG_WARN);
+  esp_log_level_set(TAG, ESP_LOG_INFO);
+
+  // exercise the ROOT code paths, without a Wi-Fi connection so that data
+  // goes out by radio
+  state_set(STATE_ROOT);
+  state_clear(STATE_WIFI);
+
+  const int64_t duration_ms = (int64_t)SOAK_DURATION * 1000;
+  const int64_t report_every_ms = duration_ms / SOAK_N_REPORTS;
+  int64_t next_report_ms = report_every_ms;
+  int64_t start_time = esp_timer_get_time();
+
+  ESP_LOGI(TAG, "Simulating %d s of operation...", SOAK_DURATION);
+
+  for (int64_t now_ms = 0; now_ms < duration_ms; now_ms += SOAK_STEP_MS) {
+    for (size_t i = 0; i < n_jobs; i++) {
+      if (now_ms >= jobs[i].next_due_ms) {
+        run_job(&jobs[i]);
+        jobs[i].next_due_ms += jobs[i].period_ms;
+      }
+    }
+
+    if (now_ms >= next_report_ms) {
+      ESP_LOGI(TAG, "%" PRId64 "/%d s simulated, %zu B allocated",
+               now_ms / 1000, SOAK_DURATION, heap_in_use());
+      report(false);
+      next_report_ms += report_every_ms;
+    }
+
+    // jump the clock forwards rather than waiting
+    esp_timer_stub_advance((int64_t)SOAK_STEP_MS * 1000);
+  }
+
+  ESP_LOGI(TAG, "Finished in %.1f s of wall time:",
+           (double)(esp_timer_get_time() - start_time -
+                    duration_ms * 1000) / 1000000.0);
+  bool passed = report(true);
+  mem_log_stats();
+  i2c_log_stats();
+
+  if (passed) {
+    ESP_LOGI(TAG, "PASSED: no job grew the heap");
+    exit(EXIT_SUCCESS);
+  }
+
+  ESP_LOGE(TAG, "FAILED: heap growth above %d B tolerance", SOAK_TOLERANCE);
+  exit(EXIT_FAILURE);
+}
@@ -0,0 +1,117 @@
+#include "STATE.h"
+
+#include "config.h"
+
+#include "esp_event.h"
+#include "esp_log.h"
+#include "esp_netif_types.h"
+#include "esp_wifi.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+#include "freertos/semphr.h"
+
+static const char *TAG = "STATE";
+
+// the connectivity of this device is kept as bits of an event group, set and
+// cleared as the Wi-Fi, IP and WebSocket events arrive rather than polled on
+// every tick, so that a task can block until a link is up and others can be
+// told as soon as one changes. changes are made one at a time, under a mutex,
+// against a copy of the bits, so that each is only passed on to watchers once
+// and the group never ends up out of step with the copy
+typedef struct {
+  EventBits_t bits;
+  state_watcher_t watcher;
+} watch_t;
+
+static EventGroupHandle_t state_group = NULL;
+static EventBits_t shadow = 0;
+static watch_t watches[STATE_MAX_WATCHERS];
+static uint8_t n_watches = 0;
+static SemaphoreHandle_t state_mutex = NULL;
+
+static void update(EventBits_t bits, bool value) {
+  xSemaphoreTake(state_mutex, portMAX_DELAY);
+  EventBits_t changed = value ? bits & ~shadow : bits & shadow;
+  shadow = value ? shadow | bits : shadow & ~bits;
+  watch_t told[STATE_MAX_WATCHERS];
+  uint8_t n_told = 0;
+  for (int i = 0; i < n_watches && changed != 0; i++)
+    if (watches[i].bits & changed)
+      told[n_told++] = watches[i];
+  if (changed != 0 && value)
+    xEventGroupSetBits(state_group, changed);
+  else if (changed != 0)
+    xEventGroupClearBits(state_group, changed);
+  xSemaphoreGive(state_mutex);
+
+  for (int i = 0; i < n_told; i++)
+    told[i].watcher(told[i].bits & changed);
+}
+
+static void wifi_handler(void *arg, esp_event_base_t event_base,
+                         int32_t event_id, void *event_data) {
+  if (event_base == WIFI_EVENT) {
+    if (event_id == WIFI_EVENT_STA_CONNECTED)
+      state_set(STATE_STA_LINK);
+    else if (event_id == WIFI_EVENT_STA_DISCONNECTED)
+      state_clear(STATE_STA_LINK | STATE_WIFI);
+    return;
+  }
+
+  // a node's STA gets an address from its parent's AP too, which isn't a
+  // router
+  if (event_id == IP_EVENT_STA_GOT_IP && !state_is(STATE_PARENT))
+    state_set(STATE_WIFI);
+  else if (event_id == IP_EVENT_STA_LOST_IP)
+    state_clear(STATE_WIFI);
+}
+
+void state_init() {
+  state_group = xEventGroupCreate();
+  assert(state_group);
+  state_mutex = xSemaphoreCreateMutex();
+  assert(state_mutex);
+}
+
+void state_start() {
+  // once the default event loop exists
+  ESP_ERROR_CHECK(esp_event_handler_register(
+      WIFI_EVENT, WIFI_EVENT_STA_CONNECTED, &wifi_handler, NULL));
+  ESP_ERROR_CHECK(esp_event_handler_register(
+      WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &wifi_handler, NULL));
+  ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP,
+                                             &wifi_handler, NULL));
+  ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_LOST_IP,
+                                             &wifi_handler, NULL));
+}
+
+EventBits_t state_get() { return xEventGroupGetBits(state_group); }
+
+bool state_is(EventBits_t bits) {
+  // all of them
+  return (state_get() & bits) == bits;
+}
+
+void state_set(EventBits_t bits) { update(bits, true); }
+
+void state_clear(EventBits_t bits) { update(bits, false); }
+
+void state_assign(EventBits_t bits, bool value) { update(bits, value); }
+
+EventBits_t state_wait(EventBits_t bits, TickType_t timeout) {
+  // until any of them are set, returning those which are
+  return xEventGroupWaitBits(state_group, bits, pdFALSE, pdFALSE, timeout) &
+         bits;
+}
+
+bool state_watch(EventBits_t bits, state_watcher_t watcher) {
+  xSemaphoreTake(state_mutex, portMAX_DELAY);
+  bool stored = n_watches < STATE_MAX_WATCHERS;
+  if (stored)
+    watches[n_watches++] = (watch_t){bits, watcher};
+  xSemaphoreGive(state_mutex);
+
+  if (!stored)
+    ESP_LOGE(TAG, "No space to watch state changes");
+  return stored;
+}
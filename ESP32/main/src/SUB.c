@@ -0,0 +1,407 @@
+#include "SUB.h"
+
+#include "LoRa.h"
+#include "MEM.h"
+#include "TASK.h"
+#include "WS.h"
+#include "config.h"
+#include "global.h"
+#include "utils.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+static const char *TAG = "SUB";
+
+// each browser is sent what it has subscribed to: this device's own data, or
+// just some of its fields, that of the devices relayed through it, alarms and
+// the job worker's statistics, each at most once per a period of its own.
+// until a browser asks for anything else it gets what every browser always
+// has, its own data whenever it changes and the alarms. each message sent is
+// a view of some data (its topic, fields, device and whether it is binary),
+// and each view due on a tick is only written once, however many browsers
+// get it
+typedef struct {
+  sub_topic_t topic;
+  uint64_t fields;    // SUB_TELEMETRY and SUB_MESH, one bit per field_t
+  uint8_t esp_id;     // SUB_MESH, or 0 for every device
+  uint32_t period_ms; // at most one message per, or 0 for every tick
+  bool on_change;     // only when `sub_publish` is told the data changed
+  int64_t sent_at;    // us, 0 before the first
+} subscription_t;
+
+typedef struct {
+  bool used;
+  int fd;
+  uint32_t version; // changed with the subscriptions
+  uint8_t n_subs;
+  subscription_t subs[SUB_MAX_PER_CLIENT];
+} client_subs_t;
+
+typedef struct {
+  sub_topic_t topic;
+  uint64_t fields;
+  uint8_t esp_id;
+  bool binary;
+  uint8_t *payload;
+  size_t length; // 0 if it couldn't be written
+} view_t;
+
+static const char *topic_names[N_SUB_TOPICS] = {
+    [SUB_TELEMETRY] = "telemetry",
+    [SUB_MESH] = "mesh",
+    [SUB_ALARMS] = "alarms",
+    [SUB_JOBS] = "jobs",
+};
+
+static const subscription_t defaults[] = {
+    {.topic = SUB_TELEMETRY, .fields = CODEC_ALL_FIELDS, .on_change = true},
+    {.topic = SUB_ALARMS},
+};
+static const uint8_t n_defaults = sizeof(defaults) / sizeof(defaults[0]);
+
+// changed by the web server's task as browsers come and go, and read by the
+// job worker
+static client_subs_t clients[WS_CONFIG_MAX_CLIENTS];
+
+// the latest from each device relayed through this one, which unlike
+// `all_messages` is kept once it has been passed on
+static report_t mesh_latest[MESH_SIZE];
+static int64_t mesh_heard_at[MESH_SIZE]; // us, 0 for an empty slot
+static portMUX_TYPE sub_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// the views written this tick, and a spare which is written again for each
+// view beyond those. only used by the job worker
+static view_t views[SUB_MAX_VIEWS + 1];
+static size_t n_views = 0;
+
+// what each view is written into, so that publishing takes nothing from the
+// pool the web server and the uplink share. the job statistics need more
+// room, but are only ever one view
+static uint8_t payloads[SUB_MAX_VIEWS + 1][WS_DATA_MAX_LEN];
+static uint8_t jobs_payload[SUB_JOBS_MAX_LEN];
+
+_Static_assert(sizeof(radio_data_packet) <= WS_DATA_MAX_LEN,
+               "a packed view has to fit where a JSON one does");
+
+static client_subs_t *find_client(int fd) {
+  for (int i = 0; i < WS_CONFIG_MAX_CLIENTS; i++)
+    if (clients[i].used && clients[i].fd == fd)
+      return &clients[i];
+  return NULL;
+}
+
+void sub_add_client(int fd) {
+  taskENTER_CRITICAL(&sub_lock);
+  client_subs_t *client = find_client(fd);
+  for (int i = 0; i < WS_CONFIG_MAX_CLIENTS && client == NULL; i++)
+    if (!clients[i].used)
+      client = &clients[i];
+  if (client != NULL) {
+    client->used = true;
+    client->fd = fd;
+    client->version++;
+    client->n_subs = n_defaults;
+    memcpy(client->subs, defaults, sizeof(defaults));
+  }
+  taskEXIT_CRITICAL(&sub_lock);
+}
+
+void sub_remove_client(int fd) {
+  taskENTER_CRITICAL(&sub_lock);
+  client_subs_t *client = find_client(fd);
+  if (client != NULL)
+    client->used = false;
+  taskEXIT_CRITICAL(&sub_lock);
+}
+
+static bool parse(const cJSON *item, subscription_t *sub) {
+  // {"topic": ..., "fields": [...], "esp_id": ..., "period": ms}, all but the
+  // topic optional
+  *sub = (subscription_t){.topic = N_SUB_TOPICS, .fields = CODEC_ALL_FIELDS};
+  cJSON *topic = cJSON_GetObjectItem(item, "topic");
+  for (int i = 0; cJSON_IsString(topic) && i < N_SUB_TOPICS; i++)
+    if (strcmp(topic->valuestring, topic_names[i]) == 0)
+      sub->topic = i;
+  if (sub->topic == N_SUB_TOPICS) {
+    ESP_LOGW(TAG, "Unknown subscription topic");
+    return false;
+  }
+
+  cJSON *fields = cJSON_GetObjectItem(item, "fields");
+  if (cJSON_IsArray(fields)) {
+    sub->fields = 0;
+    cJSON *field = NULL;
+    cJSON_ArrayForEach(field, fields) {
+      const field_info_t *info =
+          cJSON_IsString(field) ? codec_find_field(field->valuestring) : NULL;
+      if (info == NULL) {
+        ESP_LOGW(TAG, "Unknown field in %s subscription",
+                 topic_names[sub->topic]);
+        return false;
+      }
+      sub->fields |= CODEC_FIELD_BIT(info - field_info);
+    }
+  }
+
+  cJSON *esp_id = cJSON_GetObjectItem(item, "esp_id");
+  if (cJSON_IsNumber(esp_id))
+    sub->esp_id = MIN(MAX(esp_id->valueint, 0), UINT8_MAX);
+  cJSON *period = cJSON_GetObjectItem(item, "period");
+  if (cJSON_IsNumber(period))
+    sub->period_ms = MAX(period->valueint, 0);
+
+  return true;
+}
+
+int sub_update(int fd, const cJSON *content) {
+  // replaces all of a browser's subscriptions with those in `content`, or the
+  // defaults without it, returning how many were kept or -1
+  subscription_t subs[SUB_MAX_PER_CLIENT];
+  uint8_t n_subs = 0;
+  if (content == NULL) {
+    memcpy(subs, defaults, sizeof(defaults));
+    n_subs = n_defaults;
+  } else if (cJSON_IsArray(content)) {
+    cJSON *item = NULL;
+    cJSON_ArrayForEach(item, content) {
+      if (n_subs == SUB_MAX_PER_CLIENT) {
+        ESP_LOGW(TAG, "Client %d: only the first %d subscriptions are kept",
+                 fd, SUB_MAX_PER_CLIENT);
+        break;
+      }
+      if (parse(item, &subs[n_subs]))
+        n_subs++;
+    }
+  } else {
+    ESP_LOGE(TAG, "Client %d: subscriptions must be an array", fd);
+    return -1;
+  }
+
+  taskENTER_CRITICAL(&sub_lock);
+  client_subs_t *client = find_client(fd);
+  if (client != NULL) {
+    client->version++;
+    client->n_subs = n_subs;
+    memcpy(client->subs, subs, n_subs * sizeof(subscription_t));
+  }
+  taskEXIT_CRITICAL(&sub_lock);
+
+  if (client == NULL)
+    return -1;
+  ESP_LOGI(TAG, "Client %d: %u subscription(s)", fd, n_subs);
+  return n_subs;
+}
+
+void sub_note_report(const report_t *report) {
+  // the same device again, or else a new one in place of the oldest
+  int64_t now = esp_timer_get_time();
+  taskENTER_CRITICAL(&sub_lock);
+  int slot = 0;
+  for (int i = 0; i < MESH_SIZE; i++) {
+    if (mesh_heard_at[i] != 0 && mesh_latest[i].esp_id == report->esp_id) {
+      slot = i;
+      break;
+    }
+    if (mesh_heard_at[i] < mesh_heard_at[slot])
+      slot = i;
+  }
+  mesh_latest[slot] = *report;
+  mesh_heard_at[slot] = now;
+  taskEXIT_CRITICAL(&sub_lock);
+}
+
+static size_t write_jobs(char *out, size_t size) {
+  // what `mem_log_stats` logs
+  mem_pool_stats_t pool;
+  mem_get_pool_stats(&pool);
+  size_t length = snprintf(
+      out, size,
+      "{\"type\":\"jobs\",\"content\":{\"pool\":{\"in_use\":%u,"
+      "\"high_water\":%u,\"heap_fallbacks\":%" PRIu32 "},\"jobs\":[",
+      (unsigned)pool.in_use, (unsigned)pool.high_water, pool.heap_fallbacks);
+
+  bool first = true;
+  for (int i = 0; i < N_JOB_TYPES && length < size; i++) {
+    mem_job_stats_t stats;
+    mem_get_job_stats(i, &stats);
+    if (stats.runs == 0)
+      continue;
+    length += snprintf(
+        out + length, size - length,
+        "%s{\"name\":\"%s\",\"runs\":%" PRIu32 ",\"arena_high_water\":%u,"
+        "\"arena_overflows\":%" PRIu32 ",\"largest_heap_drop\":%" PRId32
+        ",\"min_free_heap\":%" PRIu32 "}",
+        first ? "" : ",", stats.name, stats.runs,
+        (unsigned)stats.arena_high_water, stats.arena_overflows,
+        stats.largest_heap_drop, stats.min_free_heap);
+    first = false;
+  }
+  if (length < size)
+    length += snprintf(out + length, size - length, "]}}");
+
+  if (length >= size) {
+    ESP_LOGE(TAG, "Job statistics don't fit in %zu bytes", size);
+    out[0] = '\0';
+    return 0;
+  }
+  return length;
+}
+
+static void write_view(view_t *view, size_t slot, const report_t *report) {
+  bool jobs = view->topic == SUB_JOBS;
+  size_t size = jobs ? sizeof(jobs_payload) : sizeof(payloads[slot]);
+  view->payload = jobs ? jobs_payload : payloads[slot];
+
+  if (jobs)
+    view->length = write_jobs((char *)view->payload, size);
+  else if (view->binary)
+    view->length = codec_pack(report, view->payload);
+  else
+    view->length = codec_write_fields(report, view->fields,
+                                      (char *)view->payload, size, true);
+}
+
+static const view_t *get_view(const view_t *key, const report_t *report) {
+  for (size_t i = 0; i < n_views; i++)
+    if (views[i].topic == key->topic && views[i].fields == key->fields &&
+        views[i].esp_id == key->esp_id && views[i].binary == key->binary)
+      return &views[i];
+
+  size_t slot = n_views;
+  if (slot > SUB_MAX_VIEWS)
+    slot = SUB_MAX_VIEWS;
+  else
+    n_views++;
+  views[slot] = *key;
+  write_view(&views[slot], slot, report);
+
+  return &views[slot];
+}
+
+static bool send_view(int fd, const view_t *key, const report_t *report) {
+  const view_t *view = get_view(key, report);
+  if (view->length == 0)
+    return false;
+  return send_to_browser(fd, view->payload, view->length, view->binary);
+}
+
+static bool is_binary(int fd) {
+  for (int i = 0; i < WS_CONFIG_MAX_CLIENTS; i++)
+    if (client_sockets[i].descriptor == fd)
+      return client_sockets[i].binary;
+  return false;
+}
+
+static bool is_due(const subscription_t *sub, int64_t now, bool changed) {
+  if (sub->on_change && !changed)
+    return false;
+  return sub->sent_at == 0 ||
+         now - sub->sent_at >= (int64_t)sub->period_ms * 1000;
+}
+
+static bool publish_to(client_subs_t *client, const report_t *own,
+                       bool changed, const report_t *mesh,
+                       const int64_t *heard_at, int64_t now) {
+  // whatever is due of what one browser has subscribed to, returning whether
+  // a subscription which follows the changes was sent anything
+  bool binary = is_binary(client->fd);
+  bool sent_change = false;
+  for (int i = 0; i < client->n_subs; i++) {
+    subscription_t *sub = &client->subs[i];
+    if (sub->topic == SUB_ALARMS || !is_due(sub, now, changed))
+      continue;
+
+    bool sent = false;
+    view_t key = {.topic = sub->topic, .fields = sub->fields};
+    if (sub->topic == SUB_TELEMETRY && own != NULL) {
+      key.esp_id = own->esp_id;
+      key.binary = binary;
+      sent = send_view(client->fd, &key, own);
+    } else if (sub->topic == SUB_MESH) {
+      // those heard from since the last time
+      for (int j = 0; j < MESH_SIZE; j++) {
+        if (heard_at[j] <= sub->sent_at ||
+            (sub->esp_id != 0 && mesh[j].esp_id != sub->esp_id))
+          continue;
+        key.esp_id = mesh[j].esp_id;
+        key.binary = binary;
+        sent |= send_view(client->fd, &key, &mesh[j]);
+      }
+    } else if (sub->topic == SUB_JOBS) {
+      key.fields = 0;
+      sent = send_view(client->fd, &key, NULL);
+    }
+
+    if (sent) {
+      sub->sent_at = now;
+      sent_change |= sub->on_change;
+    }
+  }
+
+  return sent_change;
+}
+
+bool sub_publish(const report_t *own, bool changed) {
+  // only ever called from the job worker, once per tick. `own` is this
+  // device's data, if it has any, and `changed` whether it is due to
+  // browsers which follow its changes, which this returns whether any was
+  // sent to
+  static client_subs_t subscribed[WS_CONFIG_MAX_CLIENTS];
+  static report_t mesh[MESH_SIZE];
+  static int64_t heard_at[MESH_SIZE];
+  taskENTER_CRITICAL(&sub_lock);
+  memcpy(subscribed, clients, sizeof(clients));
+  memcpy(mesh, mesh_latest, sizeof(mesh_latest));
+  memcpy(heard_at, mesh_heard_at, sizeof(mesh_heard_at));
+  taskEXIT_CRITICAL(&sub_lock);
+
+  int64_t now = esp_timer_get_time();
+  bool sent_change = false;
+  for (int i = 0; i < WS_CONFIG_MAX_CLIENTS; i++)
+    if (subscribed[i].used)
+      sent_change |=
+          publish_to(&subscribed[i], own, changed, mesh, heard_at, now);
+  n_views = 0; // written afresh next tick
+
+  // keep when each subscription was last sent, unless it has since changed
+  taskENTER_CRITICAL(&sub_lock);
+  for (int i = 0; i < WS_CONFIG_MAX_CLIENTS; i++)
+    if (subscribed[i].used && clients[i].used &&
+        clients[i].fd == subscribed[i].fd &&
+        clients[i].version == subscribed[i].version)
+      for (int j = 0; j < clients[i].n_subs; j++)
+        clients[i].subs[j].sent_at = subscribed[i].subs[j].sent_at;
+  taskEXIT_CRITICAL(&sub_lock);
+
+  return sent_change;
+}
+
+bool sub_publish_alarm(const char *message) {
+  // to each browser which has subscribed to alarms, as soon as there is one
+  int fds[WS_CONFIG_MAX_CLIENTS];
+  int n_fds = 0;
+  taskENTER_CRITICAL(&sub_lock);
+  for (int i = 0; i < WS_CONFIG_MAX_CLIENTS; i++) {
+    if (!clients[i].used)
+      continue;
+    for (int j = 0; j < clients[i].n_subs; j++) {
+      if (clients[i].subs[j].topic == SUB_ALARMS) {
+        fds[n_fds++] = clients[i].fd;
+        break;
+      }
+    }
+  }
+  taskEXIT_CRITICAL(&sub_lock);
+
+  bool sent = false;
+  for (int i = 0; i < n_fds; i++)
+    sent |= send_to_browser(fds[i], message, strlen(message), false);
+
+  return sent;
+}
@@ -1,12 +1,21 @@
 #include "TASK.h"
 
+#include "ALARM.h"
 #include "BMS.h"
+#include "CMD.h"
+#include "DLOG.h"
 #include "DNS.h"
+#include "ELECT.h"
 #include "GPS.h"
 #include "I2C.h"
 #include "INV.h"
 #include "LoRa.h"
+#include "MEM.h"
 #include "MESH.h"
+#include "PARAM.h"
+#include "PROF.h"
+#include "SCHED.h"
+#include "TRACE.h"
 #include "WS.h"
 #include "global.h"
 
@@ -16,105 +25,108 @@
 
 static const char *TAG = "TASK";
 
+// these outlive each job, as traces and deferred log lines keep names rather
+// than copying them
+static const char *job_names[N_JOB_TYPES] = {
+    [JOB_DNS_REQUEST] = "JOB_DNS_REQUEST",
+    [JOB_WS_SEND] = "JOB_WS_SEND",
+    [JOB_WS_RECEIVE] = "JOB_WS_RECEIVE",
+    [JOB_SLAVE_ESP32_TRANSMIT] = "JOB_SLAVE_ESP32_TRANSMIT",
+    [JOB_MESH_CONNECT] = "JOB_MESH_CONNECT",
+    [JOB_MESH_WS_SEND] = "JOB_MESH_WS_SEND",
+    [JOB_MESH_ELECT] = "JOB_MESH_ELECT",
+    [JOB_LORA_RECEIVE] = "JOB_LORA_RECEIVE",
+    [JOB_LORA_TRANSMIT] = "JOB_LORA_TRANSMIT",
+    [JOB_ALARM_SEND] = "JOB_ALARM_SEND",
+    [JOB_CMD_STEP] = "JOB_CMD_STEP",
+    [JOB_PARAM_SAVE] = "JOB_PARAM_SAVE",
+};
+
 void job_worker_freertos_task(void *arg) {
   job_t job;
   unsigned int n_jobs_remaining = 0;
-  bool received = false;
-  char job_type[32];
+  const char *job_type = NULL;
   int64_t start_time = 0;
   int64_t end_time = 0;
 
   while (true) {
-    if (xQueueReceive(job_queue, &job, portMAX_DELAY) == pdPASS) {
+    // wakes up now and then without a job, to check in
+    prof_checkin(PROF_IDLE_MS);
+    if (xQueueReceive(job_queue, &job, pdMS_TO_TICKS(PROF_IDLE_MS)) ==
+        pdPASS) {
       n_jobs_remaining = uxQueueMessagesWaiting(job_queue);
-      received = true;
       start_time = esp_timer_get_time();
+      job_type = job.type < N_JOB_TYPES && job_names[job.type] != NULL
+                     ? job_names[job.type]
+                     : "JOB_UNKNOWN";
+      mem_job_begin(job.type);
+      trace_begin(job_type);
       switch (job.type) {
       case JOB_DNS_REQUEST:
-        snprintf(job_type, sizeof(job_type), "JOB_DNS_REQUEST");
         handle_dns_request(job.data);
         break;
 
-      case JOB_UPDATE_DATA:
-        char bms[5] = "";
-        char gps[5] = "";
-        char inv[5] = "";
-        if (READ_BMS_ENABLED) {
-          update_telemetry_data();
-          strcpy(bms, " BMS");
-        }
-        if (READ_GPS_ENABLED) {
-          update_gps();
-          strcpy(gps, " GPS");
-        }
-        if (READ_INV_ENABLED) {
-          update_inv();
-          strcpy(inv, " INV");
-        }
-        snprintf(job_type, sizeof(job_type), "JOB_UPDATE_DATA:%s%s%s", bms, gps,
-                 inv);
-        break;
-
       case JOB_SLAVE_ESP32_TRANSMIT:
-        snprintf(job_type, sizeof(job_type), "JOB_SLAVE_ESP32_TRANSMIT");
         write_to_slave_esp32();
         break;
 
       case JOB_WS_SEND:
-        snprintf(job_type, sizeof(job_type), "JOB_WS_SEND");
         send_websocket_data();
         break;
 
       case JOB_WS_RECEIVE:
-        snprintf(job_type, sizeof(job_type), "JOB_WS_RECEIVE");
         process_event(job.data);
         break;
 
       case JOB_MESH_CONNECT:
-        snprintf(job_type, sizeof(job_type), "JOB_MESH_CONNECT");
         connect_to_root();
         break;
 
       case JOB_MESH_WS_SEND:
-        snprintf(job_type, sizeof(job_type), "JOB_MESH_WS_SEND");
         send_mesh_websocket_data();
         break;
 
-      case JOB_MESH_MERGE:
-        snprintf(job_type, sizeof(job_type), "JOB_MESH_MERGE");
-        merge_root();
+      case JOB_MESH_ELECT:
+        elect_round();
         break;
 
       case JOB_LORA_RECEIVE:
-        snprintf(job_type, sizeof(job_type), "JOB_LORA_RECEIVE");
         receive();
         break;
 
       case JOB_LORA_TRANSMIT:
-        snprintf(job_type, sizeof(job_type), "JOB_LORA_TRANSMIT");
         transmit();
         break;
 
+      case JOB_ALARM_SEND:
+        alarm_send();
+        break;
+
+      case JOB_CMD_STEP:
+        cmd_step();
+        break;
+
+      case JOB_PARAM_SAVE:
+        param_save();
+        break;
+
       default:
         break;
       }
+      trace_end(job_type);
       end_time = esp_timer_get_time();
+      mem_job_end(job.type, job_type);
+      // run whatever is chained after this job
+      sched_ran(job.type);
 
-      // free heap-allocated job data if needed
+      // return the job payload to its pool (or the heap)
       if (job.data)
-        free(job.data);
-
-      if (VERBOSE) {
-        ESP_LOGI(TAG, "JOB WORKER: Number of jobs in queue:");
-        ESP_LOGI(TAG, "  before: %d",
-                 received ? n_jobs_remaining + 1 : n_jobs_remaining);
-        ESP_LOGI(TAG, "  after:  %d", n_jobs_remaining);
-        if (received)
-          ESP_LOGI(TAG, "Processed \'%s\' in %f s", job_type,
-                   (float)(end_time - start_time) / 1000000.0);
-      }
+        mem_block_free(job.data);
 
-      received = false;
+      if (VERBOSE)
+        DLOGI(TAG, "Processed '%s' in %d us, %u job(s) left in queue",
+              DLOG_STR(job_type), (int)(end_time - start_time),
+              n_jobs_remaining);
     }
 
     vTaskDelay(pdMS_TO_TICKS(500));
@@ -0,0 +1,226 @@
+#include "TRACE.h"
+
+#include "PARAM.h"
+#include "config.h"
+#include "global.h"
+#include "utils.h"
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+
+static const char *TAG = "TRACE";
+
+// a timeline of what each task was doing and when, to be opened in
+// chrome://tracing or Perfetto. events go into a ring per core, each claimed
+// with a single atomic increment, so that tasks and interrupts record them
+// without taking a lock or waiting on each other; once a ring is full the
+// oldest are overwritten. the rings are only allocated when tracing is first
+// switched on, and kept after it is switched off so the trace can still be
+// exported
+typedef struct {
+  int64_t ts;       // us since boot
+  const char *name; // not copied
+  char phase;       // 'B'egin, 'E'nd or 'i'nstant, as Chrome has them
+  uint8_t tid;
+} trace_event_t;
+
+typedef struct {
+  atomic_uint head; // events ever claimed
+  trace_event_t events[TRACE_RING_LEN];
+} trace_ring_t;
+
+_Static_assert((TRACE_RING_LEN & (TRACE_RING_LEN - 1)) == 0,
+               "the ring index has to carry on through `head` wrapping");
+
+static trace_ring_t *rings[portNUM_PROCESSORS] = {NULL};
+static atomic_bool enabled = false;
+
+// tasks are numbered from 1 in the order they are first seen, and keep their
+// numbers. entries are only ever added, with `n_tasks` raised once each is
+// filled in, so they can be looked up without the lock
+typedef struct {
+  TaskHandle_t handle;
+  char name[configMAX_TASK_NAME_LEN];
+} trace_task_t;
+
+#define TRACE_TID_OTHER 0                   // tasks once `tasks` is full
+#define TRACE_TID_ISR (TRACE_MAX_TASKS + 1) // plus the core
+
+static trace_task_t tasks[TRACE_MAX_TASKS];
+static atomic_int n_tasks = 0;
+static portMUX_TYPE trace_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static int core() {
+#if portNUM_PROCESSORS > 1
+  return xPortGetCoreID();
+#else
+  return 0;
+#endif
+}
+
+static uint8_t task_id() {
+  TaskHandle_t handle = xTaskGetCurrentTaskHandle();
+  int n = atomic_load(&n_tasks);
+  for (int i = 0; i < n; i++)
+    if (tasks[i].handle == handle)
+      return i + 1;
+
+  // only this task adds itself, so it can't have been added since
+  uint8_t tid = TRACE_TID_OTHER;
+  taskENTER_CRITICAL(&trace_lock);
+  n = atomic_load(&n_tasks);
+  if (n < TRACE_MAX_TASKS) {
+    tasks[n].handle = handle;
+    strncpy(tasks[n].name, pcTaskGetName(handle), sizeof(tasks[n].name) - 1);
+    atomic_store(&n_tasks, n + 1);
+    tid = n + 1;
+  }
+  taskEXIT_CRITICAL(&trace_lock);
+  return tid;
+}
+
+static void record(uint8_t tid, char phase, const char *name) {
+  trace_ring_t *ring = rings[core()];
+  if (ring == NULL)
+    return;
+
+  // moving to the other core from here only means using the other's ring
+  unsigned i = atomic_fetch_add(&ring->head, 1) % TRACE_RING_LEN;
+  ring->events[i] = (trace_event_t){
+      .ts = esp_timer_get_time(),
+      .name = name,
+      .phase = phase,
+      .tid = tid,
+  };
+}
+
+static void enabled_watcher(param_id_t id, int32_t value) {
+  trace_set_enabled(value != 0);
+}
+
+void trace_init() {
+  // after `param_init`, so that a trace can be kept running through a reboot
+  trace_set_enabled(param_get(PARAM_TRACE) != 0);
+  param_watch(PARAM_BIT(PARAM_TRACE), enabled_watcher);
+}
+
+void trace_set_enabled(bool enable) {
+  if (enable == atomic_load(&enabled))
+    return;
+
+  if (enable) {
+    for (int i = 0; i < portNUM_PROCESSORS; i++) {
+      if (rings[i] == NULL)
+        rings[i] = calloc(1, sizeof(trace_ring_t));
+      if (rings[i] == NULL) {
+        ESP_LOGE(TAG, "Couldn't assign memory for tracing");
+        return;
+      }
+      // a fresh trace each time
+      atomic_store(&rings[i]->head, 0);
+    }
+  }
+  atomic_store(&enabled, enable);
+  ESP_LOGI(TAG, "Tracing %s", enable ? "started" : "stopped");
+}
+
+bool trace_enabled() { return atomic_load(&enabled); }
+
+void trace_begin(const char *name) {
+  if (atomic_load(&enabled))
+    record(task_id(), 'B', name);
+}
+
+void trace_end(const char *name) {
+  if (atomic_load(&enabled))
+    record(task_id(), 'E', name);
+}
+
+void trace_instant(const char *name) {
+  if (atomic_load(&enabled))
+    record(task_id(), 'i', name);
+}
+
+void trace_isr(const char *name) {
+  // from an interrupt, which has no task of its own
+  if (atomic_load(&enabled))
+    record(TRACE_TID_ISR + core(), 'i', name);
+}
+
+bool trace_export(chunk_emit_t emit, void *ctx) {
+  // as Chrome's JSON trace format, oldest first. recording is paused until it
+  // is done so that events aren't overwritten as they are read
+  chunk_writer_t writer;
+  if (!chunk_begin(&writer, TRACE_CHUNK_LEN, emit, ctx)) {
+    ESP_LOGE(TAG, "Couldn't assign memory to export trace");
+    return false;
+  }
+  bool was_enabled = atomic_exchange(&enabled, false);
+
+  chunk_printf(
+      &writer,
+      "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[{\"name\":\"process_name\","
+      "\"ph\":\"M\",\"pid\":%u,\"tid\":0,\"args\":{\"name\":\"bms_%02u\"}}",
+      ESP_ID, ESP_ID);
+  int n = atomic_load(&n_tasks);
+  for (int i = 0; i <= n; i++)
+    chunk_printf(
+        &writer,
+        ",{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%d,"
+        "\"args\":{\"name\":\"%s\"}}",
+        ESP_ID, i, i == TRACE_TID_OTHER ? "other" : tasks[i - 1].name);
+  for (int i = 0; i < portNUM_PROCESSORS; i++)
+    chunk_printf(
+        &writer,
+        ",{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%d,"
+        "\"args\":{\"name\":\"ISR core %d\"}}",
+        ESP_ID, TRACE_TID_ISR + i, i);
+
+  // merged across the rings by time
+  unsigned next[portNUM_PROCESSORS];
+  unsigned end[portNUM_PROCESSORS];
+  for (int i = 0; i < portNUM_PROCESSORS; i++) {
+    end[i] = rings[i] != NULL ? atomic_load(&rings[i]->head) : 0;
+    next[i] = end[i] > TRACE_RING_LEN ? end[i] - TRACE_RING_LEN : 0;
+  }
+  while (writer.ok) {
+    const trace_event_t *event = NULL;
+    int from = 0;
+    for (int i = 0; i < portNUM_PROCESSORS; i++) {
+      if (next[i] == end[i])
+        continue;
+      const trace_event_t *oldest =
+          &rings[i]->events[next[i] % TRACE_RING_LEN];
+      if (event == NULL || oldest->ts < event->ts) {
+        event = oldest;
+        from = i;
+      }
+    }
+    if (event == NULL)
+      break;
+    next[from]++;
+    if (event->name == NULL) // claimed but never filled in
+      continue;
+
+    chunk_printf(&writer,
+                 ",{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%" PRId64
+                 ",\"pid\":%u,\"tid\":%u%s}",
+                 event->name, event->phase, event->ts, ESP_ID, event->tid,
+                 event->phase == 'i' ? ",\"s\":\"t\"" : "");
+  }
+  chunk_printf(&writer, "]}");
+  bool ok = chunk_end(&writer);
+
+  atomic_store(&enabled, was_enabled);
+  if (!ok)
+    ESP_LOGW(TAG, "Trace export stopped early");
+  return ok;
+}
@@ -0,0 +1,430 @@
+#include "UPLINK.h"
+
+#include "BMS.h"
+#include "MEM.h"
+#include "PROF.h"
+#include "STATE.h"
+#include "TRACE.h"
+#include "WS.h"
+#include "config.h"
+#include "global.h"
+#include "utils.h"
+
+#include "cert.h"
+#include "local_cert.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_websocket_client.h"
+#include "freertos/FreeRTOS.h"
+
+static const char *TAG = "UPLINK";
+
+// the connection to the web server belongs to a task of its own, so that
+// nothing else ever waits on the network. messages for the web server are
+// copied into a bounded queue, or refused (for the caller to try again later)
+// while it is full or the connection is down. the callers take a message as
+// sent once it is queued, so what is queued (and batched) when the connection
+// goes is kept, and sent once it is back. the client is made once and
+// kept, with its certificate parsed and its buffers allocated, and only this
+// task starts and stops it: after a failed or dropped connection it waits,
+// twice as long each time up to `UPLINK_BACKOFF_MAX_MS`, before trying again.
+// it blocks on the connectivity state (see `STATE.c`) rather than polling
+// it, and is woken as soon as the Wi-Fi goes
+typedef struct {
+  char *data; // NULL to have the batch sent
+  size_t length;
+} uplink_item_t;
+
+// data messages are held back to go `UPLINK_BATCH_SAMPLES` frames at a time,
+// where a frame is what one message would have held before (this ESP32's
+// packs and its mesh nodes, or a radio frame), so that the TLS and WebSocket
+// framing is paid for once. a batch is sent once it is full, or once its
+// oldest frame has waited `UPLINK_BATCH_MAX_DELAY`, whichever is sooner.
+// there are two of them: one being filled and one being sent, swapped under
+// a mutex so that the reports are never copied with interrupts off
+typedef struct {
+  report_t reports[UPLINK_BATCH_MAX_REPORTS];
+  uint8_t frame_ends[UPLINK_BATCH_SAMPLES]; // past each frame's last report
+  uint8_t n_frames;
+  uint8_t n_reports;
+  int64_t first_at; // us, when the oldest frame was added
+} batch_t;
+
+static QueueHandle_t uplink_queue = NULL;
+static esp_websocket_client_handle_t ws_client = NULL;
+static bool started = false; // only touched by the task
+
+static batch_t batches[2] = {0};
+static batch_t *batch = &batches[0]; // the one being filled
+static SemaphoreHandle_t batch_mutex = NULL;
+
+bool uplink_connected() { return state_is(STATE_UPLINK); }
+
+bool uplink_send(const char *message) {
+  if (uplink_queue == NULL || !uplink_connected()) {
+    ESP_LOGW(TAG, "WebSocket not connected, dropping message: %s", message);
+    return false;
+  }
+
+  size_t length = strlen(message);
+  uplink_item_t item = {.data = mem_block_alloc(length + 1), .length = length};
+  if (item.data == NULL) {
+    ESP_LOGE(TAG, "Couldn't assign memory for outgoing message");
+    return false;
+  }
+  memcpy(item.data, message, length + 1);
+
+  if (xQueueSend(uplink_queue, &item, 0) != pdPASS) {
+    ESP_LOGW(TAG, "Queue full, dropping message");
+    mem_block_free(item.data);
+    return false;
+  }
+
+  if (VERBOSE)
+    ESP_LOGI(TAG, "Queued: %s", message);
+  return true;
+}
+
+static void request_flush() {
+  uplink_item_t item = {.data = NULL};
+  if (xQueueSend(uplink_queue, &item, 0) != pdPASS && VERBOSE)
+    ESP_LOGW(TAG, "Queue full, batch will go at its deadline");
+}
+
+bool uplink_batch(const report_t *reports, size_t n_reports) {
+  // one frame, whose first report is that of the ESP32 holding the connection
+  if (n_reports == 0)
+    return true;
+  if (uplink_queue == NULL || !uplink_connected()) {
+    ESP_LOGW(TAG, "WebSocket not connected, dropping %zu data message(s)",
+             n_reports);
+    return false;
+  }
+
+  xSemaphoreTake(batch_mutex, portMAX_DELAY);
+  bool stored = batch->n_frames < UPLINK_BATCH_SAMPLES &&
+                batch->n_reports + n_reports <= UPLINK_BATCH_MAX_REPORTS;
+  if (stored) {
+    if (batch->n_frames == 0)
+      batch->first_at = esp_timer_get_time();
+    memcpy(&batch->reports[batch->n_reports], reports,
+           n_reports * sizeof(report_t));
+    batch->n_reports += n_reports;
+    batch->frame_ends[batch->n_frames++] = batch->n_reports;
+  }
+  bool full = !stored || batch->n_frames == UPLINK_BATCH_SAMPLES;
+  xSemaphoreGive(batch_mutex);
+
+  if (full)
+    request_flush();
+  if (!stored)
+    ESP_LOGW(TAG, "Batch full, dropping %zu data message(s)", n_reports);
+  return stored;
+}
+
+static int64_t batch_deadline() {
+  // -1 if there's nothing waiting
+  xSemaphoreTake(batch_mutex, portMAX_DELAY);
+  int64_t deadline =
+      batch->n_frames == 0
+          ? -1
+          : batch->first_at + (int64_t)UPLINK_BATCH_MAX_DELAY * 1000;
+  xSemaphoreGive(batch_mutex);
+  return deadline;
+}
+
+// a batch is written a piece at a time and sent as the fragments of a single
+// WebSocket message, so that it is never held whole. only ever used by the
+// task, so one piece does for every batch
+static char piece[UPLINK_PIECE_LEN];
+
+_Static_assert(UPLINK_PIECE_LEN >= 2 * WS_DATA_MAX_LEN,
+               "a piece has to hold a data message and what comes before it");
+
+typedef struct {
+  size_t length; // in `piece`
+  size_t total;  // sent so far
+  bool started;  // as fragments
+  bool ok;
+} stream_t;
+
+static void stream_send(stream_t *stream) {
+  // once a fragment has failed, the rest are thrown away
+  if (stream->ok && stream->length > 0) {
+    TickType_t timeout = pdMS_TO_TICKS(UPLINK_SEND_TIMEOUT_MS);
+    int sent = stream->started ? esp_websocket_client_send_cont_msg(
+                                     ws_client, piece, stream->length, timeout)
+                               : esp_websocket_client_send_text_partial(
+                                     ws_client, piece, stream->length, timeout);
+    stream->ok = sent >= 0;
+    stream->started = true;
+    stream->total += stream->length;
+  }
+  stream->length = 0;
+}
+
+static char *stream_room(stream_t *stream, size_t needed) {
+  // where the next `needed` bytes go, once what's there has been sent if they
+  // wouldn't fit. NULL once sending has failed
+  if (sizeof(piece) - stream->length < needed)
+    stream_send(stream);
+  return stream->ok ? piece + stream->length : NULL;
+}
+
+static void stream_put(stream_t *stream, const char *text) {
+  size_t length = strlen(text);
+  char *out = stream_room(stream, length);
+  if (out == NULL)
+    return;
+  memcpy(out, text, length);
+  stream->length += length;
+}
+
+static bool write_batch(const batch_t *sending, stream_t *stream) {
+  // one frame goes as it always has, and more as an array of them, oldest
+  // first. in columnar form, each data message is just an array of values
+  bool outer = UPLINK_BATCH_COLUMNAR || sending->n_frames > 1;
+
+  if (UPLINK_BATCH_COLUMNAR) {
+    stream_put(stream, "{\"type\":\"columns\",\"keys\":");
+    char *out = stream_room(stream, WS_DATA_MAX_LEN);
+    size_t length = out != NULL ? codec_write_keys(out, WS_DATA_MAX_LEN) : 0;
+    if (length == 0)
+      return false;
+    stream->length += length;
+    stream_put(stream, ",\"frames\":");
+  }
+  if (outer)
+    stream_put(stream, "[");
+  for (int frame = 0, i = 0; frame < sending->n_frames; frame++) {
+    stream_put(stream, frame > 0 ? ",[" : "[");
+    for (int first = i; i < sending->frame_ends[frame]; i++) {
+      if (i > first)
+        stream_put(stream, ",");
+      char *out = stream_room(stream, WS_DATA_MAX_LEN);
+      if (out == NULL)
+        return false;
+      size_t length =
+          UPLINK_BATCH_COLUMNAR
+              ? codec_write_row(&sending->reports[i], out, WS_DATA_MAX_LEN)
+              : codec_write_json(&sending->reports[i], out, WS_DATA_MAX_LEN,
+                                 false);
+      if (length == 0)
+        return false;
+      stream->length += length;
+    }
+    stream_put(stream, "]");
+  }
+  if (outer)
+    stream_put(stream, "]");
+  if (UPLINK_BATCH_COLUMNAR)
+    stream_put(stream, "}");
+
+  return stream->ok;
+}
+
+static void send_batch() {
+  // only ever called from the task, which has the other batch to itself
+  // until the next swap
+  xSemaphoreTake(batch_mutex, portMAX_DELAY);
+  batch_t *sending = batch;
+  batch = sending == &batches[0] ? &batches[1] : &batches[0];
+  batch->n_frames = 0;
+  batch->n_reports = 0;
+  xSemaphoreGive(batch_mutex);
+  if (sending->n_frames == 0)
+    return;
+
+  trace_begin("uplink_batch");
+  stream_t stream = {.ok = true};
+  bool written = write_batch(sending, &stream);
+  TickType_t timeout = pdMS_TO_TICKS(UPLINK_SEND_TIMEOUT_MS);
+  if (!stream.started) {
+    // small enough to go in one go
+    if (written)
+      stream.ok = esp_websocket_client_send_text(ws_client, piece,
+                                                 stream.length, timeout) >= 0;
+    stream.total = stream.length;
+  } else {
+    // the message is ended even if it couldn't all be written, so that the
+    // connection can carry on
+    stream_send(&stream);
+    stream.ok &= esp_websocket_client_send_fin(ws_client, timeout) == ESP_OK;
+  }
+  trace_end("uplink_batch");
+
+  if (!stream.ok)
+    ESP_LOGW(TAG, "Failed to send batch");
+  else if (!written)
+    ESP_LOGE(TAG, "Failed to write batch of %u sample(s)", sending->n_frames);
+  else if (VERBOSE)
+    ESP_LOGI(TAG, "Sent %u sample(s) in %zu bytes", sending->n_frames,
+             stream.total);
+}
+
+static void uplink_event_handler(void *arg, esp_event_base_t event_base,
+                                 int32_t event_id, void *event_data) {
+  if (event_id == WEBSOCKET_EVENT_CONNECTED) {
+    trace_instant("uplink_connected");
+    state_set(STATE_UPLINK);
+  } else if (event_id == WEBSOCKET_EVENT_DISCONNECTED) {
+    trace_instant("uplink_disconnected");
+    state_clear(STATE_UPLINK);
+  }
+}
+
+static bool create_client() {
+  char host[64];
+  if (LOCAL)
+    snprintf(host, sizeof(host), "%s:8000", FLASK_IP);
+  else
+    snprintf(host, sizeof(host), "%s", AZURE_URL);
+  char uri[128];
+  snprintf(uri, sizeof(uri), "wss://%s/api/esp_ws", host);
+
+  const esp_websocket_client_config_t websocket_cfg = {
+      .uri = uri,
+      .disable_auto_reconnect = true, // the back-off below does that
+      .network_timeout_ms = 10000,
+      .cert_pem = LOCAL ? (const char *)local_cert_pem
+                        : (const char *)website_cert_pem,
+      .skip_cert_common_name_check = LOCAL,
+  };
+
+  ws_client = esp_websocket_client_init(&websocket_cfg);
+  if (ws_client == NULL) {
+    ESP_LOGE(TAG, "Failed to initialize WebSocket client");
+    return false;
+  }
+  esp_websocket_register_events(ws_client, WEBSOCKET_EVENT_ANY,
+                                websocket_event_handler, NULL);
+  esp_websocket_register_events(ws_client, WEBSOCKET_EVENT_ANY,
+                                uplink_event_handler, NULL);
+  return true;
+}
+
+static void stop() {
+  if (started)
+    esp_websocket_client_stop(ws_client);
+  started = false;
+  state_clear(STATE_UPLINK);
+}
+
+static uint32_t back_off(uint32_t backoff_ms) {
+  ESP_LOGW(TAG, "No connection to the web server, retrying in %" PRIu32 " ms",
+           backoff_ms);
+  vTaskDelay(pdMS_TO_TICKS(backoff_ms));
+  return MIN(backoff_ms * 2, UPLINK_BACKOFF_MAX_MS);
+}
+
+void uplink_freertos_task(void *arg) {
+  uint32_t backoff_ms = UPLINK_BACKOFF_MIN_MS;
+  int64_t started_at = 0;
+  bool was_connected = false;
+
+  while (true) {
+    if (!state_is(STATE_WIFI)) {
+      stop();
+      was_connected = false;
+      backoff_ms = UPLINK_BACKOFF_MIN_MS;
+      prof_checkin(PROF_FOREVER);
+      state_wait(STATE_WIFI, portMAX_DELAY);
+      continue;
+    }
+    // the longest of the waits below
+    prof_checkin(MAX(backoff_ms, UPLINK_CONNECT_TIMEOUT_MS));
+
+    if (ws_client == NULL && !create_client()) {
+      backoff_ms = back_off(backoff_ms);
+      continue;
+    }
+
+    if (!started) {
+      if (esp_websocket_client_start(ws_client) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start WebSocket client");
+        backoff_ms = back_off(backoff_ms);
+        continue;
+      }
+      started = true;
+      started_at = esp_timer_get_time();
+    }
+
+    if (!state_is(STATE_UPLINK)) {
+      // still connecting...
+      int64_t waited_us = esp_timer_get_time() - started_at;
+      if (!was_connected &&
+          waited_us < (int64_t)UPLINK_CONNECT_TIMEOUT_MS * 1000) {
+        state_wait(STATE_UPLINK, pdMS_TO_TICKS(UPLINK_CONNECT_TIMEOUT_MS -
+                                               waited_us / 1000));
+        continue;
+      }
+      // ...or not going to
+      stop();
+      was_connected = false;
+      backoff_ms = back_off(backoff_ms);
+      continue;
+    }
+    if (!was_connected)
+      ESP_LOGI(TAG, "Connected to the web server");
+    was_connected = true;
+    backoff_ms = UPLINK_BACKOFF_MIN_MS;
+
+    // wake up in time for the batch's deadline
+    int64_t wait_us = 1000000;
+    int64_t deadline = batch_deadline();
+    if (deadline >= 0)
+      wait_us = MAX(MIN(wait_us, deadline - esp_timer_get_time()), 0);
+
+    uplink_item_t item;
+    bool received =
+        xQueueReceive(uplink_queue, &item, pdMS_TO_TICKS(wait_us / 1000)) ==
+        pdPASS;
+    if (!state_is(STATE_WIFI | STATE_UPLINK)) {
+      // woken by the connection going, so what was received waits for it to
+      // come back, still first in line
+      if (received && item.data != NULL &&
+          xQueueSendToFront(uplink_queue, &item, 0) != pdPASS) {
+        ESP_LOGW(TAG, "Queue full, dropping message");
+        mem_block_free(item.data);
+      }
+      continue;
+    }
+    deadline = batch_deadline();
+    if ((received && item.data == NULL) ||
+        (deadline >= 0 && esp_timer_get_time() >= deadline))
+      send_batch();
+    if (!received || item.data == NULL)
+      continue;
+
+    if (VERBOSE)
+      ESP_LOGI(TAG, "Sending: %s", item.data);
+    trace_begin("uplink_send");
+    if (esp_websocket_client_send_text(
+            ws_client, item.data, item.length,
+            pdMS_TO_TICKS(UPLINK_SEND_TIMEOUT_MS)) < 0)
+      ESP_LOGW(TAG, "Failed to send message");
+    trace_end("uplink_send");
+    mem_block_free(item.data);
+  }
+}
+
+static void wifi_watcher(EventBits_t changed) {
+  // a task waiting on its queue has to be woken to find the Wi-Fi gone
+  if (!state_is(STATE_WIFI))
+    request_flush();
+}
+
+void start_uplink_task() {
+  batch_mutex = xSemaphoreCreateMutex();
+  assert(batch_mutex);
+  uplink_queue = xQueueCreate(UPLINK_QUEUE_LEN, sizeof(uplink_item_t));
+  assert(uplink_queue);
+  state_watch(STATE_WIFI, wifi_watcher);
+  xTaskCreate(uplink_freertos_task, "uplink_freertos_task", 4096, NULL, 5,
+              NULL);
+}
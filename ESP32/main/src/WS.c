@@ -1,37 +1,43 @@
 #include "WS.h"
 
-#include "BMS.h"
+#include "ALARM.h"
+#include "CHANGE.h"
+#include "CMD.h"
+#include "CODEC.h"
+#include "DATA.h"
+#include "ELECT.h"
 #include "GPS.h"
-#include "I2C.h"
+#include "LoRa.h"
+#include "MEM.h"
+#include "MESH.h"
+#include "PARAM.h"
+#include "PROF.h"
+#include "SCHED.h"
+#include "STATE.h"
+#include "SUB.h"
 #include "TASK.h"
+#include "TRACE.h"
+#include "UPLINK.h"
 #include "config.h"
 #include "global.h"
 #include "utils.h"
 
-#include "cert.h"
-#include "local_cert.h"
-
 #include <inttypes.h>
+#include <string.h>
 
 #include "cJSON.h"
-#include "driver/gpio.h"
 #include "esp_log.h"
 #include "esp_netif.h"
 #include "esp_websocket_client.h"
-#include "esp_wifi.h"
 #include "esp_wifi_types_generic.h"
 #include "lwip/ip4_addr.h"
-#include "nvs_flash.h"
 
 static const char *TAG = "WS";
 
-static bool reconnect = false;
-static char ESP_IP[16] = "xxx.xxx.xxx.xxx\0";
-static esp_websocket_client_handle_t ws_client = NULL;
 
-static TimerHandle_t websocket_timer;
 
-void add_client(int fd, const char *tkn, bool browser, uint8_t esp_id) {
+void add_client(int fd, const char *tkn, bool browser, uint8_t esp_id,
+                bool binary) {
   for (int i = 0; i < WS_CONFIG_MAX_CLIENTS; i++) {
     if (client_sockets[i].descriptor == fd) {
       return;
@@ -41,7 +47,15 @@ void add_client(int fd, const char *tkn, bool browser, uint8_t esp_id) {
       client_sockets[i].auth_token[UTILS_AUTH_TOKEN_LENGTH - 1] = '\0';
       client_sockets[i].is_browser_not_mesh = browser;
       client_sockets[i].esp_id = browser ? 0 : esp_id;
-      ESP_LOGI(TAG, "Client %d added", fd);
+      client_sockets[i].binary = binary;
+      ESP_LOGI(TAG, "Client %d added%s", fd, binary ? " (binary)" : "");
+      if (browser)
+        sub_add_client(fd);
+      if (!browser)
+        mesh_learn_route(esp_id, fd, true);
+      // so that a new browser gets data on the next tick
+      if (browser)
+        change_reset(DESTINATION_BROWSER);
       return;
     }
   }
@@ -55,13 +69,79 @@ void remove_client(int fd) {
       client_sockets[i].auth_token[0] = '\0';
       client_sockets[i].is_browser_not_mesh = true;
       client_sockets[i].esp_id = 0;
+      client_sockets[i].binary = false;
+      mesh_forget_routes(fd);
+      sub_remove_client(fd);
       ESP_LOGI(TAG, "Client %d removed", fd);
       return;
     }
   }
 }
 
-esp_err_t client_handler(httpd_req_t *req) {
+static bool receive_from_node(cJSON *item, int fd) {
+  // whichever device it came from can be reached through this child
+  cJSON *type = cJSON_GetObjectItem(item, "type");
+  cJSON *esp_id = cJSON_GetObjectItem(item, "esp_id");
+  if (cJSON_IsNumber(esp_id))
+    mesh_learn_route(esp_id->valueint, fd, false);
+
+  if (cJSON_IsString(type) && strcmp(type->valuestring, "alarm") == 0) {
+    // alarms from mesh clients are passed on straight away, rather than
+    // waiting for the next LoRa transmission, or up the mesh by a node
+    if (state_is(STATE_ROOT)) {
+      alarm_forward(item);
+    } else {
+      char *message_string = cJSON_PrintUnformatted(item);
+      if (message_string != NULL)
+        send_mesh_message(message_string);
+      cJSON_free(message_string);
+    }
+  } else if (cJSON_IsString(type) &&
+             strcmp(type->valuestring, "response") == 0) {
+    // as are the responses to requests which were forwarded to them
+    cmd_forward_response(item);
+  } else {
+    // queue message from mesh client to forward via LoRa, or along with a
+    // node's own data
+    report_t report;
+    if (!cJSON_IsNumber(esp_id) || !codec_from_json(item, &report)) {
+      char *message_string = cJSON_PrintUnformatted(item);
+      ESP_LOGE(TAG, "incoming LoRa queue message not formatted properly:\n  %s",
+               message_string);
+      cJSON_free(message_string);
+      return false;
+    }
+    mesh_keep_report(&report);
+  }
+
+  return true;
+}
+
+static bool receive_packets(const uint8_t *payload, size_t length, int fd) {
+  // the same from a node which asked for the binary protocol, as radio data
+  // packets back to back
+  if (length == 0 || length % sizeof(radio_data_packet) != 0) {
+    ESP_LOGE(TAG, "Binary frame of %zu bytes isn't whole data packets",
+             length);
+    return false;
+  }
+
+  for (size_t offset = 0; offset < length;
+       offset += sizeof(radio_data_packet)) {
+    if (payload[offset] != DATA) {
+      ESP_LOGE(TAG, "Binary frame has a packet of type %u", payload[offset]);
+      return false;
+    }
+    report_t report;
+    codec_unpack(&payload[offset], &report);
+    mesh_learn_route(report.esp_id, fd, false);
+    mesh_keep_report(&report);
+  }
+
+  return true;
+}
+
+static esp_err_t handle_client(httpd_req_t *req) {
   int fd = httpd_req_to_sockfd(req);
 
   // register new clients...
@@ -75,8 +155,10 @@ esp_err_t client_handler(httpd_req_t *req) {
         is_browser_not_mesh = false;
       char auth_token[UTILS_AUTH_TOKEN_LENGTH] = {0};
       uint8_t esp_id = 0;
+      // either kind of client can ask for data as binary frames
+      bool binary = strstr(req->uri, "proto=bin") != NULL;
       if (is_browser_not_mesh) {
-        sscanf(check_new_browser_session, "/browser_ws?auth_token=%50s",
+        sscanf(check_new_browser_session, "/browser_ws?auth_token=%50[^&]",
                auth_token);
       } else {
         sscanf(check_new_mesh_session, "/mesh_ws?auth_token=%50[^&]",
@@ -92,7 +174,7 @@ esp_err_t client_handler(httpd_req_t *req) {
       auth_token[UTILS_AUTH_TOKEN_LENGTH - 1] = '\0';
       if (auth_token[0] != '\0' &&
           strcmp(auth_token, current_auth_token) == 0) {
-        add_client(fd, auth_token, is_browser_not_mesh, esp_id);
+        add_client(fd, auth_token, is_browser_not_mesh, esp_id, binary);
         current_auth_token[0] = '\0';
         ESP_LOGI(TAG, "WebSocket handshake complete for client %d", fd);
         return ESP_OK; // WebSocket handshake happens here
@@ -113,7 +195,7 @@ esp_err_t client_handler(httpd_req_t *req) {
   }
   if (ws_pkt.len > 0) {
     // allocate buffer
-    ws_pkt.payload = malloc(ws_pkt.len + 1);
+    ws_pkt.payload = mem_block_alloc(ws_pkt.len + 1);
     if (!ws_pkt.payload) {
       ESP_LOGE(TAG, "Failed to allocate memory for WebSocket payload");
       return ESP_ERR_NO_MEM;
@@ -123,12 +205,20 @@ esp_err_t client_handler(httpd_req_t *req) {
     if (ret != ESP_OK) {
       ESP_LOGE(TAG, "Failed to receive WebSocket frame: %s",
                esp_err_to_name(ret));
-      free(ws_pkt.payload);
+      mem_block_free(ws_pkt.payload);
       return ret;
     }
     ws_pkt.payload[ws_pkt.len] = '\0';
   }
 
+  // re-determine if browser or mesh client
+  for (int i = 0; i < WS_CONFIG_MAX_CLIENTS; i++) {
+    if (client_sockets[i].descriptor == fd) {
+      is_browser_not_mesh = client_sockets[i].is_browser_not_mesh;
+      break;
+    }
+  }
+
   if (ws_pkt.type == HTTPD_WS_TYPE_TEXT) {
     if (VERBOSE)
       ESP_LOGI(TAG, "Received WebSocket message: %s", (char *)ws_pkt.payload);
@@ -137,260 +227,51 @@ esp_err_t client_handler(httpd_req_t *req) {
     cJSON *message = cJSON_Parse((char *)ws_pkt.payload);
     if (!message) {
       ESP_LOGE(TAG, "Failed to parse JSON");
-      free(ws_pkt.payload);
+      mem_block_free(ws_pkt.payload);
       return ESP_FAIL;
     }
 
-    // re-determine if browser or mesh client
-    for (int i = 0; i < WS_CONFIG_MAX_CLIENTS; i++) {
-      if (client_sockets[i].descriptor == fd) {
-        is_browser_not_mesh = client_sockets[i].is_browser_not_mesh;
-        break;
-      }
-    }
-    if (is_browser_not_mesh) {
-      // perform the request made by the local websocket client
-      cJSON *response = cJSON_CreateObject();
-      perform_request(message, response);
-    } else {
-      // queue message from mesh client to forward via LoRa
-      cJSON *esp_id_obj = cJSON_GetObjectItem(message, "esp_id");
-      if (!esp_id_obj) {
-        ESP_LOGE(TAG,
-                 "incoming LoRa queue message not formatted properly:\n  %s",
-                 cJSON_PrintUnformatted(message));
-        free(ws_pkt.payload);
-        cJSON_Delete(message);
-        return ESP_FAIL;
-      }
-      bool found = false;
-      for (int i = 0; i < MESH_SIZE; i++) {
-        if (all_messages[i].esp_id == esp_id_obj->valueint) {
-          // update existing message
-          found = true;
-          strcpy(all_messages[i].message, (char *)ws_pkt.payload);
-          i = MESH_SIZE;
-        } else if (all_messages[i].esp_id == 0) {
-          // create new message
-          found = true;
-          all_messages[i].esp_id = esp_id_obj->valueint;
-          strcpy(all_messages[i].message, (char *)ws_pkt.payload);
-          i = MESH_SIZE;
-        }
+    cJSON *type = cJSON_GetObjectItem(message, "type");
+    if (is_browser_not_mesh && cJSON_IsString(type) &&
+        strcmp(type->valuestring, "subscribe") == 0) {
+      // a change to what the local websocket client is sent, confirmed with
+      // how many of its subscriptions were kept
+      char reply[40];
+      snprintf(reply, sizeof(reply), "{\"type\":\"subscribed\",\"content\":%d}",
+               sub_update(fd, cJSON_GetObjectItem(message, "content")));
+      send_to_client(fd, reply);
+    } else if (is_browser_not_mesh) {
+      // perform the request made by the local websocket client, which gets
+      // the response once it is done
+      cmd_submit(message, CMD_ORIGIN_BROWSER, fd);
+    } else if (cJSON_IsArray(message)) {
+      // a node's own data and that of the devices relayed through it
+      cJSON *item = NULL;
+      cJSON_ArrayForEach(item, message) {
+        receive_from_node(item, fd);
       }
-      if (!found)
-        ESP_LOGE(TAG, "LoRa queue full! Dropping message: %s",
-                 cJSON_PrintUnformatted(message));
+    } else if (!receive_from_node(message, fd)) {
+      mem_block_free(ws_pkt.payload);
+      cJSON_Delete(message);
+      return ESP_FAIL;
     }
 
     cJSON_Delete(message);
+  } else if (ws_pkt.type == HTTPD_WS_TYPE_BINARY && !is_browser_not_mesh) {
+    // requests are only ever JSON, so these are data
+    if (!receive_packets(ws_pkt.payload, ws_pkt.len, fd)) {
+      mem_block_free(ws_pkt.payload);
+      return ESP_FAIL;
+    }
   } else {
     ESP_LOGW(TAG, "Received unsupported WebSocket frame type: %d", ws_pkt.type);
   }
 
-  free(ws_pkt.payload);
+  mem_block_free(ws_pkt.payload);
 
   return ESP_OK;
 }
 
-esp_err_t perform_request(cJSON *message, cJSON *response) {
-  // construct response message
-  cJSON_AddStringToObject(response, "type", "response");
-  cJSON_AddNumberToObject(response, "esp_id", ESP_ID);
-  cJSON *response_content = cJSON_CreateObject();
-
-  cJSON *type = cJSON_GetObjectItem(message, "type");
-  cJSON *content = cJSON_GetObjectItem(message, "content");
-  if (!type || !content) {
-    ESP_LOGE(TAG, "Error in request message");
-    return ESP_FAIL;
-  }
-
-  if (strcmp(type->valuestring, "query") == 0) {
-    if (strcmp(content->valuestring, "are you still there?") == 0) {
-      cJSON_AddStringToObject(response_content, "response", "yes");
-      // xQueueReset(job_queue); // prioritise this reply(?)
-    }
-  } else if (strcmp(type->valuestring, "request") == 0) {
-    cJSON *summary = cJSON_GetObjectItem(content, "summary");
-    if (summary && strcmp(summary->valuestring, "change-settings") == 0) {
-      cJSON *data = cJSON_GetObjectItem(content, "data");
-      if (!data) {
-        ESP_LOGE(TAG, "Failed to parse JSON");
-        cJSON_AddStringToObject(response_content, "status", "error");
-        return ESP_FAIL;
-      }
-
-      cJSON *esp_id = cJSON_GetObjectItem(data, "new_esp_id");
-      if (esp_id && esp_id->valueint != 0 && esp_id->valueint != ESP_ID) {
-        ESP_LOGI(TAG, "Changing device name...");
-
-        uint8_t address[2] = {0};
-        convert_uint_to_n_bytes(I2C_DEVICE_NAME_ADDR, address, sizeof(address),
-                                true);
-
-        // construct DeviceName string from ID
-        char new_id[7];
-        snprintf(new_id, sizeof(new_id), "bms_%02u", esp_id->valueint);
-        size_t new_id_length = strlen(new_id);
-
-        // convert to data array
-        uint8_t new_id_data[1 + new_id_length];
-        new_id_data[0] = new_id_length;
-        for (size_t i = 0; i < new_id_length; i++)
-          new_id_data[1 + i] = new_id[i];
-
-        // write to DataFlash
-        write_data_flash(address, sizeof(address), new_id_data,
-                         sizeof(new_id_data));
-
-        // update ESP32 memory
-        change_esp_id(new_id);
-      }
-
-      int OTC = cJSON_GetObjectItem(data, "OTC")->valueint;
-
-      uint8_t address[2] = {0};
-      convert_uint_to_n_bytes(I2C_OTC_THRESHOLD_ADDR, address, sizeof(address),
-                              true);
-      uint8_t data_flash[2] = {0};
-      read_data_flash(address, sizeof(address), data_flash, sizeof(data_flash));
-      if (OTC != (data_flash[1] << 8 | data_flash[0])) {
-        ESP_LOGI(TAG, "Changing OTC threshold...");
-        convert_uint_to_n_bytes(OTC, data_flash, sizeof(data_flash), false);
-        write_data_flash(address, sizeof(address), data_flash,
-                         sizeof(data_flash));
-      }
-
-      cJSON_AddStringToObject(response_content, "status", "success");
-    } else if (summary && strcmp(summary->valuestring, "connect-wifi") == 0) {
-      cJSON *data = cJSON_GetObjectItem(content, "data");
-      if (!data) {
-        ESP_LOGE(TAG, "Failed to parse JSON");
-        cJSON_AddStringToObject(response_content, "status", "error");
-        return ESP_FAIL;
-      }
-
-      const char *ssid = cJSON_GetObjectItem(data, "ssid")->valuestring;
-      const char *password = cJSON_GetObjectItem(data, "password")->valuestring;
-      cJSON *auto_connect = cJSON_GetObjectItem(data, "auto_connect");
-
-      int tries = 0;
-      int max_tries = 10;
-      if (!connected_to_WiFi || reconnect) {
-        if (reconnect) {
-          connected_to_WiFi = false;
-        }
-
-        wifi_config_t *wifi_sta_config = malloc(sizeof(wifi_config_t));
-        memset(wifi_sta_config, 0, sizeof(wifi_config_t));
-
-        // overwrite stored values in NVS
-        nvs_handle_t nvs;
-        esp_err_t err = nvs_open("WIFI", NVS_READWRITE, &nvs);
-        if (err != ESP_OK) {
-          ESP_LOGW(TAG, "Could not open NVS namespace for writing");
-        } else {
-          nvs_set_str(nvs, "SSID", ssid);
-          nvs_set_str(nvs, "PASSWORD", password);
-          if (cJSON_IsBool(auto_connect) && cJSON_IsTrue(auto_connect))
-            nvs_set_u8(nvs, "AUTO_CONNECT", 1);
-          else
-            nvs_set_u8(nvs, "AUTO_CONNECT", 0);
-          nvs_commit(nvs);
-          nvs_close(nvs);
-        }
-
-        strncpy((char *)wifi_sta_config->sta.ssid, ssid,
-                sizeof(wifi_sta_config->sta.ssid) - 1);
-        if (strlen(password) == 0) {
-          wifi_sta_config->ap.authmode = WIFI_AUTH_OPEN;
-        } else {
-          strncpy((char *)wifi_sta_config->sta.password, password,
-                  sizeof(wifi_sta_config->sta.password) - 1);
-        }
-        ESP_LOGI(TAG, "Connecting to AP... SSID: %s",
-                 wifi_sta_config->sta.ssid);
-
-        ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, wifi_sta_config));
-        // TODO: if reconnecting, it doesn't actually seem to drop the old
-        // connection in favour of the new one
-
-        // give some time to connect
-        vTaskDelay(pdMS_TO_TICKS(5000));
-        while (true) {
-          if (tries > max_tries)
-            break;
-          wifi_ap_record_t ap_info;
-          if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK) {
-
-            esp_netif_t *sta_netif =
-                esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
-            if (sta_netif != NULL) {
-              esp_netif_ip_info_t ip_info = {0};
-              esp_netif_get_ip_info(sta_netif, &ip_info);
-
-              if (ip_info.ip.addr != IPADDR_ANY) {
-                connected_to_WiFi = true;
-                ESP_LOGI(TAG, "Connected to router. Signal strength: %d dBm",
-                         ap_info.rssi);
-                cJSON_AddStringToObject(response_content, "status", "success");
-
-                break;
-              }
-            }
-          } else {
-            if (VERBOSE)
-              ESP_LOGI(TAG, "Not connected. Retrying... %d", tries);
-            esp_wifi_connect();
-          }
-          tries++;
-
-          vTaskDelay(pdMS_TO_TICKS(1000));
-        }
-      }
-    } else if (summary && strcmp(summary->valuestring, "reset-bms") == 0) {
-      reset();
-      cJSON_AddStringToObject(response_content, "status", "success");
-    } else if (summary && strcmp(summary->valuestring, "unseal-bms") == 0) {
-      unseal();
-      cJSON_AddStringToObject(response_content, "status", "success");
-    } else if (summary && strcmp(summary->valuestring, "flip-inverter") == 0) {
-      cJSON *data = cJSON_GetObjectItem(content, "data");
-      if (!data) {
-        ESP_LOGE(TAG, "Failed to parse JSON");
-        cJSON_AddStringToObject(response_content, "status", "error");
-        return ESP_FAIL;
-      }
-
-      bool is_enabled = (bool)cJSON_GetObjectItem(data, "is-enabled")->valueint;
-      if (is_enabled) {
-        gpio_set_level(INV_EN_GPIO, 0);
-        inverter_data.enabled = false;
-      } else {
-        gpio_set_level(INV_EN_GPIO, 1);
-        inverter_data.enabled = true;
-      }
-      cJSON_AddStringToObject(response_content, "status", "success");
-    }
-  } else {
-    return ESP_ERR_NOT_SUPPORTED;
-  }
-  cJSON_AddItemToObject(response, "content", response_content);
-  return ESP_OK;
-}
-
-void send_message(const char *message) {
-  if (esp_websocket_client_is_connected(ws_client)) {
-    if (VERBOSE)
-      ESP_LOGI(TAG, "Sending: %s", message);
-    esp_websocket_client_send_text(ws_client, message, strlen(message),
-                                   portMAX_DELAY);
-  } else {
-    ESP_LOGW(TAG, "WebSocket not connected, dropping message: %s", message);
-  }
-}
-
 void process_event(char *data) {
   cJSON *message = cJSON_Parse(data);
   if (!message) {
@@ -404,6 +285,7 @@ void process_event(char *data) {
     cJSON *content = cJSON_GetObjectItem(message, "content");
     if (!(type && content)) {
       ESP_LOGE(TAG, "Couldn't parse websocket event");
+      cJSON_Delete(message);
       return;
     }
     if (strcmp(type->valuestring, "response") == 0 &&
@@ -411,6 +293,7 @@ void process_event(char *data) {
       if (VERBOSE)
         ESP_LOGI(TAG, "Receiver: ignorning acknowledgement response message "
                       "from web server");
+      cJSON_Delete(message);
       return;
     } else {
       char *message_string = cJSON_PrintUnformatted(message);
@@ -421,7 +304,7 @@ void process_event(char *data) {
           ESP_LOGI(TAG, "adding to outgoing forwarded radio transmissions...");
         }
         strncpy(forwarded_message, message_string, strlen(message_string));
-        free(message_string);
+        cJSON_free(message_string);
       }
     }
   } else {
@@ -430,17 +313,26 @@ void process_event(char *data) {
       if (message_string) {
         ESP_LOGI(TAG, "WebSocket client: received message from ROOT:");
         ESP_LOGI(TAG, "%s", message_string);
+        cJSON_free(message_string);
       }
     }
 
-    cJSON *response = cJSON_CreateObject();
-    esp_err_t err = perform_request(message, response);
-
-    char *response_str = cJSON_PrintUnformatted(response);
-    cJSON_Delete(response);
-    if (err == ESP_OK)
-      send_message(response_str);
-    free(response_str);
+    // a route update from the parent, a request to relay down the mesh, or
+    // one for this device
+    cJSON *type = cJSON_GetObjectItem(message, "type");
+    cJSON *esp_id = cJSON_GetObjectItem(message, "esp_id");
+    if (cJSON_IsString(type) && strcmp(type->valuestring, "route") == 0) {
+      cJSON *hop = cJSON_GetObjectItem(message, "hop");
+      cJSON *proto = cJSON_GetObjectItem(message, "proto");
+      if (cJSON_IsNumber(hop))
+        mesh_set_parent_hop(MIN(MAX(hop->valueint, 0), ELECT_HOP_NONE));
+      mesh_set_parent_binary(cJSON_IsString(proto) &&
+                             strcmp(proto->valuestring, "bin") == 0);
+    } else if (cJSON_IsNumber(esp_id) && esp_id->valueint != ESP_ID) {
+      mesh_send_down(esp_id->valueint, data);
+    } else {
+      cmd_submit(message, CMD_ORIGIN_UPSTREAM, -1);
+    }
   }
   cJSON_Delete(message);
 }
@@ -459,14 +351,14 @@ void websocket_event_handler(void *arg, esp_event_base_t event_base,
   case WEBSOCKET_EVENT_DISCONNECTED:
     if (VERBOSE)
       ESP_LOGI(TAG, "WebSocket disconnected");
-    esp_websocket_client_stop(ws_client);
     break;
 
   case WEBSOCKET_EVENT_DATA:
+    trace_instant("ws_client_data");
     if (ws_event_data->data_len == 0)
       break;
 
-    char *data = malloc(ws_event_data->data_len + 1);
+    char *data = mem_block_alloc(ws_event_data->data_len + 1);
     if (!data) {
       ESP_LOGE(TAG, "Couldn't assign memory in websocket event handler");
       break;
@@ -480,7 +372,7 @@ void websocket_event_handler(void *arg, esp_event_base_t event_base,
     if (xQueueSend(job_queue, &job, 0) != pdPASS) {
       if (VERBOSE)
         ESP_LOGW(TAG, "Queue full, dropping job");
-      free(job.data);
+      mem_block_free(job.data);
     }
 
     break;
@@ -497,292 +389,157 @@ void websocket_event_handler(void *arg, esp_event_base_t event_base,
   }
 }
 
-char *get_data() {
-  // create JSON object with sensor data
-  cJSON *data = cJSON_CreateObject();
-
-  cJSON_AddNumberToObject(data, "esp_id", ESP_ID);
-
-  // get telemetry data from global struct
-  cJSON_AddNumberToObject(data, "Q", telemetry_data.Q);
-  cJSON_AddNumberToObject(data, "H", telemetry_data.H);
-  cJSON_AddNumberToObject(
-      data, "aT", round_to_dp(((float)telemetry_data.aT) / 10.0 - 273.15, 1));
-  cJSON_AddNumberToObject(data, "V",
-                          round_to_dp(((float)telemetry_data.V) / 1000.0, 1));
-  cJSON_AddNumberToObject(data, "I",
-                          round_to_dp(((float)telemetry_data.I) / 1000.0, 1));
-  cJSON_AddNumberToObject(data, "V1",
-                          round_to_dp(((float)telemetry_data.V1) / 1000.0, 2));
-  cJSON_AddNumberToObject(data, "V2",
-                          round_to_dp(((float)telemetry_data.V2) / 1000.0, 2));
-  cJSON_AddNumberToObject(data, "V3",
-                          round_to_dp(((float)telemetry_data.V3) / 1000.0, 2));
-  cJSON_AddNumberToObject(data, "V4",
-                          round_to_dp(((float)telemetry_data.V4) / 1000.0, 2));
-  cJSON_AddNumberToObject(data, "I1",
-                          round_to_dp(((float)telemetry_data.I1) / 1000.0, 2));
-  cJSON_AddNumberToObject(data, "I2",
-                          round_to_dp(((float)telemetry_data.I2) / 1000.0, 2));
-  cJSON_AddNumberToObject(data, "I3",
-                          round_to_dp(((float)telemetry_data.I3) / 1000.0, 2));
-  cJSON_AddNumberToObject(data, "I4",
-                          round_to_dp(((float)telemetry_data.I4) / 1000.0, 2));
-  cJSON_AddNumberToObject(
-      data, "T1", round_to_dp(((float)telemetry_data.T1) / 10.0 - 273.15, 2));
-  cJSON_AddNumberToObject(
-      data, "T2", round_to_dp(((float)telemetry_data.T2) / 10.0 - 273.15, 2));
-  cJSON_AddNumberToObject(
-      data, "T3", round_to_dp(((float)telemetry_data.T3) / 10.0 - 273.15, 2));
-  cJSON_AddNumberToObject(
-      data, "T4", round_to_dp(((float)telemetry_data.T4) / 10.0 - 273.15, 2));
-  cJSON_AddNumberToObject(
-      data, "cT", round_to_dp(((float)telemetry_data.cT) / 10.0 - 273.15, 1));
-  cJSON_AddNumberToObject(data, "OTC",
-                          round_to_dp(((float)telemetry_data.OTC) / 10.0, 1));
-  cJSON_AddNumberToObject(data, "CC", telemetry_data.CC);
-
-  // wifi connection status
-  cJSON_AddBoolToObject(data, "wifi", connected_to_WiFi);
-
-  // get GPS data from global struct
-  cJSON_AddNumberToObject(data, "t", gps_data.time);
-  cJSON_AddNumberToObject(data, "d", gps_data.date);
-  cJSON_AddNumberToObject(data, "lat", gps_data.latitude);
-  cJSON_AddNumberToObject(data, "lon", gps_data.longitude);
-
-  // get inverter data from global struct
-  cJSON_AddNumberToObject(data, "P", inverter_data.output_power);
-  cJSON_AddNumberToObject(data, "inv", inverter_data.enabled);
-
-  // construct full message
-  cJSON *message = cJSON_CreateObject();
-  cJSON_AddNumberToObject(message, "esp_id", ESP_ID);
-  cJSON_AddStringToObject(message, "type", "data");
-  cJSON_AddItemToObject(message, "content", data);
-
-  char *data_string = cJSON_PrintUnformatted(message);
-  cJSON_Delete(message);
-
-  return data_string;
+esp_err_t client_handler(httpd_req_t *req) {
+  // from the web server's task, for each handshake and frame
+  trace_begin("ws_frame");
+  esp_err_t ret = handle_client(req);
+  trace_end("ws_frame");
+  return ret;
 }
 
-char *convert_data_numbers_for_frontend(char *data_string) {
-  cJSON *data_json = cJSON_Parse(data_string);
-  cJSON *content = cJSON_GetObjectItem(data_json, "content");
-  if (content) {
-    cJSON *V = cJSON_GetObjectItem(content, "V");
-    if (V)
-      cJSON_SetNumberValue(V, (float)V->valueint / 10.0);
-    cJSON *I = cJSON_GetObjectItem(content, "I");
-    if (I)
-      cJSON_SetNumberValue(I, (float)I->valueint / 10.0);
-    cJSON *aT = cJSON_GetObjectItem(content, "aT");
-    if (aT)
-      cJSON_SetNumberValue(aT, (float)aT->valueint / 10.0);
-    cJSON *cT = cJSON_GetObjectItem(content, "cT");
-    if (cT)
-      cJSON_SetNumberValue(cT, (float)cT->valueint / 10.0);
-
-    cJSON *V1 = cJSON_GetObjectItem(content, "V1");
-    if (V1)
-      cJSON_SetNumberValue(V1, (float)V1->valueint / 100.0);
-    cJSON *V2 = cJSON_GetObjectItem(content, "V2");
-    if (V2)
-      cJSON_SetNumberValue(V2, (float)V2->valueint / 100.0);
-    cJSON *V3 = cJSON_GetObjectItem(content, "V3");
-    if (V3)
-      cJSON_SetNumberValue(V3, (float)V3->valueint / 100.0);
-    cJSON *V4 = cJSON_GetObjectItem(content, "V4");
-    if (V4)
-      cJSON_SetNumberValue(V4, (float)V4->valueint / 100.0);
-
-    cJSON *I1 = cJSON_GetObjectItem(content, "I1");
-    if (I1)
-      cJSON_SetNumberValue(I1, (float)I1->valueint / 100.0);
-    cJSON *I2 = cJSON_GetObjectItem(content, "I2");
-    if (I2)
-      cJSON_SetNumberValue(I2, (float)I2->valueint / 100.0);
-    cJSON *I3 = cJSON_GetObjectItem(content, "I3");
-    if (I3)
-      cJSON_SetNumberValue(I3, (float)I3->valueint / 100.0);
-    cJSON *I4 = cJSON_GetObjectItem(content, "I4");
-    if (I4)
-      cJSON_SetNumberValue(I4, (float)I4->valueint / 100.0);
-
-    cJSON *T1 = cJSON_GetObjectItem(content, "T1");
-    if (T1)
-      cJSON_SetNumberValue(T1, (float)T1->valueint / 100.0);
-    cJSON *T2 = cJSON_GetObjectItem(content, "T2");
-    if (T2)
-      cJSON_SetNumberValue(T2, (float)T2->valueint / 100.0);
-    cJSON *T3 = cJSON_GetObjectItem(content, "T3");
-    if (T3)
-      cJSON_SetNumberValue(T3, (float)T3->valueint / 100.0);
-    cJSON *T4 = cJSON_GetObjectItem(content, "T4");
-    if (T4)
-      cJSON_SetNumberValue(T4, (float)T4->valueint / 100.0);
+bool send_to_client(int fd, const char *message) {
+  httpd_ws_frame_t ws_pkt = {
+      .payload = (uint8_t *)message,
+      .len = strlen(message),
+      .type = HTTPD_WS_TYPE_TEXT,
+  };
+
+  esp_err_t err = httpd_ws_send_frame_async(server, fd, &ws_pkt);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to send frame to client %d: %s", fd,
+             esp_err_to_name(err));
+    return false;
   }
-  char *converted_data_string = cJSON_PrintUnformatted(data_json);
-  cJSON_Delete(data_json);
 
-  return converted_data_string;
+  return true;
 }
 
-void send_websocket_data() {
-  // get sensor data
-  char *data_string = LORA_IS_RECEIVER ? "" : get_data();
-  char *converted_data_string =
-      LORA_IS_RECEIVER ? "" : convert_data_numbers_for_frontend(data_string);
-
-  if (data_string != NULL && converted_data_string != NULL) {
-    // first send to all connected WebSocket clients
-    for (int i = 0; i < WS_CONFIG_MAX_CLIENTS; i++) {
-      if (client_sockets[i].is_browser_not_mesh &&
-          client_sockets[i].descriptor >= 0) {
-        httpd_ws_frame_t ws_pkt = {
-            .payload = (uint8_t *)converted_data_string,
-            .len = strlen(converted_data_string),
-            .type = HTTPD_WS_TYPE_TEXT,
-        };
-
-        int tries = 0;
-        int max_tries = 5;
-        esp_err_t err;
-        while (tries < max_tries) {
-          err = httpd_ws_send_frame_async(server, client_sockets[i].descriptor,
-                                          &ws_pkt);
-          if (err == ESP_OK)
-            break;
-          vTaskDelay(pdMS_TO_TICKS(1000));
-          tries++;
-        }
-
-        if (err != ESP_OK) {
-          ESP_LOGE(TAG, "Failed to send frame to client %d: %s",
-                   client_sockets[i].descriptor, esp_err_to_name(err));
-          remove_client(
-              client_sockets[i].descriptor); // Clean up disconnected clients
-        }
-      }
-    }
-
-    // then to website over internet
-    if (connected_to_WiFi) {
-      // get Wi-Fi station gateway
-      esp_netif_t *sta_netif = esp_netif_get_handle_from_ifkey("WIFI_STA_DEF");
-      if (sta_netif == NULL)
-        return;
+bool send_to_browser(int fd, const void *payload, size_t length, bool binary) {
+  httpd_ws_frame_t ws_pkt = {
+      .payload = (uint8_t *)payload,
+      .len = length,
+      .type = binary ? HTTPD_WS_TYPE_BINARY : HTTPD_WS_TYPE_TEXT,
+  };
+
+  int tries = 0;
+  int max_tries = 5;
+  esp_err_t err;
+  while (tries < max_tries) {
+    err = httpd_ws_send_frame_async(server, fd, &ws_pkt);
+    if (err == ESP_OK)
+      break;
+    vTaskDelay(pdMS_TO_TICKS(1000));
+    tries++;
+  }
 
-      // retrieve the IP information
-      esp_netif_ip_info_t ip_info = {0};
-      esp_netif_get_ip_info(sta_netif, &ip_info);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to send frame to client %d: %s", fd,
+             esp_err_to_name(err));
+    remove_client(fd); // Clean up disconnected clients
+    return false;
+  }
 
-      // add correct ESP32 IP info to message
-      esp_ip4addr_ntoa(&ip_info.ip, ESP_IP, 16);
+  return true;
+}
 
-      char s[64];
-      if (LOCAL) {
-        snprintf(s, sizeof(s), "%s:8000", FLASK_IP);
-      } else {
-        snprintf(s, sizeof(s), "%s", AZURE_URL);
-      }
-      char uri[128];
-      snprintf(uri, sizeof(uri), "wss://%s/api/esp_ws", s);
-
-      const esp_websocket_client_config_t websocket_cfg = {
-          .uri = uri,
-          .reconnect_timeout_ms = 10000,
-          .network_timeout_ms = 10000,
-          .cert_pem = LOCAL ? (const char *)local_cert_pem
-                            : (const char *)website_cert_pem,
-          .skip_cert_common_name_check = LOCAL,
-      };
-
-      if (ws_client == NULL) {
-        ws_client = esp_websocket_client_init(&websocket_cfg);
-        if (ws_client == NULL) {
-          ESP_LOGE(TAG, "Failed to initialize WebSocket client");
-          vTaskDelay(pdMS_TO_TICKS(1000));
-          return;
-        }
-        esp_websocket_register_events(ws_client, WEBSOCKET_EVENT_ANY,
-                                      websocket_event_handler, NULL);
-        if (esp_websocket_client_start(ws_client) != ESP_OK) {
-          ESP_LOGE(TAG, "Failed to start WebSocket client");
-          esp_websocket_client_destroy(ws_client);
-          ws_client = NULL;
-          vTaskDelay(pdMS_TO_TICKS(1000));
-          return;
-        }
-        vTaskDelay(pdMS_TO_TICKS(5000));
-      }
+char *get_data() {
+  char *data_string = cJSON_malloc(WS_DATA_MAX_LEN);
+  if (data_string == NULL)
+    return NULL;
+
+  report_t report;
+  codec_read_latest(&report);
+  if (codec_write_json(&report, data_string, WS_DATA_MAX_LEN, false) == 0) {
+    cJSON_free(data_string);
+    return NULL;
+  }
 
-      if (!esp_websocket_client_is_connected(ws_client)) {
-        esp_websocket_client_stop(ws_client);
-        esp_websocket_client_destroy(ws_client);
-        ws_client = NULL;
-      } else {
-        if (!LORA_IS_RECEIVER) {
-          // send in json array so webserver can parse
-          cJSON *json_array = cJSON_CreateArray();
-          if (json_array == NULL) {
-            ESP_LOGE(TAG, "Failed to create JSON array");
-            return;
-          }
-          cJSON *item = cJSON_Parse(data_string);
-          if (!item) {
-            ESP_LOGE(TAG, "Failed to parse JSON");
-            cJSON_Delete(json_array);
-            return;
-          }
-          cJSON_AddItemToArray(json_array, item);
-          send_message(cJSON_PrintUnformatted(json_array));
-
-          cJSON_Delete(json_array);
-        }
-      }
-    }
+  return data_string;
+}
 
-    // clean up
-    if (!LORA_IS_RECEIVER) {
-      free(data_string);
-      free(converted_data_string);
+void send_websocket_data() {
+  // only ever called from the job worker, so these can be reused. the web
+  // server gets the reports which are due as one frame of the uplink's batch
+  static report_t reports[BMS_N_PACKS];
+  static bool pack_due[BMS_N_PACKS];
+  static report_t frame[BMS_N_PACKS + MESH_SIZE];
+  // the latest data message from each mesh node, which a ROOT connected to
+  // the web server passes on with its own
+  static report_t mesh_reports[MESH_SIZE];
+  static bool mesh_waiting[MESH_SIZE];
+  bool browser_due = true;
+  bool server_due = true;
+  bool mesh_due = false;
+
+  if (!LORA_IS_RECEIVER) {
+    // get sensor data, with both versions from the same sample, if either
+    // destination needs it. browsers only get this ESP32's own pack
+    codec_read_latest(&reports[BMS_PRIMARY_PACK]);
+    browser_due = change_is_due(DESTINATION_BROWSER, BMS_PRIMARY_PACK,
+                                &reports[BMS_PRIMARY_PACK]);
+    server_due = false;
+    for (int i = 0; i < BMS_N_PACKS; i++) {
+      bool available = i == BMS_PRIMARY_PACK || codec_read_pack(i, &reports[i]);
+      pack_due[i] =
+          available && change_is_due(DESTINATION_SERVER, i, &reports[i]);
+      server_due |= pack_due[i];
     }
+    if (state_is(STATE_ROOT | STATE_WIFI))
+      mesh_due = mesh_peek_reports(mesh_reports, mesh_waiting) > 0;
+    server_due |= mesh_due;
+    // the web server takes the connection to be the first entry's, so this
+    // ESP32's own pack always goes first
+    pack_due[BMS_PRIMARY_PACK] = server_due;
   }
 
-  // check wifi connection still exists
-  wifi_ap_record_t ap_info;
-  if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) {
-    connected_to_WiFi = false;
+  // first send to all connected WebSocket clients, whatever each has
+  // subscribed to. those which follow this ESP32's changes get its own pack
+  bool sent_to_browser = sub_publish(
+      LORA_IS_RECEIVER ? NULL : &reports[BMS_PRIMARY_PACK], browser_due);
+  if (!LORA_IS_RECEIVER && browser_due) {
+    if (sent_to_browser)
+      change_mark_sent(DESTINATION_BROWSER, BMS_PRIMARY_PACK,
+                       &reports[BMS_PRIMARY_PACK]);
+    else
+      change_reset(DESTINATION_BROWSER); // nobody to send to
+  }
 
-    uint8_t auto_connect = (uint8_t)WIFI_AUTO_CONNECT;
-    nvs_handle_t nvs;
-    esp_err_t err = nvs_open("WIFI", NVS_READONLY, &nvs);
-    if (err != ESP_OK) {
-      ESP_LOGE(TAG, "Could not open NVS namespace");
-    } else {
-      if (nvs_get_u8(nvs, "AUTO_CONNECT", &auto_connect) != ESP_OK)
-        ESP_LOGW(TAG, "Could not read Wi-Fi auto-connect setting from NVS, "
-                      "using default");
-      if (auto_connect != 0)
-        send_fake_request();
-      nvs_close(nvs);
+  if (LORA_IS_RECEIVER || server_due) {
+    // then to website over internet, only batched here for the uplink task to
+    // send
+    bool sent_to_server = false;
+    if (state_is(STATE_WIFI) && server_due && !LORA_IS_RECEIVER) {
+      size_t n_reports = 0;
+      frame[n_reports++] = reports[BMS_PRIMARY_PACK];
+      for (int i = 0; i < BMS_N_PACKS; i++)
+        if (i != BMS_PRIMARY_PACK && pack_due[i])
+          frame[n_reports++] = reports[i];
+      for (int i = 0; i < MESH_SIZE && mesh_due; i++)
+        if (mesh_waiting[i])
+          frame[n_reports++] = mesh_reports[i];
+      sent_to_server = uplink_batch(frame, n_reports);
+      // only let go of once the uplink has them
+      if (mesh_due && sent_to_server)
+        mesh_commit_reports(mesh_reports, mesh_waiting);
+    }
+    if (state_is(STATE_WIFI))
+      prof_send();
+    if (!LORA_IS_RECEIVER && server_due) {
+      for (int i = 0; i < BMS_N_PACKS && sent_to_server; i++)
+        if (pack_due[i])
+          change_mark_sent(DESTINATION_SERVER, i, &reports[i]);
+      if (!sent_to_server)
+        change_reset(DESTINATION_SERVER);
     }
   }
-}
-
-void websocket_callback(TimerHandle_t xTimer) {
-  job_t job = {.type = JOB_WS_SEND};
 
-  if (xQueueSend(job_queue, &job, 0) != pdPASS)
-    if (VERBOSE)
-      ESP_LOGW(TAG, "Queue full, dropping job");
+  // keep trying to get the Wi-Fi connection back while there is none. the
+  // Wi-Fi events keep these bits up to date, so there's nothing to poll
+  if (!state_is(STATE_STA_LINK) && state_is(STATE_AUTO_CONNECT))
+    send_fake_request();
 }
 
 void start_websocket_timed_task() {
-  websocket_timer = xTimerCreate("websocket_timer", pdMS_TO_TICKS(WS_DELAY),
-                                 pdTRUE, NULL, websocket_callback);
-  assert(websocket_timer);
-  xTimerStart(websocket_timer, 0);
+  // straight after each new sample, so the data sent is fresh
+  sched_add(JOB_WS_SEND, PARAM_WS_PERIOD, SCHED_JITTER_MS, SCHED_AFTER_SAMPLE);
 }
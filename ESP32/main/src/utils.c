@@ -1,11 +1,15 @@
 #include "utils.h"
 
-#include "WS.h"
+#include "CMD.h"
+#include "STATE.h"
 #include "config.h"
 #include "global.h"
 
 #include <ctype.h>
 #include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "cJSON.h"
@@ -15,13 +19,13 @@
 #include "esp_spiffs.h"
 #include "nvs_flash.h"
 
-void change_esp_id(char *name) {
+int parse_esp_id(char *name) {
   if (strncmp(name, "bms_", 4) != 0) {
     ESP_LOGE(
         "utils",
         "New name not formatted correctly: \"%s\", should begin with \"bms_\"",
         name);
-    return;
+    return -1;
   }
   char *id_str = &name[4];
   // stop at first non-digit
@@ -31,7 +35,13 @@ void change_esp_id(char *name) {
       break;
     }
   }
-  ESP_ID = atoi(id_str);
+  return atoi(id_str);
+}
+
+void change_esp_id(char *name) {
+  int id = parse_esp_id(name);
+  if (id >= 0)
+    ESP_ID = id;
 }
 
 void initialise_nvs() {
@@ -58,6 +68,13 @@ void initialise_nvs() {
     nvs_set_u8(nvs, "AUTO_CONNECT", WIFI_AUTO_CONNECT ? 1 : 0);
     nvs_commit(nvs);
   }
+
+  // kept as state from here on, rather than read back on every tick
+  uint8_t auto_connect = (uint8_t)WIFI_AUTO_CONNECT;
+  if (nvs_get_u8(nvs, "AUTO_CONNECT", &auto_connect) != ESP_OK)
+    ESP_LOGW("NVS", "Could not read Wi-Fi auto-connect setting from NVS, "
+                    "using default");
+  state_assign(STATE_AUTO_CONNECT, auto_connect != 0);
   nvs_close(nvs);
 }
 
@@ -75,7 +92,8 @@ void initialise_spiffs() {
 }
 
 void send_fake_request() {
-  if (!connected_to_WiFi) {
+  // unless the last one is still trying
+  if (!state_is(STATE_WIFI) && !cmd_pending(CMD_CONNECT_WIFI)) {
     cJSON *message = cJSON_CreateObject();
     cJSON_AddStringToObject(message, "type", "request");
     cJSON *content = cJSON_CreateObject();
@@ -118,10 +136,8 @@ void send_fake_request() {
     cJSON_AddItemToObject(content, "data", data);
     cJSON_AddItemToObject(message, "content", content);
 
-    cJSON *response = cJSON_CreateObject();
-    perform_request(message, response);
-
-    vTaskDelay(pdMS_TO_TICKS(5000));
+    cmd_submit(message, CMD_ORIGIN_NONE, -1);
+    cJSON_Delete(message);
   }
 }
 
@@ -148,15 +164,18 @@ esp_err_t fake_login_http_event_handler(esp_http_client_event_t *evt) {
   }
   return ESP_OK;
 }
-char *send_fake_login_post_request() {
+bool send_fake_login_post_request(const char *host, char *auth_token,
+                                  size_t auth_token_size) {
   char response_buffer[39 + UTILS_AUTH_TOKEN_LENGTH] = {0};
   http_response_t response = {
       .buffer = response_buffer,
       .buffer_len = 39 + UTILS_AUTH_TOKEN_LENGTH,
   };
 
+  char url[40];
+  snprintf(url, sizeof(url), "http://%s/api/user/login", host);
   esp_http_client_config_t config = {
-      .url = "http://192.168.4.1/api/user/login",
+      .url = url,
       .event_handler = fake_login_http_event_handler,
       // .method = HTTP_METHOD_POST,
       .user_data = &response,
@@ -188,13 +207,19 @@ char *send_fake_login_post_request() {
       ESP_LOGI("MESH", "HTTP POST Status = %d, Response = %s",
                esp_http_client_get_status_code(client), response.buffer);
     cJSON *response_object = cJSON_Parse(response.buffer);
-    cJSON *auth_token = cJSON_GetObjectItem(response_object, "auth_token");
+    cJSON *token = cJSON_GetObjectItem(response_object, "auth_token");
 
-    return auth_token->valuestring;
+    // copy the token out so the parsed response can be released
+    bool success = cJSON_IsString(token);
+    if (success)
+      snprintf(auth_token, auth_token_size, "%s", token->valuestring);
+    cJSON_Delete(response_object);
+
+    return success;
   }
 
   ESP_LOGE("login", "HTTP POST request failed: %s", esp_err_to_name(err));
-  return "NONE";
+  return false;
 }
 
 esp_err_t get_POST_data(httpd_req_t *req, char *content, size_t content_size) {
@@ -275,14 +300,95 @@ void random_token(char *key) {
   key[UTILS_AUTH_TOKEN_LENGTH - 1] = '\0';
 }
 
-int round_to_dp(float var, int ndp) {
-  char str[40];
-  // format to 0 d.p. after multiplying by 10^{ndp}
-  sprintf(str, "%.0f", var * pow(10, ndp));
-  // insert back into var
-  sscanf(str, "%f", &var);
+int32_t divide_and_round(int32_t numerator, int32_t denominator) {
+  // halves are rounded away from zero
+  if ((numerator < 0) != (denominator < 0))
+    return (numerator - denominator / 2) / denominator;
+  return (numerator + denominator / 2) / denominator;
+}
+
+size_t format_fixed(char *out, int32_t value, uint8_t ndp) {
+  uint32_t magnitude = value < 0 ? -(uint32_t)value : (uint32_t)value;
+
+  // drop trailing zeros after the decimal point, as %g does
+  if (magnitude == 0)
+    ndp = 0;
+  while (ndp > 0 && magnitude % 10 == 0) {
+    magnitude /= 10;
+    ndp--;
+  }
+
+  // digits come out least significant first, with at least one before the
+  // decimal point
+  char digits[10];
+  size_t n_digits = 0;
+  do {
+    digits[n_digits++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude > 0 || n_digits <= ndp);
+
+  size_t len = 0;
+  if (value < 0)
+    out[len++] = '-';
+  while (n_digits > 0) {
+    if (n_digits == ndp)
+      out[len++] = '.';
+    out[len++] = digits[--n_digits];
+  }
+  out[len] = '\0';
+
+  return len;
+}
+
+bool chunk_begin(chunk_writer_t *writer, size_t size, chunk_emit_t emit,
+                 void *ctx) {
+  *writer = (chunk_writer_t){
+      .chunk = malloc(size), .size = size, .emit = emit, .ctx = ctx};
+  writer->ok = writer->chunk != NULL;
+  return writer->ok;
+}
+
+static void chunk_flush(chunk_writer_t *writer) {
+  if (writer->ok && writer->length > 0)
+    writer->ok = writer->emit(writer->chunk, writer->length, writer->ctx);
+  writer->length = 0;
+}
+
+void chunk_printf(chunk_writer_t *writer, const char *format, ...) {
+  // whole pieces only, so a piece that doesn't fit waits for the next chunk
+  for (int attempt = 0; attempt < 2 && writer->ok; attempt++) {
+    va_list args;
+    va_start(args, format);
+    size_t space = writer->size - writer->length;
+    int length = vsnprintf(writer->chunk + writer->length, space, format, args);
+    va_end(args);
+    if (length >= 0 && (size_t)length < space) {
+      writer->length += length;
+      return;
+    }
+    chunk_flush(writer);
+  }
+  writer->ok = false;
+}
+
+void chunk_put_string(chunk_writer_t *writer, const char *str) {
+  chunk_printf(writer, "\"");
+  for (const char *c = str; *c != '\0' && writer->ok; c++) {
+    if (*c == '"' || *c == '\\')
+      chunk_printf(writer, "\\%c", *c);
+    else if ((unsigned char)*c < 0x20)
+      chunk_printf(writer, "\\u%04x", *c);
+    else
+      chunk_printf(writer, "%c", *c);
+  }
+  chunk_printf(writer, "\"");
+}
 
-  return (int)var;
+bool chunk_end(chunk_writer_t *writer) {
+  chunk_flush(writer);
+  free(writer->chunk);
+  writer->chunk = NULL;
+  return writer->ok;
 }
 
 char *read_file(const char *path) {
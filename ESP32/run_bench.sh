@@ -0,0 +1,34 @@
+#!/bin/bash
+
+# check inputs
+if [[ $# -gt 1 || ( $# -eq 1 && ! $1 =~ ^[0-9]+$ ) ]]; then
+    echo "Usage: $0 [iterations]"
+    echo "[iterations] is how many times each timed operation is repeated (default from Kconfig)"
+    exit 1
+fi
+
+
+SCRIPT_DIR="$(cd -- "$(dirname -- "${BASH_SOURCE[0]}")" &> /dev/null && pwd)"
+BUILD_DIR=$SCRIPT_DIR/build_bench
+
+if ! cmp -s $SCRIPT_DIR/main/idf_component.yml $SCRIPT_DIR/main/idf_component.yml_linux; then
+    echo "Run \"./switch_target.sh linux\" first"
+    exit 1
+fi
+
+# build separately from the normal linux build, with the benchmarks switched on
+mkdir -p $BUILD_DIR
+echo "CONFIG_BENCH_TEST=y" > $BUILD_DIR/sdkconfig.bench
+if [ $# -eq 1 ]; then
+    echo "CONFIG_BENCH_ITERATIONS=$1" >> $BUILD_DIR/sdkconfig.bench
+fi
+rm -f $BUILD_DIR/sdkconfig
+
+idf.py --preview -B $BUILD_DIR \
+    -D SDKCONFIG=$BUILD_DIR/sdkconfig \
+    -D SDKCONFIG_DEFAULTS="$SCRIPT_DIR/sdkconfig_linux;$BUILD_DIR/sdkconfig.bench" \
+    set-target linux build || exit 1
+
+# exits non-zero if any output check failed, and leaves a timeline of the
+# run in bench_trace.json (open it at https://ui.perfetto.dev)
+$BUILD_DIR/ESP32.elf
@@ -0,0 +1,34 @@
+#!/bin/bash
+
+# check inputs
+if [[ $# -gt 1 || ( $# -eq 1 && ! $1 =~ ^[0-9]+$ ) ]]; then
+    echo "Usage: $0 [duration]"
+    echo "[duration] is the simulated run time in seconds (default from Kconfig)"
+    exit 1
+fi
+
+
+SCRIPT_DIR="$(cd -- "$(dirname -- "${BASH_SOURCE[0]}")" &> /dev/null && pwd)"
+BUILD_DIR=$SCRIPT_DIR/build_soak
+
+if ! cmp -s $SCRIPT_DIR/main/idf_component.yml $SCRIPT_DIR/main/idf_component.yml_linux; then
+    echo "Run \"./switch_target.sh linux\" first"
+    exit 1
+fi
+
+# build separately from the normal linux build, with the soak test switched on
+mkdir -p $BUILD_DIR
+echo "CONFIG_SOAK_TEST=y" > $BUILD_DIR/sdkconfig.soak
+if [ $# -eq 1 ]; then
+    echo "CONFIG_SOAK_DURATION=$1" >> $BUILD_DIR/sdkconfig.soak
+fi
+rm -f $BUILD_DIR/sdkconfig
+
+idf.py --preview -B $BUILD_DIR \
+    -D SDKCONFIG=$BUILD_DIR/sdkconfig \
+    -D SDKCONFIG_DEFAULTS="$SCRIPT_DIR/sdkconfig_linux;$BUILD_DIR/sdkconfig.soak" \
+    set-target linux build || exit 1
+
+# exits non-zero if any job leaked, or aborts on an out of bounds access; leaks
+# are left to the per job heap checks, as state allocated once is never freed
+ASAN_OPTIONS=detect_leaks=0 $BUILD_DIR/ESP32.elf
@@ -88,16 +88,75 @@ def forward_to_esp(data: dict) -> None:
 
 
 esp_clients = {}
+esp_health = {}  # the latest task profile from each ESP32
+
+
+def unbatch(message) -> list:
+    """
+    Splits a message from an ESP32 into the frames it holds, each a list of messages as they were before batching:
+        * a single frame: [ {"esp_id":1,...}, {"esp_id":2,...} ], or a lone {...}
+        * a batch of frames, oldest first: [ [ {"esp_id":1,...}, ... ], [ {"esp_id":1,...}, ... ] ]
+        * a columnar batch, with each data message as a row of values for the keys given once:
+            { "type":"columns", "keys":["esp_id","Q",...], "frames":[ [ [1,55,...], [2,60,...] ], ... ] }
+    """
+    if isinstance(message, dict):
+        if message.get("type") != "columns":
+            return [[message]]  # e.g. a single response to a request
+        keys = message["keys"]
+        return [
+            [{"esp_id": row[0], "type": "data", "content": dict(zip(keys, row))} for row in frame]
+            for frame in message["frames"]
+        ]
+    if message and all(isinstance(frame, list) for frame in message):
+        return message
+    return [message]
+
+
+def handle_frame(ws: Sock, data_list: list) -> bool:
+    """
+    Handles one frame of messages from an ESP32, returning whether it held any telemetry.
+    """
+    if not data_list or len(data_list) == 0:
+        return False
+    # alarms are sent on their own, ahead of the telemetry
+    alarms = [data for data in data_list if data.get("type") == "alarm"]
+    for alarm in alarms:
+        forward_alarm(alarm)
+    # as are the responses to requests, once they have been carried out
+    responses = [data for data in data_list if data.get("type") == "response"]
+    for esp_response in responses:
+        forward_response(esp_response)
+    # and the task profiles, which come with the heartbeat
+    healths = [data for data in data_list if data.get("type") == "health"]
+    for health in healths:
+        record_health(health)
+    data_list = [data for data in data_list if data.get("type") not in ("alarm", "response", "health")]
+    if len(data_list) == 0:
+        return False
+    with lock:
+        esp_clients[data_list[0]["esp_id"]] = (
+            {  # the first entry in the list is the one making the websocket connection (the root)
+                "ws": ws,
+                "mesh_ids": [data["esp_id"] for data in data_list],
+            }
+        )
+        update_battery_data(data_list)  # updates database
+    for data in data_list:
+        update_browsers(
+            data["esp_id"]
+        )  # updates browsers currently viewing `data["esp_id"]` detail page
+    return True
 
 
 @sock.route("/esp_ws")
 def esp_ws(ws: Sock):
     """
     Handles server WebSocket connections which are initiated by ESP32 clients, and subsequent client messages.
-    Incoming messages always have the following format:
+    Incoming messages hold one or more frames (see `unbatch`), each of the following format:
         [ {"esp_id":"bms_01","content":{"Q": 1,"H": 1}}, {"esp_id":"bms_02","content":{"Q": 2,"H": 2}}, ... ]
     The database is updated according to new telemetry data before each list element is parsed in turn,
     updating the browser clients currently viewing the detail page for the `esp_id` battery unit.
+    Frames are handled oldest first, with a single response to the message.
     """
 
     logger.info("New ESP32 WebSocket client")
@@ -113,22 +172,14 @@ def esp_ws(ws: Sock):
             }  # default response content
 
             try:
-                data_list = json.loads(message)
-                if not data_list or len(data_list) == 0:
-                    continue
-                with lock:
-                    esp_clients[data_list[0]["esp_id"]] = (
-                        {  # the first entry in the list is the one making the websocket connection (the root)
-                            "ws": ws,
-                            "mesh_ids": [data["esp_id"] for data in data_list],
-                        }
-                    )
-                    update_battery_data(data_list)  # updates database
-                for data in data_list:
-                    update_browsers(
-                        data["esp_id"]
-                    )  # updates browsers currently viewing `data["esp_id"]` detail page
+                frames = unbatch(json.loads(message))
+                telemetry = False
+                for data_list in frames:
+                    telemetry |= handle_frame(ws, data_list)
                 response["content"] = "OK"
+                if not telemetry:
+                    ws.send(json.dumps(response))
+                    continue
             except Exception as e:
                 logger.error(f"ESP WebSocket error in while loop: {e}")
 
@@ -153,6 +204,70 @@ def esp_ws(ws: Sock):
             )  # indicate to browser clients on ListPage that the esp has disconnected
 
 
+def forward_to_browsers(esp_id: int, message: dict) -> None:
+    """
+    Used to send a message from an ESP32 on to the browser clients viewing its detail page, each copy tagged with the
+    browser_id it is sent to.
+    """
+    for browser_id, info in list(browser_clients.items()):
+        if info["esp_id"] == esp_id:
+            ws = info.get("ws")
+            if not ws:
+                continue
+            try:
+                ws.send(json.dumps({**message, "browser_id": browser_id}))
+            except Exception as e:
+                logger.error(f"Browser WebSocket forward error: {e}")
+                del browser_clients[browser_id]
+
+
+def forward_alarm(alarm: dict) -> None:
+    """
+    Used to pass an alarm raised (or cleared) on an ESP32 straight on to the browser clients viewing its detail page.
+    The message carries the alarm itself, rather than triggering a fetch from the database.
+    """
+    esp_id = alarm["esp_id"]
+    content = alarm.get("content", {})
+    if content.get("raised"):
+        logger.warning(f"Alarm raised by esp_id={esp_id}: {content}")
+    else:
+        logger.info(f"Alarm update from esp_id={esp_id}: {content}")
+
+    forward_to_browsers(esp_id, {"type": "alarm", "esp_id": esp_id, "content": content})
+
+
+def record_health(health: dict) -> None:
+    """
+    Used to keep the latest task profile of an ESP32, and to log when one of its tasks has stalled or is short of stack:
+        { "type":"health", "esp_id":1, "content":{"uptime":120, "free_heap":51234, "min_free_heap":40960, "stalls":0,
+          "keys":["name","cpu","stack_free","stalls","stalled"], "tasks":[ ["job_worker_free",3,812,0,0], ... ]} }
+    """
+    esp_id = health["esp_id"]
+    content = health.get("content", {})
+    keys = content.get("keys", [])
+    tasks = [dict(zip(keys, row)) for row in content.get("tasks", [])]
+    with lock:
+        esp_health[esp_id] = {**content, "tasks": tasks}
+
+    for task in tasks:
+        if task.get("stalled"):
+            logger.warning(f"Task {task.get('name')} stalled on esp_id={esp_id}")
+    logger.info(f"Health of esp_id={esp_id}: {content.get('free_heap')} bytes free, {content.get('stalls')} stalls")
+
+
+def forward_response(esp_response: dict) -> None:
+    """
+    Used to pass the outcome of a request on to the browser clients viewing the detail page of the ESP32 which carried it out.
+    Response messages look like:
+        { "type":"response", "esp_id":1, "content":{"summary":"connect-wifi", "status":"success"} }
+    """
+    esp_id = esp_response["esp_id"]
+    content = esp_response.get("content", {})
+    logger.info(f"Response from esp_id={esp_id}: {content}")
+
+    forward_to_browsers(esp_id, {"type": "response", "esp_id": esp_id, "content": content})
+
+
 def update_browsers(esp_id: int) -> None:
     """
     Used to send WebSocket messages to browser clients when any ESP32 WebSocket client updates.